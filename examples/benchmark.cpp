@@ -0,0 +1,371 @@
+/**
+ * @file benchmark.cpp
+ * @brief End-to-end inference benchmark for embee.cpp
+ *
+ * Runs generation over a grid of prompt lengths, generation lengths and
+ * thread counts and reports prefill and decode throughput, time to first
+ * token, inter-token latency percentiles and peak resident memory. Results
+ * can also be written as JSON for dashboards.
+ *
+ * Example (the README performance table is produced this way):
+ *   benchmark --model models/phi3-mini-4b.amb --prompt 128 --gen 128 --threads 4
+ */
+
+#include "embee/engine.h"
+#include "embee/memory.h"
+#include "embee/model.h"
+#include "embee/tokenizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string model_path;
+    std::vector<size_t> prompt_lengths = {128};
+    std::vector<size_t> gen_lengths = {128};
+    std::vector<size_t> thread_counts = {0};
+    size_t warmup = 1;
+    size_t repetitions = 3;
+    float temperature = 0.0f;
+    size_t draft_layers = 0;
+    size_t draft_tokens = 4;
+    std::string json_path;
+    std::string profile_path;
+    bool hardware_counters = false;
+};
+
+// Measurements of one generate call
+struct RunResult {
+    size_t prompt_tokens = 0;
+    size_t generated_tokens = 0;
+    double ttft_s = 0.0;
+    double total_s = 0.0;
+    std::vector<double> inter_token_s;
+};
+
+// Aggregate over the repetitions of one grid point
+struct Summary {
+    size_t prompt_tokens = 0;
+    size_t gen_tokens = 0;
+    size_t threads = 0;
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+    double ttft_ms = 0.0;
+    double itl_p50_ms = 0.0;
+    double itl_p99_ms = 0.0;
+};
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " --model PATH [options]\n"
+              << "  --prompt N[,N...]     Prompt lengths in tokens (default: 128)\n"
+              << "  --gen N[,N...]        Tokens to generate (default: 128)\n"
+              << "  --threads N[,N...]    Thread counts (default: 0 = OpenMP default)\n"
+              << "  --warmup N            Untimed runs per configuration (default: 1)\n"
+              << "  --repetitions N       Timed runs per configuration (default: 3)\n"
+              << "  --temperature T       Sampling temperature (default: 0 = greedy)\n"
+              << "  --draft-layers N      Self-draft with the first N layers (greedy only, default: 0 = off)\n"
+              << "  --draft-tokens N      Tokens drafted per verification pass (default: 4)\n"
+              << "  --json FILE           Also write results as JSON ('-' for stdout)\n"
+              << "  --profile FILE        Print per-op timings and write a Chrome trace of the\n"
+              << "                        last run to FILE\n"
+              << "  --counters            With --profile, add perf_event hardware counters per op" << std::endl;
+}
+
+std::vector<size_t> parse_list(const std::string& value) {
+    std::vector<size_t> result;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        result.push_back(std::stoul(item));
+    }
+    if (result.empty()) {
+        throw std::invalid_argument("Empty list: " + value);
+    }
+    return result;
+}
+
+// Build a prompt that tokenizes to (about) n tokens with this model's tokenizer
+std::string make_prompt(const embee::Tokenizer& tokenizer, size_t n_tokens) {
+    const std::string filler =
+        "The quick brown fox jumps over the lazy dog while the committee reviews the budget. ";
+    std::string text;
+    while (tokenizer.encode(text).size() < n_tokens) {
+        text += filler;
+    }
+    embee::TokenVector tokens = tokenizer.encode(text);
+    tokens.resize(n_tokens);
+    return tokenizer.decode(tokens);
+}
+
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * values.size()));
+    return values[std::min(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+double median(std::vector<double> values) {
+    return percentile(std::move(values), 50.0);
+}
+
+size_t peak_rss_bytes() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return static_cast<size_t>(usage.ru_maxrss);         // bytes
+#else
+        return static_cast<size_t>(usage.ru_maxrss) * 1024;  // kilobytes
+#endif
+    }
+#endif
+    return 0;
+}
+
+RunResult run_once(embee::Engine& engine, const std::string& prompt, size_t prompt_tokens,
+                   const embee::GenerationConfig& config) {
+    RunResult result;
+    result.prompt_tokens = prompt_tokens;
+
+    auto start = Clock::now();
+    auto last = start;
+    engine.generate_with_callback(prompt, [&](embee::TokenId, const std::string&) {
+        auto now = Clock::now();
+        if (result.generated_tokens == 0) {
+            result.ttft_s = std::chrono::duration<double>(now - start).count();
+        } else {
+            result.inter_token_s.push_back(std::chrono::duration<double>(now - last).count());
+        }
+        last = now;
+        ++result.generated_tokens;
+        return true;
+    }, config);
+    result.total_s = std::chrono::duration<double>(Clock::now() - start).count();
+    return result;
+}
+
+Summary summarize(const std::vector<RunResult>& runs, size_t threads) {
+    Summary summary;
+    summary.threads = threads;
+    std::vector<double> prefill, decode, ttft, itl;
+    for (const auto& run : runs) {
+        summary.prompt_tokens = run.prompt_tokens;
+        summary.gen_tokens = run.generated_tokens;
+        // TTFT covers the prompt forward pass plus sampling the first token
+        if (run.ttft_s > 0.0) {
+            prefill.push_back(run.prompt_tokens / run.ttft_s);
+        }
+        double decode_s = run.total_s - run.ttft_s;
+        if (run.generated_tokens > 1 && decode_s > 0.0) {
+            decode.push_back((run.generated_tokens - 1) / decode_s);
+        }
+        ttft.push_back(run.ttft_s * 1e3);
+        for (double s : run.inter_token_s) {
+            itl.push_back(s * 1e3);
+        }
+    }
+    summary.prefill_tps = median(prefill);
+    summary.decode_tps = median(decode);
+    summary.ttft_ms = median(ttft);
+    summary.itl_p50_ms = percentile(itl, 50.0);
+    summary.itl_p99_ms = percentile(itl, 99.0);
+    return summary;
+}
+
+void write_json(std::ostream& out, const Options& options, const embee::ModelConfig& config,
+                const std::vector<Summary>& results) {
+    out << std::fixed << std::setprecision(3);
+    out << "{\n"
+        << "  \"model\": " << json_string(config.model_name) << ",\n"
+        << "  \"model_path\": " << json_string(options.model_path) << ",\n"
+        << "  \"warmup\": " << options.warmup << ",\n"
+        << "  \"repetitions\": " << options.repetitions << ",\n"
+        << "  \"peak_rss_bytes\": " << peak_rss_bytes() << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Summary& r = results[i];
+        out << "    {\"prompt_tokens\": " << r.prompt_tokens
+            << ", \"gen_tokens\": " << r.gen_tokens
+            << ", \"threads\": " << r.threads
+            << ", \"prefill_tokens_per_s\": " << r.prefill_tps
+            << ", \"decode_tokens_per_s\": " << r.decode_tps
+            << ", \"ttft_ms\": " << r.ttft_ms
+            << ", \"itl_p50_ms\": " << r.itl_p50_ms
+            << ", \"itl_p99_ms\": " << r.itl_p99_ms << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--model") {
+                options.model_path = next();
+            } else if (arg == "--prompt") {
+                options.prompt_lengths = parse_list(next());
+            } else if (arg == "--gen") {
+                options.gen_lengths = parse_list(next());
+            } else if (arg == "--threads") {
+                options.thread_counts = parse_list(next());
+            } else if (arg == "--warmup") {
+                options.warmup = std::stoul(next());
+            } else if (arg == "--repetitions") {
+                options.repetitions = std::max<size_t>(1, std::stoul(next()));
+            } else if (arg == "--temperature") {
+                options.temperature = std::stof(next());
+            } else if (arg == "--draft-layers") {
+                options.draft_layers = std::stoul(next());
+            } else if (arg == "--draft-tokens") {
+                options.draft_tokens = std::stoul(next());
+            } else if (arg == "--json") {
+                options.json_path = next();
+            } else if (arg == "--profile") {
+                options.profile_path = next();
+            } else if (arg == "--counters") {
+                options.hardware_counters = true;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (options.model_path.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        embee::Model model(options.model_path);
+        const auto& model_config = model.config();
+        const embee::Tokenizer& tokenizer = *model.tokenizer();
+
+        std::cerr << "Model: " << model_config.model_name << " (" << model_config.n_layers
+                  << " layers, " << model_config.n_embd << " embedding size)" << std::endl;
+        std::cerr << std::left << std::setw(8) << "prompt" << std::setw(8) << "gen"
+                  << std::setw(9) << "threads" << std::right
+                  << std::setw(14) << "prefill t/s" << std::setw(13) << "decode t/s"
+                  << std::setw(12) << "TTFT ms" << std::setw(12) << "ITL p50"
+                  << std::setw(12) << "ITL p99" << std::endl;
+
+        // Every run gets a fresh engine: one that ran the same prompt before
+        // would serve it from its KV cache and time a one-token prefill. The
+        // engines share a pool, so their KV buffers are allocated only once.
+        embee::ScratchPool pool(std::numeric_limits<size_t>::max());
+        std::unique_ptr<embee::Engine> engine;
+        std::vector<Summary> results;
+        for (size_t threads : options.thread_counts) {
+            embee::EngineConfig engine_config;
+            engine_config.n_threads = threads;
+            engine_config.enable_profiling = !options.profile_path.empty();
+            engine_config.enable_hardware_counters = options.hardware_counters;
+            engine_config.scratch_pool = &pool;
+
+            for (size_t prompt_len : options.prompt_lengths) {
+                std::string prompt = make_prompt(tokenizer, prompt_len);
+                size_t prompt_tokens = tokenizer.encode(prompt).size();
+
+                for (size_t gen_len : options.gen_lengths) {
+                    embee::GenerationConfig gen_config;
+                    gen_config.max_length = gen_len;
+                    gen_config.temperature = options.temperature;
+                    gen_config.top_p = options.temperature > 0.0f ? 0.9f : 0.0f;
+                    gen_config.repetition_penalty = 1.0f;
+                    gen_config.ignore_eos = true;
+                    gen_config.draft_layers = options.draft_layers;
+                    gen_config.draft_tokens = options.draft_tokens;
+
+                    auto run = [&]() {
+                        engine.reset();
+                        engine = std::make_unique<embee::Engine>(model, engine_config);
+                        return run_once(*engine, prompt, prompt_tokens, gen_config);
+                    };
+                    for (size_t w = 0; w < options.warmup; ++w) {
+                        run();
+                    }
+                    std::vector<RunResult> runs;
+                    for (size_t r = 0; r < options.repetitions; ++r) {
+                        runs.push_back(run());
+                    }
+
+                    Summary s = summarize(runs, threads);
+                    results.push_back(s);
+                    std::cerr << std::left << std::setw(8) << s.prompt_tokens << std::setw(8) << s.gen_tokens
+                              << std::setw(9) << threads << std::right << std::fixed << std::setprecision(2)
+                              << std::setw(14) << s.prefill_tps << std::setw(13) << s.decode_tps
+                              << std::setw(12) << s.ttft_ms << std::setw(12) << s.itl_p50_ms
+                              << std::setw(12) << s.itl_p99_ms << std::endl;
+                    if (engine->profiler()) {
+                        std::cerr << embee::Profiler::table(engine->profiler()->requests().back());
+                    }
+                }
+            }
+        }
+        if (engine && engine->profiler()) {
+            std::ofstream trace(options.profile_path);
+            engine->profiler()->write_chrome_trace(trace);
+        }
+
+        std::cerr << "Peak RSS: " << std::fixed << std::setprecision(1)
+                  << peak_rss_bytes() / (1024.0 * 1024.0) << " MiB" << std::endl;
+
+        if (options.json_path == "-") {
+            write_json(std::cout, options, model_config, results);
+        } else if (!options.json_path.empty()) {
+            std::ofstream out(options.json_path);
+            write_json(out, options, model_config, results);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -6,8 +6,11 @@
 #include "embee/engine.h"
 #include "embee/model.h"
 #include "embee/tokenizer.h"
+#include "embee/metrics.h"
 
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
 #include <chrono>
@@ -25,16 +28,31 @@ namespace Color {
     const std::string Cyan = "\033[36m";
 }
 
+// Print memory use by category in MiB
+void print_memory(const std::string& label, const embee::MemoryStats& stats) {
+    auto mib = [](size_t bytes) { return bytes / (1024.0 * 1024.0); };
+    std::cout << std::fixed << std::setprecision(1)
+              << label << ": " << mib(stats.total()) << " MiB"
+              << " (weights " << mib(stats.weights_resident) << " resident / "
+              << mib(stats.weights_mapped) << " mapped, KV cache "
+              << mib(stats.kv_cache_used) << " / " << mib(stats.kv_cache_reserved)
+              << ", activations " << mib(stats.activations)
+              << ", tokenizer " << mib(stats.tokenizer)
+              << ", sampler " << mib(stats.sampler_scratch) << ")"
+              << std::defaultfloat << std::endl;
+}
+
 int main(int argc, char** argv) {
     // Parse command line arguments
     if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <model_path> [temperature] [top_p]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " <model_path> [temperature] [top_p] [metrics_port]" << std::endl;
         return 1;
     }
     
     std::string model_path = argv[1];
     float temperature = argc > 2 ? std::stof(argv[2]) : 0.7f;
     float top_p = argc > 3 ? std::stof(argv[3]) : 0.9f;
+    int metrics_port = argc > 4 ? std::stoi(argv[4]) : -1;
     
     std::cout << Color::Bold << Color::Cyan 
               << "Loading model from: " << model_path << Color::Reset << std::endl;
@@ -49,8 +67,19 @@ int main(int argc, char** argv) {
                   << config.n_heads << " heads, "
                   << config.n_embd << " embedding size)" << std::endl;
         
+        // Optionally expose Prometheus metrics on localhost
+        embee::MetricsRegistry metrics;
+        std::unique_ptr<embee::MetricsServer> metrics_server;
+        if (metrics_port >= 0) {
+            metrics_server = std::make_unique<embee::MetricsServer>(metrics, static_cast<uint16_t>(metrics_port));
+            std::cout << "Metrics: http://127.0.0.1:" << metrics_server->port() << "/metrics" << std::endl;
+        }
+        
         // Create the inference engine
-        embee::Engine engine(model);
+        embee::EngineConfig engine_config;
+        engine_config.metrics = &metrics;
+        embee::Engine engine(model, engine_config);
+        print_memory("Memory", engine.memory_usage());
         
         // Set up generation config
         embee::GenerationConfig gen_config;
@@ -105,6 +134,9 @@ int main(int argc, char** argv) {
             std::cout << std::endl;
             std::cout << Color::Magenta << "[Generated in " 
                       << elapsed.count() << " seconds]" << Color::Reset << std::endl;
+            std::cout << Color::Magenta;
+            print_memory("Peak memory", engine.peak_memory_usage());
+            std::cout << Color::Reset;
         }
         
     } catch (const std::exception& e) {
@@ -0,0 +1,471 @@
+/**
+ * @file kernel_bench.cpp
+ * @brief Microbenchmarks for the hot compute kernels with roofline reporting
+ *
+ * First probes the host's sustainable memory bandwidth (STREAM-style read
+ * and triad loops) and FP32 FMA throughput, then times each kernel and
+ * reports GFLOP/s, GB/s and the fraction of its roofline bound
+ * min(peak GFLOP/s, arithmetic intensity * bandwidth). A kernel far below
+ * its bound is where tuning effort pays off; a drop between runs is a
+ * regression.
+ */
+
+#include "embee/kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using embee::DataType;
+namespace kernels = embee::kernels;
+
+struct Options {
+    size_t threads = 0;
+    double min_seconds = 0.25;
+    size_t dim = 4096;
+    std::string filter;
+};
+
+struct Roofline {
+    double bandwidth_gbs = 0.0;
+    double peak_gflops = 0.0;
+    size_t llc_bytes = 0;      // Last-level cache size (0 = unknown)
+};
+
+// Best seconds per call of fn over several timed batches
+double time_best(const Options& options, const std::function<void()>& fn) {
+    fn();  // Warm caches and thread pool
+    double best = 1e30;
+    for (int rep = 0; rep < 3; ++rep) {
+        size_t calls = 0;
+        auto start = Clock::now();
+        double elapsed = 0.0;
+        do {
+            fn();
+            ++calls;
+            elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        } while (elapsed < options.min_seconds / 3);
+        best = std::min(best, elapsed / calls);
+    }
+    return best;
+}
+
+int resolve_threads(size_t n) {
+#ifdef _OPENMP
+    return n > 0 ? static_cast<int>(n) : omp_get_max_threads();
+#else
+    (void)n;
+    return 1;
+#endif
+}
+
+// Size of the largest CPU cache, from sysconf or sysfs (0 if unknown)
+size_t last_level_cache_bytes() {
+    size_t bytes = 0;
+#if defined(_SC_LEVEL3_CACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+    bytes = static_cast<size_t>(std::max(0L, std::max(sysconf(_SC_LEVEL3_CACHE_SIZE),
+                                                      sysconf(_SC_LEVEL2_CACHE_SIZE))));
+#endif
+    for (int index = 0; bytes == 0 && index < 8; ++index) {
+        std::ifstream file("/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/size");
+        std::string size;
+        while (file >> size) {
+            const size_t scale = size.back() == 'K' ? 1024 : size.back() == 'M' ? 1024 * 1024 : 1;
+            bytes = std::max<size_t>(bytes, std::stoul(size) * scale);
+        }
+    }
+    return bytes;
+}
+
+constexpr int FMA_LANES = 8, FMA_CHAINS = 10;
+
+// Run FMA_CHAINS independent chains of FMA_LANES-wide multiply-adds. The
+// chains are separate variables: an array of them is not kept in registers
+// at -O2, and the loads and stores would hide the FMA rate.
+float fma_chains(long iterations) {
+#if defined(__AVX2__) && defined(__FMA__)
+    const __m256 mul = _mm256_set1_ps(0.999999f);
+    const __m256 add = _mm256_set1_ps(1e-7f);
+    __m256 a0 = _mm256_set1_ps(1.000f), a1 = _mm256_set1_ps(1.001f), a2 = _mm256_set1_ps(1.002f);
+    __m256 a3 = _mm256_set1_ps(1.003f), a4 = _mm256_set1_ps(1.004f), a5 = _mm256_set1_ps(1.005f);
+    __m256 a6 = _mm256_set1_ps(1.006f), a7 = _mm256_set1_ps(1.007f), a8 = _mm256_set1_ps(1.008f);
+    __m256 a9 = _mm256_set1_ps(1.009f);
+    for (long i = 0; i < iterations; ++i) {
+        a0 = _mm256_fmadd_ps(a0, mul, add);
+        a1 = _mm256_fmadd_ps(a1, mul, add);
+        a2 = _mm256_fmadd_ps(a2, mul, add);
+        a3 = _mm256_fmadd_ps(a3, mul, add);
+        a4 = _mm256_fmadd_ps(a4, mul, add);
+        a5 = _mm256_fmadd_ps(a5, mul, add);
+        a6 = _mm256_fmadd_ps(a6, mul, add);
+        a7 = _mm256_fmadd_ps(a7, mul, add);
+        a8 = _mm256_fmadd_ps(a8, mul, add);
+        a9 = _mm256_fmadd_ps(a9, mul, add);
+    }
+    const __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(a2, a3)),
+                                     _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(a4, a5), _mm256_add_ps(a6, a7)),
+                                                   _mm256_add_ps(a8, a9)));
+    float lanes[FMA_LANES];
+    _mm256_storeu_ps(lanes, sum);
+    return lanes[0];
+#else
+    float acc[FMA_CHAINS * FMA_LANES];
+    for (int j = 0; j < FMA_CHAINS * FMA_LANES; ++j) {
+        acc[j] = 1.0f + j * 1e-4f;
+    }
+    for (long i = 0; i < iterations; ++i) {
+        #pragma omp simd
+        for (int j = 0; j < FMA_CHAINS * FMA_LANES; ++j) {
+            acc[j] = acc[j] * 0.999999f + 1e-7f;
+        }
+    }
+    return std::accumulate(acc, acc + FMA_CHAINS * FMA_LANES, 0.0f);
+#endif
+}
+
+Roofline probe_host(const Options& options) {
+    Roofline roof;
+    const long n = 32 * 1024 * 1024;  // 128 MiB per array, far beyond any LLC
+    std::vector<float> a(n, 1.0f), b(n, 2.0f), c(n, 0.5f);
+    const int threads = resolve_threads(options.threads);
+
+    // Read-only sweep: the access pattern of GEMV over weights
+    volatile float sink = 0.0f;
+    double read_s = time_best(options, [&]() {
+        float total = 0.0f;
+        #pragma omp parallel for num_threads(threads) reduction(+:total) schedule(static)
+        for (long i = 0; i < n; ++i) {
+            total += a[i];
+        }
+        sink = total;
+    });
+    (void)sink;
+
+    // STREAM triad
+    double triad_s = time_best(options, [&]() {
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        for (long i = 0; i < n; ++i) {
+            a[i] = b[i] + 0.5f * c[i];
+        }
+    });
+
+    roof.bandwidth_gbs = std::max(n * sizeof(float) / read_s, 3.0 * n * sizeof(float) / triad_s) / 1e9;
+
+    // FMA throughput: 8-wide vectors in 10 independent chains per thread,
+    // enough to cover FMA latency times the two FMA ports of recent cores.
+    // Scalar chains would measure an eighth of the peak the kernels reach.
+    const long iterations = 1 << 22;
+    std::vector<float> out(threads);
+    double fma_s = time_best(options, [&]() {
+        #pragma omp parallel num_threads(threads)
+        {
+#ifdef _OPENMP
+            const int t = omp_get_thread_num();
+#else
+            const int t = 0;
+#endif
+            out[t] = fma_chains(iterations);
+        }
+    });
+    roof.peak_gflops = 2.0 * FMA_LANES * FMA_CHAINS * iterations * threads / fma_s / 1e9;
+    roof.llc_bytes = last_level_cache_bytes();
+    return roof;
+}
+
+void report(const Roofline& roof, const std::string& name, double seconds, double flops, double bytes) {
+    const double gflops = flops / seconds / 1e9;
+    const double gbs = bytes / seconds / 1e9;
+    const double intensity = bytes > 0.0 ? flops / bytes : 0.0;
+    const double memory_bound = intensity * roof.bandwidth_gbs;
+    const double bound = std::min(roof.peak_gflops, memory_bound);
+    std::cout << std::left << std::setw(26) << name << std::right << std::fixed
+              << std::setw(10) << std::setprecision(1) << seconds * 1e6
+              << std::setw(10) << std::setprecision(2) << gflops
+              << std::setw(10) << gbs
+              << std::setw(8) << std::setprecision(2) << intensity
+              << std::setw(8) << (memory_bound < roof.peak_gflops ? "mem" : "fp")
+              << std::setw(8) << std::setprecision(0) << (bound > 0.0 ? 100.0 * gflops / bound : 0.0) << "%"
+              << std::endl;
+}
+
+const char* type_name(DataType type) {
+    switch (type) {
+        case DataType::FP32: return "fp32";
+        case DataType::FP16: return "fp16";
+        case DataType::BF16: return "bf16";
+        case DataType::INT8: return "int8";
+        case DataType::INT5: return "int5";
+        case DataType::INT4: return "int4";
+        case DataType::ADAPTIVE: return "adaptive";
+    }
+    return "?";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::stoul(argv[++i]);
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_seconds = std::stod(argv[++i]);
+        } else if (arg == "--dim" && i + 1 < argc) {
+            options.dim = std::stoul(argv[++i]);
+        } else if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--threads N] [--min-time SECONDS] [--dim N] [--filter SUBSTRING]" << std::endl;
+            return 1;
+        }
+    }
+
+    const size_t threads = options.threads;
+    const size_t dim = options.dim / 128 * 128;
+    const size_t block = 32;
+    auto wanted = [&](const std::string& name) {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    };
+
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    auto random_vector = [&](size_t n) {
+        std::vector<float> v(n);
+        for (auto& x : v) {
+            x = normal(gen);
+        }
+        return v;
+    };
+
+    Roofline roof = probe_host(options);
+    std::cout << "Host: " << resolve_threads(threads) << " threads, "
+              << std::fixed << std::setprecision(1) << roof.bandwidth_gbs << " GB/s memory bandwidth, "
+              << roof.peak_gflops << " GFLOP/s FP32 FMA" << std::endl;
+    std::cout << std::left << std::setw(26) << "kernel" << std::right << std::setw(10) << "us"
+              << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s" << std::setw(8) << "AI"
+              << std::setw(8) << "bound" << std::setw(9) << "roof" << std::endl;
+
+    // GEMV and GEMM over a dim x dim weight in every storage type
+    const std::vector<float> weights = random_vector(dim * dim);
+    const std::vector<float> x = random_vector(dim * 32);
+    std::vector<float> y(dim * 32);
+    // The adaptive weight mixes precisions at about 5 bits per weight:
+    // three in four blocks INT4, then INT5, INT8 and FP16 in turn
+    std::vector<DataType> mix(dim / block);
+    for (size_t b = 0; b < mix.size(); ++b) {
+        const DataType upgrades[] = {DataType::INT5, DataType::INT8, DataType::FP16};
+        mix[b] = b % 4 != 3 ? DataType::INT4 : upgrades[b / 4 % 3];
+    }
+    for (DataType type : {DataType::FP32, DataType::FP16, DataType::BF16,
+                          DataType::INT8, DataType::INT5, DataType::INT4, DataType::ADAPTIVE}) {
+        std::vector<uint8_t> w;
+        if (type == DataType::ADAPTIVE) {
+            std::vector<uint8_t> row(kernels::row_bytes(DataType::FP16, dim, block) +
+                                     kernels::adaptive_mask_bytes(mix.size()));
+            for (size_t r = 0; r < dim; ++r) {
+                const size_t size = kernels::quantize_adaptive_row(weights.data() + r * dim, mix.data(),
+                                                                   row.data(), dim, block);
+                w.insert(w.end(), row.begin(), row.begin() + size);
+            }
+        } else {
+            const size_t stride = kernels::row_bytes(type, dim, block);
+            w.resize(stride * dim);
+            for (size_t r = 0; r < dim; ++r) {
+                kernels::quantize_row(type, weights.data() + r * dim, w.data() + r * stride, dim, block);
+            }
+        }
+
+        // Weights that stay cached run above the DRAM roofline
+        if (roof.llc_bytes > 0 && w.size() <= roof.llc_bytes &&
+            (wanted(std::string("gemv_") + type_name(type)) || wanted(std::string("gemm_") + type_name(type)))) {
+            std::cerr << "Warning: the " << type_name(type) << " weight (" << w.size() / 1024 << " KiB) fits in the "
+                      << roof.llc_bytes / 1024 << " KiB last-level cache; raise --dim to measure DRAM-bound rates"
+                      << std::endl;
+        }
+
+        std::string name = std::string("gemv_") + type_name(type);
+        if (wanted(name)) {
+            double s = time_best(options, [&]() {
+                kernels::gemv(type, w.data(), x.data(), y.data(), dim, dim, block, threads);
+            });
+            report(roof, name, s, 2.0 * dim * dim, w.size() + 2.0 * dim * sizeof(float));
+        }
+
+        for (size_t m : {8, 32}) {
+            name = std::string("gemm_") + type_name(type) + "_m" + std::to_string(m);
+            if (wanted(name)) {
+                double s = time_best(options, [&]() {
+                    kernels::gemm(type, w.data(), x.data(), y.data(), m, dim, dim, block, threads);
+                });
+                report(roof, name, s, 2.0 * m * dim * dim, w.size() + 2.0 * m * dim * sizeof(float));
+            }
+        }
+    }
+
+    // Attention over a 32-head, 128-dim KV cache at several context lengths
+    const size_t n_heads = 32, n_kv_heads = 8, head_dim = 128;
+    for (size_t n_ctx : {512, 2048}) {
+        std::string name = "attention_ctx" + std::to_string(n_ctx);
+        if (!wanted(name)) {
+            continue;
+        }
+        const size_t kv_dim = n_kv_heads * head_dim;
+        std::vector<float> q = random_vector(n_heads * head_dim);
+        std::vector<float> k = random_vector(n_ctx * kv_dim);
+        std::vector<float> v = random_vector(n_ctx * kv_dim);
+        std::vector<float> out(n_heads * head_dim), scratch(n_heads * n_ctx);
+        double s = time_best(options, [&]() {
+            kernels::attention(q.data(), k.data(), v.data(), out.data(), n_heads, n_kv_heads,
+                               head_dim, n_ctx, scratch.data(), threads);
+        });
+        report(roof, name, s, 4.0 * n_heads * n_ctx * head_dim,
+               2.0 * n_ctx * kv_dim * sizeof(float));
+    }
+
+    // Kernels compiled for fixed head and block sizes against the generic versions
+    for (bool generic : {false, true}) {
+        const kernels::KernelSet set = kernels::select_kernels(head_dim, block, generic);
+        const std::string suffix = generic ? "_generic" : "_specialized";
+        std::string name = "attention_ctx512" + suffix;
+        if (wanted(name)) {
+            const size_t n_ctx = 512, kv_dim = n_kv_heads * head_dim;
+            std::vector<float> q = random_vector(n_heads * head_dim);
+            std::vector<float> k = random_vector(n_ctx * kv_dim);
+            std::vector<float> v = random_vector(n_ctx * kv_dim);
+            std::vector<float> out(n_heads * head_dim), scratch(n_heads * n_ctx);
+            double s = time_best(options, [&]() {
+                set.attention(q.data(), k.data(), v.data(), out.data(), n_heads, n_kv_heads,
+                              head_dim, n_ctx, scratch.data(), threads, nullptr);
+            });
+            report(roof, name, s, 4.0 * n_heads * n_ctx * head_dim, 2.0 * n_ctx * kv_dim * sizeof(float));
+        }
+        name = "gemv_int4" + suffix;
+        if (wanted(name)) {
+            const size_t stride = kernels::row_bytes(DataType::INT4, dim, block);
+            std::vector<uint8_t> w(stride * dim);
+            for (size_t r = 0; r < dim; ++r) {
+                kernels::quantize_row(DataType::INT4, weights.data() + r * dim, w.data() + r * stride, dim, block);
+            }
+            double s = time_best(options, [&]() {
+                set.gemv(DataType::INT4, w.data(), x.data(), y.data(), dim, dim, block, threads,
+                         kernels::MatmulEpilogue());
+            });
+            report(roof, name, s, 2.0 * dim * dim, w.size() + 2.0 * dim * sizeof(float));
+        }
+    }
+
+    // Element-wise kernels on one hidden-state vector
+    std::vector<float> hidden = random_vector(dim);
+    std::vector<float> norm_weight = random_vector(dim);
+    std::vector<float> normed(dim);
+    if (wanted("rms_norm")) {
+        double s = time_best(options, [&]() {
+            kernels::rms_norm(hidden.data(), norm_weight.data(), normed.data(), dim);
+        });
+        report(roof, "rms_norm", s, 4.0 * dim, 3.0 * dim * sizeof(float));
+    }
+    if (wanted("layer_norm")) {
+        double s = time_best(options, [&]() {
+            kernels::layer_norm(hidden.data(), norm_weight.data(), norm_weight.data(), normed.data(), dim);
+        });
+        report(roof, "layer_norm", s, 7.0 * dim, 4.0 * dim * sizeof(float));
+    }
+    if (wanted("rope")) {
+        // A decode step: query and key of a new position
+        size_t pos = 0;
+        double s = time_best(options, [&]() {
+            kernels::rope(normed.data(), dim / head_dim, head_dim, pos, 10000.0f, 1.0f);
+            kernels::rope(hidden.data(), dim / head_dim, head_dim, pos, 10000.0f, 1.0f);
+            pos = (pos + 1) % 4096;
+        });
+        report(roof, "rope", s, 12.0 * dim, 4.0 * dim * sizeof(float));
+    }
+    if (wanted("silu")) {
+        double s = time_best(options, [&]() {
+            std::copy(hidden.begin(), hidden.end(), normed.begin());
+            kernels::silu(normed.data(), dim);
+        });
+        report(roof, "silu", s, 4.0 * dim, 2.0 * dim * sizeof(float));
+    }
+
+    // Vocabulary-sized kernels
+    const size_t n_vocab = 32000;
+    std::vector<float> logits = random_vector(n_vocab);
+    std::vector<float> work(n_vocab);
+    if (wanted("softmax")) {
+        double s = time_best(options, [&]() {
+            std::copy(logits.begin(), logits.end(), work.begin());
+            kernels::softmax(work.data(), n_vocab);
+        });
+        report(roof, "softmax_32k", s, 4.0 * n_vocab, 3.0 * n_vocab * sizeof(float));
+    }
+    if (wanted("sample")) {
+        std::mt19937 rng(7);
+        kernels::SamplingScratch sampling;
+        double s = time_best(options, [&]() {
+            kernels::sample_top_p(logits.data(), n_vocab, 0.9f, rng, sampling);
+        });
+        report(roof, "sample_top_p_32k", s, 4.0 * n_vocab, 3.0 * n_vocab * sizeof(float));
+
+        s = time_best(options, [&]() {
+            volatile embee::TokenId t = kernels::argmax(logits.data(), n_vocab);
+            (void)t;
+        });
+        report(roof, "argmax_32k", s, 1.0 * n_vocab, n_vocab * sizeof(float));
+    }
+
+    // LM head over a 32k vocabulary: full logits then argmax, against the
+    // tiled head with fused top-k that never stores the logits
+    if (wanted("lm_head")) {
+        const size_t n_embd = std::min<size_t>(dim, 2048);
+        const size_t stride = kernels::row_bytes(DataType::INT4, n_embd, block);
+        std::vector<uint8_t> head(stride * n_vocab);
+        std::vector<float> row = random_vector(n_embd);
+        for (size_t r = 0; r < n_vocab; ++r) {
+            kernels::quantize_row(DataType::INT4, row.data(), head.data() + r * stride, n_embd, block);
+            row[r % n_embd] = normal(gen);
+        }
+        const std::vector<float> h = random_vector(n_embd);
+        kernels::SamplingScratch sampling;
+        double s = time_best(options, [&]() {
+            kernels::gemv(DataType::INT4, head.data(), h.data(), work.data(), n_vocab, n_embd, block, threads);
+            volatile embee::TokenId t = kernels::argmax(work.data(), n_vocab);
+            (void)t;
+        });
+        report(roof, "lm_head_argmax_int4", s, 2.0 * n_vocab * n_embd, head.size() + 2.0 * n_vocab * sizeof(float));
+        for (size_t k : {1, 40}) {
+            s = time_best(options, [&]() {
+                kernels::lm_head_top_k(DataType::INT4, head.data(), h.data(), n_vocab, n_embd, block, k, nullptr,
+                                       sampling, threads);
+            });
+            report(roof, "lm_head_top" + std::to_string(k) + "_int4", s, 2.0 * n_vocab * n_embd, head.size());
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file quant_report.cpp
+ * @brief Quality report of a quantized model against its original
+ *
+ * Compares every tensor of the two AMB files (RMSE, cosine similarity and
+ * largest absolute error) and, given a text file, the perplexity of both
+ * models on it. The report can be written as JSON, so quantization
+ * configurations can be compared on data.
+ *
+ * Example:
+ *   quant_report models/llama-7b-f16.amb models/llama-7b-q4.amb \
+ *       --text data/wiki.txt --chunks 16 --json report.json
+ */
+
+#include "embee/evaluation.h"
+#include "embee/model.h"
+#include "embee/quantizer.h"
+#include "embee/tokenizer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+    std::string reference_path;
+    std::string quantized_path;
+    std::string text_path;
+    size_t context_tokens = 0;
+    size_t chunks = 0;
+    size_t block_size = 0;
+    size_t threads = 0;
+    std::string json_path;
+    bool quiet = false;
+};
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " ORIGINAL.amb QUANTIZED.amb [options]\n"
+              << "  --text FILE           Also compare perplexity on this text\n"
+              << "  --context N           Tokens per perplexity chunk (default: 512, or the\n"
+              << "                        reference model's context if shorter)\n"
+              << "  --chunks N            Chunks of text to run (default: 0 = all)\n"
+              << "  --block-size N        Weights per scale (default: from the quantized model)\n"
+              << "  --threads N           Worker threads (default: 0 = OpenMP default)\n"
+              << "  --json FILE           Also write the report as JSON ('-' for stdout)\n"
+              << "  --quiet               Only print the summary" << std::endl;
+}
+
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+std::string shape_string(const std::vector<size_t>& shape, const char* separator) {
+    std::ostringstream out;
+    for (size_t i = 0; i < shape.size(); ++i) {
+        out << (i ? separator : "") << shape[i];
+    }
+    return out.str();
+}
+
+void write_json(std::ostream& out, const Options& options, const std::vector<embee::TensorError>& errors,
+                const embee::PerplexityResult* reference, const embee::PerplexityResult* quantized) {
+    out << std::setprecision(9);
+    out << "{\n"
+        << "  \"reference\": " << json_string(options.reference_path) << ",\n"
+        << "  \"quantized\": " << json_string(options.quantized_path) << ",\n"
+        << "  \"tensors\": [\n";
+    for (size_t i = 0; i < errors.size(); ++i) {
+        const embee::TensorError& e = errors[i];
+        out << "    {\"name\": " << json_string(e.name)
+            << ", \"shape\": [" << shape_string(e.shape, ", ") << "]"
+            << ", \"reference_type\": \"" << embee::data_type_name(e.reference_type) << "\""
+            << ", \"type\": \"" << embee::data_type_name(e.type) << "\""
+            << ", \"rmse\": " << e.rmse
+            << ", \"cosine\": " << e.cosine
+            << ", \"max_error\": " << e.max_error << "}"
+            << (i + 1 < errors.size() ? "," : "") << "\n";
+    }
+    out << "  ]";
+    if (reference && quantized) {
+        out << ",\n  \"perplexity\": {\n"
+            << "    \"text\": " << json_string(options.text_path) << ",\n"
+            << "    \"context_tokens\": " << options.context_tokens << ",\n"
+            << "    \"chunks\": " << reference->n_chunks << ",\n"
+            << "    \"tokens\": " << reference->n_tokens << ",\n"
+            << "    \"reference\": " << reference->perplexity << ",\n"
+            << "    \"quantized\": " << quantized->perplexity << ",\n"
+            << "    \"delta\": " << quantized->perplexity - reference->perplexity << ",\n"
+            << "    \"reference_nll\": " << reference->mean_nll << ",\n"
+            << "    \"quantized_nll\": " << quantized->mean_nll << "\n"
+            << "  }";
+    }
+    out << "\n}\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--text") {
+                options.text_path = next();
+            } else if (arg == "--context") {
+                options.context_tokens = std::stoul(next());
+            } else if (arg == "--chunks") {
+                options.chunks = std::stoul(next());
+            } else if (arg == "--block-size") {
+                options.block_size = std::stoul(next());
+            } else if (arg == "--threads") {
+                options.threads = std::stoul(next());
+            } else if (arg == "--json") {
+                options.json_path = next();
+            } else if (arg == "--quiet") {
+                options.quiet = true;
+            } else if (!arg.empty() && arg[0] != '-' && options.reference_path.empty()) {
+                options.reference_path = arg;
+            } else if (!arg.empty() && arg[0] != '-' && options.quantized_path.empty()) {
+                options.quantized_path = arg;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (options.reference_path.empty() || options.quantized_path.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        const std::vector<embee::TensorError> errors = embee::compare_model_tensors(
+            options.reference_path, options.quantized_path, options.block_size, options.threads);
+        if (!options.quiet) {
+            std::cerr << std::left << std::setw(48) << "tensor" << std::setw(20) << "shape" << std::setw(16)
+                      << "types" << std::right << std::setw(12) << "rmse" << std::setw(12) << "cosine"
+                      << std::setw(12) << "max error" << std::endl;
+            for (const embee::TensorError& e : errors) {
+                std::cerr << std::left << std::setw(48) << e.name << std::setw(20)
+                          << "{" + shape_string(e.shape, ", ") + "}" << std::setw(16)
+                          << std::string(embee::data_type_name(e.reference_type)) + " -> " +
+                                 embee::data_type_name(e.type)
+                          << std::right << std::scientific << std::setprecision(3) << std::setw(12) << e.rmse
+                          << std::fixed << std::setprecision(6) << std::setw(12) << e.cosine
+                          << std::scientific << std::setprecision(3) << std::setw(12) << e.max_error
+                          << std::defaultfloat << std::endl;
+            }
+        }
+        if (errors.empty()) {
+            throw std::runtime_error(options.reference_path + " holds no tensors to compare");
+        }
+        auto worst = std::min_element(errors.begin(), errors.end(),
+                                      [](const embee::TensorError& a, const embee::TensorError& b) {
+                                          return a.cosine < b.cosine;
+                                      });
+        if (worst != errors.end()) {
+            std::cerr << "Compared " << errors.size() << " tensors; lowest cosine " << std::fixed
+                      << std::setprecision(6) << worst->cosine << " (" << worst->name << ")" << std::endl;
+        }
+
+        embee::PerplexityResult reference, quantized;
+        if (!options.text_path.empty()) {
+            std::ifstream file(options.text_path, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Failed to open " + options.text_path);
+            }
+            std::ostringstream text;
+            text << file.rdbuf();
+            // Each model runs on its own file's weights; the perplexities are
+            // only comparable when both tokenize the text the same way
+            size_t n_vocab = 0;
+            {
+                const embee::Model model(options.reference_path);
+                n_vocab = model.tokenizer()->vocab_size();
+                if (options.context_tokens == 0) {
+                    options.context_tokens = std::min<size_t>(512, model.config().max_seq_len);
+                }
+                reference = embee::evaluate_perplexity(model, text.str(), options.context_tokens, options.chunks,
+                                                       options.threads);
+            }
+            {
+                const embee::Model model(options.quantized_path);
+                if (model.tokenizer()->vocab_size() != n_vocab) {
+                    throw std::runtime_error("The two models have different tokenizers");
+                }
+                quantized = embee::evaluate_perplexity(model, text.str(), options.context_tokens, options.chunks,
+                                                       options.threads);
+            }
+            std::cerr << "Perplexity on " << reference.n_tokens << " tokens: " << std::fixed
+                      << std::setprecision(4) << reference.perplexity << " -> " << quantized.perplexity << " ("
+                      << std::showpos << 100.0 * (quantized.perplexity / reference.perplexity - 1.0) << "%)"
+                      << std::noshowpos << std::endl;
+        }
+
+        const bool with_perplexity = !options.text_path.empty();
+        if (options.json_path == "-") {
+            write_json(std::cout, options, errors, with_perplexity ? &reference : nullptr, &quantized);
+        } else if (!options.json_path.empty()) {
+            std::ofstream out(options.json_path);
+            if (!out) {
+                throw std::runtime_error("Failed to open " + options.json_path);
+            }
+            write_json(out, options, errors, with_perplexity ? &reference : nullptr, &quantized);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file quantize.cpp
+ * @brief Quantize a full-precision AMB model
+ *
+ * Streams the model tensor by tensor (see embee/quantizer.h), so it runs on
+ * machines with less RAM than the model. Weight matrices get the chosen
+ * block-quantized type; norms, biases and learned position embeddings stay
+ * FP32. Individual tensors can be given another type by name pattern.
+ *
+ * Example (keep the output projection at 8 bits):
+ *   quantize models/llama-70b-f16.amb models/llama-70b-q4.amb --type int4 \
+ *       --tensor-type 'lm_head.weight=int8'
+ *
+ * Example (mixed precision at 4.5 bits per weight, calibrated on text):
+ *   quantize models/llama-7b-f16.amb models/llama-7b-a45.amb --type adaptive \
+ *       --bits-per-weight 4.5 --calibration data/wiki.txt
+ *
+ * Example (INT4 with GPTQ error compensation; its Gram matrices take about
+ * 11 GB for a 7B model, see embee/calibration.h):
+ *   quantize models/llama-7b-f16.amb models/llama-7b-q4.amb --type int4 \
+ *       --method gptq --calibration data/wiki.txt
+ */
+
+#include "embee/calibration.h"
+#include "embee/model.h"
+#include "embee/quantizer.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " INPUT.amb OUTPUT.amb [options]\n"
+              << "  --type T              Type of weight matrices: int4, int5, int8, adaptive, fp16,\n"
+              << "                        bf16, fp32 (default: int4)\n"
+              << "  --block-size N        Weights per scale, a multiple of 8 (default: 32)\n"
+              << "  --tensor-type P=T     Store tensors whose names match P ('*' wildcards) as T;\n"
+              << "                        repeatable, the first matching pattern wins\n"
+              << "  --bits-per-weight B   Average size of adaptive tensors (default: 5.0)\n"
+              << "  --calibration FILE    Text run through the input model to weight adaptive\n"
+              << "                        errors by activation size (default: unweighted)\n"
+              << "  --method M            Quantization of int4, int5 and int8 tensors: rtn,\n"
+              << "                        activation-aware or gptq; the latter two need\n"
+              << "                        --calibration (default: rtn). gptq holds a Gram\n"
+              << "                        matrix of 2 n^2 bytes per layer input of width n\n"
+              << "                        (about 11 GB for a 7B model) and 16 n^2 bytes per\n"
+              << "                        tensor being converted\n"
+              << "  --gptq-damping D      Added to the Gram diagonal, relative to its mean\n"
+              << "                        (default: 0.01)\n"
+              << "  --calibration-chunks N\n"
+              << "                        Prompts of calibration text to run (default: 0 = all)\n"
+              << "  --chunk-tokens N      Tokens per calibration prompt (default: 512, or less\n"
+              << "                        to fit the input model's context)\n"
+              << "  --threads N           Tensors converted concurrently (default: 0 = OpenMP default)\n"
+              << "  --in-flight N         Converted tensors held in memory before writing\n"
+              << "                        (default: the thread count)\n"
+              << "  --quiet               Only print the summary" << std::endl;
+}
+
+std::string shape_string(const std::vector<size_t>& shape) {
+    std::ostringstream out;
+    out << "{";
+    for (size_t i = 0; i < shape.size(); ++i) {
+        out << (i ? ", " : "") << shape[i];
+    }
+    out << "}";
+    return out.str();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string input_path;
+    std::string output_path;
+    embee::QuantizerConfig config;
+    std::string calibration_path;
+    size_t calibration_chunks = 0;
+    size_t chunk_tokens = 0;
+    bool quiet = false;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--type") {
+                config.type = embee::parse_data_type(next());
+            } else if (arg == "--block-size") {
+                config.block_size = std::stoul(next());
+            } else if (arg == "--tensor-type") {
+                const std::string rule = next();
+                const size_t eq = rule.rfind('=');
+                if (eq == std::string::npos || eq == 0) {
+                    throw std::invalid_argument("Expected PATTERN=TYPE, got " + rule);
+                }
+                config.rules.push_back({rule.substr(0, eq), embee::parse_data_type(rule.substr(eq + 1))});
+            } else if (arg == "--bits-per-weight") {
+                config.target_bits_per_weight = std::stof(next());
+            } else if (arg == "--calibration") {
+                calibration_path = next();
+            } else if (arg == "--method") {
+                config.method = embee::parse_quantization_method(next());
+            } else if (arg == "--gptq-damping") {
+                config.gptq_damping = std::stof(next());
+            } else if (arg == "--calibration-chunks") {
+                calibration_chunks = std::stoul(next());
+            } else if (arg == "--chunk-tokens") {
+                chunk_tokens = std::stoul(next());
+            } else if (arg == "--threads") {
+                config.n_threads = std::stoul(next());
+            } else if (arg == "--in-flight") {
+                config.max_tensors_in_flight = std::stoul(next());
+            } else if (arg == "--quiet") {
+                quiet = true;
+            } else if (!arg.empty() && arg[0] != '-' && input_path.empty()) {
+                input_path = arg;
+            } else if (!arg.empty() && arg[0] != '-' && output_path.empty()) {
+                output_path = arg;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        if (input_path.empty() || output_path.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (config.method != embee::QuantizationMethod::ROUND_TO_NEAREST && calibration_path.empty()) {
+            throw std::invalid_argument(std::string("--method ") +
+                                        embee::quantization_method_name(config.method) +
+                                        " needs --calibration");
+        }
+        embee::ActivationStats stats(config.method == embee::QuantizationMethod::GPTQ);
+        if (!calibration_path.empty()) {
+            std::ifstream file(calibration_path, std::ios::binary);
+            if (!file) {
+                throw std::runtime_error("Failed to open " + calibration_path);
+            }
+            std::ostringstream text;
+            text << file.rdbuf();
+            const embee::Model model(input_path);
+            if (chunk_tokens == 0) {
+                chunk_tokens = std::min<size_t>(512, model.config().max_seq_len);
+            }
+            const size_t n_tokens = embee::collect_activation_stats(model, text.str(), stats, chunk_tokens,
+                                                                    calibration_chunks, config.n_threads);
+            std::cerr << "Calibrated " << stats.weights().size() << " weights on " << n_tokens << " tokens"
+                      << std::endl;
+            config.activation_stats = &stats;
+        }
+
+        auto report = [quiet](const embee::TensorQuantization& t) {
+            if (quiet) {
+                return;
+            }
+            std::cerr << std::left << std::setw(48) << t.name << std::setw(20) << shape_string(t.shape)
+                      << embee::data_type_name(t.source_type) << " -> " << std::setw(6)
+                      << embee::data_type_name(t.type) << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(10) << t.source_bytes / (1024.0 * 1024.0) << " -> "
+                      << std::setw(8) << t.bytes / (1024.0 * 1024.0) << " MiB";
+            if (t.method != embee::QuantizationMethod::ROUND_TO_NEAREST) {
+                std::cerr << "  " << embee::quantization_method_name(t.method);
+            }
+            std::cerr << std::endl;
+        };
+        const embee::QuantizationSummary summary =
+            embee::quantize_model(input_path, output_path, config, report);
+
+        const double bpw = summary.n_weights > 0 ? 8.0 * summary.bytes / summary.n_weights : 0.0;
+        std::cerr << "Quantized " << summary.n_quantized << " of " << summary.n_tensors << " tensors: "
+                  << std::fixed << std::setprecision(1) << summary.source_bytes / (1024.0 * 1024.0)
+                  << " MiB -> " << summary.bytes / (1024.0 * 1024.0) << " MiB ("
+                  << std::setprecision(2) << bpw << " bits per weight)" << std::endl;
+        uint64_t n_adaptive = 0;
+        for (uint64_t n : summary.adaptive_blocks) {
+            n_adaptive += n;
+        }
+        if (n_adaptive > 0) {
+            const char* names[] = {"int4", "int5", "int8", "fp16"};
+            std::cerr << "Adaptive blocks:";
+            for (size_t i = 0; i < summary.adaptive_blocks.size(); ++i) {
+                std::cerr << " " << names[i] << " " << std::setprecision(1)
+                          << 100.0 * summary.adaptive_blocks[i] / n_adaptive << "%";
+            }
+            std::cerr << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
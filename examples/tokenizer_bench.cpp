@@ -0,0 +1,402 @@
+/**
+ * @file tokenizer_bench.cpp
+ * @brief Tokenizer throughput benchmark and golden-output regression check
+ *
+ * Measures encode, batch encode and decode throughput (MB/s of text) for
+ * every tokenizer given on the command line over the bundled corpora, and
+ * compares the produced tokens against golden files so that behavior
+ * changes are caught together with speed changes.
+ *
+ * Golden files live in <golden_dir>/<tokenizer>/<corpus>.tokens and hold the
+ * space-separated token IDs of each corpus line (encoded without its newline).
+ * Run with --update-golden to (re)generate them after an intended change.
+ *
+ * Besides the character tokenizer, the byte-level BPE fixture
+ * examples/data/tokenizers/byte_bpe.tok (a BINARY_BPE section) is checked
+ * whenever it exists. --train-bpe rebuilds it from the corpora.
+ */
+
+#include "embee/amb_format.h"
+#include "embee/tokenizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct NamedTokenizer {
+    std::string name;
+    std::unique_ptr<embee::Tokenizer> tokenizer;
+};
+
+struct Corpus {
+    std::string name;
+    std::string text;
+    std::vector<std::string_view> lines;
+};
+
+struct Options {
+    std::string corpus_dir = "examples/data/corpora";
+    std::string golden_dir = "examples/data/golden";
+    std::string bpe_fixture = "examples/data/tokenizers/byte_bpe.tok";
+    std::string train_bpe_path;
+    size_t n_merges = 400;
+    bool update_golden = false;
+    size_t repetitions = 5;
+    double min_seconds = 0.2;
+    size_t threads = 0;
+};
+
+void print_usage(const char* argv0) {
+    std::cerr << "Usage: " << argv0 << " [options]\n"
+              << "  --corpus-dir DIR      Directory of *.txt corpora (default: examples/data/corpora)\n"
+              << "  --golden-dir DIR      Directory of golden token files (default: examples/data/golden)\n"
+              << "  --update-golden       Write golden files instead of checking them\n"
+              << "  --fixture FILE        Byte-level BPE fixture checked when it exists\n"
+              << "                        (default: examples/data/tokenizers/byte_bpe.tok)\n"
+              << "  --train-bpe FILE      Train a byte-level BPE fixture on the corpora, write it\n"
+              << "                        to FILE and exit\n"
+              << "  --merges N            Merges learned by --train-bpe (default: 400)\n"
+              << "  --amb FILE            Benchmark the tokenizer stored in an AMB file\n"
+              << "  --repetitions N       Timed repetitions, best is reported (default: 5)\n"
+              << "  --min-time SECONDS    Minimum duration of each repetition (default: 0.2)\n"
+              << "  --threads N           Threads for encode_batch (default: OpenMP default)\n"
+              << "The character tokenizer and the fixture are always benchmarked." << std::endl;
+}
+
+std::vector<Corpus> load_corpora(const std::string& dir) {
+    std::vector<fs::path> paths;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".txt") {
+            paths.push_back(entry.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::vector<Corpus> corpora(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+        std::ifstream file(paths[i], std::ios::binary);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        corpora[i].name = paths[i].stem().string();
+        corpora[i].text = buffer.str();
+    }
+
+    // Split after the strings have reached their final address
+    for (auto& corpus : corpora) {
+        std::string_view text = corpus.text;
+        size_t start = 0;
+        while (start < text.size()) {
+            size_t end = text.find('\n', start);
+            if (end == std::string_view::npos) {
+                end = text.size();
+            }
+            corpus.lines.push_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    return corpora;
+}
+
+// Learn byte-level BPE merges from the corpora: repeatedly merge the most
+// frequent adjacent pair (ties to the lowest IDs) within words, each word
+// being a run of non-space bytes with its leading space. Deterministic, so
+// the fixture and its golden files can be regenerated exactly.
+embee::amb::TokenizerSpec train_byte_bpe(const std::vector<Corpus>& corpora, size_t n_merges) {
+    embee::amb::TokenizerSpec spec;
+    std::map<std::string, embee::TokenId> ids;
+    for (int b = 0; b < 256; ++b) {
+        spec.vocab.push_back(std::string(1, static_cast<char>(b)));
+        ids.emplace(spec.vocab.back(), b);
+    }
+
+    std::map<std::string, size_t> word_counts;
+    for (const auto& corpus : corpora) {
+        for (std::string_view line : corpus.lines) {
+            size_t start = 0;
+            while (start < line.size()) {
+                size_t end = line.find_first_not_of(' ', start);
+                end = end == std::string_view::npos ? line.size() : line.find(' ', end);
+                end = end == std::string_view::npos ? line.size() : end;
+                ++word_counts[std::string(line.substr(start, end - start))];
+                start = end;
+            }
+        }
+    }
+    std::vector<std::pair<std::vector<embee::TokenId>, size_t>> words;
+    for (const auto& [word, count] : word_counts) {
+        words.push_back({std::vector<embee::TokenId>(word.begin(), word.end()), count});
+        for (auto& id : words.back().first) {
+            id = static_cast<uint8_t>(id);
+        }
+    }
+
+    while (spec.merges.size() < n_merges) {
+        std::map<std::pair<embee::TokenId, embee::TokenId>, size_t> pair_counts;
+        for (const auto& [symbols, count] : words) {
+            for (size_t i = 0; i + 1 < symbols.size(); ++i) {
+                pair_counts[{symbols[i], symbols[i + 1]}] += count;
+            }
+        }
+        auto best = pair_counts.end();
+        for (auto it = pair_counts.begin(); it != pair_counts.end(); ++it) {
+            if (best == pair_counts.end() || it->second > best->second) {
+                best = it;
+            }
+        }
+        if (best == pair_counts.end() || best->second < 2) {
+            break;
+        }
+        const auto [left, right] = best->first;
+        const std::string merged_string = spec.vocab[left] + spec.vocab[right];
+        auto [it, added] = ids.emplace(merged_string, static_cast<embee::TokenId>(spec.vocab.size()));
+        if (added) {
+            spec.vocab.push_back(merged_string);
+        }
+        spec.merges.push_back({left, right});
+        for (auto& [symbols, count] : words) {
+            std::vector<embee::TokenId> out;
+            for (size_t i = 0; i < symbols.size(); ++i) {
+                if (i + 1 < symbols.size() && symbols[i] == left && symbols[i + 1] == right) {
+                    out.push_back(it->second);
+                    ++i;
+                } else {
+                    out.push_back(symbols[i]);
+                }
+            }
+            symbols = std::move(out);
+        }
+    }
+
+    spec.vocab.push_back("<|endoftext|>");
+    const embee::TokenId eot = static_cast<embee::TokenId>(spec.vocab.size() - 1);
+    spec.special_tokens = {eot};
+    spec.bos_id = eot;
+    spec.eos_id = eot;
+    return spec;
+}
+
+// Run fn repeatedly for at least min_seconds; return the best seconds per call
+template <typename Fn>
+double time_best(const Options& options, Fn&& fn) {
+    using clock = std::chrono::steady_clock;
+    double best = 1e30;
+    for (size_t rep = 0; rep < options.repetitions; ++rep) {
+        size_t calls = 0;
+        auto start = clock::now();
+        double elapsed = 0.0;
+        do {
+            fn();
+            ++calls;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while (elapsed < options.min_seconds);
+        best = std::min(best, elapsed / calls);
+    }
+    return best;
+}
+
+std::string format_tokens(const embee::TokenVector& tokens) {
+    std::string line;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (i > 0) {
+            line += ' ';
+        }
+        line += std::to_string(tokens[i]);
+    }
+    return line;
+}
+
+// Returns an empty string on success, otherwise a description of the first difference
+std::string check_golden(const Options& options, const NamedTokenizer& tok, const Corpus& corpus,
+                         const std::vector<embee::TokenVector>& encoded) {
+    fs::path path = fs::path(options.golden_dir) / tok.name / (corpus.name + ".tokens");
+
+    if (options.update_golden) {
+        fs::create_directories(path.parent_path());
+        std::ofstream out(path);
+        for (const auto& tokens : encoded) {
+            out << format_tokens(tokens) << '\n';
+        }
+        return out ? "" : "failed to write " + path.string();
+    }
+
+    std::ifstream in(path);
+    if (!in) {
+        return "missing golden file " + path.string();
+    }
+    std::string expected;
+    for (size_t i = 0; i < encoded.size(); ++i) {
+        if (!std::getline(in, expected)) {
+            return path.string() + ": golden file ends at line " + std::to_string(i + 1);
+        }
+        std::string actual = format_tokens(encoded[i]);
+        if (actual != expected) {
+            return path.string() + ":" + std::to_string(i + 1) + ": expected [" + expected +
+                   "] got [" + actual + "]";
+        }
+    }
+    if (std::getline(in, expected)) {
+        return path.string() + ": golden file has extra lines";
+    }
+    return "";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    std::vector<NamedTokenizer> tokenizers;
+
+    try {
+        tokenizers.push_back({"char", std::make_unique<embee::CharTokenizer>()});
+
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto next = [&]() -> std::string {
+                if (i + 1 >= argc) {
+                    throw std::invalid_argument("Missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "--corpus-dir") {
+                options.corpus_dir = next();
+            } else if (arg == "--golden-dir") {
+                options.golden_dir = next();
+            } else if (arg == "--update-golden") {
+                options.update_golden = true;
+            } else if (arg == "--fixture") {
+                options.bpe_fixture = next();
+            } else if (arg == "--train-bpe") {
+                options.train_bpe_path = next();
+            } else if (arg == "--merges") {
+                options.n_merges = std::stoul(next());
+            } else if (arg == "--amb") {
+                tokenizers.push_back({"amb", embee::Tokenizer::load(next())});
+            } else if (arg == "--repetitions") {
+                options.repetitions = std::max<size_t>(1, std::stoul(next()));
+            } else if (arg == "--min-time") {
+                options.min_seconds = std::stod(next());
+            } else if (arg == "--threads") {
+                options.threads = std::stoul(next());
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+
+        std::vector<Corpus> corpora = load_corpora(options.corpus_dir);
+        if (corpora.empty()) {
+            std::cerr << "No corpora found in " << options.corpus_dir << std::endl;
+            return 1;
+        }
+
+        if (!options.train_bpe_path.empty()) {
+            const embee::amb::TokenizerSpec spec = train_byte_bpe(corpora, options.n_merges);
+            const std::vector<uint8_t> section = embee::amb::serialize_tokenizer(spec);
+            fs::path path(options.train_bpe_path);
+            if (path.has_parent_path()) {
+                fs::create_directories(path.parent_path());
+            }
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(section.data()), section.size());
+            if (!out) {
+                throw std::runtime_error("Failed to write " + path.string());
+            }
+            std::cerr << "Wrote " << spec.vocab.size() << " tokens and " << spec.merges.size() << " merges to "
+                      << path.string() << std::endl;
+            return 0;
+        }
+        if (fs::exists(options.bpe_fixture)) {
+            tokenizers.insert(tokenizers.begin() + 1, {"byte_bpe", embee::Tokenizer::load(options.bpe_fixture)});
+        }
+
+        std::cout << std::left << std::setw(8) << "tokenizer" << std::setw(14) << " corpus"
+                  << std::right << std::setw(10) << "tokens" << std::setw(12) << "B/token"
+                  << std::setw(12) << "enc MB/s" << std::setw(12) << "batch MB/s"
+                  << std::setw(12) << "dec MB/s" << "  golden" << std::endl;
+
+        size_t failures = 0;
+        for (const auto& tok : tokenizers) {
+            for (const auto& corpus : corpora) {
+                const double mb = corpus.text.size() / 1e6;
+
+                // Correctness: per-line encoding, compared with the batch API and golden files
+                std::vector<embee::TokenVector> encoded;
+                size_t n_tokens = 0;
+                for (auto line : corpus.lines) {
+                    encoded.push_back(tok.tokenizer->encode(std::string(line)));
+                    n_tokens += encoded.back().size();
+                }
+
+                embee::TokenVector flat;
+                std::vector<size_t> offsets;
+                tok.tokenizer->encode_batch(corpus.lines, flat, offsets, options.threads);
+
+                std::string problem;
+                for (size_t i = 0; i < encoded.size() && problem.empty(); ++i) {
+                    if (!std::equal(encoded[i].begin(), encoded[i].end(),
+                                    flat.begin() + offsets[i], flat.begin() + offsets[i + 1])) {
+                        problem = "encode_batch differs from encode at line " + std::to_string(i + 1);
+                    }
+                }
+                if (problem.empty()) {
+                    problem = check_golden(options, tok, corpus, encoded);
+                }
+
+                // Throughput
+                double enc_s = time_best(options, [&]() {
+                    for (auto line : corpus.lines) {
+                        volatile size_t n = tok.tokenizer->encode(std::string(line)).size();
+                        (void)n;
+                    }
+                });
+                double batch_s = time_best(options, [&]() {
+                    tok.tokenizer->encode_batch(corpus.lines, flat, offsets, options.threads);
+                });
+                double dec_s = time_best(options, [&]() {
+                    for (const auto& tokens : encoded) {
+                        volatile size_t n = tok.tokenizer->decode(tokens).size();
+                        (void)n;
+                    }
+                });
+
+                std::cout << std::left << std::setw(8) << tok.name << ' ' << std::setw(13) << corpus.name
+                          << std::right << std::setw(10) << n_tokens
+                          << std::setw(12) << std::fixed << std::setprecision(2)
+                          << (n_tokens ? static_cast<double>(corpus.text.size()) / n_tokens : 0.0)
+                          << std::setw(12) << std::setprecision(1) << mb / enc_s
+                          << std::setw(12) << mb / batch_s
+                          << std::setw(12) << mb / dec_s
+                          << "  " << (problem.empty() ? (options.update_golden ? "updated" : "ok") : "FAIL")
+                          << std::endl;
+                if (!problem.empty()) {
+                    std::cerr << "  " << problem << std::endl;
+                    ++failures;
+                }
+            }
+        }
+
+        if (failures > 0) {
+            std::cerr << failures << " tokenizer/corpus combination(s) failed" << std::endl;
+            return 2;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
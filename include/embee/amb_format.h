@@ -0,0 +1,281 @@
+/**
+ * @file amb_format.h
+ * @brief On-disk layout of AMB model files and helpers to read them in place
+ */
+
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace embee {
+namespace amb {
+
+constexpr char MAGIC[5] = {'A', 'M', 'B', 'E', 'E'};
+// Version 2 pads tensor record headers so that tensor data is aligned;
+// version 1 files are still read
+constexpr uint8_t FORMAT_VERSION = 2;
+constexpr size_t HEADER_SIZE = 28;
+
+// Sections that are used in place (tokenizer, weights) start on this boundary
+constexpr size_t SECTION_ALIGNMENT = 8;
+
+/**
+ * Parsed AMB file header (see docs/model_format.md)
+ */
+struct Header {
+    uint8_t version = 0;
+    uint16_t flags = 0;
+    uint32_t metadata_size = 0;
+    uint32_t config_size = 0;
+    uint32_t tokenizer_size = 0;
+    uint64_t weights_size = 0;
+
+    size_t metadata_offset() const { return HEADER_SIZE; }
+    size_t config_offset() const { return metadata_offset() + metadata_size; }
+    size_t tokenizer_offset() const { return config_offset() + config_size; }
+    size_t weights_offset() const { return tokenizer_offset() + tokenizer_size; }
+
+    // Whether record headers are padded so tensor data is SECTION_ALIGNMENT aligned
+    bool aligned_tensor_data() const { return version >= 2; }
+};
+
+/**
+ * Parse and validate the header at the start of an AMB file
+ * @param data Start of the file
+ * @param size Size of the file in bytes
+ * @return The parsed header
+ * @throws std::runtime_error if the magic, version or section sizes are invalid
+ */
+Header parse_header(const uint8_t* data, size_t size);
+
+/**
+ * Serialize a header (the inverse of parse_header)
+ * @param header Section sizes; the version is always FORMAT_VERSION
+ * @return The first HEADER_SIZE bytes of a file
+ */
+std::array<uint8_t, HEADER_SIZE> serialize_header(const Header& header);
+
+/**
+ * Parse the top-level members of a JSON object (the metadata and config sections)
+ * @param json Object text; trailing padding spaces are allowed
+ * @return The raw JSON text of each member's value, by key (strings keep
+ *         their quotes; see json_string())
+ * @throws std::runtime_error if the text is not a well-formed object
+ */
+std::unordered_map<std::string, std::string> parse_json_object(const std::string& json);
+
+/**
+ * Value of a JSON string literal, with escapes resolved
+ * @throws std::runtime_error if value is not a string literal
+ */
+std::string json_string(const std::string& value);
+
+/**
+ * One tensor of the weights section, viewed in place
+ */
+struct TensorRecord {
+    std::string name;
+    std::vector<size_t> shape;
+    DataType data_type = DataType::FP32;
+    const uint8_t* data = nullptr;   // Tensor bytes, inside the section
+    uint64_t data_size = 0;
+    size_t offset = 0;               // Section offset of the record
+    size_t end = 0;                  // Section offset of the next record (after padding)
+};
+
+/**
+ * Parse the tensor record at an offset of the weights section
+ *
+ * Data type codes 6 and 7 (INT4BLOCK, INT5BLOCK) are read as INT4 and INT5,
+ * which are block-quantized.
+ * @param section Start of the weights section (8-byte aligned in the file)
+ * @param size Section size in bytes
+ * @param offset Offset of the record within the section
+ * @param aligned_data Whether the record header is padded before the data
+ *        (Header::aligned_tensor_data())
+ * @return The record; its data points into section
+ * @throws std::runtime_error if the record is truncated or its data type is unsupported
+ */
+TensorRecord parse_tensor_record(const uint8_t* section, size_t size, size_t offset, bool aligned_data);
+
+/**
+ * Serialize the fields of a tensor record that precede its data
+ *
+ * A record is these bytes, data_size bytes of data, then
+ * tensor_record_padding() zero bytes. The fields are zero-padded to a
+ * multiple of SECTION_ALIGNMENT bytes: records start aligned, so the data
+ * does too (format version 2).
+ * @throws std::invalid_argument if the name or shape do not fit the format
+ */
+std::vector<uint8_t> serialize_tensor_header(const std::string& name, const std::vector<size_t>& shape,
+                                             DataType type, uint64_t data_size);
+
+/**
+ * Zero bytes that follow a record ending at a section offset
+ */
+inline size_t tensor_record_padding(size_t offset) {
+    return (SECTION_ALIGNMENT - offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT;
+}
+
+/**
+ * @class MappedFile
+ * @brief Read-only memory mapping of a whole file
+ *
+ * Falls back to reading the file into memory on platforms without mmap.
+ */
+class MappedFile {
+public:
+    /**
+     * Map a file into memory
+     * @param path Path to the file
+     * @throws std::runtime_error if the file cannot be opened or mapped
+     */
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    /**
+     * Count how many bytes of a range are currently resident in RAM
+     * @param offset Start of the range within the file
+     * @param length Length of the range in bytes
+     * @return Resident bytes (the whole range when the file was read, not mapped)
+     */
+    size_t resident_bytes(size_t offset, size_t length) const;
+
+    /**
+     * Drop the pages of a range from the process's resident set
+     *
+     * The data stays valid; reading it again faults it back in from the
+     * file. Used when streaming through files larger than RAM.
+     * @param offset Start of the range within the file
+     * @param length Length of the range in bytes
+     */
+    void evict(size_t offset, size_t length) const;
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<uint8_t> fallback_;
+};
+
+/**
+ * Tokenizer section type identifiers
+ */
+enum class TokenizerType : uint8_t {
+    BPE = 0,
+    SENTENCEPIECE = 1,
+    WORDPIECE = 2,
+    CUSTOM = 3,
+    BINARY_BPE = 4   // Fixed layout used in place from the mapped file
+};
+
+/**
+ * Fixed-size header of a BINARY_BPE tokenizer section
+ *
+ * All offsets are relative to the start of the section and point to 4-byte
+ * aligned arrays. Absent special tokens are stored as -1.
+ */
+struct TokenizerSectionHeader {
+    uint8_t type;                // TokenizerType::BINARY_BPE
+    uint8_t version;             // Layout version (current: 1)
+    uint16_t flags;              // Reserved
+    uint32_t n_vocab;            // Number of tokens
+    int32_t bos_id;
+    int32_t eos_id;
+    int32_t pad_id;
+    int32_t unk_id;
+    int32_t mask_id;
+    uint32_t merge_table_size;   // Number of hash slots (power of two)
+    uint32_t n_trie_nodes;       // Special-token trie nodes (0 = no trie)
+    uint32_t n_trie_edges;
+    uint32_t string_pool_size;   // Bytes in the string pool
+    uint32_t offsets_offset;     // uint32_t[n_vocab + 1] into the string pool
+    uint32_t string_pool_offset; // Token strings, concatenated
+    uint32_t byte_tokens_offset; // int32_t[256] base token of each byte
+    uint32_t merges_offset;      // MergeSlot[merge_table_size]
+    uint32_t trie_nodes_offset;  // TrieNode[n_trie_nodes]
+    uint32_t trie_edges_offset;  // TrieEdge[n_trie_edges]
+    uint32_t reserved[3];
+};
+static_assert(sizeof(TokenizerSectionHeader) == 80, "tokenizer header layout changed");
+
+constexpr uint8_t TOKENIZER_LAYOUT_VERSION = 1;
+
+/**
+ * Open-addressing hash slot mapping a token pair to its merge
+ */
+struct MergeSlot {
+    int32_t left;     // -1 marks an empty slot
+    int32_t right;
+    int32_t merged;   // Token produced by the merge
+    uint32_t rank;    // Merge priority (lower merges first)
+};
+static_assert(sizeof(MergeSlot) == 16, "merge slot layout changed");
+
+/**
+ * Special-token trie node; its edges are sorted by byte
+ */
+struct TrieNode {
+    uint32_t first_edge;
+    uint32_t n_edges;
+    int32_t token_id;  // Token ending at this node, or -1
+};
+static_assert(sizeof(TrieNode) == 12, "trie node layout changed");
+
+struct TrieEdge {
+    uint32_t byte;     // Only the low 8 bits are used
+    uint32_t child;
+};
+static_assert(sizeof(TrieEdge) == 8, "trie edge layout changed");
+
+/**
+ * Hash slot for a token pair in the merge table
+ */
+inline uint32_t merge_hash(int32_t left, int32_t right, uint32_t mask) {
+    uint32_t h = static_cast<uint32_t>(left) * 0x9E3779B1u;
+    h ^= static_cast<uint32_t>(right) * 0x85EBCA77u;
+    h ^= h >> 15;
+    return h & mask;
+}
+
+/**
+ * In-memory description of a BPE tokenizer, used to build a binary section
+ */
+struct TokenizerSpec {
+    std::vector<std::string> vocab;                      // Token strings (raw bytes)
+    std::vector<std::pair<TokenId, TokenId>> merges;     // In rank order
+    std::vector<TokenId> special_tokens;                 // Matched atomically in text
+    int32_t bos_id = -1;
+    int32_t eos_id = -1;
+    int32_t pad_id = -1;
+    int32_t unk_id = -1;
+    int32_t mask_id = -1;
+};
+
+/**
+ * Serialize a tokenizer into a BINARY_BPE section
+ *
+ * The merged token of each pair is the vocabulary entry whose string is the
+ * concatenation of the pair. A byte without a vocabulary entry of its own is
+ * encoded as unk_id.
+ * @param spec Tokenizer description
+ * @return Section bytes, ready to be written at an 8-byte aligned offset
+ * @throws std::invalid_argument if the spec is inconsistent, or a byte has
+ *         no vocabulary entry and there is no unk_id
+ */
+std::vector<uint8_t> serialize_tokenizer(const TokenizerSpec& spec);
+
+} // namespace amb
+} // namespace embee
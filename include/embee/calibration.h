@@ -0,0 +1,129 @@
+/**
+ * @file calibration.h
+ * @brief Activation statistics gathered by running text through a model
+ *
+ * Quantization error in a weight column costs output error in proportion to
+ * the activations that column multiplies. Running representative text
+ * through the engine with an ActivationStats attached records, for every
+ * weight matrix, the mean square of each input column. The quantizer uses
+ * these as the importance of each weight column (an importance matrix).
+ *
+ * GPTQ also needs each input's Gram matrix, held as a packed FP32 lower
+ * triangle: cols (cols + 1) / 2 values. Weights that multiply the same input
+ * share one entry (see ActivationStats::share_input()), so a LLaMA block
+ * holds four: the attention input, the attention output, the feed-forward
+ * input of c_fc and c_gate, and the input of mlp.c_proj. For a 7B model
+ * (n_embd 4096, n_ff 11008) that is about 340 MB per block and 11 GB over
+ * its 32 blocks, all held until the quantizer is done.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace embee {
+
+class Model;
+
+/**
+ * @class ActivationStats
+ * @brief Per-column input statistics of weight matrices
+ *
+ * Attach to EngineConfig::activation_stats; every matmul the engine runs
+ * then adds its inputs. Safe to share between engines: each weight's entry
+ * has its own lock, so matmuls of different weights add concurrently.
+ */
+class ActivationStats {
+public:
+    /**
+     * @param collect_gram Also accumulate each weight's input Gram matrix
+     *        X^T X, as GPTQ quantization needs. It holds cols x cols values
+     *        per weight and costs O(cols^2) per input row.
+     */
+    explicit ActivationStats(bool collect_gram = false) : collect_gram_(collect_gram) {}
+
+    /**
+     * Add rows of the input of a weight matrix
+     * @param weight Name of the weight tensor
+     * @param x Inputs (rows x cols)
+     */
+    void add(const std::string& weight, const float* x, size_t rows, size_t cols);
+
+    /**
+     * Record the inputs of a weight under another weight that multiplies the
+     * same input, so that both share one entry and one Gram matrix. add()
+     * then ignores the weight. Declaring the same sharing again does nothing.
+     * @param weight Weight whose inputs are those of `with`
+     * @param with Weight whose entry holds them
+     * @throws std::invalid_argument if weight has already recorded inputs of its own
+     */
+    void share_input(const std::string& weight, const std::string& with);
+
+    /**
+     * Mean square of each input column of a weight
+     * @return One value per column, or an empty vector if the weight saw no input
+     */
+    std::vector<float> importance(const std::string& weight) const;
+
+    /**
+     * Mean of x x^T over the inputs of a weight
+     * @return cols x cols values, row-major, or an empty vector if the weight
+     *         saw no input or Gram matrices are not collected
+     */
+    std::vector<double> gram(const std::string& weight) const;
+
+    /**
+     * Whether Gram matrices are collected
+     */
+    bool collects_gram() const { return collect_gram_; }
+
+    /**
+     * Input rows recorded for a weight
+     */
+    uint64_t rows(const std::string& weight) const;
+
+    /**
+     * Names of the weights with statistics, including those sharing an input
+     */
+    std::vector<std::string> weights() const;
+
+private:
+    struct Entry {
+        mutable std::mutex mutex;   // Guards the fields below
+        std::vector<double> sum_squares;
+        std::vector<float> gram;    // Lower triangle packed by rows: row i starts at i (i + 1) / 2
+        uint64_t rows = 0;
+        Entry* source = nullptr;    // Entry holding the inputs when shared; guarded by the map's lock
+    };
+
+    // The entry holding a weight's inputs, or null; entries never move once created
+    const Entry* find(const std::string& weight) const;
+
+    bool collect_gram_;
+    mutable std::mutex mutex_;   // Guards the map, not the entries
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+/**
+ * Run calibration text through a model and record its activation statistics
+ *
+ * The text is tokenized and split into chunks of chunk_tokens tokens, and
+ * the tokens of each chunk are run as one prompt.
+ * @param model Model to run, ideally at full precision
+ * @param text Calibration text
+ * @param stats Receives the statistics of every weight matrix the forward pass used
+ * @param chunk_tokens Tokens per prompt (at most the context length)
+ * @param max_chunks Chunks to run (0 = all)
+ * @param n_threads Worker threads (0 = OpenMP default)
+ * @return Number of tokens run
+ * @throws std::invalid_argument if chunk_tokens is 0 or does not fit the context
+ */
+size_t collect_activation_stats(const Model& model, const std::string& text, ActivationStats& stats,
+                                size_t chunk_tokens = 512, size_t max_chunks = 0, size_t n_threads = 0);
+
+} // namespace embee
@@ -7,6 +7,7 @@
 
 #include "model.h"
 #include "types.h"
+#include "profiler.h"
 #include <string>
 #include <vector>
 #include <memory>
@@ -14,6 +15,10 @@
 
 namespace embee {
 
+class ActivationStats;
+class MetricsRegistry;
+class ScratchPool;
+
 /**
  * @struct GenerationConfig
  * @brief Configuration for text generation
@@ -21,12 +26,54 @@ namespace embee {
 struct GenerationConfig {
     size_t max_length = 512;              // Maximum number of tokens to generate
     float temperature = 0.8f;             // Sampling temperature (1.0 = no change, 0.0 = greedy)
-    float top_p = 0.9f;                   // Nucleus sampling probability threshold
+    float top_p = 0.9f;                   // Nucleus sampling probability threshold (near 0 = greedy)
+    size_t top_k = 0;                     // Sample among the k most likely tokens (0 = whole vocabulary)
     float repetition_penalty = 1.1f;      // Penalty for repeating tokens
     size_t batch_size = 1;               // Batch size for processing
     bool use_cache = true;               // Whether to use KV cache
+    bool ignore_eos = false;             // Keep generating past EOS (benchmarking)
+    size_t draft_layers = 0;             // Layers of the self-draft forward (0 = no drafting; greedy only)
+    size_t draft_tokens = 4;             // Tokens drafted per verification pass
+};
+
+/**
+ * @struct ScoringConfig
+ * @brief Configuration for scoring token sequences
+ */
+struct ScoringConfig {
+    size_t window = 0;                   // Positions per forward pass of long sequences (0 = max_seq_len)
+    size_t stride = 0;                   // Tokens newly scored per window after the first (0 = window / 2)
+};
+
+/**
+ * @struct EngineConfig
+ * @brief Configuration fixed for the lifetime of an engine
+ */
+struct EngineConfig {
+    size_t n_threads = 0;                // Worker threads for compute (0 = OpenMP default)
+    bool enable_profiling = false;       // Record per-op timings (see profiler())
+    bool enable_hardware_counters = false; // Also attribute perf_event counters to ops (Linux)
+    MetricsRegistry* metrics = nullptr;  // Registry for serving metrics (must outlive the engine)
+    ScratchPool* scratch_pool = nullptr; // Pool for KV cache buffers, shareable between engines (must outlive them)
+    TokenVector vocabulary_shortlist;    // Tokens the LM head scores, plus EOS (empty = whole vocabulary)
+    ActivationStats* activation_stats = nullptr; // Records every matmul's inputs (calibration; must outlive the engine)
+    bool fuse_graph = true;              // Run the graph fusion passes (off to check them against the plain graph)
 };
 
+/**
+ * Read a vocabulary shortlist from a token frequency file
+ *
+ * Each line holds a token ID and its count, separated by whitespace; blank
+ * lines and lines starting with '#' are skipped. The most frequent tokens
+ * are kept until they account for the requested share of all counts.
+ * @param path Frequency file
+ * @param coverage Share of the total count to cover (0 to 1]
+ * @param max_tokens Upper bound on the shortlist size (0 = no bound)
+ * @return Token IDs for EngineConfig::vocabulary_shortlist, most frequent first
+ * @throws std::runtime_error if the file cannot be read or a line is malformed
+ */
+TokenVector load_vocabulary_shortlist(const std::string& path, double coverage = 1.0, size_t max_tokens = 0);
+
 /**
  * @class Engine
  * @brief Main inference engine for transformer models
@@ -44,8 +91,10 @@ public:
     /**
      * Create an inference engine for a model
      * @param model The model to use for inference
+     * @param config Engine configuration
      */
-    explicit Engine(const Model& model);
+    explicit Engine(const Model& model, const EngineConfig& config = {});
+    ~Engine();
     
     /**
      * Generate text from a prompt
@@ -66,10 +115,84 @@ public:
     
     /**
      * Get the raw logits for a prompt (last token)
+     *
+     * With a vocabulary shortlist, tokens outside it get -infinity.
      * @param prompt The input prompt
      * @return Vector of logits for the vocabulary
      */
     std::vector<float> get_logits(const std::string& prompt);
+
+    /**
+     * Get the raw logits after a token sequence (last token)
+     *
+     * As get_logits(const std::string&), without tokenizing. The KV cache of
+     * a shared prefix with the previous call is reused, so extending the
+     * sequence one token per call costs one token of compute each.
+     * @param tokens Token IDs (1 to max_seq_len of them)
+     * @return Vector of logits for the vocabulary
+     * @throws std::invalid_argument if tokens is empty or holds an ID outside the vocabulary
+     * @throws std::length_error if tokens exceeds the maximum sequence length
+     */
+    std::vector<float> get_logits(const TokenVector& tokens);
+
+    /**
+     * Get the log-probability of every token of a sequence after the ones before it
+     *
+     * The sequence runs as one prefill and the LM head scores all of its
+     * positions batch by batch; nothing is sampled. Sequences longer than
+     * config.window are scored with a sliding window moved config.stride
+     * tokens at a time: each window is a fresh prefill that scores only the
+     * tokens not scored before, so every token has at least window - stride
+     * tokens of context. With a vocabulary shortlist, probabilities are
+     * normalized over the shortlist and other tokens score -infinity.
+     * @param tokens Token IDs
+     * @param config Window and stride
+     * @return tokens.size() - 1 values; entry i is log p(tokens[i + 1] | tokens[0..i])
+     * @throws std::invalid_argument if a token ID is outside the vocabulary,
+     *         the window does not fit the context or the stride is not below it
+     */
+    std::vector<float> score(const TokenVector& tokens, const ScoringConfig& config = {});
+
+    /**
+     * Score several sequences, as score() does each
+     *
+     * A sequence that fits the window reuses the KV cache and the scores of
+     * the prefix it shares with the previous sequence, so candidates that
+     * follow a common prompt (reranking) only run their own tokens.
+     * @param sequences Token sequences
+     * @param config Window and stride
+     * @return The scores of each sequence, in order
+     * @throws std::invalid_argument as score()
+     */
+    std::vector<std::vector<float>> score_batch(const std::vector<TokenVector>& sequences,
+                                                const ScoringConfig& config = {});
+    
+    /**
+     * Get the profiler holding per-op timings of recent requests
+     * @return The profiler, or nullptr if profiling is disabled
+     */
+    Profiler* profiler() const;
+    
+    /**
+     * Get the current memory use of the model and engine
+     * @return Bytes by category
+     */
+    MemoryStats memory_usage() const;
+    
+    /**
+     * Get the high-water mark of each category since creation or the last reset
+     *
+     * Engine buffers are sampled after every forward pass and at the end of
+     * every request. Weights and tokenizer are sampled at construction and on
+     * each call, since counting resident weights scans the whole mapping.
+     * @return Per-category maxima (total() of the result bounds the peak total)
+     */
+    MemoryStats peak_memory_usage() const;
+    
+    /**
+     * Restart high-water tracking from the current usage
+     */
+    void reset_peak_memory_usage();
     
 private:
     // Forward declaration of implementation
@@ -0,0 +1,82 @@
+/**
+ * @file evaluation.h
+ * @brief Quality of a quantized model relative to its original
+ *
+ * Two measures are provided. compare_model_tensors() reads the tensors of
+ * both AMB files and reports how far each quantized tensor is from its
+ * original; evaluate_perplexity() runs text through a model and reports how
+ * well it predicts it. Together they show where a quantization configuration
+ * loses accuracy and what that costs end to end.
+ */
+
+#pragma once
+
+#include "types.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace embee {
+
+class Model;
+
+/**
+ * Difference between a tensor and its quantized version
+ */
+struct TensorError {
+    std::string name;
+    std::vector<size_t> shape;
+    DataType reference_type;
+    DataType type;
+    double rmse = 0.0;        // Root mean square of the element differences
+    double cosine = 1.0;      // Cosine similarity of the two tensors as vectors
+    double max_error = 0.0;   // Largest absolute element difference
+};
+
+/**
+ * Compare every tensor of a model with its quantized version
+ *
+ * Both files are memory mapped and read a row at a time, so models larger
+ * than RAM can be compared.
+ * @param reference_path Original AMB model
+ * @param quantized_path Quantized AMB model
+ * @param block_size Weights per scale in block-quantized tensors (0 = the
+ *        block size in the quantized model's "quant" config entry, else 32)
+ * @param n_threads Worker threads (0 = OpenMP default)
+ * @return One entry per tensor, in the reference file's order
+ * @throws std::runtime_error if a file cannot be read, is malformed, or the
+ *         quantized model lacks a tensor of the reference
+ * @throws std::invalid_argument if a tensor's shape differs between the models
+ */
+std::vector<TensorError> compare_model_tensors(const std::string& reference_path, const std::string& quantized_path,
+                                               size_t block_size = 0, size_t n_threads = 0);
+
+/**
+ * Result of a perplexity evaluation
+ */
+struct PerplexityResult {
+    double perplexity = 0.0;   // exp(mean_nll)
+    double mean_nll = 0.0;     // Mean negative log-likelihood per scored token (nats)
+    size_t n_tokens = 0;       // Tokens scored
+    size_t n_chunks = 0;       // Chunks run
+};
+
+/**
+ * Perplexity of a model on a text
+ *
+ * The text is tokenized and split into chunks of context_tokens tokens;
+ * every token of a chunk but the first is scored given the tokens before
+ * it in the chunk.
+ * @param model Model to evaluate
+ * @param text Evaluation text
+ * @param context_tokens Tokens per chunk (2 to the context length)
+ * @param max_chunks Chunks to run (0 = all)
+ * @param n_threads Worker threads (0 = OpenMP default)
+ * @return The perplexity and the number of tokens it covers
+ * @throws std::invalid_argument if context_tokens does not fit the context or
+ *         the text has fewer than two tokens
+ */
+PerplexityResult evaluate_perplexity(const Model& model, const std::string& text, size_t context_tokens = 512,
+                                     size_t max_chunks = 0, size_t n_threads = 0);
+
+} // namespace embee
@@ -0,0 +1,229 @@
+/**
+ * @file graph.h
+ * @brief Static compute graph of the forward pass
+ *
+ * At engine construction the model's architecture is compiled into a flat
+ * list of instructions over a fixed set of activation buffers. Fusion passes
+ * then fold element-wise work into the instruction that produces its input,
+ * and the engine executes the list with one switch per instruction. Adding an
+ * architecture means describing its block in build_graph(), not touching the
+ * hot loop.
+ */
+
+#pragma once
+
+#include "model.h"
+#include "profiler.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace embee {
+
+/**
+ * Activation buffers an instruction can read or write; each holds one row
+ * per token of the batch
+ */
+enum class BufferId : uint8_t {
+    RESIDUAL,    // Residual stream (n_embd)
+    ATTN_IN,     // Normed input of the attention block (n_embd)
+    QKV,         // Fused query, key and value projections
+    ATTN,        // Attention output (n_embd)
+    ATTN_PROJ,   // Attention output projection (n_embd)
+    FFN_IN,      // Normed input of the feed-forward block (n_embd)
+    FF,          // Feed-forward hidden state (n_ff)
+    FF_GATE,     // Gate branch of a gated feed-forward (n_ff)
+    FFN_PROJ,    // Feed-forward down projection (n_embd)
+    ROUTER,      // Router logits of a mixture-of-experts block (n_experts)
+    FINAL_IN,    // Normed last hidden state (one row)
+    LOGITS,      // Logits of the last token (one row)
+    COUNT
+};
+
+/**
+ * Name of a buffer
+ */
+const char* buffer_name(BufferId id);
+
+/**
+ * Operations of the graph
+ */
+enum class OpCode : uint8_t {
+    EMBED,       // dst = weight[token] (+ bias[position], learned position embeddings)
+    NORM,        // dst = norm(src) * weight (+ bias)
+    MATMUL,      // dst = weight src (+ bias), followed by the epilogue flags
+    ROPE,        // Rotate the query and key parts of dst in place
+    KV_STORE,    // Copy the key and value parts of src into the layer's cache
+    ATTENTION,   // dst = attention of the query part of src over the layer's cache
+    ADD,         // dst += src
+    MUL,         // dst *= src
+    ACTIVATION,  // dst = act(dst)
+    MOE          // dst = sum over each token's top-k experts (chosen from ROUTER) of gate * expert(src)
+};
+
+/**
+ * Instruction flags
+ */
+enum InstructionFlag : uint8_t {
+    FLAG_RMS_NORM = 1 << 0,     // NORM: RMSNorm instead of LayerNorm
+    FLAG_LAST_ROW = 1 << 1,     // Only the last token's row of src
+    FLAG_ACTIVATE = 1 << 2,     // MATMUL epilogue: apply the activation function
+    FLAG_ACCUMULATE = 1 << 3,   // MATMUL, MOE: add into dst instead of overwriting it
+    FLAG_SCALE = 1 << 4         // EMBED: multiply by sqrt(n_embd); NORM: scale by (1 + weight)
+};
+
+/**
+ * Branches of a parallel block. Consecutive instructions with a non-zero
+ * branch form a region whose two branches only share read-only inputs and
+ * may run concurrently; the region as written is a valid sequential order.
+ */
+enum InstructionBranch : uint8_t {
+    BRANCH_ATTENTION = 1,
+    BRANCH_FFN = 2
+};
+
+/**
+ * One step of the program
+ */
+struct Instruction {
+    OpCode op;
+    uint8_t flags = 0;
+    BufferId dst = BufferId::COUNT;
+    BufferId src = BufferId::COUNT;
+    int32_t layer = -1;                 // Block index, -1 outside the blocks
+    uint8_t branch = 0;                 // Parallel blocks: BRANCH_ATTENTION or BRANCH_FFN, else 0
+    ProfileOp profile_op = ProfileOp::COUNT;
+    const Tensor* weight = nullptr;
+    const Tensor* bias = nullptr;
+};
+
+/**
+ * Weights of one feed-forward expert
+ */
+struct ExpertWeights {
+    const Tensor* up = nullptr;
+    const Tensor* gate = nullptr;   // Gated (SwiGLU) experts only
+    const Tensor* down = nullptr;
+};
+
+/**
+ * Weights of one transformer block; optional tensors are null when absent
+ */
+struct BlockWeights {
+    const Tensor* attn_norm = nullptr;
+    const Tensor* attn_norm_bias = nullptr;
+    const Tensor* qkv = nullptr;
+    const Tensor* qkv_bias = nullptr;
+    const Tensor* attn_out = nullptr;
+    const Tensor* attn_out_bias = nullptr;
+    const Tensor* ffn_norm = nullptr;
+    const Tensor* ffn_norm_bias = nullptr;
+    const Tensor* ffn_up = nullptr;
+    const Tensor* ffn_up_bias = nullptr;
+    const Tensor* ffn_gate = nullptr;
+    const Tensor* ffn_down = nullptr;
+    const Tensor* ffn_down_bias = nullptr;
+    const Tensor* ffn_router = nullptr;   // Mixture of experts: replaces ffn_up/ffn_gate/ffn_down
+    std::vector<ExpertWeights> experts;
+};
+
+/**
+ * All weights of the forward pass
+ */
+struct GraphWeights {
+    const Tensor* token_embedding = nullptr;
+    const Tensor* position_embedding = nullptr;   // Null for RoPE models
+    const Tensor* final_norm = nullptr;
+    const Tensor* final_norm_bias = nullptr;
+    const Tensor* lm_head = nullptr;
+    std::vector<BlockWeights> layers;
+};
+
+/**
+ * How attention and feed-forward are combined in a block
+ */
+enum class BlockTopology : uint8_t {
+    SEQUENTIAL,   // x += attn(norm1(x)); x += ffn(norm2(x))
+    PARALLEL      // x += attn(norm1(x)) + ffn(norm2(x)), norm2 = norm1 when the block has one norm
+};
+
+/**
+ * Per-architecture choices made when building the graph
+ */
+struct ArchitectureTraits {
+    const char* name;
+    bool rms_norm;                   // RMSNorm instead of LayerNorm
+    BlockTopology topology;
+    bool scale_embedding = false;    // Token embeddings are multiplied by sqrt(n_embd)
+    bool norm_weight_offset = false; // Norm weights are stored as offsets from one
+    bool gated_ffn = false;          // Feed-forward is up * act(gate); c_gate is required
+};
+
+/**
+ * Traits of an architecture
+ */
+ArchitectureTraits architecture_traits(ModelArchitecture architecture);
+
+/**
+ * A compiled forward pass
+ */
+struct Graph {
+    std::vector<Instruction> program;
+    size_t logits_begin = 0;   // Instructions from here on only compute logits
+
+    /**
+     * Whether the program has branches that may run concurrently
+     */
+    bool has_branches() const;
+
+    /**
+     * Index of the first instruction of a layer; logits_begin for layers
+     * past the last one. program[0, layer_begin(n)) runs the embedding and
+     * the first n layers.
+     */
+    size_t layer_begin(size_t layer) const;
+
+    /**
+     * Whether any instruction reads or writes a buffer
+     */
+    bool uses(BufferId id) const;
+
+    /**
+     * Program listing, one line per instruction
+     */
+    std::string describe() const;
+};
+
+/**
+ * Build the unfused graph for a model
+ * @param config Model configuration (architecture, RoPE, activation)
+ * @param weights Bound weights, one BlockWeights per layer
+ * @throws std::invalid_argument if the weights or activation do not match the
+ *         architecture's block layout (a Phi-2 style block, or a Gemma
+ *         feed-forward that is not GeGLU)
+ */
+Graph build_graph(const ModelConfig& config, const GraphWeights& weights);
+
+/**
+ * Fold a MATMUL followed by an ACTIVATION of its output (in the same
+ * branch) into the matmul epilogue
+ * @return Number of instructions removed
+ */
+size_t fuse_activations(Graph& graph);
+
+/**
+ * Fold "tmp = W x; dst += tmp" into an accumulating matmul (or MOE) into dst
+ * when tmp is not read afterwards (residual adds)
+ * @return Number of instructions removed
+ */
+size_t fuse_residual_adds(Graph& graph);
+
+/**
+ * Build and optimize the graph for a model
+ * @param fuse Run the fusion passes
+ * @throws std::invalid_argument as build_graph()
+ */
+Graph compile_graph(const ModelConfig& config, const GraphWeights& weights, bool fuse = true);
+
+} // namespace embee
@@ -0,0 +1,285 @@
+/**
+ * @file kernels.h
+ * @brief CPU compute kernels used by the inference engine
+ *
+ * Matrices are row-major with one output feature per row, i.e. a weight of
+ * shape {rows, cols} maps a cols-long input to a rows-long output. Integer
+ * weight types are block-quantized along each row (see docs/model_format.md):
+ * every block of block_size values stores an FP16 scale followed by the
+ * packed values.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "tensor.h"
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace embee {
+namespace kernels {
+
+/**
+ * Convert between IEEE half precision and single precision
+ */
+uint16_t fp32_to_fp16(float value);
+float fp16_to_fp32(uint16_t value);
+
+/**
+ * Bytes used by one row of n values stored as the given type
+ * @param type Storage type (FP32, FP16, INT8, INT5, INT4 or ADAPTIVE)
+ * @param n Number of values in the row (a multiple of block_size for integer types)
+ * @param block_size Quantization block size (ignored for float types)
+ * @param row A stored row; required for ADAPTIVE, whose size depends on the
+ *        row's precision mask
+ */
+size_t row_bytes(DataType type, size_t n, size_t block_size, const uint8_t* row = nullptr);
+
+/**
+ * Convert a row of FP32 values into the given storage type (not ADAPTIVE;
+ * see quantize_adaptive_row())
+ */
+void quantize_row(DataType type, const float* src, uint8_t* dst, size_t n, size_t block_size);
+
+/**
+ * Encode one INT8, INT5 or INT4 block with a chosen scale
+ *
+ * Values are divided by the scale, rounded to the nearest level and clamped
+ * to the type's range (INT8 -128..127, INT5 -16..15, INT4 -8..7). The scale
+ * is stored as FP16, so pass an FP16-representable one to get exactly
+ * level * scale back. Used by quantizers that choose scales themselves.
+ * @param dst row_bytes(type, block_size, block_size) bytes
+ * @throws std::invalid_argument for other types
+ */
+void quantize_block_with_scale(DataType type, const float* src, float scale, uint8_t* dst, size_t block_size);
+
+/**
+ * ADAPTIVE rows mix block precisions. A row starts with a precision mask of
+ * 2 bits per block (block b in bits 2 * (b % 4) of byte b / 4: 0 = INT4,
+ * 1 = INT5, 2 = INT8, 3 = FP16), padded to an even number of bytes, followed
+ * by the blocks in order, each in the layout of its type. FP16 blocks hold
+ * block_size halves and no scale. All rows of a tensor use the same mask, so
+ * they have one size.
+ */
+size_t adaptive_mask_bytes(size_t n_blocks);
+
+/**
+ * Precision of one block of a stored ADAPTIVE row
+ */
+DataType adaptive_block_type(const uint8_t* row, size_t block);
+
+/**
+ * Convert a row of FP32 values into an ADAPTIVE row
+ * @param block_types Precision of each of the n / block_size blocks (INT4,
+ *        INT5, INT8 or FP16)
+ * @param dst At least adaptive_mask_bytes() plus the blocks' bytes
+ * @return Bytes written
+ * @throws std::invalid_argument for other block types
+ */
+size_t quantize_adaptive_row(const float* src, const DataType* block_types, uint8_t* dst,
+                             size_t n, size_t block_size);
+
+/**
+ * Convert a row stored in the given type back to FP32
+ */
+void dequantize_row(DataType type, const uint8_t* src, float* dst, size_t n, size_t block_size);
+
+/**
+ * Dot product of two FP32 vectors
+ */
+float dot(const float* a, const float* b, size_t n);
+
+/**
+ * Element-wise work fused into the end of gemv/gemm and applied to each
+ * output while it is still in a register: y = act(W x + bias), or
+ * y += W x + bias when accumulating
+ */
+struct MatmulEpilogue {
+    const float* bias = nullptr;   // One value per output row, or null
+    bool activate = false;         // Apply activation after the bias
+    ActivationFunction activation = ActivationFunction::GELU;
+    bool accumulate = false;       // Add into y instead of overwriting it
+};
+
+/**
+ * Matrix-vector product: y = W x
+ * @param type Storage type of W
+ * @param w Weight rows (rows x cols)
+ * @param x Input vector (cols)
+ * @param y Output vector (rows)
+ * @param n_threads Worker threads (0 = OpenMP default)
+ * @param epilogue Bias, activation and accumulation applied to each output
+ */
+void gemv(DataType type, const uint8_t* w, const float* x, float* y,
+          size_t rows, size_t cols, size_t block_size, size_t n_threads = 0,
+          const MatmulEpilogue& epilogue = MatmulEpilogue());
+
+/**
+ * Matrix-matrix product for a batch of inputs: Y = X W^T
+ *
+ * W is processed in tiles of rows that are dequantized once into a
+ * thread-local FP32 buffer and reused for every input row.
+ * @param x Inputs (m x cols)
+ * @param y Outputs (m x rows)
+ */
+void gemm(DataType type, const uint8_t* w, const float* x, float* y,
+          size_t m, size_t rows, size_t cols, size_t block_size, size_t n_threads = 0,
+          const MatmulEpilogue& epilogue = MatmulEpilogue());
+
+/**
+ * gemv and gemm over a weight view, e.g. a row range of a fused weight
+ */
+void gemv(const WeightView& w, const float* x, float* y, size_t n_threads = 0,
+          const MatmulEpilogue& epilogue = MatmulEpilogue());
+void gemm(const WeightView& w, const float* x, float* y, size_t m, size_t n_threads = 0,
+          const MatmulEpilogue& epilogue = MatmulEpilogue());
+
+/**
+ * RMS normalization: y = x / rms(x) * (weight_offset + weight)
+ * @param weight_offset Added to every weight; 1 for weights stored as
+ *        offsets from one (Gemma)
+ */
+void rms_norm(const float* x, const float* weight, float* y, size_t n, float eps = 1e-5f,
+              float weight_offset = 0.0f);
+
+/**
+ * Layer normalization: y = (x - mean) / stddev * weight + bias (bias may be null)
+ */
+void layer_norm(const float* x, const float* weight, const float* bias, float* y,
+                size_t n, float eps = 1e-5f);
+
+/**
+ * Rotary position embedding applied in place to consecutive heads
+ * @param x Vector of n_heads * head_dim values
+ * @param pos Position of the token in the sequence
+ * @param freq_base RoPE base frequency (usually 10000)
+ * @param scaling Linear position scaling for extended context
+ */
+void rope(float* x, size_t n_heads, size_t head_dim, size_t pos, float freq_base, float scaling);
+
+/**
+ * Numerically stable softmax in place
+ */
+void softmax(float* x, size_t n);
+
+/**
+ * Single-query multi-head attention over a KV cache (supports GQA/MQA)
+ * @param q Query (n_heads * head_dim)
+ * @param k_cache Keys, n_ctx rows of n_kv_heads * head_dim values
+ * @param v_cache Values, same layout as k_cache
+ * @param out Output (n_heads * head_dim)
+ * @param n_ctx Number of cached positions to attend to
+ * @param scratch At least n_heads * n_ctx floats for attention scores
+ * @param alibi_slopes ALiBi slope per head, or null. The score of position t
+ *        is biased by -slope * (n_ctx - 1 - t) as it is computed, so no bias
+ *        matrix is built
+ */
+void attention(const float* q, const float* k_cache, const float* v_cache, float* out,
+               size_t n_heads, size_t n_kv_heads, size_t head_dim, size_t n_ctx,
+               float* scratch, size_t n_threads = 0, const float* alibi_slopes = nullptr);
+
+/**
+ * ALiBi head slopes: a geometric sequence from 2^(-max_bias / n) for the
+ * largest power of two n <= n_heads, with the remaining heads interleaved
+ * at half the step (MPT, BLOOM)
+ * @param n_heads Number of attention heads
+ * @param max_bias Bias exponent (8 in the ALiBi paper)
+ * @return One slope per head
+ */
+std::vector<float> alibi_slopes(size_t n_heads, float max_bias = 8.0f);
+
+/**
+ * Activation functions applied in place
+ */
+void gelu(float* x, size_t n);
+void silu(float* x, size_t n);
+void relu(float* x, size_t n);
+
+/**
+ * Apply an activation function in place (SwiGLU uses SiLU on the gate)
+ */
+void activate(ActivationFunction function, float* x, size_t n);
+
+/**
+ * Kernel signatures, for kernels chosen once per model
+ */
+using AttentionFn = void (*)(const float* q, const float* k_cache, const float* v_cache, float* out,
+                             size_t n_heads, size_t n_kv_heads, size_t head_dim, size_t n_ctx,
+                             float* scratch, size_t n_threads, const float* alibi_slopes);
+using RopeFn = void (*)(float* x, size_t n_heads, size_t head_dim, size_t pos, float freq_base, float scaling);
+using DequantizeRowFn = void (*)(DataType type, const uint8_t* src, float* dst, size_t n, size_t block_size);
+using GemvFn = void (*)(DataType type, const uint8_t* w, const float* x, float* y, size_t rows, size_t cols,
+                        size_t block_size, size_t n_threads, const MatmulEpilogue& epilogue);
+using GemmFn = void (*)(DataType type, const uint8_t* w, const float* x, float* y, size_t m, size_t rows,
+                        size_t cols, size_t block_size, size_t n_threads, const MatmulEpilogue& epilogue);
+
+/**
+ * Kernels specialized for a model's head size and quantization block size
+ *
+ * Common sizes (head_dim 64, 80, 96 and 128; block size 32, 64 and 128) have
+ * versions compiled with the size as a constant, so inner loops have fixed
+ * trip counts and unroll fully. Other sizes get the generic kernels. The
+ * free functions above pick the same versions per call.
+ */
+struct KernelSet {
+    size_t head_dim = 0;
+    size_t block_size = 0;
+    bool specialized_head_dim = false;     // attention and rope are specialized
+    bool specialized_block_size = false;   // dequantize_row, gemv and gemm are specialized
+    AttentionFn attention = nullptr;
+    RopeFn rope = nullptr;
+    DequantizeRowFn dequantize_row = nullptr;
+    GemvFn gemv = nullptr;
+    GemmFn gemm = nullptr;
+};
+
+/**
+ * Choose kernels for a head size and block size
+ * @param generic Use the generic kernels regardless (for comparison)
+ */
+KernelSet select_kernels(size_t head_dim, size_t block_size, bool generic = false);
+
+/**
+ * Reusable buffers for sampling
+ */
+struct SamplingScratch {
+    std::vector<float> probs;
+    std::vector<int32_t> indices;
+    std::vector<std::pair<float, TokenId>> candidates;   // Per-thread heaps, then the result of lm_head_top_k()
+};
+
+/**
+ * Largest k logits of an LM head without materializing the logits
+ *
+ * Computes W x one tile of the vocabulary at a time. Each thread keeps a
+ * running top-k of its tiles, and the per-thread lists are merged at the
+ * end, so only k values per thread are stored. Works on any stored weight,
+ * including a token embedding reused as a tied head. Ties go to the lower
+ * token ID, as in argmax().
+ * @param w Weight rows (n_vocab rows of n_embd values)
+ * @param x Hidden state (n_embd)
+ * @param k Candidates wanted (1 for greedy decoding)
+ * @param skip Optional per-token flags; tokens with a non-zero flag are left out
+ * @param scratch Receives the candidates in scratch.candidates, best first
+ * @return Number of candidates (k, or fewer if the vocabulary is smaller)
+ */
+size_t lm_head_top_k(DataType type, const uint8_t* w, const float* x, size_t n_vocab, size_t n_embd,
+                     size_t block_size, size_t k, const uint8_t* skip, SamplingScratch& scratch,
+                     size_t n_threads = 0);
+
+/**
+ * Index of the largest logit
+ */
+TokenId argmax(const float* logits, size_t n);
+
+/**
+ * Sample a token using top-p (nucleus) sampling; top_p near 0 is greedy
+ */
+TokenId sample_top_p(const float* logits, size_t n, float top_p, std::mt19937& gen,
+                     SamplingScratch& scratch);
+
+} // namespace kernels
+} // namespace embee
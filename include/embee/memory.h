@@ -0,0 +1,236 @@
+/**
+ * @file memory.h
+ * @brief Aligned allocation, arenas and scratch pools
+ *
+ * All allocations here are at least 64-byte aligned (a cache line and the
+ * widest SIMD register) and are not zero-filled: containers using
+ * AlignedAllocator default-initialize their elements, so resizing a weight
+ * buffer that is about to be overwritten costs no memory traffic. Large
+ * allocations on Linux are page aligned and advised for transparent huge
+ * pages.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace embee {
+
+/**
+ * Default alignment of embee allocations
+ */
+constexpr size_t MEMORY_ALIGNMENT = 64;
+
+/**
+ * Allocate uninitialized memory
+ * @param bytes Size in bytes
+ * @param alignment Power-of-two alignment (at least MEMORY_ALIGNMENT is used)
+ * @return Pointer to the memory
+ * @throws std::bad_alloc on failure
+ */
+void* aligned_allocate(size_t bytes, size_t alignment = MEMORY_ALIGNMENT);
+
+/**
+ * Free memory from aligned_allocate
+ * @param ptr Pointer returned by aligned_allocate (may be null)
+ */
+void aligned_free(void* ptr);
+
+/**
+ * @class AlignedAllocator
+ * @brief Standard allocator returning aligned, uninitialized storage
+ *
+ * Value-less construction default-initializes, so std::vector::resize
+ * leaves trivially constructible elements uninitialized instead of zeroing
+ * them. Use assign(n, 0) where zeroes are needed.
+ */
+template <typename T, size_t Alignment = MEMORY_ALIGNMENT>
+class AlignedAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() noexcept = default;
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(aligned_allocate(n * sizeof(T), Alignment));
+    }
+
+    void deallocate(T* p, size_t) noexcept {
+        aligned_free(p);
+    }
+
+    template <typename U>
+    void construct(U* p) noexcept(noexcept(::new (static_cast<void*>(p)) U)) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+/**
+ * Vector with aligned, uninitialized-on-resize storage
+ */
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+/**
+ * Byte storage of tensors
+ */
+using AlignedBuffer = AlignedVector<uint8_t>;
+
+/**
+ * @class Arena
+ * @brief Bump allocator for memory with a common lifetime
+ *
+ * Memory is carved from large aligned blocks and released all at once by
+ * reset() or destruction. Requests larger than the block size get a block of
+ * their own.
+ */
+class Arena {
+public:
+    /**
+     * @param block_size Size of each block in bytes
+     */
+    explicit Arena(size_t block_size = 1 << 20);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * Allocate uninitialized memory that lives until reset()
+     * @param bytes Size in bytes
+     * @param alignment Power-of-two alignment, at most the page size
+     */
+    void* allocate(size_t bytes, size_t alignment = MEMORY_ALIGNMENT);
+
+    /**
+     * Typed convenience wrapper around allocate()
+     */
+    template <typename T>
+    T* allocate_array(size_t n) {
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T) > MEMORY_ALIGNMENT ? alignof(T) : MEMORY_ALIGNMENT));
+    }
+
+    /**
+     * Release everything allocated from the arena
+     */
+    void reset();
+
+    /**
+     * Bytes handed out since the last reset
+     */
+    size_t bytes_used() const { return used_; }
+
+    /**
+     * Bytes held in blocks
+     */
+    size_t bytes_reserved() const { return reserved_; }
+
+private:
+    struct Block {
+        uint8_t* data;
+        size_t size;
+    };
+    size_t block_size_;
+    std::vector<Block> blocks_;
+    size_t offset_ = 0;     // Next free byte in blocks_.back()
+    size_t used_ = 0;
+    size_t reserved_ = 0;
+};
+
+/**
+ * @class ScratchPool
+ * @brief Thread-safe pool of reusable buffers in power-of-two size classes
+ *
+ * Buffers are page aligned. Released buffers are kept for reuse while the
+ * pool holds less than max_cached_bytes, so short-lived per-request scratch
+ * (such as a session's KV cache) does not go back to the OS and fault in
+ * fresh pages each time.
+ */
+class ScratchPool {
+public:
+    /**
+     * RAII handle of a pooled buffer; returns it to the pool on destruction
+     */
+    class Block {
+    public:
+        Block() = default;
+        ~Block() { release(); }
+        Block(Block&& other) noexcept { *this = std::move(other); }
+        Block& operator=(Block&& other) noexcept;
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+
+        void* data() const { return data_; }
+        size_t size() const { return size_; }
+        explicit operator bool() const { return data_ != nullptr; }
+
+        /**
+         * Return the buffer to its pool now
+         */
+        void release();
+
+    private:
+        friend class ScratchPool;
+        ScratchPool* pool_ = nullptr;
+        void* data_ = nullptr;
+        size_t size_ = 0;
+    };
+
+    /**
+     * @param max_cached_bytes Upper bound on bytes kept for reuse
+     */
+    explicit ScratchPool(size_t max_cached_bytes = size_t(256) << 20);
+    ~ScratchPool();
+
+    ScratchPool(const ScratchPool&) = delete;
+    ScratchPool& operator=(const ScratchPool&) = delete;
+
+    /**
+     * Get an uninitialized buffer of at least bytes (rounded up to a size class)
+     * @param bytes Minimum size in bytes
+     */
+    Block acquire(size_t bytes);
+
+    /**
+     * Bytes held for reuse
+     */
+    size_t cached_bytes() const;
+
+    /**
+     * Free all cached buffers
+     */
+    void trim();
+
+private:
+    static constexpr size_t MIN_CLASS_SHIFT = 12;   // 4 KiB
+    size_t max_cached_bytes_;
+    mutable std::mutex mutex_;
+    std::vector<std::vector<void*>> free_lists_;    // Indexed by size class
+    size_t cached_bytes_ = 0;
+
+    void give_back(void* data, size_t size);
+};
+
+} // namespace embee
@@ -0,0 +1,73 @@
+/**
+ * @file memory_planner.h
+ * @brief Static placement of activation buffers in a single arena
+ *
+ * Each intermediate tensor of the forward pass is described by its size and
+ * the range of steps during which it is live. Tensors whose lifetimes do not
+ * overlap may share memory, so placing them is interval-graph coloring with
+ * sizes: the planner assigns byte offsets so that no two simultaneously live
+ * tensors overlap, keeping the arena close to the peak live size.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace embee {
+
+/**
+ * Result of planning: one offset per buffer in a shared arena
+ */
+struct MemoryPlan {
+    std::vector<size_t> offsets;   // Byte offset of each buffer, in add() order
+    size_t arena_size = 0;         // Bytes needed for the arena
+    size_t naive_size = 0;         // Bytes needed without reuse (for reporting)
+    size_t peak_live_size = 0;     // Largest total of simultaneously live buffers (lower bound)
+};
+
+/**
+ * @class ActivationPlanner
+ * @brief Collects buffer lifetimes and assigns arena offsets
+ */
+class ActivationPlanner {
+public:
+    /**
+     * Describe a buffer
+     * @param name Name for diagnostics
+     * @param bytes Size in bytes
+     * @param first_step First step at which the buffer is written
+     * @param last_step Last step at which the buffer is read (inclusive)
+     * @return Buffer index into MemoryPlan::offsets
+     * @throws std::invalid_argument if last_step < first_step
+     */
+    size_t add(const std::string& name, size_t bytes, size_t first_step, size_t last_step);
+
+    /**
+     * Assign offsets
+     *
+     * Buffers are placed largest first, each at the lowest aligned offset
+     * that does not overlap an already placed buffer with an intersecting
+     * lifetime (greedy-by-size best fit).
+     * @param alignment Alignment of every offset in bytes (power of two)
+     * @return The plan
+     */
+    MemoryPlan plan(size_t alignment = 64) const;
+
+    /**
+     * Describe a plan as text, one line per buffer
+     */
+    std::string describe(const MemoryPlan& plan) const;
+
+private:
+    struct Buffer {
+        std::string name;
+        size_t bytes;
+        size_t first_step;
+        size_t last_step;
+    };
+    std::vector<Buffer> buffers_;
+};
+
+} // namespace embee
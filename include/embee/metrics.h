@@ -0,0 +1,170 @@
+/**
+ * @file metrics.h
+ * @brief Lock-free serving metrics with Prometheus text exposition
+ *
+ * A MetricsRegistry owns named counters, gauges and histograms. Updating a
+ * metric is a handful of relaxed atomic operations, so it is safe from any
+ * thread and cheap enough for per-token use; only registration takes a lock.
+ * Engines record into the registry passed in EngineConfig::metrics, and
+ * several engines may share one registry.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace embee {
+
+/**
+ * @class Counter
+ * @brief Monotonically increasing count
+ */
+class Counter {
+public:
+    void inc(uint64_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+/**
+ * @class Gauge
+ * @brief Value that can go up and down
+ */
+class Gauge {
+public:
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    void add(double delta);
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_{0.0};
+};
+
+/**
+ * @class Histogram
+ * @brief Distribution of observations over fixed bucket upper bounds
+ */
+class Histogram {
+public:
+    /**
+     * @param bounds Ascending bucket upper bounds (+Inf is implicit)
+     */
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double value);
+
+    const std::vector<double>& bounds() const { return bounds_; }
+
+    /**
+     * Observations in each bucket (not cumulative); the last entry is +Inf
+     */
+    std::vector<uint64_t> bucket_counts() const;
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    /**
+     * Default latency buckets in seconds, 1 ms to 10 s
+     */
+    static std::vector<double> latency_buckets();
+
+private:
+    std::vector<double> bounds_;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+    std::atomic<uint64_t> count_{0};
+    std::atomic<double> sum_{0.0};
+};
+
+/**
+ * @class MetricsRegistry
+ * @brief Named metrics of one process
+ *
+ * Registering a name that already exists with the same kind returns the
+ * existing metric, so independent components can share series. Returned
+ * references stay valid for the registry's lifetime.
+ */
+class MetricsRegistry {
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    MetricsRegistry(const MetricsRegistry&) = delete;
+    MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    /**
+     * Get or create a metric
+     * @param name Metric name (Prometheus naming rules)
+     * @param help One-line description
+     * @throws std::invalid_argument if the name is registered as another kind
+     */
+    Counter& counter(const std::string& name, const std::string& help);
+    Gauge& gauge(const std::string& name, const std::string& help);
+    Histogram& histogram(const std::string& name, const std::string& help,
+                         std::vector<double> bounds = Histogram::latency_buckets());
+
+    /**
+     * Render all metrics in the Prometheus text exposition format (0.0.4)
+     */
+    std::string prometheus_text() const;
+
+private:
+    enum class Kind { COUNTER, GAUGE, HISTOGRAM };
+    struct Entry;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<Entry>> entries_;
+
+    Entry& find_or_add(const std::string& name, const std::string& help, Kind kind,
+                       std::vector<double>* bounds);
+};
+
+/**
+ * @class MetricsServer
+ * @brief Minimal HTTP listener serving GET /metrics from a registry
+ *
+ * Runs one background thread that answers requests sequentially. Binds to
+ * localhost by default; it is meant for a scraper on the same host or a
+ * sidecar, not for exposure to untrusted networks.
+ */
+class MetricsServer {
+public:
+    /**
+     * Start listening
+     * @param registry Registry to expose; must outlive the server
+     * @param port TCP port (0 picks a free port, see port())
+     * @param address IPv4 address to bind
+     * @throws std::runtime_error if the socket cannot be bound
+     */
+    MetricsServer(const MetricsRegistry& registry, uint16_t port,
+                  const std::string& address = "127.0.0.1");
+
+    /**
+     * Stop the listener and join its thread
+     */
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    /**
+     * Port actually bound
+     */
+    uint16_t port() const { return port_; }
+
+private:
+    const MetricsRegistry& registry_;
+    int socket_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+
+    void serve();
+};
+
+} // namespace embee
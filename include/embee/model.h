@@ -13,6 +13,12 @@
 
 namespace embee {
 
+class Tokenizer;
+
+namespace amb {
+class MappedFile;
+}
+
 /**
  * @struct ModelConfig
  * @brief Configuration parameters for a transformer model
@@ -26,15 +32,20 @@ struct ModelConfig {
     size_t n_kv_heads;        // Number of KV heads (for GQA/MQA)
     size_t max_seq_len;       // Maximum sequence length
     bool is_rope;             // Uses rotary position embeddings
+    bool use_alibi = false;   // Adds ALiBi linear biases to attention scores (MPT, some Falcon)
+    float alibi_max_bias = 8.0f;  // ALiBi slope exponent
     
     // Architecture-specific parameters
     ModelArchitecture architecture;
     ActivationFunction activation_function;
     float rope_freq_base;     // Base frequency for RoPE (usually 10000.0)
     float rope_scaling;       // Scaling factor for RoPE (for extended context)
+    size_t n_experts = 0;       // Feed-forward experts per layer (0 = dense feed-forward)
+    size_t n_experts_used = 0;  // Experts each token is routed to (top-k)
     
     // Quantization parameters
     QuantizationType quant_type;
+    size_t quant_block_size = 32;  // Weights per scale in block-quantized tensors
     
     // Optional model metadata
     std::string model_name;
@@ -50,7 +61,13 @@ class Model {
 public:
     /**
      * Load a model from a file
+     *
+     * AMB weights are used in place from the mapped file when their data is
+     * aligned for its element type, and copied once otherwise. A file that
+     * is not an AMB model, or an AMB file without weights, gets a small
+     * random placeholder model (with the file's tokenizer, if any).
      * @param path Path to the model file
+     * @throws std::runtime_error if an AMB model's config or weights are malformed
      */
     explicit Model(const std::string& path);
     
@@ -81,13 +98,25 @@ public:
      */
     std::shared_ptr<Tokenizer> tokenizer() const { return tokenizer_; }
     
+    /**
+     * Get the memory held by the weights and tokenizer
+     * @return Weight and tokenizer fields of MemoryStats (engine fields are zero)
+     */
+    MemoryStats memory_usage() const;
+    
 private:
     ModelConfig config_;
     std::unordered_map<std::string, Tensor> weights_;
     std::shared_ptr<Tokenizer> tokenizer_;
+    std::shared_ptr<amb::MappedFile> mapping_;   // Backing file for in-place sections
+    size_t mapped_weights_offset_ = 0;          // Weights section within mapping_
+    size_t mapped_weights_size_ = 0;
     
     // Model loading helpers
     void load_amb_model(const std::string& path);
+    void load_amb_config(const std::string& metadata_json, const std::string& config_json);
+    void load_amb_weights(const uint8_t* section, size_t size, size_t section_offset, bool aligned_data);
+    void load_placeholder_model();
     void load_gguf_model(const std::string& path);
     void load_onnx_model(const std::string& path);
     
@@ -0,0 +1,63 @@
+/**
+ * @file moe.h
+ * @brief Top-k routing of tokens to mixture-of-experts feed-forward layers
+ *
+ * A mixture-of-experts block replaces the feed-forward network with
+ * n_experts smaller ones and a router that sends each token to k of them.
+ * Routing a whole batch at once and grouping the assignments by expert lets
+ * every selected expert run as one matmul over its tokens, so its weights
+ * are read once per batch step, and experts that no token selected are not
+ * read at all.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace embee {
+
+/**
+ * Assignments of a batch of tokens to experts, grouped by expert
+ *
+ * Expert e handles assignments [offsets[e], offsets[e + 1]); within an
+ * expert, tokens are in batch order.
+ */
+struct ExpertRouting {
+    std::vector<uint32_t> offsets;   // n_experts + 1 entries
+    std::vector<uint32_t> tokens;    // Batch row of each assignment
+    std::vector<float> weights;      // Gate weight of each assignment
+
+    // Scratch: each token's experts and gates (n_tokens x k), fill cursors
+    std::vector<uint32_t> selected;
+    std::vector<float> gates;
+    std::vector<uint32_t> cursor;
+
+    /**
+     * Number of tokens routed to an expert
+     */
+    size_t count(size_t expert) const { return offsets[expert + 1] - offsets[expert]; }
+
+    /**
+     * Number of experts with at least one token
+     */
+    size_t active_experts() const;
+};
+
+/**
+ * Route each token to its k highest-scoring experts
+ *
+ * Gate weights are the softmax of the selected router logits, so each
+ * token's weights sum to one (Mixtral). The routing's vectors are reused
+ * between calls and only grow.
+ * @param logits Router logits, n_tokens x n_experts
+ * @param n_tokens Rows of logits
+ * @param n_experts Experts per layer
+ * @param k Experts per token (1 <= k <= n_experts)
+ * @param routing Output
+ * @throws std::invalid_argument if k is out of range
+ */
+void route_top_k(const float* logits, size_t n_tokens, size_t n_experts, size_t k, ExpertRouting& routing);
+
+} // namespace embee
@@ -0,0 +1,349 @@
+/**
+ * @file profiler.h
+ * @brief Low-overhead per-op timing of the inference engine
+ *
+ * The engine records one event per op per layer using the CPU timestamp
+ * counter. Events are grouped per request (one generate/get_logits call) and
+ * can be summarized as a text table or exported as Chrome trace JSON, which
+ * chrome://tracing and ui.perfetto.dev both open.
+ *
+ * Profiling is opt-in at runtime (EngineConfig::enable_profiling); building
+ * with EMBEE_PROFILER_ENABLED=0 removes the instrumentation entirely.
+ *
+ * On Linux the profiler can also read hardware counters through
+ * perf_event_open (EngineConfig::enable_hardware_counters) and attribute
+ * them to each op. Counters the kernel or container does not permit are
+ * skipped; the rest still work.
+ */
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#ifndef EMBEE_PROFILER_ENABLED
+#define EMBEE_PROFILER_ENABLED 1
+#endif
+
+namespace embee {
+
+/**
+ * Operations timed by the profiler
+ */
+enum class ProfileOp : uint8_t {
+    EMBEDDING,
+    ATTN_NORM,
+    QKV_PROJ,
+    ROPE,
+    KV_STORE,
+    ATTENTION,
+    ATTN_OUT_PROJ,
+    FFN_NORM,
+    FFN_UP,
+    ACTIVATION,
+    FFN_DOWN,
+    ROUTER,
+    EXPERTS,
+    RESIDUAL,
+    FINAL_NORM,
+    LM_HEAD,
+    SAMPLING,
+    DETOKENIZE,
+    COUNT
+};
+
+/**
+ * Human-readable name of an op
+ */
+const char* profile_op_name(ProfileOp op);
+
+/**
+ * Read a cheap monotonic timestamp (TSC on x86, virtual counter on ARM64)
+ */
+inline uint64_t read_timestamp() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+/**
+ * Hardware counters the profiler can attribute to ops
+ */
+enum class HardwareCounter : uint8_t {
+    CYCLES,
+    INSTRUCTIONS,
+    LLC_MISSES,      // Last-level cache read misses
+    DTLB_MISSES,     // Data TLB read misses
+    MEMORY_BYTES,    // DRAM traffic from uncore memory controllers (system-wide)
+    COUNT
+};
+
+using CounterValues = std::array<uint64_t, static_cast<size_t>(HardwareCounter::COUNT)>;
+
+/**
+ * Human-readable name of a hardware counter
+ */
+const char* hardware_counter_name(HardwareCounter counter);
+
+/**
+ * @class PerfCounters
+ * @brief Hardware counters of a set of threads via Linux perf_event_open
+ *
+ * Per-thread counters (cycles, instructions, LLC and dTLB misses) are opened
+ * for the calling thread and every OpenMP worker of a team of the given
+ * size, and read() sums them, so ops that run in parallel are fully
+ * counted. MEMORY_BYTES needs uncore PMU access (CAP_PERFMON or
+ * perf_event_paranoid <= 0) and counts the whole socket, including other
+ * processes. On other platforms nothing is available.
+ */
+class PerfCounters {
+public:
+    /**
+     * Open counters
+     * @param n_threads OpenMP team size used by the kernels (0 = OpenMP default)
+     */
+    explicit PerfCounters(size_t n_threads);
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /**
+     * Whether a counter could be opened
+     */
+    bool available(HardwareCounter counter) const;
+
+    /**
+     * Whether any counter could be opened
+     */
+    bool any_available() const;
+
+    /**
+     * Read the current totals (unavailable counters read as 0)
+     */
+    void read(CounterValues& values) const;
+
+    /**
+     * Which counters are available, and why the others are not
+     */
+    const std::string& status() const { return status_; }
+
+private:
+    struct Group;
+    std::vector<std::unique_ptr<Group>> groups_;   // One per thread
+    std::vector<int> uncore_fds_;
+    std::vector<double> uncore_scales_;            // Bytes per uncore count
+    std::array<bool, static_cast<size_t>(HardwareCounter::COUNT)> available_{};
+    std::string status_;
+};
+
+/**
+ * One timed op; layer is -1 for ops outside the transformer layers
+ */
+struct ProfileEvent {
+    ProfileOp op;
+    int32_t layer;
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * Aggregate timing of one op
+ */
+struct OpStats {
+    uint64_t calls = 0;
+    double total_ns = 0.0;
+    double max_ns = 0.0;
+    CounterValues counters{};    // Summed hardware counters (when recorded)
+};
+
+/**
+ * All events recorded during one request
+ */
+struct RequestProfile {
+    uint64_t id = 0;
+    double start_ns = 0.0;       // Relative to the profiler's creation
+    double duration_ns = 0.0;
+    double ns_per_tick = 1.0;    // Timestamp calibration for this request
+    uint64_t start_tick = 0;
+    std::vector<ProfileEvent> events;
+    std::vector<CounterValues> counters;   // Per-event counter deltas; empty unless enabled
+    std::array<bool, static_cast<size_t>(HardwareCounter::COUNT)> counters_available{};
+
+    /**
+     * Per-op totals over all layers
+     */
+    std::array<OpStats, static_cast<size_t>(ProfileOp::COUNT)> by_op() const;
+
+    /**
+     * Total nanoseconds spent in each layer (index = layer)
+     */
+    std::vector<double> by_layer() const;
+};
+
+/**
+ * @class Profiler
+ * @brief Collects op timings for the most recent requests
+ */
+class Profiler {
+public:
+    /**
+     * @param max_requests Number of most recent requests to keep
+     */
+    explicit Profiler(size_t max_requests = 16);
+    ~Profiler();
+
+    /**
+     * Attribute hardware counters to ops from now on
+     * @param n_threads OpenMP team size used by the kernels (0 = OpenMP default)
+     * @return Whether any counter could be opened (see hardware_counter_status())
+     */
+    bool enable_hardware_counters(size_t n_threads);
+
+    /**
+     * Open counters, or nullptr when hardware counters are not enabled
+     */
+    const PerfCounters* hardware_counters() const { return counters_.get(); }
+
+    /**
+     * Description of which hardware counters are available and why
+     */
+    std::string hardware_counter_status() const;
+
+    /**
+     * Start collecting events for a new request
+     */
+    void begin_request();
+
+    /**
+     * Finish the current request and calibrate its timestamps
+     */
+    void end_request();
+
+    /**
+     * Record one op (called through ProfileScope)
+     */
+    void record(ProfileOp op, int32_t layer, uint64_t start, uint64_t end) {
+        if (active_) {
+            current_.events.push_back(ProfileEvent{op, layer, start, end});
+        }
+    }
+
+    /**
+     * Record one op with hardware counter readings taken around it
+     */
+    void record(ProfileOp op, int32_t layer, uint64_t start, uint64_t end,
+                const CounterValues& counters_start, const CounterValues& counters_end);
+
+    /**
+     * Completed requests, oldest first
+     */
+    const std::deque<RequestProfile>& requests() const { return requests_; }
+
+    /**
+     * Format per-op and per-layer totals of a request as a text table
+     * @param request Request to format
+     */
+    static std::string table(const RequestProfile& request);
+
+    /**
+     * Table for the most recent request (empty if none)
+     */
+    std::string table() const;
+
+    /**
+     * Write all kept requests in Chrome trace event format
+     */
+    void write_chrome_trace(std::ostream& out) const;
+
+    /**
+     * Drop all recorded requests
+     */
+    void clear() { requests_.clear(); }
+
+private:
+    size_t max_requests_;
+    uint64_t next_id_ = 1;
+    bool active_ = false;
+    RequestProfile current_;
+    std::unique_ptr<PerfCounters> counters_;
+    std::string counter_status_ = "hardware counters not enabled";
+    std::chrono::steady_clock::time_point epoch_;
+    std::chrono::steady_clock::time_point request_start_;
+    std::deque<RequestProfile> requests_;
+};
+
+/**
+ * @class ProfileScope
+ * @brief Times the enclosing scope; does nothing when the profiler is null
+ */
+class ProfileScope {
+public:
+    ProfileScope(Profiler* profiler, ProfileOp op, int32_t layer)
+        : profiler_(profiler), op_(op), layer_(layer) {
+        if (profiler_) {
+            counters_ = profiler_->hardware_counters();
+            if (counters_) {
+                counters_->read(counters_start_);
+            }
+            start_ = read_timestamp();
+        }
+    }
+
+    ~ProfileScope() {
+        if (profiler_) {
+            const uint64_t end = read_timestamp();
+            if (counters_) {
+                CounterValues counters_end;
+                counters_->read(counters_end);
+                profiler_->record(op_, layer_, start_, end, counters_start_, counters_end);
+            } else {
+                profiler_->record(op_, layer_, start_, end);
+            }
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    Profiler* profiler_;
+    ProfileOp op_;
+    int32_t layer_;
+    uint64_t start_ = 0;
+    const PerfCounters* counters_ = nullptr;
+    CounterValues counters_start_;
+};
+
+#define EMBEE_PROFILE_CONCAT_INNER(a, b) a##b
+#define EMBEE_PROFILE_CONCAT(a, b) EMBEE_PROFILE_CONCAT_INNER(a, b)
+
+#if EMBEE_PROFILER_ENABLED
+#define EMBEE_PROFILE(profiler, op, layer) \
+    ::embee::ProfileScope EMBEE_PROFILE_CONCAT(embee_profile_scope_, __LINE__)(profiler, op, layer)
+#else
+#define EMBEE_PROFILE(profiler, op, layer) ((void)(profiler), (void)(layer))
+#endif
+
+} // namespace embee
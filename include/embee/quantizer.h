@@ -0,0 +1,172 @@
+/**
+ * @file quantizer.h
+ * @brief Offline conversion of AMB models to quantized storage types
+ *
+ * The quantizer streams a model tensor by tensor. The input file is memory
+ * mapped and each tensor's pages are dropped once it has been converted;
+ * converted tensors are written in file order as soon as their window is
+ * done. Memory use is therefore bounded by the tensors in flight, not by
+ * the model size, and models larger than RAM can be quantized. GPTQ is the
+ * exception: its calibration statistics hold a Gram matrix per layer input
+ * for the whole run (see calibration.h), and each tensor in flight inverts
+ * its matrix in 16 cols^2 bytes of doubles.
+ *
+ * ADAPTIVE tensors choose a precision per column block (INT4, INT5, INT8 or
+ * FP16; see kernels::quantize_adaptive_row()). A first pass over them
+ * measures the error of every block at every precision, weighted by the
+ * importance of its input columns when calibration statistics are given
+ * (see calibration.h). The blocks that lose the most are then upgraded until
+ * the bits-per-weight budget is spent, and a second pass writes them.
+ *
+ * INT8, INT5 and INT4 tensors can also be quantized against calibration
+ * statistics while keeping the standard block layout, so the kernels read
+ * them unchanged: ACTIVATION_AWARE picks each block's scale to minimize the
+ * activation-weighted error, and GPTQ compensates every rounding error in
+ * the columns not yet quantized using the inputs' Gram matrix.
+ */
+
+#pragma once
+
+#include "types.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace embee {
+
+class ActivationStats;
+
+/**
+ * Storage type for the tensors whose names match a pattern
+ */
+struct TensorTypeRule {
+    std::string pattern;   // Tensor name; '*' matches any run of characters
+    DataType type;
+};
+
+/**
+ * How the values of INT8, INT5 and INT4 blocks are chosen
+ */
+enum class QuantizationMethod {
+    ROUND_TO_NEAREST,   // Scale from the block's largest value, values rounded independently
+    ACTIVATION_AWARE,   // Scale searched per block for the least activation-weighted error
+    GPTQ                // Rounding errors compensated in later columns (needs Gram matrices)
+};
+
+/**
+ * @struct QuantizerConfig
+ * @brief Options of a quantization run
+ */
+struct QuantizerConfig {
+    DataType type = DataType::INT4;      // Storage type of weight matrices
+    size_t block_size = 32;              // Weights per scale in block-quantized tensors
+    std::vector<TensorTypeRule> rules;   // Per-tensor overrides; the first matching rule wins
+    size_t n_threads = 0;                // Tensors converted concurrently (0 = OpenMP default)
+    size_t max_tensors_in_flight = 0;    // Converted tensors held before writing (0 = n_threads)
+    float target_bits_per_weight = 5.0f; // Average size of ADAPTIVE tensors, masks and scales included
+    const ActivationStats* activation_stats = nullptr; // Importance of weight columns (null = unweighted)
+    QuantizationMethod method = QuantizationMethod::ROUND_TO_NEAREST; // Needs activation_stats unless rounding
+    float gptq_damping = 0.01f;          // Added to the Gram diagonal, relative to its mean
+};
+
+/**
+ * What happened to one tensor
+ */
+struct TensorQuantization {
+    std::string name;
+    std::vector<size_t> shape;
+    DataType source_type;
+    DataType type;
+    uint64_t source_bytes;
+    uint64_t bytes;
+    QuantizationMethod method;   // Rounding for tensors not stored as INT8, INT5 or INT4
+};
+
+/**
+ * Totals of a quantization run
+ */
+struct QuantizationSummary {
+    size_t n_tensors = 0;
+    size_t n_quantized = 0;      // Tensors stored in a block-quantized type
+    uint64_t source_bytes = 0;   // Tensor data read
+    uint64_t bytes = 0;          // Tensor data written
+    uint64_t n_weights = 0;      // Elements of all tensors
+    std::array<uint64_t, 4> adaptive_blocks{};   // ADAPTIVE blocks stored as INT4, INT5, INT8 and FP16
+};
+
+/**
+ * Parse a storage type name: fp32, fp16, bf16, int8, int5, int4 or adaptive
+ * (int5_block and int4_block are accepted as well)
+ * @throws std::invalid_argument for unknown names
+ */
+DataType parse_data_type(const std::string& name);
+
+/**
+ * Lower-case name of a storage type, as accepted by parse_data_type()
+ */
+const char* data_type_name(DataType type);
+
+/**
+ * Parse a quantization method name: rtn, activation-aware (or awq) or gptq
+ * @throws std::invalid_argument for unknown names
+ */
+QuantizationMethod parse_quantization_method(const std::string& name);
+
+/**
+ * Name of a quantization method, as accepted by parse_quantization_method()
+ */
+const char* quantization_method_name(QuantizationMethod method);
+
+/**
+ * Whether a storage type holds block-quantized integers (ADAPTIVE included)
+ */
+bool is_block_quantized(DataType type);
+
+/**
+ * Choose the storage type of a tensor
+ *
+ * Rules are applied first. Otherwise vectors (norms, biases) and the learned
+ * position embedding stay FP32, since the engine reads them as plain floats,
+ * and matrices get config.type. Matrices whose rows are not a whole number
+ * of blocks fall back to FP16 instead of a block-quantized type.
+ * @param config Quantizer options
+ * @param name Tensor name
+ * @param shape Tensor shape
+ * @return The storage type
+ * @throws std::invalid_argument if a rule asks for a block-quantized type
+ *         the tensor's shape cannot hold
+ */
+DataType select_tensor_type(const QuantizerConfig& config, const std::string& name,
+                            const std::vector<size_t>& shape);
+
+/**
+ * Quantize an AMB model into a new AMB file
+ *
+ * Metadata and tokenizer sections are copied. The config section gets a
+ * "quant" entry describing config.type and config.block_size. Source
+ * tensors must be FP32, FP16 or BF16. ADAPTIVE tensors are read twice and
+ * fit config.target_bits_per_weight on average; a budget below their
+ * all-INT4 size leaves them all INT4. config.method applies to every INT8,
+ * INT5 and INT4 tensor, each of which then needs calibration statistics,
+ * except tables that are only looked up (transformer.wpe.weight, and
+ * transformer.wte.weight when lm_head.weight exists): these are rounded to
+ * nearest and reported as such.
+ * @param input_path Full-precision AMB model
+ * @param output_path Quantized model to write (removed again on failure)
+ * @param config Quantizer options
+ * @param on_tensor Called for every tensor, in file order, once it is written
+ * @return Totals
+ * @throws std::runtime_error if a file cannot be read or written or the input is malformed
+ * @throws std::invalid_argument if a tensor cannot be converted as configured,
+ *         its calibration statistics do not match its shape, or the method
+ *         lacks the statistics it needs (including those of any INT8, INT5
+ *         or INT4 tensor)
+ */
+QuantizationSummary quantize_model(const std::string& input_path, const std::string& output_path,
+                                   const QuantizerConfig& config,
+                                   const std::function<void(const TensorQuantization&)>& on_tensor = {});
+
+} // namespace embee
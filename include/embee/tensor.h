@@ -0,0 +1,318 @@
+/**
+ * @file tensor.h
+ * @brief Typed, strided views of tensor memory
+ *
+ * Views describe memory owned elsewhere (a Tensor, the KV cache, an
+ * activation arena) and never copy it. Slicing only adjusts the data pointer,
+ * extents and strides, so a per-head slice of the KV cache or a range of rows
+ * of a fused weight costs nothing.
+ */
+
+#pragma once
+
+#include "types.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace embee {
+
+/**
+ * Highest rank a TensorView supports
+ */
+constexpr size_t MAX_TENSOR_RANK = 4;
+
+/**
+ * @class TensorView
+ * @brief Non-owning strided view of elements of type T
+ *
+ * Strides are in elements, not bytes. Use a const T for read-only views; a
+ * TensorView<T> converts implicitly to TensorView<const T>.
+ */
+template <typename T>
+class TensorView {
+public:
+    TensorView() = default;
+
+    /**
+     * Contiguous row-major view
+     * @param data First element
+     * @param shape Extent of each axis, outermost first
+     */
+    TensorView(T* data, std::initializer_list<size_t> shape)
+        : TensorView(data, std::vector<size_t>(shape)) {}
+
+    TensorView(T* data, const std::vector<size_t>& shape) : data_(data), rank_(shape.size()) {
+        if (rank_ > MAX_TENSOR_RANK) {
+            throw std::invalid_argument("Tensor rank " + std::to_string(rank_) + " is not supported");
+        }
+        ptrdiff_t stride = 1;
+        for (size_t i = rank_; i-- > 0;) {
+            shape_[i] = shape[i];
+            strides_[i] = stride;
+            stride *= static_cast<ptrdiff_t>(shape[i]);
+        }
+    }
+
+    template <typename U, typename = std::enable_if_t<std::is_same<const U, T>::value &&
+                                                      !std::is_same<U, T>::value>>
+    TensorView(const TensorView<U>& other)
+        : data_(other.data()), rank_(other.rank()) {
+        for (size_t i = 0; i < rank_; ++i) {
+            shape_[i] = other.dim(i);
+            strides_[i] = other.stride(i);
+        }
+    }
+
+    T* data() const { return data_; }
+    size_t rank() const { return rank_; }
+    size_t dim(size_t axis) const { return shape_[axis]; }
+    ptrdiff_t stride(size_t axis) const { return strides_[axis]; }
+
+    /**
+     * Number of elements
+     */
+    size_t size() const {
+        size_t n = 1;
+        for (size_t i = 0; i < rank_; ++i) {
+            n *= shape_[i];
+        }
+        return n;
+    }
+
+    /**
+     * Whether elements are densely packed in row-major order
+     */
+    bool is_contiguous() const {
+        ptrdiff_t expected = 1;
+        for (size_t i = rank_; i-- > 0;) {
+            if (shape_[i] != 1 && strides_[i] != expected) {
+                return false;
+            }
+            expected *= static_cast<ptrdiff_t>(shape_[i]);
+        }
+        return true;
+    }
+
+    /**
+     * Element access; one index per axis (unchecked)
+     */
+    template <typename... Index>
+    T& operator()(Index... index) const {
+        static_assert(sizeof...(Index) <= MAX_TENSOR_RANK, "Too many indices");
+        const size_t indices[] = {static_cast<size_t>(index)...};
+        ptrdiff_t offset = 0;
+        for (size_t i = 0; i < sizeof...(Index); ++i) {
+            offset += static_cast<ptrdiff_t>(indices[i]) * strides_[i];
+        }
+        return data_[offset];
+    }
+
+    /**
+     * Fix one axis at an index, dropping it from the view
+     */
+    TensorView select(size_t axis, size_t index) const {
+        check_axis(axis);
+        if (index >= shape_[axis]) {
+            throw std::out_of_range("Index " + std::to_string(index) + " out of range for axis " +
+                                    std::to_string(axis));
+        }
+        TensorView result;
+        result.data_ = data_ + static_cast<ptrdiff_t>(index) * strides_[axis];
+        for (size_t i = 0; i < rank_; ++i) {
+            if (i != axis) {
+                result.shape_[result.rank_] = shape_[i];
+                result.strides_[result.rank_] = strides_[i];
+                ++result.rank_;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * Restrict one axis to [begin, end)
+     */
+    TensorView slice(size_t axis, size_t begin, size_t end) const {
+        check_axis(axis);
+        if (begin > end || end > shape_[axis]) {
+            throw std::out_of_range("Slice [" + std::to_string(begin) + ", " + std::to_string(end) +
+                                    ") out of range for axis " + std::to_string(axis));
+        }
+        TensorView result = *this;
+        result.data_ = data_ + static_cast<ptrdiff_t>(begin) * strides_[axis];
+        result.shape_[axis] = end - begin;
+        return result;
+    }
+
+    TensorView row(size_t index) const { return select(0, index); }
+    TensorView rows(size_t begin, size_t end) const { return slice(0, begin, end); }
+
+    /**
+     * Swap two axes
+     */
+    TensorView transpose(size_t a, size_t b) const {
+        check_axis(a);
+        check_axis(b);
+        TensorView result = *this;
+        std::swap(result.shape_[a], result.shape_[b]);
+        std::swap(result.strides_[a], result.strides_[b]);
+        return result;
+    }
+
+    /**
+     * Reinterpret a contiguous view with another shape of the same size
+     * @throws std::invalid_argument if the view is strided or the sizes differ
+     */
+    TensorView reshape(const std::vector<size_t>& shape) const {
+        TensorView result(data_, shape);
+        if (!is_contiguous() || result.size() != size()) {
+            throw std::invalid_argument("Cannot reshape a strided view or change its size");
+        }
+        return result;
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t rank_ = 0;
+    std::array<size_t, MAX_TENSOR_RANK> shape_{};
+    std::array<ptrdiff_t, MAX_TENSOR_RANK> strides_{};
+
+    void check_axis(size_t axis) const {
+        if (axis >= rank_) {
+            throw std::out_of_range("Axis " + std::to_string(axis) + " out of range for rank " +
+                                    std::to_string(rank_));
+        }
+    }
+};
+
+/**
+ * One quantization block of a row: FP16 scale followed by packed values
+ */
+struct QuantBlock {
+    const uint8_t* ptr;   // Start of the block (the scale)
+
+    float scale() const;
+    const uint8_t* packed() const { return ptr + 2; }
+};
+
+/**
+ * @class WeightView
+ * @brief Non-owning view of a row-major matrix in any storage type
+ *
+ * Rows are stored back to back, each row_bytes(type, cols, block_size) long
+ * (for ADAPTIVE weights, the size given by the first row's precision mask).
+ * Element access dispatches on the data type, so the same code reads FP32,
+ * FP16, BF16 and block-quantized weights.
+ */
+class WeightView {
+public:
+    /**
+     * Forward iterator over the quantization blocks of one row
+     */
+    class BlockIterator {
+    public:
+        BlockIterator(const uint8_t* ptr, size_t block_bytes) : ptr_(ptr), block_bytes_(block_bytes) {}
+        QuantBlock operator*() const { return QuantBlock{ptr_}; }
+        BlockIterator& operator++() { ptr_ += block_bytes_; return *this; }
+        bool operator==(const BlockIterator& other) const { return ptr_ == other.ptr_; }
+        bool operator!=(const BlockIterator& other) const { return ptr_ != other.ptr_; }
+
+    private:
+        const uint8_t* ptr_;
+        size_t block_bytes_;
+    };
+
+    struct BlockRange {
+        BlockIterator first;
+        BlockIterator last;
+        BlockIterator begin() const { return first; }
+        BlockIterator end() const { return last; }
+    };
+
+    WeightView() = default;
+
+    /**
+     * @param type Storage type
+     * @param data First byte of row 0
+     * @param rows Number of rows
+     * @param cols Values per row
+     * @param block_size Quantization block size (ignored for float types)
+     */
+    WeightView(DataType type, const uint8_t* data, size_t rows, size_t cols, size_t block_size);
+
+    DataType type() const { return type_; }
+    const uint8_t* data() const { return data_; }
+    size_t rows() const { return rows_; }
+    size_t cols() const { return cols_; }
+    size_t block_size() const { return block_size_; }
+    size_t row_stride() const { return row_stride_; }   // Bytes per row
+
+    /**
+     * Whether rows are stored as quantization blocks
+     */
+    bool is_quantized() const;
+
+    /**
+     * First byte of a row
+     */
+    const uint8_t* row(size_t r) const { return data_ + r * row_stride_; }
+
+    /**
+     * Rows [begin, end) as a view of the same storage
+     */
+    WeightView slice_rows(size_t begin, size_t end) const;
+
+    /**
+     * Convert one row to FP32
+     * @param dst At least cols() floats
+     */
+    void dequantize_row(size_t r, float* dst) const;
+
+    /**
+     * Value of one element, converted to FP32
+     */
+    float at(size_t r, size_t c) const;
+
+    /**
+     * Quantization blocks of a row
+     * @throws std::logic_error for float types and ADAPTIVE, whose blocks
+     *         differ in size
+     */
+    BlockRange blocks(size_t r) const;
+
+    /**
+     * The matrix as a float view; FP32 only
+     * @throws std::logic_error for other types
+     */
+    TensorView<const float> as_fp32() const;
+
+private:
+    DataType type_ = DataType::FP32;
+    const uint8_t* data_ = nullptr;
+    size_t rows_ = 0;
+    size_t cols_ = 0;
+    size_t block_size_ = 0;
+    size_t row_stride_ = 0;
+};
+
+/**
+ * View the data of an FP32 tensor
+ * @throws std::invalid_argument if the tensor is not FP32
+ */
+TensorView<float> fp32_view(Tensor& tensor);
+TensorView<const float> fp32_view(const Tensor& tensor);
+
+/**
+ * View a tensor as a matrix of shape[0] rows (1 for vectors) and the
+ * remaining axes flattened into columns
+ * @param block_size Quantization block size of the model
+ */
+WeightView weight_view(const Tensor& tensor, size_t block_size);
+
+} // namespace embee
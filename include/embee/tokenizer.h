@@ -7,6 +7,7 @@
 
 #include "types.h"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <unordered_map>
@@ -14,6 +15,13 @@
 
 namespace embee {
 
+namespace amb {
+struct TokenizerSectionHeader;
+struct MergeSlot;
+struct TrieNode;
+struct TrieEdge;
+}
+
 /**
  * @class Tokenizer
  * @brief Abstract base class for all tokenizers (BPE, SentencePiece, etc.)
@@ -29,6 +37,45 @@ public:
      */
     virtual TokenVector encode(const std::string& text) const = 0;
     
+    /**
+     * Encode text, appending the token IDs to an existing buffer
+     *
+     * The default implementation forwards to encode(). Tokenizers override
+     * this to skip the temporary string and result vector, which is what
+     * encode_batch() calls for every document.
+     * @param text Input text to tokenize
+     * @param out Buffer the token IDs are appended to
+     */
+    virtual void encode_into(std::string_view text, TokenVector& out) const;
+    
+    /**
+     * Encode many documents into one flat token buffer
+     *
+     * Documents are split into contiguous chunks across worker threads. Each
+     * thread encodes its chunk into a thread-local scratch buffer that is
+     * reused between calls, then the chunks are copied into @p tokens in
+     * document order. On return the tokens of document i are
+     * tokens[offsets[i]] .. tokens[offsets[i + 1] - 1].
+     * @param texts Documents to encode
+     * @param n_texts Number of documents
+     * @param tokens Output token buffer (resized, capacity is reused)
+     * @param offsets Output document offsets (resized to n_texts + 1)
+     * @param n_threads Number of worker threads (0 = OpenMP default)
+     */
+    void encode_batch(const std::string_view* texts, size_t n_texts,
+                      TokenVector& tokens, std::vector<size_t>& offsets,
+                      size_t n_threads = 0) const;
+    
+    /**
+     * Encode many documents into one flat token buffer
+     * @see encode_batch(const std::string_view*, size_t, TokenVector&, std::vector<size_t>&, size_t)
+     */
+    void encode_batch(const std::vector<std::string_view>& texts,
+                      TokenVector& tokens, std::vector<size_t>& offsets,
+                      size_t n_threads = 0) const {
+        encode_batch(texts.data(), texts.size(), tokens, offsets, n_threads);
+    }
+    
     /**
      * Decode tokens back to text
      * @param tokens Vector of token IDs
@@ -42,6 +89,12 @@ public:
      */
     virtual size_t vocab_size() const = 0;
     
+    /**
+     * Get the memory held by the tokenizer's tables
+     * @return Size in bytes (0 if the implementation does not track it)
+     */
+    virtual size_t memory_usage() const;
+    
     /**
      * Get the ID of the token used for beginning of sequence
      * @return BOS token ID or nullopt if not available
@@ -62,8 +115,14 @@ public:
     
     /**
      * Create a tokenizer from a file
+     *
+     * AMB files (and bare binary tokenizer sections) are mapped and used in
+     * place. SentencePiece ".model" files and vocab.json/merges.txt
+     * directories are not supported yet.
      * @param path Path to the tokenizer file
      * @return Unique pointer to a Tokenizer instance
+     * @throws std::runtime_error if the file format is not recognized or
+     *         not supported
      */
     static std::unique_ptr<Tokenizer> load(const std::string& path);
 };
@@ -100,6 +159,7 @@ private:
 class SentencePieceTokenizer : public Tokenizer {
 public:
     SentencePieceTokenizer(const std::string& model_path);
+    ~SentencePieceTokenizer() override;  // Defined where Impl is complete
     
     TokenVector encode(const std::string& text) const override;
     std::string decode(const TokenVector& tokens) const override;
@@ -114,4 +174,77 @@ private:
     std::unique_ptr<Impl> pimpl_;
 };
 
-} // namespace embee
\ No newline at end of file
+/**
+ * @class CharTokenizer
+ * @brief Byte-per-token tokenizer used by placeholder models and tests
+ *
+ * Each byte of the input becomes one token with the byte's value as its ID.
+ */
+class CharTokenizer : public Tokenizer {
+public:
+    TokenVector encode(const std::string& text) const override;
+    void encode_into(std::string_view text, TokenVector& out) const override;
+    std::string decode(const TokenVector& tokens) const override;
+    size_t vocab_size() const override;
+    std::optional<TokenId> bos_token() const override;
+    std::optional<TokenId> eos_token() const override;
+    std::optional<TokenId> pad_token() const override;
+};
+
+/**
+ * @class BinaryTokenizer
+ * @brief Byte-level BPE tokenizer running directly on a BINARY_BPE section
+ *
+ * Construction validates the section header, its array bounds, special
+ * token IDs and byte tokens, then records pointers into the section; nothing
+ * is parsed or copied (unless the section is not 4-byte aligned, in which
+ * case it is copied once). Merge slots and trie links are bounds-checked as
+ * encoding reads them, so a corrupt entry makes encode() throw
+ * std::runtime_error. The layout is described in
+ * docs/model_format.md and produced by amb::serialize_tokenizer().
+ */
+class BinaryTokenizer : public Tokenizer {
+public:
+    /**
+     * Wrap a tokenizer section in place
+     * @param data Start of the section
+     * @param size Size of the section in bytes
+     * @param owner Keeps the underlying storage (e.g. the file mapping) alive
+     * @throws std::runtime_error if the section is malformed: an array out of
+     *         bounds, or a special or byte token outside the vocabulary
+     */
+    BinaryTokenizer(const uint8_t* data, size_t size, std::shared_ptr<const void> owner = nullptr);
+    
+    TokenVector encode(const std::string& text) const override;
+    void encode_into(std::string_view text, TokenVector& out) const override;
+    std::string decode(const TokenVector& tokens) const override;
+    size_t vocab_size() const override;
+    size_t memory_usage() const override;
+    std::optional<TokenId> bos_token() const override;
+    std::optional<TokenId> eos_token() const override;
+    std::optional<TokenId> pad_token() const override;
+    
+private:
+    std::shared_ptr<const void> owner_;
+    size_t section_size_;
+    const amb::TokenizerSectionHeader* header_;
+    const uint32_t* offsets_;
+    const char* string_pool_;
+    const int32_t* byte_tokens_;
+    const amb::MergeSlot* merges_;
+    const amb::TrieNode* trie_nodes_;
+    const amb::TrieEdge* trie_edges_;
+    uint32_t merge_mask_;
+    
+    // Encode text without special tokens, one pre-tokenized piece at a time
+    void encode_text(const uint8_t* text, size_t length, TokenVector& out) const;
+    void encode_piece(const uint8_t* piece, size_t length, TokenVector& out) const;
+
+    // Token merging a pair and its rank, or -1 if the pair does not merge
+    int32_t find_merge(int32_t left, int32_t right, uint32_t& rank) const;
+    
+    // Length of the longest special token at the start of text (0 if none)
+    size_t match_special(const uint8_t* text, size_t length, TokenId& id) const;
+};
+
+} // namespace embee
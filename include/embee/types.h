@@ -10,6 +10,7 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include "memory.h"
 
 namespace embee {
 
@@ -20,7 +21,7 @@ enum class ModelArchitecture {
     LLAMA,      // LLaMA, LLaMA-2, etc.
     MISTRAL,    // Mistral, Mixtral
     GEMMA,      // Google Gemma
-    PHI,        // Microsoft Phi-2, Phi-3
+    PHI,        // Microsoft Phi-3 (Phi-2's shared-norm parallel blocks are not supported)
     FALCON,     // Falcon
     GPT2,       // OpenAI GPT-2
     MPT,        // MosaicML MPT
@@ -59,7 +60,8 @@ enum class DataType {
     BF16,   // 16-bit brain floating point
     INT8,   // 8-bit integer
     INT4,   // 4-bit integer
-    INT5    // 5-bit integer
+    INT5,   // 5-bit integer
+    ADAPTIVE // Per-block mix of INT4, INT5, INT8 and FP16 (precision mask per row)
 };
 
 /**
@@ -79,13 +81,50 @@ public:
     // Data type
     DataType data_type;
     
-    // Raw tensor data
-    std::vector<uint8_t> data;
+    // Raw tensor data (64-byte aligned, not zero-filled on resize)
+    AlignedBuffer data;
+    
+    // Read-only bytes used in place instead of data, e.g. inside a mapped
+    // model file (null when the tensor owns its data)
+    const uint8_t* mapped = nullptr;
+    size_t mapped_size = 0;
     
     // Tensor name (for debugging and model analysis)
     std::string name;
+
+    // Number of elements (product of shape)
+    size_t numel() const;
+
+    // The tensor's bytes, wherever they are stored
+    const uint8_t* bytes() const { return mapped ? mapped : data.data(); }
+    size_t byte_size() const { return mapped ? mapped_size : data.size(); }
+
+    // Typed and strided access: fp32_view() and weight_view() in tensor.h
+};
+
+/**
+ * Memory use by category, in bytes
+ *
+ * Mapped bytes are address space backed by the model file; only the
+ * resident part occupies RAM. Everything else is heap memory owned by the
+ * model or engine.
+ */
+struct MemoryStats {
+    size_t weights_mapped = 0;      // Weight bytes mapped from the model file
+    size_t weights_resident = 0;    // Weight bytes in RAM (resident mapped pages + heap weights)
+    size_t weights_heap = 0;        // Weight bytes held in heap buffers
+    size_t kv_cache_used = 0;       // KV cache bytes holding cached positions
+    size_t kv_cache_reserved = 0;   // KV cache bytes allocated
+    size_t activations = 0;         // Activation arena (including logits)
+    size_t tokenizer = 0;           // Tokenizer tables
+    size_t sampler_scratch = 0;     // Sampling buffers
     
-    // Methods for accessing data will be added
+    /**
+     * Estimated RAM footprint: resident weights plus all heap allocations
+     */
+    size_t total() const {
+        return weights_resident + kv_cache_reserved + activations + tokenizer + sampler_scratch;
+    }
 };
 
 } // namespace embee
\ No newline at end of file
@@ -0,0 +1,529 @@
+/**
+ * @file amb_format.cpp
+ * @brief AMB header parsing, file mapping and tokenizer section serialization
+ */
+
+#include "embee/amb_format.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace embee {
+namespace amb {
+
+namespace {
+
+template <typename T>
+T read_le(const uint8_t* p) {
+    // AMB is little-endian, as are all supported targets
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void write_le(uint8_t* p, T value) {
+    std::memcpy(p, &value, sizeof(T));
+}
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Data type codes of tensor records (docs/model_format.md)
+DataType data_type_from_code(uint8_t code) {
+    switch (code) {
+        case 0: return DataType::FP32;
+        case 1: return DataType::FP16;
+        case 2: return DataType::BF16;
+        case 3: return DataType::INT8;
+        case 4:
+        case 6: return DataType::INT4;
+        case 5:
+        case 7: return DataType::INT5;
+        case 8: return DataType::ADAPTIVE;
+    }
+    throw std::runtime_error("Unsupported tensor data type code: " + std::to_string(code));
+}
+
+uint8_t data_type_code(DataType type) {
+    return type == DataType::ADAPTIVE ? 8 : static_cast<uint8_t>(type);
+}
+
+constexpr const char* JSON_SPACE = " \t\r\n";
+
+[[noreturn]] void malformed_json() {
+    throw std::runtime_error("Malformed JSON in AMB section");
+}
+
+// Offset just past the JSON value (object, array, string or scalar) at pos
+size_t skip_json_value(const std::string& json, size_t pos) {
+    if (pos >= json.size()) {
+        malformed_json();
+    }
+    if (json[pos] != '"' && json[pos] != '{' && json[pos] != '[') {
+        const size_t end = json.find_first_of(",}] \t\r\n", pos);
+        if (end == pos) {
+            malformed_json();
+        }
+        return end == std::string::npos ? json.size() : end;
+    }
+    int depth = 0;
+    bool in_string = false;
+    for (size_t i = pos; i < json.size(); ++i) {
+        const char c = json[i];
+        if (in_string) {
+            if (c == '\\') {
+                ++i;
+            } else if (c == '"') {
+                in_string = false;
+                if (depth == 0) {
+                    return i + 1;
+                }
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return i + 1;
+        }
+    }
+    malformed_json();
+}
+
+void append_utf8(std::string& out, uint32_t c) {
+    if (c < 0x80) {
+        out += static_cast<char>(c);
+    } else if (c < 0x800) {
+        out += static_cast<char>(0xC0 | (c >> 6));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    } else {
+        out += static_cast<char>(0xE0 | (c >> 12));
+        out += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (c & 0x3F));
+    }
+}
+
+} // namespace
+
+Header parse_header(const uint8_t* data, size_t size) {
+    if (size < HEADER_SIZE || std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+        throw std::runtime_error("Not an AMB file (bad magic)");
+    }
+
+    Header header;
+    header.version = data[5];
+    header.flags = read_le<uint16_t>(data + 6);
+    header.metadata_size = read_le<uint32_t>(data + 8);
+    header.config_size = read_le<uint32_t>(data + 12);
+    header.tokenizer_size = read_le<uint32_t>(data + 16);
+    header.weights_size = read_le<uint64_t>(data + 20);
+
+    if (header.version == 0 || header.version > FORMAT_VERSION) {
+        throw std::runtime_error("Unsupported AMB version: " + std::to_string(header.version));
+    }
+    if (header.weights_offset() > size || header.weights_size > size - header.weights_offset()) {
+        throw std::runtime_error("AMB section sizes exceed the file size");
+    }
+    return header;
+}
+
+std::array<uint8_t, HEADER_SIZE> serialize_header(const Header& header) {
+    std::array<uint8_t, HEADER_SIZE> out{};
+    std::memcpy(out.data(), MAGIC, sizeof(MAGIC));
+    out[5] = FORMAT_VERSION;
+    write_le<uint16_t>(out.data() + 6, header.flags);
+    write_le<uint32_t>(out.data() + 8, header.metadata_size);
+    write_le<uint32_t>(out.data() + 12, header.config_size);
+    write_le<uint32_t>(out.data() + 16, header.tokenizer_size);
+    write_le<uint64_t>(out.data() + 20, header.weights_size);
+    return out;
+}
+
+std::unordered_map<std::string, std::string> parse_json_object(const std::string& json) {
+    std::unordered_map<std::string, std::string> members;
+    size_t pos = json.find_first_not_of(JSON_SPACE);
+    if (pos == std::string::npos || json[pos] != '{') {
+        malformed_json();
+    }
+    pos = json.find_first_not_of(JSON_SPACE, pos + 1);
+    while (pos != std::string::npos && json[pos] != '}') {
+        const size_t key_end = skip_json_value(json, pos);
+        const std::string key = json_string(json.substr(pos, key_end - pos));
+        pos = json.find_first_not_of(JSON_SPACE, key_end);
+        if (pos == std::string::npos || json[pos] != ':') {
+            malformed_json();
+        }
+        pos = json.find_first_not_of(JSON_SPACE, pos + 1);
+        const size_t value_end = skip_json_value(json, pos);
+        members[key] = json.substr(pos, value_end - pos);
+        pos = json.find_first_not_of(JSON_SPACE, value_end);
+        if (pos != std::string::npos && json[pos] == ',') {
+            pos = json.find_first_not_of(JSON_SPACE, pos + 1);
+            if (pos != std::string::npos && json[pos] == '}') {
+                malformed_json();
+            }
+        } else if (pos == std::string::npos || json[pos] != '}') {
+            malformed_json();
+        }
+    }
+    if (pos == std::string::npos || json.find_first_not_of(JSON_SPACE, pos + 1) != std::string::npos) {
+        malformed_json();
+    }
+    return members;
+}
+
+std::string json_string(const std::string& value) {
+    if (value.size() < 2 || value.front() != '"' || value.back() != '"') {
+        throw std::runtime_error("Expected a JSON string, got " + value.substr(0, 64));
+    }
+    std::string out;
+    for (size_t i = 1; i + 1 < value.size(); ++i) {
+        if (value[i] != '\\') {
+            out += value[i];
+            continue;
+        }
+        if (++i + 1 >= value.size()) {
+            malformed_json();
+        }
+        switch (value[i]) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (i + 5 >= value.size()) {
+                    malformed_json();
+                }
+                // Code points outside the BMP (surrogate pairs) are not needed by any section
+                append_utf8(out, static_cast<uint32_t>(std::stoul(value.substr(i + 1, 4), nullptr, 16)));
+                i += 4;
+                break;
+            }
+            default: out += value[i]; break;
+        }
+    }
+    return out;
+}
+
+TensorRecord parse_tensor_record(const uint8_t* section, size_t size, size_t offset, bool aligned_data) {
+    auto need = [&](size_t pos, size_t n) {
+        if (pos > size || n > size - pos) {
+            throw std::runtime_error("Truncated tensor record at weights offset " + std::to_string(offset));
+        }
+    };
+
+    TensorRecord record;
+    record.offset = offset;
+    size_t pos = offset;
+    need(pos, 2);
+    const uint16_t name_length = read_le<uint16_t>(section + pos);
+    pos += 2;
+    need(pos, name_length + 1);
+    record.name.assign(reinterpret_cast<const char*>(section + pos), name_length);
+    pos += name_length;
+    const uint8_t n_dims = section[pos++];
+    need(pos, 4 * n_dims + 1 + 8);
+    for (uint8_t i = 0; i < n_dims; ++i) {
+        record.shape.push_back(read_le<uint32_t>(section + pos));
+        pos += 4;
+    }
+    record.data_type = data_type_from_code(section[pos++]);
+    record.data_size = read_le<uint64_t>(section + pos);
+    pos += 8;
+    if (aligned_data) {
+        need(pos, tensor_record_padding(pos));
+        pos += tensor_record_padding(pos);
+    }
+    need(pos, record.data_size);
+    record.data = section + pos;
+    pos += record.data_size;
+    record.end = std::min(size, pos + tensor_record_padding(pos));
+    return record;
+}
+
+std::vector<uint8_t> serialize_tensor_header(const std::string& name, const std::vector<size_t>& shape,
+                                             DataType type, uint64_t data_size) {
+    if (name.size() > UINT16_MAX || shape.size() > UINT8_MAX) {
+        throw std::invalid_argument("Tensor name or rank too large for AMB: " + name.substr(0, 64));
+    }
+    const size_t fields = 2 + name.size() + 1 + 4 * shape.size() + 1 + 8;
+    std::vector<uint8_t> out(fields + tensor_record_padding(fields), 0);
+    uint8_t* p = out.data();
+    write_le<uint16_t>(p, static_cast<uint16_t>(name.size()));
+    p += 2;
+    std::memcpy(p, name.data(), name.size());
+    p += name.size();
+    *p++ = static_cast<uint8_t>(shape.size());
+    for (size_t dim : shape) {
+        if (dim > UINT32_MAX) {
+            throw std::invalid_argument("Tensor dimension too large for AMB: " + name);
+        }
+        write_le<uint32_t>(p, static_cast<uint32_t>(dim));
+        p += 4;
+    }
+    *p++ = data_type_code(type);
+    write_le<uint64_t>(p, data_size);
+    return out;
+}
+
+MappedFile::MappedFile(const std::string& path) {
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat file: " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+        void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Failed to map file: " + path);
+        }
+        data_ = static_cast<const uint8_t*>(addr);
+    }
+    ::close(fd);
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+    fallback_.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(fallback_.data()), fallback_.size());
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+#endif
+}
+
+size_t MappedFile::resident_bytes(size_t offset, size_t length) const {
+    if (offset >= size_) {
+        return 0;
+    }
+    length = std::min(length, size_ - offset);
+#ifndef _WIN32
+    if (fallback_.empty() && length > 0) {
+        // mincore works on whole pages starting at a page boundary
+        const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        const size_t first = offset / page * page;
+        const size_t last = offset + length;
+        const size_t n_pages = (last - first + page - 1) / page;
+        std::vector<unsigned char> residency(n_pages);
+        if (::mincore(const_cast<uint8_t*>(data_) + first, last - first, residency.data()) != 0) {
+            return 0;
+        }
+        size_t resident = 0;
+        for (size_t i = 0; i < n_pages; ++i) {
+            if (residency[i] & 1) {
+                const size_t page_start = std::max(first + i * page, offset);
+                const size_t page_end = std::min(first + (i + 1) * page, last);
+                resident += page_end - page_start;
+            }
+        }
+        return resident;
+    }
+#endif
+    return length;
+}
+
+void MappedFile::evict(size_t offset, size_t length) const {
+#ifndef _WIN32
+    if (!fallback_.empty() || offset >= size_) {
+        return;
+    }
+    // Only whole pages inside the range, so neighbouring data stays resident
+    const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const size_t first = align_up(offset, page);
+    const size_t last = std::min(offset + length, size_) / page * page;
+    if (last > first) {
+        ::madvise(const_cast<uint8_t*>(data_) + first, last - first, MADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)length;
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (data_ && fallback_.empty()) {
+        ::munmap(const_cast<uint8_t*>(data_), size_);
+    }
+#endif
+}
+
+std::vector<uint8_t> serialize_tokenizer(const TokenizerSpec& spec) {
+    const size_t n_vocab = spec.vocab.size();
+
+    std::unordered_map<std::string, TokenId> ids;
+    ids.reserve(n_vocab);
+    size_t pool_size = 0;
+    for (size_t i = 0; i < n_vocab; ++i) {
+        ids.emplace(spec.vocab[i], static_cast<TokenId>(i));
+        pool_size += spec.vocab[i].size();
+    }
+
+    auto check_id = [n_vocab](int64_t id) {
+        if (id < -1 || id >= static_cast<int64_t>(n_vocab)) {
+            throw std::invalid_argument("Tokenizer spec references token out of range: " +
+                                        std::to_string(id));
+        }
+    };
+    for (int32_t id : {spec.bos_id, spec.eos_id, spec.pad_id, spec.unk_id, spec.mask_id}) {
+        check_id(id);
+    }
+
+    // Merge table sized for a load factor of at most 0.5
+    uint32_t table_size = 16;
+    while (table_size < spec.merges.size() * 2) {
+        table_size *= 2;
+    }
+    std::vector<MergeSlot> slots(table_size, MergeSlot{-1, -1, -1, 0});
+    for (size_t rank = 0; rank < spec.merges.size(); ++rank) {
+        auto [left, right] = spec.merges[rank];
+        check_id(left);
+        check_id(right);
+        if (left < 0 || right < 0) {
+            throw std::invalid_argument("Merge references an absent token");
+        }
+        auto merged = ids.find(spec.vocab[left] + spec.vocab[right]);
+        if (merged == ids.end()) {
+            throw std::invalid_argument("Merge result not in vocabulary: " +
+                                        spec.vocab[left] + spec.vocab[right]);
+        }
+        uint32_t slot = merge_hash(left, right, table_size - 1);
+        while (slots[slot].left >= 0) {
+            if (slots[slot].left == left && slots[slot].right == right) {
+                break;  // Duplicate merge: keep the first (lowest) rank
+            }
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (slots[slot].left < 0) {
+            slots[slot] = MergeSlot{left, right, merged->second, static_cast<uint32_t>(rank)};
+        }
+    }
+
+    // Special-token trie, built with per-node child maps then flattened
+    std::vector<std::unordered_map<uint8_t, uint32_t>> children;
+    std::vector<int32_t> node_token;
+    if (!spec.special_tokens.empty()) {
+        children.emplace_back();
+        node_token.push_back(-1);
+        for (TokenId id : spec.special_tokens) {
+            check_id(id);
+            if (id < 0 || spec.vocab[id].empty()) {
+                throw std::invalid_argument("Special token must be a non-empty vocabulary entry");
+            }
+            uint32_t node = 0;
+            for (unsigned char c : spec.vocab[id]) {
+                auto it = children[node].find(c);
+                if (it == children[node].end()) {
+                    uint32_t child = static_cast<uint32_t>(children.size());
+                    children[node].emplace(c, child);
+                    children.emplace_back();
+                    node_token.push_back(-1);
+                    node = child;
+                } else {
+                    node = it->second;
+                }
+            }
+            node_token[node] = id;
+        }
+    }
+    std::vector<TrieNode> nodes(children.size());
+    std::vector<TrieEdge> edges;
+    for (size_t n = 0; n < children.size(); ++n) {
+        nodes[n].first_edge = static_cast<uint32_t>(edges.size());
+        nodes[n].n_edges = static_cast<uint32_t>(children[n].size());
+        nodes[n].token_id = node_token[n];
+        for (unsigned b = 0; b < 256; ++b) {
+            auto it = children[n].find(static_cast<uint8_t>(b));
+            if (it != children[n].end()) {
+                edges.push_back(TrieEdge{b, it->second});
+            }
+        }
+    }
+
+    // Lay out the section
+    TokenizerSectionHeader header{};
+    header.type = static_cast<uint8_t>(TokenizerType::BINARY_BPE);
+    header.version = TOKENIZER_LAYOUT_VERSION;
+    header.n_vocab = static_cast<uint32_t>(n_vocab);
+    header.bos_id = spec.bos_id;
+    header.eos_id = spec.eos_id;
+    header.pad_id = spec.pad_id;
+    header.unk_id = spec.unk_id;
+    header.mask_id = spec.mask_id;
+    header.merge_table_size = table_size;
+    header.n_trie_nodes = static_cast<uint32_t>(nodes.size());
+    header.n_trie_edges = static_cast<uint32_t>(edges.size());
+    header.string_pool_size = static_cast<uint32_t>(pool_size);
+
+    size_t offset = sizeof(TokenizerSectionHeader);
+    header.offsets_offset = static_cast<uint32_t>(offset);
+    offset += (n_vocab + 1) * sizeof(uint32_t);
+    header.byte_tokens_offset = static_cast<uint32_t>(offset);
+    offset += 256 * sizeof(int32_t);
+    header.merges_offset = static_cast<uint32_t>(offset);
+    offset += slots.size() * sizeof(MergeSlot);
+    header.trie_nodes_offset = static_cast<uint32_t>(offset);
+    offset += nodes.size() * sizeof(TrieNode);
+    header.trie_edges_offset = static_cast<uint32_t>(offset);
+    offset += edges.size() * sizeof(TrieEdge);
+    header.string_pool_offset = static_cast<uint32_t>(offset);
+    offset += pool_size;
+    if (offset > UINT32_MAX) {
+        throw std::invalid_argument("Tokenizer section exceeds 4 GiB");
+    }
+
+    std::vector<uint8_t> out(align_up(offset, SECTION_ALIGNMENT), 0);
+    std::memcpy(out.data(), &header, sizeof(header));
+
+    uint32_t pool_pos = 0;
+    uint8_t* offsets = out.data() + header.offsets_offset;
+    for (size_t i = 0; i < n_vocab; ++i) {
+        std::memcpy(offsets + i * sizeof(uint32_t), &pool_pos, sizeof(uint32_t));
+        std::memcpy(out.data() + header.string_pool_offset + pool_pos,
+                    spec.vocab[i].data(), spec.vocab[i].size());
+        pool_pos += static_cast<uint32_t>(spec.vocab[i].size());
+    }
+    std::memcpy(offsets + n_vocab * sizeof(uint32_t), &pool_pos, sizeof(uint32_t));
+
+    for (unsigned b = 0; b < 256; ++b) {
+        auto it = ids.find(std::string(1, static_cast<char>(b)));
+        if (it == ids.end() && spec.unk_id < 0) {
+            throw std::invalid_argument("Tokenizer has no token for byte " + std::to_string(b) +
+                                        " and no unknown token");
+        }
+        int32_t id = it != ids.end() ? it->second : spec.unk_id;
+        std::memcpy(out.data() + header.byte_tokens_offset + b * sizeof(int32_t), &id, sizeof(id));
+    }
+
+    std::memcpy(out.data() + header.merges_offset, slots.data(), slots.size() * sizeof(MergeSlot));
+    if (!nodes.empty()) {
+        std::memcpy(out.data() + header.trie_nodes_offset, nodes.data(), nodes.size() * sizeof(TrieNode));
+    }
+    if (!edges.empty()) {
+        std::memcpy(out.data() + header.trie_edges_offset, edges.data(), edges.size() * sizeof(TrieEdge));
+    }
+    return out;
+}
+
+} // namespace amb
+} // namespace embee
@@ -0,0 +1,187 @@
+/**
+ * @file calibration.cpp
+ * @brief Collection of activation statistics for quantization
+ */
+
+#include "embee/calibration.h"
+#include "embee/engine.h"
+#include "embee/memory.h"
+#include "embee/model.h"
+#include "embee/tokenizer.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace embee {
+
+const ActivationStats::Entry* ActivationStats::find(const std::string& weight) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(weight);
+    if (it == entries_.end()) {
+        return nullptr;
+    }
+    return it->second.source ? it->second.source : &it->second;
+}
+
+void ActivationStats::share_input(const std::string& weight, const std::string& with) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Entry* source = &entries_[with];
+    if (source->source) {
+        source = source->source;
+    }
+    Entry& entry = entries_[weight];
+    if (&entry == source || entry.source == source) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> entry_lock(entry.mutex);
+        if (entry.rows > 0) {
+            throw std::invalid_argument("Inputs of " + weight + " were already recorded on their own");
+        }
+    }
+    entry.source = source;
+    // Weights that shared this weight's input now share the source's
+    for (auto& other : entries_) {
+        if (other.second.source == &entry) {
+            other.second.source = source;
+        }
+    }
+}
+
+void ActivationStats::add(const std::string& weight, const float* x, size_t rows, size_t cols) {
+    Entry* found;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        found = &entries_[weight];
+        if (found->source) {
+            return;   // Recorded by the weight it shares its input with
+        }
+    }
+    Entry& entry = *found;
+    std::lock_guard<std::mutex> lock(entry.mutex);
+    if (entry.sum_squares.empty()) {
+        entry.sum_squares.assign(cols, 0.0);
+    } else if (entry.sum_squares.size() != cols) {
+        throw std::invalid_argument("Inputs of " + weight + " changed width from " +
+                                    std::to_string(entry.sum_squares.size()) + " to " + std::to_string(cols));
+    }
+    for (size_t r = 0; r < rows; ++r) {
+        const float* row = x + r * cols;
+        for (size_t j = 0; j < cols; ++j) {
+            entry.sum_squares[j] += static_cast<double>(row[j]) * row[j];
+        }
+    }
+    if (collect_gram_) {
+        entry.gram.resize(cols * (cols + 1) / 2);
+        float* gram = entry.gram.data();
+        const long n = static_cast<long>(cols);
+        #pragma omp parallel for schedule(dynamic, 16)
+        for (long i = 0; i < n; ++i) {
+            float* g = gram + i * (i + 1) / 2;
+            for (size_t r = 0; r < rows; ++r) {
+                const float* row = x + r * cols;
+                const float xi = row[i];
+                if (xi == 0.0f) {
+                    continue;
+                }
+                for (long j = 0; j <= i; ++j) {
+                    g[j] += xi * row[j];
+                }
+            }
+        }
+    }
+    entry.rows += rows;
+}
+
+std::vector<float> ActivationStats::importance(const std::string& weight) const {
+    const Entry* entry = find(weight);
+    if (!entry) {
+        return {};
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->rows == 0) {
+        return {};
+    }
+    std::vector<float> result(entry->sum_squares.size());
+    for (size_t j = 0; j < result.size(); ++j) {
+        result[j] = static_cast<float>(entry->sum_squares[j] / static_cast<double>(entry->rows));
+    }
+    return result;
+}
+
+std::vector<double> ActivationStats::gram(const std::string& weight) const {
+    const Entry* entry = find(weight);
+    if (!entry) {
+        return {};
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (entry->rows == 0 || entry->gram.empty()) {
+        return {};
+    }
+    const size_t cols = entry->sum_squares.size();
+    const double scale = 1.0 / static_cast<double>(entry->rows);
+    std::vector<double> result(cols * cols);
+    for (size_t i = 0; i < cols; ++i) {
+        for (size_t j = 0; j <= i; ++j) {
+            result[i * cols + j] = result[j * cols + i] = entry->gram[i * (i + 1) / 2 + j] * scale;
+        }
+    }
+    return result;
+}
+
+uint64_t ActivationStats::rows(const std::string& weight) const {
+    const Entry* entry = find(weight);
+    if (!entry) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    return entry->rows;
+}
+
+std::vector<std::string> ActivationStats::weights() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> names;
+    names.reserve(entries_.size());
+    for (const auto& entry : entries_) {
+        // Sharing is declared before any input arrives
+        const Entry& holder = entry.second.source ? *entry.second.source : entry.second;
+        std::lock_guard<std::mutex> entry_lock(holder.mutex);
+        if (holder.rows > 0) {
+            names.push_back(entry.first);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+size_t collect_activation_stats(const Model& model, const std::string& text, ActivationStats& stats,
+                                size_t chunk_tokens, size_t max_chunks, size_t n_threads) {
+    if (chunk_tokens == 0 || chunk_tokens > model.config().max_seq_len) {
+        throw std::invalid_argument("Calibration chunks must hold 1 to " +
+                                    std::to_string(model.config().max_seq_len) + " tokens");
+    }
+
+    // Each chunk gets a fresh engine, so no prefix is served from the KV
+    // cache of the chunk before and every token's matmuls are recorded. The
+    // engines share a pool, so their KV buffers are allocated only once.
+    ScratchPool pool(std::numeric_limits<size_t>::max());
+    EngineConfig config;
+    config.n_threads = n_threads;
+    config.activation_stats = &stats;
+    config.scratch_pool = &pool;
+
+    // The token slices run as they are: decoding and re-encoding a chunk
+    // would split merges and special tokens at its edges
+    const TokenVector tokens = model.tokenizer()->encode(text);
+    size_t n_run = 0;
+    for (size_t begin = 0, chunk = 0; begin < tokens.size() && (max_chunks == 0 || chunk < max_chunks);
+         begin += chunk_tokens, ++chunk) {
+        const size_t end = std::min(begin + chunk_tokens, tokens.size());
+        Engine engine(model, config);
+        engine.get_logits(TokenVector(tokens.begin() + begin, tokens.begin() + end));
+        n_run += end - begin;
+    }
+    return n_run;
+}
+
+} // namespace embee
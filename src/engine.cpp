@@ -4,283 +4,1484 @@
  */
 
 #include "embee/engine.h"
+#include "embee/calibration.h"
 #include "embee/model.h"
 #include "embee/tokenizer.h"
+#include "embee/kernels.h"
+#include "embee/profiler.h"
+#include "embee/metrics.h"
+#include "embee/memory_planner.h"
+#include "embee/memory.h"
+#include "embee/tensor.h"
+#include "embee/graph.h"
+#include "embee/moe.h"
+#include <array>
 #include <vector>
 #include <string>
 #include <cmath>
 #include <random>
 #include <algorithm>
 #include <numeric>
+#include <stdexcept>
+#include <chrono>
+#include <iostream>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <fstream>
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace embee {
 
+namespace {
+
+// Tokens processed together during prefill; bounds the activation buffers
+constexpr size_t MAX_BATCH_TOKENS = 64;
+
+// Alignment of the activation arena and of every buffer in it
+constexpr size_t ARENA_ALIGNMENT = 64;
+
+// Steps of one forward pass, used to plan activation lifetimes. Every layer
+// repeats steps ATTN_NORM..FFN_RESIDUAL on the same buffers, so only the
+// residual stream lives across layers.
+enum ForwardStep : size_t {
+    STEP_EMBEDDING,
+    STEP_ATTN_NORM,
+    STEP_QKV,          // Projection, RoPE and KV store all work on the qkv buffer
+    STEP_ATTENTION,
+    STEP_ATTN_OUT,
+    STEP_ATTN_RESIDUAL,
+    STEP_FFN_NORM,
+    STEP_FFN_UP,
+    STEP_ACTIVATION,
+    STEP_FFN_DOWN,
+    STEP_FFN_RESIDUAL,
+    STEP_FINAL_NORM,
+    STEP_LM_HEAD,
+    STEP_SAMPLING
+};
+
+// What a forward pass leaves for the last token: its logits, or only the
+// normed hidden state when sampling runs the LM head itself
+enum class ForwardOutput {
+    LOGITS,
+    HIDDEN
+};
+
+struct AlignedFree {
+    void operator()(uint8_t* p) const {
+        aligned_free(p);
+    }
+};
+
+constexpr size_t GRAPH_BUFFERS = static_cast<size_t>(BufferId::COUNT);
+
+// Begins a profiled request on construction and ends it on destruction
+class RequestScope {
+public:
+    explicit RequestScope(Profiler* profiler) : profiler_(profiler) {
+        if (profiler_) {
+            profiler_->begin_request();
+        }
+    }
+    ~RequestScope() {
+        if (profiler_) {
+            profiler_->end_request();
+        }
+    }
+
+private:
+    Profiler* profiler_;
+};
+
+// Series an engine records into a MetricsRegistry (see docs/architecture.md)
+struct EngineMetrics {
+    explicit EngineMetrics(MetricsRegistry& registry)
+        : requests(registry.counter("embee_requests_total", "Completed generate, get_logits and score calls")),
+          prompt_tokens(registry.counter("embee_prompt_tokens_total", "Prompt tokens received")),
+          prefill_tokens(registry.counter("embee_prefill_tokens_total",
+                                          "Prompt tokens run through the model (excludes reused prefixes)")),
+          generated_tokens(registry.counter("embee_generated_tokens_total", "Tokens generated")),
+          prefix_lookup_tokens(registry.counter("embee_prefix_cache_lookup_tokens_total",
+                                                "Prompt tokens eligible for KV prefix reuse")),
+          prefix_hit_tokens(registry.counter("embee_prefix_cache_hit_tokens_total",
+                                             "Prompt tokens served from the KV cache")),
+          draft_tokens(registry.counter("embee_draft_tokens_total", "Tokens proposed by self-drafting")),
+          draft_accepted_tokens(registry.counter("embee_draft_accepted_tokens_total",
+                                                 "Drafted tokens kept after verification")),
+          queue_depth(registry.gauge("embee_queue_depth", "Requests currently inside the engine")),
+          kv_cache_tokens(registry.gauge("embee_kv_cache_tokens", "Positions held in KV caches")),
+          kv_cache_capacity(registry.gauge("embee_kv_cache_capacity_tokens", "Positions allocated in KV caches")),
+          ttft(registry.histogram("embee_time_to_first_token_seconds",
+                                  "Time from request start to the first generated token")),
+          inter_token(registry.histogram("embee_inter_token_latency_seconds",
+                                         "Time between consecutive generated tokens")),
+          request_duration(registry.histogram("embee_request_duration_seconds", "Duration of a request")) {}
+
+    Counter& requests;
+    Counter& prompt_tokens;
+    Counter& prefill_tokens;
+    Counter& generated_tokens;
+    Counter& prefix_lookup_tokens;
+    Counter& prefix_hit_tokens;
+    Counter& draft_tokens;
+    Counter& draft_accepted_tokens;
+    Gauge& queue_depth;
+    Gauge& kv_cache_tokens;
+    Gauge& kv_cache_capacity;
+    Histogram& ttft;
+    Histogram& inter_token;
+    Histogram& request_duration;
+};
+
+// Tracks one request in the metrics: queue depth while inside, count and duration at the end
+class RequestMetrics {
+public:
+    explicit RequestMetrics(EngineMetrics* metrics)
+        : metrics_(metrics), start_(std::chrono::steady_clock::now()) {
+        if (metrics_) {
+            metrics_->queue_depth.add(1.0);
+        }
+    }
+    ~RequestMetrics() {
+        if (metrics_) {
+            metrics_->queue_depth.add(-1.0);
+            metrics_->requests.inc();
+            metrics_->request_duration.observe(seconds_since_start());
+        }
+    }
+
+    double seconds_since_start() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    EngineMetrics* metrics_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace
+
 // Implementation details for the Engine class
 class Engine::Impl {
 public:
-    explicit Impl(const Model& model) : model_(model) {
-        // Initialize any necessary resources
+    Impl(const Model& model, const EngineConfig& engine_config)
+        : model_(model), engine_config_(engine_config) {
         const auto& config = model_.config();
-        
-        // Set up memory for activations, KV cache, etc.
-        // This is simplified for now
+
         head_size_ = config.n_embd / config.n_heads;
-        kv_cache_initialized_ = false;
+        pool_ = engine_config_.scratch_pool;
+        if (!pool_) {
+            own_pool_ = std::make_unique<ScratchPool>(0);
+            pool_ = own_pool_.get();
+        }
+        bind_weights();
+        share_calibration_inputs();
+        graph_ = compile_graph(config, weights_, engine_config_.fuse_graph);
+        kernels_ = kernels::select_kernels(head_size_, config.quant_block_size);
+        if (config.use_alibi) {
+            alibi_slopes_ = kernels::alibi_slopes(config.n_heads, config.alibi_max_bias);
+        }
+        plan_activations();
+        init_branch_threads();
+        update_peak_memory(memory_usage());
+
+        if (engine_config_.metrics) {
+            metrics_ = std::make_unique<EngineMetrics>(*engine_config_.metrics);
+        }
+
+#if EMBEE_PROFILER_ENABLED
+        if (engine_config_.enable_profiling) {
+            profiler_ = std::make_unique<Profiler>();
+            if (engine_config_.enable_hardware_counters &&
+                !profiler_->enable_hardware_counters(engine_config_.n_threads)) {
+                std::cerr << "Hardware counters disabled: " << profiler_->hardware_counter_status() << std::endl;
+            }
+        }
+#endif
     }
-    
+
+    ~Impl() {
+        // Gauges may be shared with other engines; withdraw this engine's share
+        if (metrics_) {
+            metrics_->kv_cache_tokens.add(-static_cast<double>(reported_cached_));
+            metrics_->kv_cache_capacity.add(-static_cast<double>(kv_capacity_));
+        }
+    }
+
     std::string generate(const std::string& prompt, const GenerationConfig& config) {
         std::string result = prompt;
-        
+
         auto callback = [&result](TokenId token_id, const std::string& text) {
             result += text;
             return true;
         };
-        
+
         generate_with_callback(prompt, callback, config);
         return result;
     }
-    
-    void generate_with_callback(const std::string& prompt, TokenCallback callback, 
+
+    MemoryStats memory_usage() const {
+        MemoryStats stats = model_.memory_usage();
+        add_engine_memory(stats);
+        return stats;
+    }
+
+    MemoryStats peak_memory_usage() {
+        update_peak_memory(memory_usage());
+        return peak_memory_;
+    }
+
+    void reset_peak_memory_usage() {
+        peak_memory_ = MemoryStats();
+        update_peak_memory(memory_usage());
+    }
+
+    void generate_with_callback(const std::string& prompt, TokenCallback callback,
                               const GenerationConfig& config) {
+        RequestScope request(profiler_.get());
+        RequestMetrics request_metrics(metrics_.get());
+        MemorySample memory_sample{*this};
+        const size_t max_seq_len = model_.config().max_seq_len;
+
         // Tokenize the prompt
-        TokenVector tokens = model_.tokenizer()->encode(prompt);
-        
-        // Initialize or reset KV cache if needed
-        if (!kv_cache_initialized_ || !config.use_cache) {
-            initialize_kv_cache(config.max_length);
-        }
-        
+        TokenVector tokens = encode_prompt(prompt);
+
+        // Make room for the prompt and everything we may generate
+        reserve_kv_cache(std::min(max_seq_len, tokens.size() + config.max_length));
+
         // Initialize random generator for sampling
         std::random_device rd;
         std::mt19937 gen(rd());
-        
+
+        // Greedy and top-k decoding only need the best few logits; the LM
+        // head then runs in sampling, fused with the top-k selection
+        const size_t candidates = config.top_p < 1e-6f ? 1 : config.top_k;
+        const ForwardOutput output = candidates > 0 ? ForwardOutput::HIDDEN : ForwardOutput::LOGITS;
+
+        // Self-drafting proposes tokens with the first layers only; they are
+        // kept while the full model agrees, so the output is the greedy one
+        const bool drafting = config.draft_layers > 0;
+        if (drafting) {
+            if (config.draft_layers >= model_.config().n_layers) {
+                throw std::invalid_argument("Draft layers must be fewer than the model's " +
+                                            std::to_string(model_.config().n_layers));
+            }
+            if (candidates != 1 || !config.use_cache) {
+                throw std::invalid_argument("Self-drafting requires greedy decoding with the KV cache");
+            }
+        }
+        TokenVector verified;   // Tokens verified ahead of the output; all but the last are cached
+        size_t n_emitted = 0;
+
         // Process the prompt (forward pass without generation)
-        process_tokens(tokens);
-        
+        process_prompt(tokens, config.use_cache, output);
+
         // Generation loop
         size_t generated_count = 0;
         TokenId next_token = 0;
-        
-        while (generated_count < config.max_length) {
-            // Get logits for the next token
-            auto logits = get_next_token_logits();
-            
-            // Apply temperature
-            if (config.temperature > 0) {
-                for (auto& logit : logits) {
-                    logit /= config.temperature;
+        double last_token_time = 0.0;
+
+        while (generated_count < config.max_length && tokens.size() < max_seq_len) {
+            if (n_emitted < verified.size()) {
+                next_token = verified[n_emitted++];
+            } else if (candidates > 0) {
+                next_token = sample_candidates(tokens, candidates, config, gen);
+            } else {
+                EMBEE_PROFILE(profiler_.get(), ProfileOp::SAMPLING, -1);
+
+                // Get logits for the next token (one per LM head row)
+                const float* logits = buffer(BufferId::LOGITS);
+                std::copy(logits, logits + n_out_, sample_logits_);
+
+                // Apply temperature
+                if (config.temperature > 0) {
+                    for (size_t i = 0; i < n_out_; ++i) {
+                        sample_logits_[i] /= config.temperature;
+                    }
                 }
+
+                // Apply repetition penalty
+                if (config.repetition_penalty != 1.0f) {
+                    apply_repetition_penalty(sample_logits_, tokens, config.repetition_penalty);
+                }
+
+                // Sample next token (using top-p sampling)
+                next_token = output_token(kernels::sample_top_p(sample_logits_, n_out_, config.top_p,
+                                                                gen, sampling_scratch_));
             }
-            
-            // Apply repetition penalty
-            if (config.repetition_penalty != 1.0f) {
-                apply_repetition_penalty(logits, tokens, config.repetition_penalty);
-            }
-            
-            // Sample next token (using top-p sampling)
-            next_token = sample_token(logits, config.top_p, gen);
-            
+
             // Check for EOS token
             auto eos_token = model_.tokenizer()->eos_token();
-            if (eos_token && next_token == eos_token.value()) {
+            if (!config.ignore_eos && eos_token && next_token == eos_token.value()) {
                 break;
             }
-            
+
             // Add token to the sequence
             tokens.push_back(next_token);
-            
-            // Process the new token (forward pass for single token)
-            process_single_token(next_token, tokens.size() - 1);
-            
+
             // Decode the token to text
-            std::string token_text = model_.tokenizer()->decode({next_token});
-            
-            // Call the callback with the generated token
+            std::string token_text;
+            {
+                EMBEE_PROFILE(profiler_.get(), ProfileOp::DETOKENIZE, -1);
+                token_text = model_.tokenizer()->decode({next_token});
+            }
+
+            if (metrics_) {
+                const double now = request_metrics.seconds_since_start();
+                if (generated_count == 0) {
+                    metrics_->ttft.observe(now);
+                } else {
+                    metrics_->inter_token.observe(now - last_token_time);
+                }
+                last_token_time = now;
+                metrics_->generated_tokens.inc();
+            }
+
+            // Hand the token out before its forward pass so it is not delayed by it
             if (!callback(next_token, token_text)) {
                 break;
             }
-            
+
             generated_count++;
+            if (generated_count == config.max_length || tokens.size() == max_seq_len) {
+                break;
+            }
+
+            // Process the new token (forward pass for single token)
+            if (n_emitted < verified.size()) {
+                continue;   // Already in the KV cache
+            }
+            if (drafting) {
+                verified = draft_and_verify(tokens, config.max_length - generated_count, config, gen);
+                n_emitted = 0;
+            }
+            if (verified.empty()) {
+                if (config.use_cache) {
+                    process_single_token(next_token, tokens.size() - 1, output);
+                } else {
+                    process_tokens(tokens, output);
+                }
+            }
         }
     }
-    
+
     std::vector<float> get_logits(const std::string& prompt) {
+        RequestScope request(profiler_.get());
+        RequestMetrics request_metrics(metrics_.get());
+        MemorySample memory_sample{*this};
+
         // Tokenize the prompt
-        TokenVector tokens = model_.tokenizer()->encode(prompt);
-        
+        return last_logits(encode_prompt(prompt));
+    }
+
+    std::vector<float> get_logits(const TokenVector& tokens) {
+        if (tokens.empty()) {
+            throw std::invalid_argument("get_logits needs at least one token");
+        }
+        if (tokens.size() > model_.config().max_seq_len) {
+            throw std::length_error("Sequence of " + std::to_string(tokens.size()) +
+                                    " tokens exceeds the maximum sequence length");
+        }
+        check_vocabulary(tokens);
+        RequestScope request(profiler_.get());
+        RequestMetrics request_metrics(metrics_.get());
+        MemorySample memory_sample{*this};
+        return last_logits(tokens);
+    }
+
+    std::vector<float> score(const TokenVector& tokens, const ScoringConfig& config) {
+        const auto [window, stride] = scoring_window(config);
+        check_vocabulary(tokens);
+        RequestScope request(profiler_.get());
+        RequestMetrics request_metrics(metrics_.get());
+        MemorySample memory_sample{*this};
+        return score_sequence(tokens, window, stride, nullptr, nullptr);
+    }
+
+    std::vector<std::vector<float>> score_batch(const std::vector<TokenVector>& sequences,
+                                                const ScoringConfig& config) {
+        const auto [window, stride] = scoring_window(config);
+        for (const TokenVector& tokens : sequences) {
+            check_vocabulary(tokens);
+        }
+        RequestScope request(profiler_.get());
+        RequestMetrics request_metrics(metrics_.get());
+        MemorySample memory_sample{*this};
+        std::vector<std::vector<float>> result;
+        result.reserve(sequences.size());
+        for (size_t i = 0; i < sequences.size(); ++i) {
+            result.push_back(score_sequence(sequences[i], window, stride, i > 0 ? &sequences[i - 1] : nullptr,
+                                            i > 0 ? &result[i - 1] : nullptr));
+        }
+        return result;
+    }
+
+    Profiler* profiler() const {
+        return profiler_.get();
+    }
+
+private:
+    // Logits of the last of a sequence's tokens, over the whole vocabulary
+    std::vector<float> last_logits(const TokenVector& tokens) {
+        reserve_kv_cache(tokens.size());
+
         // Process all tokens
-        process_tokens(tokens);
-        
+        process_prompt(tokens, true);
+
         // Return final token logits
-        return last_logits_;
+        const float* logits = buffer(BufferId::LOGITS);
+        if (shortlist_.empty()) {
+            return std::vector<float>(logits, logits + n_out_);
+        }
+        std::vector<float> result(model_.config().n_vocab, -std::numeric_limits<float>::infinity());
+        for (size_t row = 0; row < n_out_; ++row) {
+            result[shortlist_[row]] = logits[row];
+        }
+        return result;
     }
-    
-private:
+
+    void check_vocabulary(const TokenVector& tokens) const {
+        for (TokenId token : tokens) {
+            if (token < 0 || static_cast<size_t>(token) >= model_.config().n_vocab) {
+                throw std::invalid_argument("Token ID " + std::to_string(token) + " is outside the vocabulary");
+            }
+        }
+    }
+
+    // Window and stride of a scoring request, defaults resolved
+    std::pair<size_t, size_t> scoring_window(const ScoringConfig& config) const {
+        const size_t max_seq_len = model_.config().max_seq_len;
+        const size_t window = config.window > 0 ? config.window : max_seq_len;
+        if (window < 2 || window > max_seq_len) {
+            throw std::invalid_argument("Scoring window must hold 2 to " + std::to_string(max_seq_len) + " tokens");
+        }
+        const size_t stride = config.stride > 0 ? config.stride : window / 2;
+        if (stride >= window) {
+            throw std::invalid_argument("Scoring stride must be less than the window");
+        }
+        return {window, stride};
+    }
+
+    // Log-probabilities of a sequence's tokens after the first. A sequence
+    // that fits the window shares the KV cache and the scores of its common
+    // prefix with the previous one, when given; longer sequences slide the
+    // window from position 0 on, each step a fresh prefill that scores only
+    // the tokens the previous window did not reach.
+    std::vector<float> score_sequence(const TokenVector& tokens, size_t window, size_t stride,
+                                      const TokenVector* previous, const std::vector<float>* previous_scores) {
+        const size_t n = tokens.size();
+        std::vector<float> scores(n > 1 ? n - 1 : 0);
+        if (metrics_) {
+            metrics_->prompt_tokens.inc(n);
+        }
+        if (n < 2) {
+            return scores;
+        }
+        if (n <= window) {
+            // Positions before start keep their cached keys and values; the
+            // last shared one is rerun since its hidden state scores tokens[start + 1]
+            size_t start = 0;
+            if (previous && previous->size() <= window && cached_tokens_ == *previous) {
+                const size_t limit = std::min(previous->size(), n);
+                while (start < limit && (*previous)[start] == tokens[start]) {
+                    ++start;
+                }
+                start = start > 0 ? start - 1 : 0;
+                std::copy(previous_scores->begin(), previous_scores->begin() + start, scores.begin());
+                if (metrics_) {
+                    metrics_->prefix_lookup_tokens.inc(n);
+                    metrics_->prefix_hit_tokens.inc(start);
+                }
+            }
+            forward_scores(tokens.data(), n, start, start, scores.data());
+            return scores;
+        }
+        for (size_t begin = 0, scored = 0;; begin += stride) {
+            const size_t end = std::min(begin + window, n);
+            forward_scores(tokens.data() + begin, end - begin, 0, scored - begin, scores.data() + begin);
+            scored = end - 1;
+            if (end == n) {
+                break;
+            }
+        }
+        return scores;
+    }
+
+    // Run tokens [start, n) at positions [start, n) on top of the cached
+    // positions before start, and write log p(tokens[i + 1] | tokens[0..i])
+    // to scores[i] for i in [first, n - 1). The LM head runs on each batch's
+    // scored rows together.
+    void forward_scores(const TokenId* tokens, size_t n, size_t start, size_t first, float* scores) {
+        reserve_kv_cache(n);
+        set_cached_tokens(std::min(cached_tokens_.size(), start));
+        if (metrics_) {
+            metrics_->prefill_tokens.inc(n - start);
+        }
+        for (size_t done = start; done < n; done += MAX_BATCH_TOKENS) {
+            const size_t m = std::min(MAX_BATCH_TOKENS, n - done);
+            run_program(0, graph_.logits_begin, tokens + done, m, done);
+            const size_t lo = std::max(done, first);
+            const size_t hi = std::min(done + m, n - 1);
+            if (lo < hi) {
+                score_rows(buffer(BufferId::RESIDUAL) + (lo - done) * model_.config().n_embd, tokens + lo + 1,
+                           hi - lo, scores + lo);
+            }
+        }
+        cached_tokens_.insert(cached_tokens_.end(), tokens + start, tokens + n);
+        set_cached_tokens(cached_tokens_.size());
+        sample_engine_memory();
+    }
+
+    // Final norm, LM head and log-softmax of rows hidden states; scores[i]
+    // receives the log-probability of targets[i] after row i
+    void score_rows(const float* hidden, const TokenId* targets, size_t rows, float* scores) {
+        const size_t n_embd = model_.config().n_embd;
+        score_hidden_.resize(MAX_BATCH_TOKENS * n_embd);
+        score_logits_.resize(MAX_BATCH_TOKENS * n_out_);
+        const Instruction& norm = graph_.program[graph_.logits_begin];
+        {
+            EMBEE_PROFILE(profiler_.get(), norm.profile_op, norm.layer);
+            for (size_t i = 0; i < rows; ++i) {
+                normalize(norm, hidden + i * n_embd, score_hidden_.data() + i * n_embd, n_embd);
+            }
+        }
+        {
+            EMBEE_PROFILE(profiler_.get(), ProfileOp::LM_HEAD, -1);
+            multiply(*weights_.lm_head, score_hidden_.data(), score_logits_.data(), rows, kernels::MatmulEpilogue(),
+                     engine_config_.n_threads);
+        }
+        EMBEE_PROFILE(profiler_.get(), ProfileOp::SAMPLING, -1);
+        for (size_t i = 0; i < rows; ++i) {
+            const float* logits = score_logits_.data() + i * n_out_;
+            const int32_t row = output_row(targets[i]);
+            if (row < 0) {
+                scores[i] = -std::numeric_limits<float>::infinity();
+                continue;
+            }
+            const float max_logit = *std::max_element(logits, logits + n_out_);
+            double sum = 0.0;
+            for (size_t j = 0; j < n_out_; ++j) {
+                sum += std::exp(static_cast<double>(logits[j]) - max_logit);
+            }
+            scores[i] = static_cast<float>(logits[row] - max_logit - std::log(sum));
+        }
+    }
+
+    // An activation buffer of the graph
+    struct BufferSlot {
+        float* data = nullptr;   // Null when the graph does not use the buffer
+        size_t width = 0;        // Floats per row
+        size_t rows = 0;         // Rows held (MAX_BATCH_TOKENS, or 1 for last-token buffers)
+    };
+
     const Model& model_;
-    bool kv_cache_initialized_;
+    EngineConfig engine_config_;
     size_t head_size_;
-    
+    size_t qkv_dim_ = 0;
+    size_t n_ff_ = 0;
+
+    // Weights, bound once by name, and the forward pass compiled from them
+    GraphWeights weights_;
+    Graph graph_;
+    kernels::KernelSet kernels_;   // Specialized for head_size_ and the quantization block size
+
+    // Threads of the attention and feed-forward branches of parallel blocks;
+    // zero when the branches run one after the other
+    size_t attention_threads_ = 0;
+    size_t ffn_threads_ = 0;
+
+    std::vector<float> alibi_slopes_;   // Per-head ALiBi slopes; empty without ALiBi
+
+    // Vocabulary shortlist: the LM head computes n_out_ logits, one per row.
+    // Without a shortlist row i is token i; with one, the rows are copied
+    // into shortlist_head_ in token order.
+    size_t n_out_ = 0;
+    Tensor shortlist_head_;
+    TokenVector shortlist_;                // Token of each row; empty without a shortlist
+    std::vector<int32_t> shortlist_row_;   // Row of each token, -1 outside the shortlist
+
     // State variables
-    std::vector<float> last_logits_;
-    
-    // KV Cache - simplified for now
-    // In a real implementation, this would be a more efficient data structure
-    std::vector<std::vector<float>> key_cache_;
-    std::vector<std::vector<float>> value_cache_;
-    
-    // Initialize the KV cache to the appropriate size
-    void initialize_kv_cache(size_t max_seq_len) {
+    kernels::SamplingScratch sampling_scratch_;
+    std::unique_ptr<Profiler> profiler_;
+
+    // Activation arena; the graph buffers and the buffers below point into
+    // it at offsets chosen by plan_activations()
+    std::unique_ptr<uint8_t, AlignedFree> arena_;
+    size_t arena_size_ = 0;
+    std::array<BufferSlot, GRAPH_BUFFERS> buffers_;
+    float* scores_ = nullptr;          // Attention scores (n_heads x context)
+    float* sample_logits_ = nullptr;   // Logits adjusted for sampling
+
+    // Scoring: normed hidden states and logits of a batch's scored rows,
+    // allocated on the first score() call
+    std::vector<float> score_hidden_;
+    std::vector<float> score_logits_;
+
+    std::vector<uint8_t> penalized_;   // Flags of tokens under repetition penalty (fused LM head)
+
+    // Mixture of experts: the batch's routing and one expert's gathered rows
+    ExpertRouting routing_;
+    float* expert_in_ = nullptr;       // Rows routed to the current expert (n_embd)
+    float* expert_ff_ = nullptr;       // Its hidden state (n_ff)
+    float* expert_gate_ = nullptr;     // Gate branch of gated experts (n_ff)
+    float* expert_out_ = nullptr;      // Its output before weighting (n_embd)
+
+    // KV cache: one pooled block holding, per layer, a [capacity x kv_dim]
+    // key buffer followed by the value buffer
+    std::unique_ptr<ScratchPool> own_pool_;   // Used when EngineConfig has no pool
+    ScratchPool* pool_ = nullptr;
+    ScratchPool::Block kv_block_;
+    size_t kv_capacity_ = 0;
+    TokenVector cached_tokens_;    // Tokens whose keys and values are in the cache
+    size_t reported_cached_ = 0;   // Cache occupancy last added to the metrics gauge
+
+    std::unique_ptr<EngineMetrics> metrics_;
+
+    // High-water mark of each memory category
+    MemoryStats peak_memory_;
+
+    // Fill in the engine-owned categories of stats
+    void add_engine_memory(MemoryStats& stats) const {
+        const size_t kv_bytes_per_position =
+            2 * model_.config().n_layers * model_.config().n_kv_heads * head_size_ * sizeof(float);
+        stats.kv_cache_used = cached_tokens_.size() * kv_bytes_per_position;
+        stats.kv_cache_reserved = std::max(kv_block_.size(), kv_capacity_ * kv_bytes_per_position);
+        stats.activations = arena_size_ + (score_hidden_.capacity() + score_logits_.capacity()) * sizeof(float);
+        stats.weights_heap += shortlist_head_.data.size();
+        stats.weights_resident += shortlist_head_.data.size();
+        stats.sampler_scratch = sampling_scratch_.probs.capacity() * sizeof(float) +
+                                sampling_scratch_.indices.capacity() * sizeof(int32_t) +
+                                sampling_scratch_.candidates.capacity() * sizeof(std::pair<float, TokenId>) +
+                                penalized_.capacity();
+    }
+
+    void update_peak_memory(const MemoryStats& stats) {
+        MemoryStats& peak = peak_memory_;
+        peak.weights_mapped = std::max(peak.weights_mapped, stats.weights_mapped);
+        peak.weights_resident = std::max(peak.weights_resident, stats.weights_resident);
+        peak.weights_heap = std::max(peak.weights_heap, stats.weights_heap);
+        peak.kv_cache_used = std::max(peak.kv_cache_used, stats.kv_cache_used);
+        peak.kv_cache_reserved = std::max(peak.kv_cache_reserved, stats.kv_cache_reserved);
+        peak.activations = std::max(peak.activations, stats.activations);
+        peak.tokenizer = std::max(peak.tokenizer, stats.tokenizer);
+        peak.sampler_scratch = std::max(peak.sampler_scratch, stats.sampler_scratch);
+    }
+
+    // Sample the engine buffers only; counting resident weights walks the
+    // whole mapping, so they are sampled when the peak is queried
+    void sample_engine_memory() {
+        MemoryStats stats;
+        add_engine_memory(stats);
+        update_peak_memory(stats);
+    }
+
+    // Ends a request: samples the engine buffers, including sampler scratch
+    // grown after the last forward pass
+    struct MemorySample {
+        Impl& impl;
+        ~MemorySample() { impl.sample_engine_memory(); }
+    };
+
+    const Tensor* find_weight(const std::string& name) const {
+        return model_.has_tensor(name) ? &model_.get_tensor(name) : nullptr;
+    }
+
+    const Tensor* require_weight(const std::string& name) const {
+        const Tensor* tensor = find_weight(name);
+        if (!tensor) {
+            throw std::runtime_error("Model is missing required tensor: " + name);
+        }
+        return tensor;
+    }
+
+    // Norm weights and biases are applied as plain float arrays
+    static const float* fp32_data(const Tensor* tensor) {
+        return tensor ? fp32_view(*tensor).data() : nullptr;
+    }
+
+    static void check_vector(const Tensor* tensor, size_t n) {
+        if (tensor && (tensor->data_type != DataType::FP32 || tensor->byte_size() != n * sizeof(float))) {
+            throw std::runtime_error("Tensor " + tensor->name + " must be FP32 with " +
+                                     std::to_string(n) + " elements");
+        }
+    }
+
+    static void check_matrix(const Tensor* tensor, size_t rows, size_t cols) {
+        if (tensor && (tensor->shape.size() != 2 || tensor->shape[0] != rows || tensor->shape[1] != cols)) {
+            throw std::runtime_error("Tensor " + tensor->name + " must have shape {" +
+                                     std::to_string(rows) + ", " + std::to_string(cols) + "}");
+        }
+    }
+
+    // Look up every tensor the forward pass needs (names in docs/model_format.md)
+    void bind_weights() {
         const auto& config = model_.config();
-        
-        // Allocate memory for KV cache
-        // This is a simplified version - real implementation would be more memory-efficient
-        key_cache_.resize(config.n_layers);
-        value_cache_.resize(config.n_layers);
-        
-        size_t kv_dim = config.n_kv_heads * head_size_;
-        
+        const size_t n_embd = config.n_embd;
+        qkv_dim_ = (config.n_heads + 2 * config.n_kv_heads) * head_size_;
+
+        weights_.token_embedding = require_weight("transformer.wte.weight");
+        check_matrix(weights_.token_embedding, config.n_vocab, n_embd);
+        if (config.is_rope && config.use_alibi) {
+            throw std::runtime_error("Model config enables both RoPE and ALiBi");
+        }
+        const bool relative_positions = config.is_rope || config.use_alibi;
+        weights_.position_embedding = relative_positions ? nullptr : find_weight("transformer.wpe.weight");
+        check_matrix(weights_.position_embedding, config.max_seq_len, n_embd);
+        weights_.final_norm = require_weight("transformer.ln_f.weight");
+        weights_.final_norm_bias = find_weight("transformer.ln_f.bias");
+        check_vector(weights_.final_norm, n_embd);
+        check_vector(weights_.final_norm_bias, n_embd);
+
+        // Tied embeddings reuse the token embedding as the output projection
+        weights_.lm_head = find_weight("lm_head.weight");
+        if (!weights_.lm_head) {
+            weights_.lm_head = weights_.token_embedding;
+        }
+        check_matrix(weights_.lm_head, config.n_vocab, n_embd);
+        n_out_ = config.n_vocab;
+        if (!engine_config_.vocabulary_shortlist.empty()) {
+            bind_shortlist();
+        }
+
+        const bool parallel = architecture_traits(config.architecture).topology == BlockTopology::PARALLEL;
+        weights_.layers.resize(config.n_layers);
         for (size_t i = 0; i < config.n_layers; ++i) {
-            key_cache_[i].resize(max_seq_len * kv_dim);
-            value_cache_[i].resize(max_seq_len * kv_dim);
+            const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+            BlockWeights& w = weights_.layers[i];
+            w.attn_norm = require_weight(prefix + "ln_1.weight");
+            w.attn_norm_bias = find_weight(prefix + "ln_1.bias");
+            w.qkv = require_weight(prefix + "attn.c_attn.weight");
+            w.qkv_bias = find_weight(prefix + "attn.c_attn.bias");
+            w.attn_out = require_weight(prefix + "attn.c_proj.weight");
+            w.attn_out_bias = find_weight(prefix + "attn.c_proj.bias");
+            // Parallel blocks may share the attention norm. So do Phi-2 blocks,
+            // which compile_graph() rejects with a clearer error.
+            const bool shared_norm = parallel || config.architecture == ModelArchitecture::PHI;
+            w.ffn_norm = shared_norm ? find_weight(prefix + "ln_2.weight") : require_weight(prefix + "ln_2.weight");
+            w.ffn_norm_bias = find_weight(prefix + "ln_2.bias");
+            if (config.n_experts > 0) {
+                bind_experts(prefix, w);
+            } else {
+                w.ffn_up = require_weight(prefix + "mlp.c_fc.weight");
+                w.ffn_up_bias = find_weight(prefix + "mlp.c_fc.bias");
+                w.ffn_gate = find_weight(prefix + "mlp.c_gate.weight");
+                w.ffn_down = require_weight(prefix + "mlp.c_proj.weight");
+                w.ffn_down_bias = find_weight(prefix + "mlp.c_proj.bias");
+            }
+
+            if (i == 0) {
+                const Tensor* up = w.ffn_up ? w.ffn_up : w.experts[0].up;
+                n_ff_ = up->shape.empty() ? 0 : up->shape[0];
+            }
+            check_vector(w.attn_norm, n_embd);
+            check_vector(w.attn_norm_bias, n_embd);
+            check_matrix(w.qkv, qkv_dim_, n_embd);
+            check_vector(w.qkv_bias, qkv_dim_);
+            check_matrix(w.attn_out, n_embd, n_embd);
+            check_vector(w.attn_out_bias, n_embd);
+            check_vector(w.ffn_norm, n_embd);
+            check_vector(w.ffn_norm_bias, n_embd);
+            check_matrix(w.ffn_up, n_ff_, n_embd);
+            check_vector(w.ffn_up_bias, n_ff_);
+            check_matrix(w.ffn_gate, n_ff_, n_embd);
+            check_matrix(w.ffn_down, n_embd, n_ff_);
+            check_vector(w.ffn_down_bias, n_embd);
+            check_matrix(w.ffn_router, config.n_experts, n_embd);
+            for (const ExpertWeights& expert : w.experts) {
+                check_matrix(expert.up, n_ff_, n_embd);
+                check_matrix(expert.gate, n_ff_, n_embd);
+                check_matrix(expert.down, n_embd, n_ff_);
+            }
+            if (config.activation_function == ActivationFunction::SWIGLU && w.experts.empty() && !w.ffn_gate) {
+                throw std::runtime_error("SwiGLU model is missing " + prefix + "mlp.c_gate.weight");
+            }
         }
-        
-        kv_cache_initialized_ = true;
     }
-    
-    // Process all tokens in the sequence
-    void process_tokens(const TokenVector& tokens) {
-        // This is a placeholder implementation
-        // In a real system, we would run the full transformer forward pass
-        
-        // For now, just generate random logits as a dummy implementation
+
+    // Weights that multiply the same activations record them once, so
+    // calibration keeps one Gram matrix per input rather than per weight
+    void share_calibration_inputs() {
+        ActivationStats* stats = engine_config_.activation_stats;
+        if (!stats) {
+            return;
+        }
+        auto share = [stats](const Tensor* weight, const Tensor* with) {
+            if (weight && with) {
+                stats->share_input(weight->name, with->name);
+            }
+        };
+        const bool parallel =
+            architecture_traits(model_.config().architecture).topology == BlockTopology::PARALLEL;
+        for (const BlockWeights& w : weights_.layers) {
+            // Without ln_2 a parallel block's feed-forward reads the attention input
+            const Tensor* ffn_in = parallel && !w.ffn_norm ? w.qkv : w.ffn_router ? w.ffn_router : w.ffn_up;
+            share(w.ffn_router, ffn_in);
+            share(w.ffn_up, ffn_in);
+            share(w.ffn_gate, ffn_in);
+            // Each expert sees only its routed tokens
+            for (const ExpertWeights& expert : w.experts) {
+                share(expert.gate, expert.up);
+            }
+        }
+    }
+
+    // Copy the shortlisted rows of the LM head into a matrix of their own,
+    // so that the head streams only those rows. EOS always stays scorable.
+    void bind_shortlist() {
         const auto& config = model_.config();
-        last_logits_.resize(config.n_vocab);
-        
-        // Fill with random values (just for demo)
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::normal_distribution<float> dist(0.0f, 1.0f);
-        
-        for (auto& logit : last_logits_) {
-            logit = dist(gen);
+        TokenVector tokens = engine_config_.vocabulary_shortlist;
+        if (auto eos = model_.tokenizer()->eos_token()) {
+            tokens.push_back(eos.value());
+        }
+        for (TokenId token : tokens) {
+            if (token < 0 || static_cast<size_t>(token) >= config.n_vocab) {
+                throw std::out_of_range("Shortlisted token ID out of range: " + std::to_string(token));
+            }
+        }
+        std::sort(tokens.begin(), tokens.end());
+        tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+        const WeightView head = weight_view(*weights_.lm_head, config.quant_block_size);
+        const size_t stride = head.row_stride();
+        shortlist_head_.name = weights_.lm_head->name + "[shortlist]";
+        shortlist_head_.data_type = head.type();
+        shortlist_head_.shape = {tokens.size(), head.cols()};
+        shortlist_head_.data.resize(tokens.size() * stride);
+        shortlist_row_.assign(config.n_vocab, -1);
+        for (size_t row = 0; row < tokens.size(); ++row) {
+            std::memcpy(shortlist_head_.data.data() + row * stride, head.row(tokens[row]), stride);
+            shortlist_row_[tokens[row]] = static_cast<int32_t>(row);
+        }
+        shortlist_ = std::move(tokens);
+        weights_.lm_head = &shortlist_head_;
+        n_out_ = shortlist_.size();
+    }
+
+    TokenId output_token(size_t row) const {
+        return shortlist_.empty() ? static_cast<TokenId>(row) : shortlist_[row];
+    }
+
+    // LM head row of a token, or -1 if the head does not score it
+    int32_t output_row(TokenId token) const {
+        if (token < 0 || static_cast<size_t>(token) >= model_.config().n_vocab) {
+            return -1;
+        }
+        return shortlist_.empty() ? token : shortlist_row_[token];
+    }
+
+    // Router and experts of a mixture-of-experts block. Only tensor metadata
+    // is touched here: expert weights are first read when a token is routed
+    // to them, so experts no prompt selects stay unfaulted in a mapped file.
+    void bind_experts(const std::string& prefix, BlockWeights& w) const {
+        const auto& config = model_.config();
+        if (config.n_experts_used == 0 || config.n_experts_used > config.n_experts) {
+            throw std::runtime_error("Model routes to " + std::to_string(config.n_experts_used) + " of " +
+                                     std::to_string(config.n_experts) + " experts");
+        }
+        w.ffn_router = require_weight(prefix + "mlp.router.weight");
+        w.experts.resize(config.n_experts);
+        for (size_t e = 0; e < config.n_experts; ++e) {
+            const std::string expert = prefix + "mlp.experts." + std::to_string(e) + ".";
+            ExpertWeights& ew = w.experts[e];
+            ew.up = require_weight(expert + "c_fc.weight");
+            ew.gate = find_weight(expert + "c_gate.weight");
+            ew.down = require_weight(expert + "c_proj.weight");
+            if (config.activation_function == ActivationFunction::SWIGLU && !ew.gate) {
+                throw std::runtime_error("SwiGLU model is missing " + expert + "c_gate.weight");
+            }
         }
     }
-    
+
+    // Place every activation buffer in one arena, sharing memory between
+    // buffers whose lifetimes do not overlap
+    void plan_activations() {
+        const auto& config = model_.config();
+        const size_t rows = MAX_BATCH_TOKENS;
+        const size_t n_embd = config.n_embd;
+
+        struct Slot {
+            float** buffer;
+            size_t index;
+        };
+        ActivationPlanner planner;
+        std::vector<Slot> slots;
+        // Branches of a parallel block may run concurrently, so nothing
+        // inside a block may share memory there
+        const bool branches = graph_.has_branches();
+        auto add = [&](float** buffer, const char* name, size_t bytes, size_t first, size_t last) {
+            if (branches && first >= STEP_ATTN_NORM && last <= STEP_FFN_RESIDUAL) {
+                first = STEP_ATTN_NORM;
+                last = STEP_FFN_RESIDUAL;
+            }
+            slots.push_back(Slot{buffer, planner.add(name, bytes, first, last)});
+        };
+        // Buffers the fused graph no longer touches get no memory
+        auto add_buffer = [&](BufferId id, size_t width, size_t n_rows, size_t first, size_t last) {
+            BufferSlot& slot = buffers_[static_cast<size_t>(id)];
+            slot.width = width;
+            slot.rows = n_rows;
+            if (graph_.uses(id)) {
+                add(&slot.data, buffer_name(id), n_rows * width * sizeof(float), first, last);
+            }
+        };
+        // Self-draft verification normalizes and samples one row at a time
+        add_buffer(BufferId::RESIDUAL, n_embd, rows, STEP_EMBEDDING, STEP_SAMPLING);
+        add_buffer(BufferId::ATTN_IN, n_embd, rows, STEP_ATTN_NORM, STEP_QKV);
+        add_buffer(BufferId::QKV, qkv_dim_, rows, STEP_QKV, STEP_ATTENTION);
+        add(&scores_, "scores", config.n_heads * config.max_seq_len * sizeof(float),
+            STEP_ATTENTION, STEP_ATTENTION);
+        add_buffer(BufferId::ATTN, n_embd, rows, STEP_ATTENTION, STEP_ATTN_OUT);
+        add_buffer(BufferId::ATTN_PROJ, n_embd, rows, STEP_ATTN_OUT, STEP_ATTN_RESIDUAL);
+        // Experts read the normed input until the last one has run
+        const bool moe = config.n_experts > 0;
+        add_buffer(BufferId::FFN_IN, n_embd, rows, STEP_FFN_NORM, moe ? STEP_FFN_DOWN : STEP_FFN_UP);
+        add_buffer(BufferId::FF, n_ff_, rows, STEP_FFN_UP, STEP_FFN_DOWN);
+        add_buffer(BufferId::FF_GATE, n_ff_, rows, STEP_FFN_UP, STEP_ACTIVATION);
+        add_buffer(BufferId::FFN_PROJ, n_embd, rows, STEP_FFN_DOWN, STEP_FFN_RESIDUAL);
+        add_buffer(BufferId::ROUTER, config.n_experts, rows, STEP_FFN_UP, STEP_FFN_DOWN);
+        if (moe) {
+            add(&expert_in_, "expert_in", rows * n_embd * sizeof(float), STEP_FFN_UP, STEP_FFN_DOWN);
+            add(&expert_ff_, "expert_ff", rows * n_ff_ * sizeof(float), STEP_FFN_UP, STEP_FFN_DOWN);
+            add(&expert_gate_, "expert_gate", rows * n_ff_ * sizeof(float), STEP_FFN_UP, STEP_ACTIVATION);
+            add(&expert_out_, "expert_out", rows * n_embd * sizeof(float), STEP_FFN_DOWN, STEP_FFN_DOWN);
+        }
+        // Fused greedy/top-k sampling reads the final hidden state
+        add_buffer(BufferId::FINAL_IN, n_embd, 1, STEP_FINAL_NORM, STEP_SAMPLING);
+        add_buffer(BufferId::LOGITS, n_out_, 1, STEP_LM_HEAD, STEP_SAMPLING);
+        add(&sample_logits_, "sample_logits", n_out_ * sizeof(float), STEP_SAMPLING, STEP_SAMPLING);
+
+        const MemoryPlan plan = planner.plan(ARENA_ALIGNMENT);
+        arena_size_ = plan.arena_size;
+        arena_.reset(static_cast<uint8_t*>(aligned_allocate(arena_size_, ARENA_ALIGNMENT)));
+        for (const Slot& slot : slots) {
+            *slot.buffer = reinterpret_cast<float*>(arena_.get() + plan.offsets[slot.index]);
+        }
+    }
+
+    TokenVector encode_prompt(const std::string& prompt) const {
+        TokenVector tokens = model_.tokenizer()->encode(prompt);
+        if (tokens.empty()) {
+            // The forward pass needs at least one token to condition on
+            auto bos = model_.tokenizer()->bos_token();
+            if (!bos) {
+                throw std::invalid_argument("Empty prompt and the tokenizer has no BOS token");
+            }
+            tokens.push_back(bos.value());
+        }
+        if (tokens.size() > model_.config().max_seq_len) {
+            throw std::length_error("Prompt of " + std::to_string(tokens.size()) +
+                                    " tokens exceeds the maximum sequence length");
+        }
+        return tokens;
+    }
+
+    // Keys (slot 0) or values (slot 1) of a layer as {capacity, n_kv_heads, head_size}
+    TensorView<float> kv_cache(size_t layer, size_t slot) const {
+        const size_t n_kv_heads = model_.config().n_kv_heads;
+        float* base = static_cast<float*>(kv_block_.data()) +
+                      (2 * layer + slot) * kv_capacity_ * n_kv_heads * head_size_;
+        return TensorView<float>(base, {kv_capacity_, n_kv_heads, head_size_});
+    }
+
+    // Grow the KV cache to hold n_positions positions (existing entries are kept)
+    void reserve_kv_cache(size_t n_positions) {
+        if (n_positions <= kv_capacity_) {
+            return;
+        }
+        const auto& config = model_.config();
+        const size_t kv_dim = config.n_kv_heads * head_size_;
+        ScratchPool::Block block = pool_->acquire(2 * config.n_layers * n_positions * kv_dim * sizeof(float));
+        float* dst = static_cast<float*>(block.data());
+        if (kv_block_) {
+            // Layer buffers move to the new stride; copy the filled rows across
+            const float* src = static_cast<const float*>(kv_block_.data());
+            for (size_t i = 0; i < 2 * config.n_layers; ++i) {
+                std::memcpy(dst + i * n_positions * kv_dim, src + i * kv_capacity_ * kv_dim,
+                            kv_capacity_ * kv_dim * sizeof(float));
+            }
+        }
+        kv_block_ = std::move(block);
+        if (metrics_) {
+            metrics_->kv_cache_capacity.add(static_cast<double>(n_positions - kv_capacity_));
+        }
+        kv_capacity_ = n_positions;
+    }
+
+    // Process all tokens in the sequence
+    void process_tokens(const TokenVector& tokens, ForwardOutput output = ForwardOutput::LOGITS) {
+        forward(tokens.data(), tokens.size(), 0, output);
+    }
+
+    // Process a prompt, skipping the prefix already in the KV cache when reuse is set
+    void process_prompt(const TokenVector& tokens, bool reuse, ForwardOutput output = ForwardOutput::LOGITS) {
+        size_t prefix = 0;
+        if (reuse) {
+            // Keep at least the last token so its logits are computed
+            const size_t limit = std::min(cached_tokens_.size(), tokens.size() - 1);
+            while (prefix < limit && cached_tokens_[prefix] == tokens[prefix]) {
+                ++prefix;
+            }
+        }
+        if (metrics_) {
+            metrics_->prompt_tokens.inc(tokens.size());
+            metrics_->prefill_tokens.inc(tokens.size() - prefix);
+            if (reuse) {
+                metrics_->prefix_lookup_tokens.inc(tokens.size());
+                metrics_->prefix_hit_tokens.inc(prefix);
+            }
+        }
+        forward(tokens.data() + prefix, tokens.size() - prefix, prefix, output);
+    }
+
     // Process a single new token (using KV cache for efficiency)
-    void process_single_token(TokenId token, size_t position) {
-        // This is a placeholder implementation
-        // In a real system, this would use the KV cache to efficiently process just the new token
-        
-        // For now, just generate random logits as a dummy implementation
+    void process_single_token(TokenId token, size_t position, ForwardOutput output = ForwardOutput::LOGITS) {
+        forward(&token, 1, position, output);
+    }
+
+    // Run tokens at positions [start_pos, start_pos + n) through the model,
+    // leaving the logits (or normed hidden state) of the last one in its buffer
+    void forward(const TokenId* tokens, size_t n, size_t start_pos, ForwardOutput output = ForwardOutput::LOGITS) {
+        reserve_kv_cache(start_pos + n);
+        // Positions from start_pos on are overwritten; forget them first in case of failure
+        set_cached_tokens(std::min(cached_tokens_.size(), start_pos));
+        for (size_t done = 0; done < n; done += MAX_BATCH_TOKENS) {
+            const size_t m = std::min(MAX_BATCH_TOKENS, n - done);
+            forward_batch(tokens + done, m, start_pos + done, done + m == n, output);
+        }
+        cached_tokens_.insert(cached_tokens_.end(), tokens, tokens + n);
+        set_cached_tokens(cached_tokens_.size());
+        sample_engine_memory();
+    }
+
+    // Truncate cached_tokens_ to n entries and publish the cache occupancy
+    void set_cached_tokens(size_t n) {
+        if (metrics_) {
+            metrics_->kv_cache_tokens.add(static_cast<double>(n) - static_cast<double>(reported_cached_));
+        }
+        cached_tokens_.resize(n);
+        reported_cached_ = n;
+    }
+
+    float* buffer(BufferId id) const {
+        return id == BufferId::COUNT ? nullptr : buffers_[static_cast<size_t>(id)].data;
+    }
+
+    // Split the thread pool between the two branches of parallel blocks.
+    // Profiled engines keep one branch at a time so op timings are not
+    // interleaved.
+    void init_branch_threads() {
+#ifdef _OPENMP
+        const size_t threads = engine_config_.n_threads > 0 ? engine_config_.n_threads
+                                                            : static_cast<size_t>(omp_get_max_threads());
+        if (!graph_.has_branches() || threads < 2 || engine_config_.enable_profiling) {
+            return;
+        }
+        attention_threads_ = threads / 2;
+        ffn_threads_ = threads - attention_threads_;
+#endif
+    }
+
+    // Run the compiled graph on m tokens at positions [pos0, pos0 + m)
+    void forward_batch(const TokenId* tokens, size_t m, size_t pos0, bool last_batch, ForwardOutput output) {
+        // The LM head is the last instruction; HIDDEN stops after the final norm
+        size_t end = graph_.logits_begin;
+        if (last_batch) {
+            end = output == ForwardOutput::LOGITS ? graph_.program.size() : graph_.program.size() - 1;
+        }
+        run_program(0, end, tokens, m, pos0);
+    }
+
+    // Run program[begin, end) on m tokens at positions [pos0, pos0 + m)
+    void run_program(size_t begin, size_t end, const TokenId* tokens, size_t m, size_t pos0) {
+        Profiler* prof = profiler_.get();
+        for (size_t i = begin; i < end;) {
+            if (graph_.program[i].branch != 0 && attention_threads_ > 0) {
+                size_t region_end = i;
+                while (region_end < end && graph_.program[region_end].branch != 0) {
+                    ++region_end;
+                }
+                run_branches(i, region_end, tokens, m, pos0);
+                i = region_end;
+                continue;
+            }
+            const Instruction& ins = graph_.program[i];
+            EMBEE_PROFILE(prof, ins.profile_op, ins.layer);
+            execute(ins, tokens, m, pos0, engine_config_.n_threads);
+            ++i;
+        }
+    }
+
+    // Run the attention and feed-forward branches of program[begin, end)
+    // concurrently, each on its share of the threads
+    void run_branches(size_t begin, size_t end, const TokenId* tokens, size_t m, size_t pos0) {
+        std::exception_ptr error[2];
+        #pragma omp parallel num_threads(2)
+        {
+#ifdef _OPENMP
+            const size_t side = static_cast<size_t>(omp_get_thread_num());
+            // The kernels of each branch open a nested team. The nesting
+            // limit is an ICV of this implicit task (OpenMP 5.0), so raising
+            // it here leaves the caller's setting untouched
+            if (omp_get_max_active_levels() < 2) {
+                omp_set_max_active_levels(2);
+            }
+#else
+            const size_t side = 0;
+#endif
+            const uint8_t branch = side == 0 ? BRANCH_ATTENTION : BRANCH_FFN;
+            const size_t threads = side == 0 ? attention_threads_ : ffn_threads_;
+            try {
+                for (size_t i = begin; i < end; ++i) {
+                    if (graph_.program[i].branch == branch) {
+                        execute(graph_.program[i], tokens, m, pos0, threads);
+                    }
+                }
+            } catch (...) {
+                error[side] = std::current_exception();
+            }
+        }
+        for (const auto& e : error) {
+            if (e) {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    void execute(const Instruction& ins, const TokenId* tokens, size_t m, size_t pos0, size_t threads) {
         const auto& config = model_.config();
-        last_logits_.resize(config.n_vocab);
-        
-        // Fill with random values (just for demo)
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::normal_distribution<float> dist(0.0f, 1.0f);
-        
-        for (auto& logit : last_logits_) {
-            logit = dist(gen);
-        }
-    }
-    
-    // Get logits for the next token
-    std::vector<float> get_next_token_logits() const {
-        return last_logits_;
-    }
-    
-    // Apply repetition penalty to logits
-    void apply_repetition_penalty(std::vector<float>& logits, 
-                                 const TokenVector& tokens,
-                                 float penalty) {
-        for (TokenId token : tokens) {
-            if (token >= 0 && static_cast<size_t>(token) < logits.size()) {
-                // If token is repeated, penalize it
-                if (logits[token] > 0) {
-                    logits[token] /= penalty;
-                } else {
-                    logits[token] *= penalty;
+        const size_t block = config.quant_block_size;
+        float* dst = buffer(ins.dst);
+        const float* src = buffer(ins.src);
+        const size_t dst_width = ins.dst == BufferId::COUNT ? 0 : buffers_[static_cast<size_t>(ins.dst)].width;
+        const size_t src_width = ins.src == BufferId::COUNT ? 0 : buffers_[static_cast<size_t>(ins.src)].width;
+        size_t rows = m;
+        if (ins.flags & FLAG_LAST_ROW) {
+            rows = 1;
+            if (buffers_[static_cast<size_t>(ins.src)].rows > 1) {
+                src += (m - 1) * src_width;
+            }
+        }
+
+        switch (ins.op) {
+            case OpCode::EMBED: {
+                const WeightView embeddings = weight_view(*ins.weight, block);
+                for (size_t i = 0; i < m; ++i) {
+                    if (tokens[i] < 0 || static_cast<size_t>(tokens[i]) >= config.n_vocab) {
+                        throw std::out_of_range("Token ID out of range: " + std::to_string(tokens[i]));
+                    }
+                    float* x = dst + i * dst_width;
+                    kernels_.dequantize_row(embeddings.type(), embeddings.row(tokens[i]), x, dst_width, block);
+                    if (ins.flags & FLAG_SCALE) {
+                        const float scale = std::sqrt(static_cast<float>(dst_width));
+                        for (size_t d = 0; d < dst_width; ++d) {
+                            x[d] *= scale;
+                        }
+                    }
+                    if (ins.bias) {
+                        const float* pe = fp32_view(*ins.bias).row(pos0 + i).data();
+                        for (size_t d = 0; d < dst_width; ++d) {
+                            x[d] += pe[d];
+                        }
+                    }
                 }
+                break;
             }
+            case OpCode::NORM:
+                for (size_t i = 0; i < rows; ++i) {
+                    normalize(ins, src + i * src_width, dst + i * dst_width, src_width);
+                }
+                break;
+            case OpCode::MATMUL: {
+                kernels::MatmulEpilogue epilogue;
+                epilogue.bias = fp32_data(ins.bias);
+                epilogue.activate = (ins.flags & FLAG_ACTIVATE) != 0;
+                epilogue.activation = config.activation_function;
+                epilogue.accumulate = (ins.flags & FLAG_ACCUMULATE) != 0;
+                multiply(*ins.weight, src, dst, rows, epilogue, threads);
+                break;
+            }
+            case OpCode::ROPE: {
+                const size_t q_dim = config.n_heads * head_size_;
+                for (size_t i = 0; i < m; ++i) {
+                    float* q = dst + i * dst_width;
+                    kernels_.rope(q, config.n_heads, head_size_, pos0 + i,
+                                  config.rope_freq_base, config.rope_scaling);
+                    kernels_.rope(q + q_dim, config.n_kv_heads, head_size_, pos0 + i,
+                                  config.rope_freq_base, config.rope_scaling);
+                }
+                break;
+            }
+            case OpCode::KV_STORE: {
+                const size_t q_dim = config.n_heads * head_size_;
+                const size_t kv_dim = config.n_kv_heads * head_size_;
+                const TensorView<float> k_cache = kv_cache(ins.layer, 0);
+                const TensorView<float> v_cache = kv_cache(ins.layer, 1);
+                for (size_t i = 0; i < m; ++i) {
+                    const float* k = src + i * src_width + q_dim;
+                    std::copy(k, k + kv_dim, k_cache.row(pos0 + i).data());
+                    std::copy(k + kv_dim, k + 2 * kv_dim, v_cache.row(pos0 + i).data());
+                }
+                break;
+            }
+            case OpCode::ATTENTION: {
+                const TensorView<float> k_cache = kv_cache(ins.layer, 0);
+                const TensorView<float> v_cache = kv_cache(ins.layer, 1);
+                for (size_t i = 0; i < m; ++i) {
+                    // Causal: token i attends to every position up to its own
+                    kernels_.attention(src + i * src_width, k_cache.data(), v_cache.data(),
+                                       dst + i * dst_width, config.n_heads, config.n_kv_heads,
+                                       head_size_, pos0 + i + 1, scores_, threads,
+                                       alibi_slopes_.empty() ? nullptr : alibi_slopes_.data());
+                }
+                break;
+            }
+            case OpCode::ADD:
+                for (size_t j = 0; j < rows * dst_width; ++j) {
+                    dst[j] += src[j];
+                }
+                break;
+            case OpCode::MUL:
+                for (size_t j = 0; j < rows * dst_width; ++j) {
+                    dst[j] *= src[j];
+                }
+                break;
+            case OpCode::ACTIVATION:
+                kernels::activate(config.activation_function, dst, rows * dst_width);
+                break;
+            case OpCode::MOE:
+                run_experts(weights_.layers[ins.layer], src, src_width, dst, dst_width, m,
+                            (ins.flags & FLAG_ACCUMULATE) != 0, threads);
+                break;
         }
     }
-    
-    // Sample a token using top-p (nucleus) sampling
-    TokenId sample_token(const std::vector<float>& logits, float top_p, std::mt19937& gen) {
-        // Convert logits to probabilities
-        std::vector<float> probs(logits.size());
-        
-        // Compute softmax
-        float max_logit = *std::max_element(logits.begin(), logits.end());
-        float sum_exp = 0.0f;
-        
-        for (size_t i = 0; i < logits.size(); ++i) {
-            probs[i] = std::exp(logits[i] - max_logit);
-            sum_exp += probs[i];
-        }
-        
-        for (auto& p : probs) {
-            p /= sum_exp;
-        }
-        
-        // If top_p is close to 0, just return the most likely token
-        if (top_p < 1e-6f) {
-            return static_cast<TokenId>(std::distance(probs.begin(), 
-                                                    std::max_element(probs.begin(), probs.end())));
-        }
-        
-        // Sort indices by probability (descending)
-        std::vector<size_t> indices(probs.size());
-        std::iota(indices.begin(), indices.end(), 0);
-        
-        std::sort(indices.begin(), indices.end(), [&probs](size_t a, size_t b) {
-            return probs[a] > probs[b];
-        });
-        
-        // Compute cumulative probabilities and find cutoff
-        float cumsum = 0.0f;
-        size_t cutoff_idx = indices.size() - 1;
-        
-        for (size_t i = 0; i < indices.size(); ++i) {
-            cumsum += probs[indices[i]];
-            if (cumsum >= top_p) {
-                cutoff_idx = i;
+
+    // One row of a NORM instruction
+    static void normalize(const Instruction& norm, const float* x, float* y, size_t n) {
+        if (norm.flags & FLAG_RMS_NORM) {
+            kernels::rms_norm(x, fp32_data(norm.weight), y, n, 1e-5f, norm.flags & FLAG_SCALE ? 1.0f : 0.0f);
+        } else {
+            kernels::layer_norm(x, fp32_data(norm.weight), fp32_data(norm.bias), y, n);
+        }
+    }
+
+    // y = W x for `rows` rows of x, through the selected kernels
+    void multiply(const Tensor& weight, const float* x, float* y, size_t rows,
+                  const kernels::MatmulEpilogue& epilogue, size_t threads) {
+        const size_t block = model_.config().quant_block_size;
+        const WeightView w = weight_view(weight, block);
+        if (engine_config_.activation_stats) {
+            engine_config_.activation_stats->add(weight.name, x, rows, w.cols());
+        }
+        if (rows == 1) {
+            kernels_.gemv(w.type(), w.data(), x, y, w.rows(), w.cols(), block, threads, epilogue);
+        } else {
+            kernels_.gemm(w.type(), w.data(), x, y, rows, w.rows(), w.cols(), block, threads, epilogue);
+        }
+    }
+
+    // Mixture-of-experts feed-forward over m rows of x. Tokens are grouped by
+    // expert so that each selected expert's weights are streamed once per
+    // batch; experts no token selected are skipped without being read.
+    void run_experts(const BlockWeights& w, const float* x, size_t x_width, float* y, size_t y_width,
+                     size_t m, bool accumulate, size_t threads) {
+        const auto& config = model_.config();
+        route_top_k(buffer(BufferId::ROUTER), m, config.n_experts, config.n_experts_used, routing_);
+        if (!accumulate) {
+            std::fill(y, y + m * y_width, 0.0f);
+        }
+        for (size_t e = 0; e < config.n_experts; ++e) {
+            const size_t count = routing_.count(e);
+            if (count == 0) {
+                continue;
+            }
+            const uint32_t* rows = routing_.tokens.data() + routing_.offsets[e];
+            const float* gates = routing_.weights.data() + routing_.offsets[e];
+            for (size_t j = 0; j < count; ++j) {
+                std::copy(x + rows[j] * x_width, x + (rows[j] + 1) * x_width, expert_in_ + j * x_width);
+            }
+
+            const ExpertWeights& expert = w.experts[e];
+            kernels::MatmulEpilogue up;
+            up.activate = !expert.gate;
+            up.activation = config.activation_function;
+            multiply(*expert.up, expert_in_, expert_ff_, count, up, threads);
+            if (expert.gate) {
+                multiply(*expert.gate, expert_in_, expert_gate_, count, kernels::MatmulEpilogue(), threads);
+                kernels::activate(config.activation_function, expert_gate_, count * n_ff_);
+                for (size_t j = 0; j < count * n_ff_; ++j) {
+                    expert_ff_[j] *= expert_gate_[j];
+                }
+            }
+            multiply(*expert.down, expert_ff_, expert_out_, count, kernels::MatmulEpilogue(), threads);
+
+            for (size_t j = 0; j < count; ++j) {
+                float* out = y + rows[j] * y_width;
+                const float* value = expert_out_ + j * y_width;
+                for (size_t d = 0; d < y_width; ++d) {
+                    out[d] += gates[j] * value[d];
+                }
+            }
+        }
+    }
+
+    // One round of self-drafting. The last of tokens is not in the KV cache
+    // yet. Up to draft_tokens tokens are drafted greedily with only the first
+    // draft_layers layers, then the full model runs over that token and the
+    // drafts as one batch, and drafts are kept while they match its greedy
+    // choice. Returns the kept drafts followed by the full model's next
+    // token; all but that last token are left in the KV cache. Returns
+    // nothing, with the cache unchanged, when there is no room to draft.
+    TokenVector draft_and_verify(const TokenVector& tokens, size_t remaining, const GenerationConfig& config,
+                                 std::mt19937& gen) {
+        const size_t pos0 = tokens.size() - 1;
+        // Drafts and the token after them must fit the batch, the context and the request
+        const size_t k = std::min({config.draft_tokens, MAX_BATCH_TOKENS - 1,
+                                   model_.config().max_seq_len - 1 - pos0, remaining - 1});
+        if (k == 0) {
+            return {};
+        }
+        auto eos_token = model_.tokenizer()->eos_token();
+        reserve_kv_cache(pos0 + k + 1);
+        set_cached_tokens(std::min(cached_tokens_.size(), pos0));
+
+        // Draft: the first layers, the final norm and the fused LM head. The
+        // keys and values they store are those of the full model's first
+        // layers, so later drafts attend to exact early-layer context.
+        const size_t draft_end = graph_.layer_begin(config.draft_layers);
+        TokenVector batch(tokens.end() - 1, tokens.end());
+        TokenVector history = tokens;
+        for (size_t i = 0; i < k; ++i) {
+            run_program(0, draft_end, &batch[i], 1, pos0 + i);
+            run_program(graph_.logits_begin, graph_.program.size() - 1, &batch[i], 1, pos0 + i);
+            const TokenId draft = sample_candidates(history, 1, config, gen);
+            batch.push_back(draft);
+            history.push_back(draft);
+            if (!config.ignore_eos && eos_token && draft == eos_token.value()) {
+                break;
+            }
+        }
+
+        // Verify: one batched full forward, then the greedy choice after each
+        // row, under the same repetition penalty sequential decoding applies
+        forward(batch.data(), batch.size(), pos0, ForwardOutput::HIDDEN);
+        const Instruction& final_norm = graph_.program[graph_.logits_begin];
+        TokenVector result;
+        history.resize(tokens.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            {
+                // The final norm reads the last of m rows; m = i + 1 selects row i
+                EMBEE_PROFILE(profiler_.get(), final_norm.profile_op, final_norm.layer);
+                execute(final_norm, batch.data(), i + 1, pos0, engine_config_.n_threads);
+            }
+            const TokenId token = sample_candidates(history, 1, config, gen);
+            result.push_back(token);
+            if (i + 1 == batch.size() || token != batch[i + 1]) {
                 break;
             }
+            history.push_back(token);
         }
-        
-        // Re-normalize probabilities up to the cutoff
-        float norm_factor = 0.0f;
-        for (size_t i = 0; i <= cutoff_idx; ++i) {
-            norm_factor += probs[indices[i]];
+
+        // Rejected drafts leave stale cache entries behind
+        set_cached_tokens(pos0 + result.size());
+        if (metrics_) {
+            metrics_->draft_tokens.inc(batch.size() - 1);
+            metrics_->draft_accepted_tokens.inc(result.size() - 1);
         }
-        
-        // Sample from the truncated distribution
-        std::uniform_real_distribution<float> dist(0.0f, norm_factor);
-        float r = dist(gen);
-        float cdf = 0.0f;
-        
-        for (size_t i = 0; i <= cutoff_idx; ++i) {
-            cdf += probs[indices[i]];
-            if (r <= cdf) {
-                return static_cast<TokenId>(indices[i]);
+        return result;
+    }
+
+    // Pick the next token from the k best logits of the final hidden state.
+    // Tokens under repetition penalty are left out of the fused LM head and
+    // scored exactly, so a penalty can never hide a better candidate.
+    TokenId sample_candidates(const TokenVector& tokens, size_t k, const GenerationConfig& config,
+                              std::mt19937& gen) {
+        const size_t block = model_.config().quant_block_size;
+        const WeightView head = weight_view(*weights_.lm_head, block);
+        const float* x = buffer(BufferId::FINAL_IN);
+        const bool penalize = config.repetition_penalty != 1.0f;
+        auto& candidates = sampling_scratch_.candidates;
+        size_t n = 0;
+        {
+            EMBEE_PROFILE(profiler_.get(), ProfileOp::LM_HEAD, -1);
+            if (penalize) {
+                penalized_.resize(n_out_);
+                for (TokenId token : tokens) {
+                    const int32_t row = output_row(token);
+                    if (row >= 0) {
+                        penalized_[row] = 1;
+                    }
+                }
+            }
+            n = kernels::lm_head_top_k(head.type(), head.data(), x, n_out_, head.cols(), block, k,
+                                   penalize ? penalized_.data() : nullptr, sampling_scratch_,
+                                   engine_config_.n_threads);
+        }
+
+        EMBEE_PROFILE(profiler_.get(), ProfileOp::SAMPLING, -1);
+        if (penalize) {
+            // sample_logits_ is free here; use it sparsely for the penalized rows
+            const size_t first_penalized = candidates.size();
+            for (TokenId token : tokens) {
+                const int32_t row = output_row(token);
+                if (row >= 0 && penalized_[row]) {
+                    penalized_[row] = 0;
+                    kernels_.gemv(head.type(), head.row(row), x, sample_logits_ + row, 1, head.cols(),
+                                  block, 1, kernels::MatmulEpilogue());
+                    candidates.emplace_back(0.0f, row);
+                }
+            }
+            apply_repetition_penalty(sample_logits_, tokens, config.repetition_penalty);
+            for (size_t i = first_penalized; i < candidates.size(); ++i) {
+                candidates[i].first = sample_logits_[candidates[i].second];
+            }
+            n = std::min(k, candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+                              [](const std::pair<float, TokenId>& a, const std::pair<float, TokenId>& b) {
+                                  return a.first > b.first || (a.first == b.first && a.second < b.second);
+                              });
+        }
+
+        // Temperature, then top-p among the candidates
+        const float temperature = config.temperature > 0 ? config.temperature : 1.0f;
+        for (size_t i = 0; i < n; ++i) {
+            sample_logits_[i] = candidates[i].first / temperature;
+        }
+        const size_t pick = kernels::sample_top_p(sample_logits_, n, config.top_p, gen, sampling_scratch_);
+        return output_token(candidates[pick].second);
+    }
+
+    // Apply repetition penalty to logits (one per LM head row)
+    void apply_repetition_penalty(float* logits, const TokenVector& tokens, float penalty) {
+        for (TokenId token : tokens) {
+            const int32_t row = output_row(token);
+            if (row >= 0) {
+                // If token is repeated, penalize it
+                if (logits[row] > 0) {
+                    logits[row] /= penalty;
+                } else {
+                    logits[row] *= penalty;
+                }
             }
         }
-        
-        // Fallback (should rarely happen)
-        return static_cast<TokenId>(indices[0]);
     }
 };
 
 // Engine implementation (delegates to Impl)
-Engine::Engine(const Model& model) : pimpl_(std::make_unique<Impl>(model)) {}
+Engine::Engine(const Model& model, const EngineConfig& config)
+    : pimpl_(std::make_unique<Impl>(model, config)) {}
+
+Engine::~Engine() = default;
 
 std::string Engine::generate(const std::string& prompt, const GenerationConfig& config) {
     return pimpl_->generate(prompt, config);
 }
 
-void Engine::generate_with_callback(const std::string& prompt, TokenCallback callback, 
+void Engine::generate_with_callback(const std::string& prompt, TokenCallback callback,
                                   const GenerationConfig& config) {
     pimpl_->generate_with_callback(prompt, callback, config);
 }
@@ -289,4 +1490,79 @@ std::vector<float> Engine::get_logits(const std::string& prompt) {
     return pimpl_->get_logits(prompt);
 }
 
-} // namespace embee
\ No newline at end of file
+std::vector<float> Engine::get_logits(const TokenVector& tokens) {
+    return pimpl_->get_logits(tokens);
+}
+
+std::vector<float> Engine::score(const TokenVector& tokens, const ScoringConfig& config) {
+    return pimpl_->score(tokens, config);
+}
+
+std::vector<std::vector<float>> Engine::score_batch(const std::vector<TokenVector>& sequences,
+                                                    const ScoringConfig& config) {
+    return pimpl_->score_batch(sequences, config);
+}
+
+Profiler* Engine::profiler() const {
+    return pimpl_->profiler();
+}
+
+MemoryStats Engine::memory_usage() const {
+    return pimpl_->memory_usage();
+}
+
+MemoryStats Engine::peak_memory_usage() const {
+    return pimpl_->peak_memory_usage();
+}
+
+void Engine::reset_peak_memory_usage() {
+    pimpl_->reset_peak_memory_usage();
+}
+
+TokenVector load_vocabulary_shortlist(const std::string& path, double coverage, size_t max_tokens) {
+    if (!(coverage > 0.0 && coverage <= 1.0)) {
+        throw std::invalid_argument("Shortlist coverage must be in (0, 1]");
+    }
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Failed to open token frequency file: " + path);
+    }
+
+    std::vector<std::pair<double, TokenId>> counts;
+    double total = 0.0;
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+        std::istringstream fields(line);
+        std::string first;
+        if (!(fields >> first) || first[0] == '#') {
+            continue;
+        }
+        TokenId token = 0;
+        double count = 0.0;
+        std::istringstream token_field(first);
+        if (!(token_field >> token) || !token_field.eof() || !(fields >> count) || count < 0.0) {
+            throw std::runtime_error(path + ":" + std::to_string(line_number) +
+                                     ": expected a token ID and a count");
+        }
+        counts.emplace_back(count, token);
+        total += count;
+    }
+
+    // Most frequent first; ties keep the lower token ID
+    std::sort(counts.begin(), counts.end(),
+              [](const std::pair<double, TokenId>& a, const std::pair<double, TokenId>& b) {
+                  return a.first > b.first || (a.first == b.first && a.second < b.second);
+              });
+    TokenVector tokens;
+    double covered = 0.0;
+    for (const auto& entry : counts) {
+        if ((max_tokens > 0 && tokens.size() == max_tokens) || (covered >= coverage * total && !tokens.empty())) {
+            break;
+        }
+        tokens.push_back(entry.second);
+        covered += entry.first;
+    }
+    return tokens;
+}
+
+} // namespace embee
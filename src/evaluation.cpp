@@ -0,0 +1,181 @@
+/**
+ * @file evaluation.cpp
+ * @brief Tensor error and perplexity of quantized models
+ */
+
+#include "embee/evaluation.h"
+#include "embee/amb_format.h"
+#include "embee/engine.h"
+#include "embee/model.h"
+#include "embee/tensor.h"
+#include "embee/tokenizer.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+// Block size recorded in the "quant" entry of a model config (0 if none)
+size_t quant_config_block_size(const std::string& config_json) {
+    const size_t quant = config_json.find("\"quant\"");
+    if (quant == std::string::npos) {
+        return 0;
+    }
+    const size_t key = config_json.find("\"block_size\"", quant);
+    const size_t colon = key == std::string::npos ? key : config_json.find(':', key);
+    if (colon == std::string::npos) {
+        return 0;
+    }
+    return std::strtoul(config_json.c_str() + colon + 1, nullptr, 10);
+}
+
+// The tensor records of a mapped AMB file
+std::vector<amb::TensorRecord> read_records(const amb::MappedFile& file, amb::Header& header) {
+    header = amb::parse_header(file.data(), file.size());
+    const uint8_t* weights = file.data() + header.weights_offset();
+    std::vector<amb::TensorRecord> records;
+    for (size_t offset = 0; offset < header.weights_size;) {
+        records.push_back(
+            amb::parse_tensor_record(weights, header.weights_size, offset, header.aligned_tensor_data()));
+        offset = records.back().end;
+    }
+    return records;
+}
+
+// Difference statistics of two tensors of the same shape
+TensorError compare_tensor(const amb::TensorRecord& reference, const amb::TensorRecord& quantized,
+                           size_t block_size, size_t n_threads) {
+    TensorError result;
+    result.name = reference.name;
+    result.shape = reference.shape;
+    result.reference_type = reference.data_type;
+    result.type = quantized.data_type;
+
+    size_t n = 1;
+    for (size_t dim : reference.shape) {
+        n *= dim;
+    }
+    if (n == 0) {
+        return result;
+    }
+    const size_t rows = reference.shape.size() > 1 ? reference.shape[0] : 1;
+    const size_t cols = n / rows;
+    const WeightView a(reference.data_type, reference.data, rows, cols, block_size);
+    const WeightView b(quantized.data_type, quantized.data, rows, cols, block_size);
+
+    double squared_error = 0.0, dot = 0.0, norm_a = 0.0, norm_b = 0.0, max_error = 0.0;
+    const long n_rows = static_cast<long>(rows);
+#ifdef _OPENMP
+    const int threads = n_threads > 0 ? static_cast<int>(n_threads) : omp_get_max_threads();
+#else
+    (void)n_threads;
+#endif
+    #pragma omp parallel num_threads(threads) \
+        reduction(+ : squared_error, dot, norm_a, norm_b) reduction(max : max_error)
+    {
+        std::vector<float> row_a(cols), row_b(cols);
+        #pragma omp for schedule(static)
+        for (long r = 0; r < n_rows; ++r) {
+            a.dequantize_row(r, row_a.data());
+            b.dequantize_row(r, row_b.data());
+            for (size_t j = 0; j < cols; ++j) {
+                const double x = row_a[j];
+                const double y = row_b[j];
+                squared_error += (x - y) * (x - y);
+                dot += x * y;
+                norm_a += x * x;
+                norm_b += y * y;
+                max_error = std::max(max_error, std::fabs(x - y));
+            }
+        }
+    }
+
+    result.rmse = std::sqrt(squared_error / static_cast<double>(n));
+    if (norm_a > 0.0 && norm_b > 0.0) {
+        result.cosine = dot / std::sqrt(norm_a * norm_b);
+    } else if (norm_a > 0.0 || norm_b > 0.0) {
+        result.cosine = 0.0;
+    }
+    result.max_error = max_error;
+    return result;
+}
+
+} // namespace
+
+std::vector<TensorError> compare_model_tensors(const std::string& reference_path, const std::string& quantized_path,
+                                               size_t block_size, size_t n_threads) {
+    const amb::MappedFile reference_file(reference_path);
+    const amb::MappedFile quantized_file(quantized_path);
+    amb::Header reference_header, quantized_header;
+    const std::vector<amb::TensorRecord> reference = read_records(reference_file, reference_header);
+    const std::vector<amb::TensorRecord> quantized = read_records(quantized_file, quantized_header);
+
+    if (block_size == 0) {
+        block_size = quant_config_block_size(std::string(
+            reinterpret_cast<const char*>(quantized_file.data() + quantized_header.config_offset()),
+            quantized_header.config_size));
+        if (block_size == 0) {
+            block_size = 32;
+        }
+    }
+
+    std::unordered_map<std::string, const amb::TensorRecord*> by_name;
+    for (const amb::TensorRecord& record : quantized) {
+        by_name.emplace(record.name, &record);
+    }
+
+    std::vector<TensorError> result;
+    result.reserve(reference.size());
+    for (const amb::TensorRecord& record : reference) {
+        auto it = by_name.find(record.name);
+        if (it == by_name.end()) {
+            throw std::runtime_error("Tensor " + record.name + " is missing from " + quantized_path);
+        }
+        if (it->second->shape != record.shape) {
+            throw std::invalid_argument("Tensor " + record.name + " has a different shape in " + quantized_path);
+        }
+        result.push_back(compare_tensor(record, *it->second, block_size, n_threads));
+    }
+    return result;
+}
+
+PerplexityResult evaluate_perplexity(const Model& model, const std::string& text, size_t context_tokens,
+                                     size_t max_chunks, size_t n_threads) {
+    if (context_tokens < 2 || context_tokens > model.config().max_seq_len) {
+        throw std::invalid_argument("Perplexity chunks must hold 2 to " +
+                                    std::to_string(model.config().max_seq_len) + " tokens");
+    }
+    const TokenVector tokens = model.tokenizer()->encode(text);
+    if (tokens.size() < 2) {
+        throw std::invalid_argument("Perplexity text must hold at least two tokens");
+    }
+
+    EngineConfig config;
+    config.n_threads = n_threads;
+    Engine engine(model, config);
+
+    PerplexityResult result;
+    double nll = 0.0;
+    for (size_t begin = 0; begin + 1 < tokens.size() && (max_chunks == 0 || result.n_chunks < max_chunks);
+         begin += context_tokens, ++result.n_chunks) {
+        const size_t end = std::min(begin + context_tokens, tokens.size());
+        for (float score : engine.score(TokenVector(tokens.begin() + begin, tokens.begin() + end))) {
+            nll -= score;
+            ++result.n_tokens;
+        }
+    }
+
+    result.mean_nll = result.n_tokens > 0 ? nll / static_cast<double>(result.n_tokens) : 0.0;
+    result.perplexity = std::exp(result.mean_nll);
+    return result;
+}
+
+} // namespace embee
@@ -0,0 +1,335 @@
+/**
+ * @file graph.cpp
+ * @brief Graph construction per architecture and fusion passes
+ */
+
+#include "embee/graph.h"
+#include <sstream>
+#include <stdexcept>
+
+namespace embee {
+
+namespace {
+
+const char* op_name(OpCode op) {
+    switch (op) {
+        case OpCode::EMBED: return "embed";
+        case OpCode::NORM: return "norm";
+        case OpCode::MATMUL: return "matmul";
+        case OpCode::ROPE: return "rope";
+        case OpCode::KV_STORE: return "kv_store";
+        case OpCode::ATTENTION: return "attention";
+        case OpCode::ADD: return "add";
+        case OpCode::MUL: return "mul";
+        case OpCode::ACTIVATION: return "activation";
+        case OpCode::MOE: return "moe";
+    }
+    return "unknown";
+}
+
+// In-place ops read their destination as well as their source
+bool reads(const Instruction& ins, BufferId id) {
+    if (ins.src == id) {
+        return true;
+    }
+    switch (ins.op) {
+        case OpCode::ROPE:
+        case OpCode::ADD:
+        case OpCode::MUL:
+        case OpCode::ACTIVATION:
+            return ins.dst == id;
+        case OpCode::MATMUL:
+            return ins.dst == id && (ins.flags & FLAG_ACCUMULATE);
+        case OpCode::MOE:
+            return id == BufferId::ROUTER || (ins.dst == id && (ins.flags & FLAG_ACCUMULATE));
+        default:
+            return false;
+    }
+}
+
+// Whether the instruction replaces the whole contents of a buffer
+bool overwrites(const Instruction& ins, BufferId id) {
+    return ins.dst == id && !reads(ins, id);
+}
+
+// Whether the value in id after instruction `from` is read before being overwritten
+bool read_later(const Graph& graph, size_t from, BufferId id) {
+    for (size_t i = from + 1; i < graph.program.size(); ++i) {
+        if (reads(graph.program[i], id)) {
+            return true;
+        }
+        if (overwrites(graph.program[i], id)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void erase_instruction(Graph& graph, size_t index) {
+    graph.program.erase(graph.program.begin() + static_cast<std::ptrdiff_t>(index));
+    if (index < graph.logits_begin) {
+        --graph.logits_begin;
+    }
+}
+
+} // namespace
+
+const char* buffer_name(BufferId id) {
+    switch (id) {
+        case BufferId::RESIDUAL: return "residual";
+        case BufferId::ATTN_IN: return "attn_in";
+        case BufferId::QKV: return "qkv";
+        case BufferId::ATTN: return "attn";
+        case BufferId::ATTN_PROJ: return "attn_proj";
+        case BufferId::FFN_IN: return "ffn_in";
+        case BufferId::FF: return "ffn_hidden";
+        case BufferId::FF_GATE: return "ffn_gate";
+        case BufferId::FFN_PROJ: return "ffn_proj";
+        case BufferId::ROUTER: return "router";
+        case BufferId::FINAL_IN: return "final_in";
+        case BufferId::LOGITS: return "logits";
+        case BufferId::COUNT: break;
+    }
+    return "none";
+}
+
+ArchitectureTraits architecture_traits(ModelArchitecture architecture) {
+    switch (architecture) {
+        case ModelArchitecture::LLAMA: return {"llama", true, BlockTopology::SEQUENTIAL};
+        case ModelArchitecture::MISTRAL: return {"mistral", true, BlockTopology::SEQUENTIAL};
+        case ModelArchitecture::GEMMA: return {"gemma", true, BlockTopology::SEQUENTIAL, true, true, true};
+        // Phi-3 layout; Phi-2 blocks (shared LayerNorm, parallel, partial
+        // rotary embeddings) are rejected by build_graph
+        case ModelArchitecture::PHI: return {"phi", true, BlockTopology::SEQUENTIAL};
+        case ModelArchitecture::FALCON: return {"falcon", false, BlockTopology::PARALLEL};
+        case ModelArchitecture::GPT2: return {"gpt2", false, BlockTopology::SEQUENTIAL};
+        case ModelArchitecture::MPT: return {"mpt", false, BlockTopology::SEQUENTIAL};
+        case ModelArchitecture::CUSTOM: return {"custom", false, BlockTopology::SEQUENTIAL};
+    }
+    return {"unknown", false, BlockTopology::SEQUENTIAL};
+}
+
+bool Graph::has_branches() const {
+    for (const auto& ins : program) {
+        if (ins.branch != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t Graph::layer_begin(size_t layer) const {
+    for (size_t i = 0; i < logits_begin; ++i) {
+        if (program[i].layer >= 0 && static_cast<size_t>(program[i].layer) >= layer) {
+            return i;
+        }
+    }
+    return logits_begin;
+}
+
+bool Graph::uses(BufferId id) const {
+    for (const auto& ins : program) {
+        if (ins.dst == id || ins.src == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string Graph::describe() const {
+    std::ostringstream out;
+    for (size_t i = 0; i < program.size(); ++i) {
+        const Instruction& ins = program[i];
+        if (i == logits_begin) {
+            out << "-- logits --\n";
+        }
+        out << i << ": ";
+        if (ins.layer >= 0) {
+            out << "L" << ins.layer << " ";
+        }
+        if (ins.branch != 0) {
+            out << (ins.branch == BRANCH_ATTENTION ? "|attn " : "|ffn ");
+        }
+        out << op_name(ins.op);
+        if (ins.dst != BufferId::COUNT) {
+            out << " " << buffer_name(ins.dst);
+        }
+        if (ins.src != BufferId::COUNT) {
+            out << (ins.flags & FLAG_ACCUMULATE ? " += " : " <- ") << buffer_name(ins.src);
+        }
+        if (ins.weight) {
+            out << " [" << ins.weight->name << (ins.bias ? " + bias" : "") << "]";
+        }
+        if (ins.flags & FLAG_ACTIVATE) {
+            out << " +act";
+        }
+        if (ins.flags & FLAG_SCALE) {
+            out << " +scale";
+        }
+        if (ins.flags & FLAG_LAST_ROW) {
+            out << " (last row)";
+        }
+        out << "\n";
+    }
+    return out.str();
+}
+
+Graph build_graph(const ModelConfig& config, const GraphWeights& weights) {
+    const ArchitectureTraits traits = architecture_traits(config.architecture);
+    const uint8_t norm_flags = static_cast<uint8_t>((traits.rms_norm ? FLAG_RMS_NORM : 0) |
+                                                   (traits.norm_weight_offset ? FLAG_SCALE : 0));
+
+    const bool parallel = traits.topology == BlockTopology::PARALLEL;
+
+    Graph graph;
+    auto& program = graph.program;
+    uint8_t branch = 0;
+    auto emit = [&program, &branch](OpCode op, BufferId dst, BufferId src, int32_t layer, ProfileOp profile_op,
+                                    const Tensor* weight = nullptr, const Tensor* bias = nullptr,
+                                    uint8_t flags = 0) {
+        Instruction ins;
+        ins.op = op;
+        ins.flags = flags;
+        ins.dst = dst;
+        ins.src = src;
+        ins.layer = layer;
+        ins.branch = branch;
+        ins.profile_op = profile_op;
+        ins.weight = weight;
+        ins.bias = bias;
+        program.push_back(ins);
+    };
+
+    if (traits.gated_ffn && config.activation_function != ActivationFunction::GELU) {
+        throw std::invalid_argument(std::string(traits.name) + " feed-forward blocks are GeGLU; "
+                                    "the activation must be GELU");
+    }
+
+    emit(OpCode::EMBED, BufferId::RESIDUAL, BufferId::COUNT, -1, ProfileOp::EMBEDDING,
+         weights.token_embedding, weights.position_embedding, traits.scale_embedding ? FLAG_SCALE : 0);
+
+    // Pre-norm blocks. Sequential: x += attn(norm(x)); x += ffn(norm(x)).
+    // Parallel (Falcon): both branches read norms of the same x, run as
+    // independent branches and are added to x after both finish; with a
+    // single norm the feed-forward reuses the attention input.
+    for (size_t l = 0; l < weights.layers.size(); ++l) {
+        const BlockWeights& w = weights.layers[l];
+        const int32_t layer = static_cast<int32_t>(l);
+        const BufferId ffn_in = parallel && !w.ffn_norm ? BufferId::ATTN_IN : BufferId::FFN_IN;
+        if (!parallel && !w.ffn_norm) {
+            throw std::invalid_argument("Layer " + std::to_string(l) + " of this " + traits.name +
+                                        " model has a single norm; blocks with a shared norm (Phi-2) "
+                                        "are not supported");
+        }
+        if (traits.gated_ffn) {
+            bool gated = w.ffn_router ? !w.experts.empty() : w.ffn_gate != nullptr;
+            for (const ExpertWeights& expert : w.experts) {
+                gated = gated && expert.gate;
+            }
+            if (!gated) {
+                throw std::invalid_argument("Layer " + std::to_string(l) + " of this " + traits.name +
+                                            " model has no feed-forward gate");
+            }
+        }
+
+        emit(OpCode::NORM, BufferId::ATTN_IN, BufferId::RESIDUAL, layer, ProfileOp::ATTN_NORM,
+             w.attn_norm, w.attn_norm_bias, norm_flags);
+        if (parallel && w.ffn_norm) {
+            emit(OpCode::NORM, BufferId::FFN_IN, BufferId::RESIDUAL, layer, ProfileOp::FFN_NORM,
+                 w.ffn_norm, w.ffn_norm_bias, norm_flags);
+        }
+
+        branch = parallel ? BRANCH_ATTENTION : 0;
+        emit(OpCode::MATMUL, BufferId::QKV, BufferId::ATTN_IN, layer, ProfileOp::QKV_PROJ, w.qkv, w.qkv_bias);
+        if (config.is_rope) {
+            emit(OpCode::ROPE, BufferId::QKV, BufferId::COUNT, layer, ProfileOp::ROPE);
+        }
+        emit(OpCode::KV_STORE, BufferId::COUNT, BufferId::QKV, layer, ProfileOp::KV_STORE);
+        emit(OpCode::ATTENTION, BufferId::ATTN, BufferId::QKV, layer, ProfileOp::ATTENTION);
+        emit(OpCode::MATMUL, BufferId::ATTN_PROJ, BufferId::ATTN, layer, ProfileOp::ATTN_OUT_PROJ,
+             w.attn_out, w.attn_out_bias);
+        if (!parallel) {
+            emit(OpCode::ADD, BufferId::RESIDUAL, BufferId::ATTN_PROJ, layer, ProfileOp::RESIDUAL);
+            emit(OpCode::NORM, BufferId::FFN_IN, BufferId::RESIDUAL, layer, ProfileOp::FFN_NORM,
+                 w.ffn_norm, w.ffn_norm_bias, norm_flags);
+        }
+
+        branch = parallel ? BRANCH_FFN : 0;
+        if (w.ffn_router) {
+            // Mixture of experts: route, then run each selected expert over its tokens
+            emit(OpCode::MATMUL, BufferId::ROUTER, ffn_in, layer, ProfileOp::ROUTER, w.ffn_router);
+            emit(OpCode::MOE, BufferId::FFN_PROJ, ffn_in, layer, ProfileOp::EXPERTS);
+        } else {
+            emit(OpCode::MATMUL, BufferId::FF, ffn_in, layer, ProfileOp::FFN_UP, w.ffn_up, w.ffn_up_bias);
+            if (w.ffn_gate) {
+                // Gated feed-forward applies the activation to the gate: up * act(gate)
+                emit(OpCode::MATMUL, BufferId::FF_GATE, ffn_in, layer, ProfileOp::FFN_UP, w.ffn_gate);
+                emit(OpCode::ACTIVATION, BufferId::FF_GATE, BufferId::COUNT, layer, ProfileOp::ACTIVATION);
+                emit(OpCode::MUL, BufferId::FF, BufferId::FF_GATE, layer, ProfileOp::ACTIVATION);
+            } else {
+                emit(OpCode::ACTIVATION, BufferId::FF, BufferId::COUNT, layer, ProfileOp::ACTIVATION);
+            }
+            emit(OpCode::MATMUL, BufferId::FFN_PROJ, BufferId::FF, layer, ProfileOp::FFN_DOWN,
+                 w.ffn_down, w.ffn_down_bias);
+        }
+
+        branch = 0;
+        if (parallel) {
+            emit(OpCode::ADD, BufferId::RESIDUAL, BufferId::ATTN_PROJ, layer, ProfileOp::RESIDUAL);
+        }
+        emit(OpCode::ADD, BufferId::RESIDUAL, BufferId::FFN_PROJ, layer, ProfileOp::RESIDUAL);
+    }
+
+    graph.logits_begin = program.size();
+    emit(OpCode::NORM, BufferId::FINAL_IN, BufferId::RESIDUAL, -1, ProfileOp::FINAL_NORM,
+         weights.final_norm, weights.final_norm_bias, norm_flags | FLAG_LAST_ROW);
+    emit(OpCode::MATMUL, BufferId::LOGITS, BufferId::FINAL_IN, -1, ProfileOp::LM_HEAD,
+         weights.lm_head, nullptr, FLAG_LAST_ROW);
+    return graph;
+}
+
+size_t fuse_activations(Graph& graph) {
+    size_t removed = 0;
+    auto& program = graph.program;
+    for (size_t i = 0; i + 1 < program.size(); ++i) {
+        Instruction& producer = program[i];
+        const Instruction& next = program[i + 1];
+        if (producer.op == OpCode::MATMUL && next.op == OpCode::ACTIVATION && next.dst == producer.dst &&
+            next.branch == producer.branch && !(producer.flags & (FLAG_ACCUMULATE | FLAG_ACTIVATE))) {
+            producer.flags |= FLAG_ACTIVATE;
+            erase_instruction(graph, i + 1);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+size_t fuse_residual_adds(Graph& graph) {
+    size_t removed = 0;
+    auto& program = graph.program;
+    for (size_t i = 0; i + 1 < program.size(); ++i) {
+        Instruction& producer = program[i];
+        const Instruction& add = program[i + 1];
+        if ((producer.op == OpCode::MATMUL || producer.op == OpCode::MOE) &&
+            add.op == OpCode::ADD && add.src == producer.dst && add.branch == producer.branch &&
+            add.dst != producer.src && !(producer.flags & (FLAG_ACCUMULATE | FLAG_ACTIVATE)) &&
+            !read_later(graph, i + 1, producer.dst)) {
+            producer.dst = add.dst;
+            producer.flags |= FLAG_ACCUMULATE;
+            erase_instruction(graph, i + 1);
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+Graph compile_graph(const ModelConfig& config, const GraphWeights& weights, bool fuse) {
+    Graph graph = build_graph(config, weights);
+    if (fuse) {
+        fuse_activations(graph);
+        fuse_residual_adds(graph);
+    }
+    return graph;
+}
+
+} // namespace embee
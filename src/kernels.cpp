@@ -0,0 +1,1062 @@
+/**
+ * @file kernels.cpp
+ * @brief Implementation of the CPU compute kernels
+ */
+
+#include "embee/kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#define EMBEE_KERNELS_AVX2 1
+#endif
+
+namespace embee {
+namespace kernels {
+
+namespace {
+
+int resolve_threads(size_t n_threads) {
+#ifdef _OPENMP
+    return n_threads > 0 ? static_cast<int>(n_threads) : omp_get_max_threads();
+#else
+    (void)n_threads;
+    return 1;
+#endif
+}
+
+// Rows of W dequantized together by gemm()
+constexpr size_t GEMM_TILE_ROWS = 16;
+
+// Vocabulary rows whose logits lm_head_top_k() holds at a time
+constexpr size_t LM_HEAD_TILE = 256;
+
+void check_block_size(DataType type, size_t n, size_t block_size) {
+    if (block_size == 0 || block_size % 8 != 0 || n % block_size != 0) {
+        throw std::invalid_argument("Row length " + std::to_string(n) +
+                                    " is not a multiple of a valid block size for type " +
+                                    std::to_string(static_cast<int>(type)));
+    }
+}
+
+inline float read_scale(const uint8_t* block) {
+    uint16_t h;
+    std::memcpy(&h, block, sizeof(h));
+    return fp16_to_fp32(h);
+}
+
+inline void write_scale(uint8_t* block, float scale) {
+    uint16_t h = fp32_to_fp16(scale);
+    std::memcpy(block, &h, sizeof(h));
+}
+
+float absmax(const float* x, size_t n) {
+    float m = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        m = std::max(m, std::fabs(x[i]));
+    }
+    return m;
+}
+
+// Kernels templated on a size N are compiled with N as a constant, so inner
+// loops have fixed trip counts the compiler can fully unroll. N == 0 is the
+// generic version, taking the size at run time.
+
+template <size_t N>
+inline float dot_n(const float* a, const float* b, size_t size) {
+    const size_t n = N ? N : size;
+    size_t i = 0;
+    float sum = 0.0f;
+#ifdef EMBEE_KERNELS_AVX2
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3));
+    __m128 lo = _mm256_castps256_ps128(acc);
+    __m128 hi = _mm256_extractf128_ps(acc, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    sum = _mm_cvtss_f32(lo);
+#else
+    // Independent accumulators let the compiler vectorize without -ffast-math
+    float acc[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+    for (; i + 8 <= n; i += 8) {
+        for (size_t j = 0; j < 8; ++j) {
+            acc[j] += a[i + j] * b[i + j];
+        }
+    }
+    for (float v : acc) {
+        sum += v;
+    }
+#endif
+    // Head sizes are multiples of 8, so the specialized versions have no tail
+    if (N == 0 || N % 8 != 0) {
+        for (; i < n; ++i) {
+            sum += a[i] * b[i];
+        }
+    }
+    return sum;
+}
+
+// Dot product of one quantized block with FP32 inputs
+
+template <size_t N>
+float dot_block_q8(const uint8_t* block, const float* x, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    const int8_t* q = reinterpret_cast<const int8_t*>(block + 2);
+    float sum = 0.0f;
+    for (size_t i = 0; i < bs; ++i) {
+        sum += q[i] * x[i];
+    }
+    return sum * read_scale(block);
+}
+
+template <size_t N>
+float dot_block_q4(const uint8_t* block, const float* x, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    const uint8_t* qs = block + 2;
+    float sum = 0.0f;
+    for (size_t i = 0; i < bs / 2; ++i) {
+        sum += (static_cast<int>(qs[i] & 0x0F) - 8) * x[2 * i];
+        sum += (static_cast<int>(qs[i] >> 4) - 8) * x[2 * i + 1];
+    }
+    return sum * read_scale(block);
+}
+
+template <size_t N>
+float dot_block_q5(const uint8_t* block, const float* x, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    const uint8_t* qs = block + 2;
+    const uint8_t* qh = qs + bs / 2;
+    float sum = 0.0f;
+    for (size_t i = 0; i < bs / 2; ++i) {
+        size_t e0 = 2 * i;
+        size_t e1 = 2 * i + 1;
+        int v0 = (qs[i] & 0x0F) | (((qh[e0 / 8] >> (e0 % 8)) & 1) << 4);
+        int v1 = (qs[i] >> 4) | (((qh[e1 / 8] >> (e1 % 8)) & 1) << 4);
+        sum += (v0 - 16) * x[e0] + (v1 - 16) * x[e1];
+    }
+    return sum * read_scale(block);
+}
+
+float dot_f16(const uint16_t* w, const float* x, size_t n) {
+    float sum = 0.0f;
+    size_t i = 0;
+#if defined(EMBEE_KERNELS_AVX2) && defined(__F16C__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 wv = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+        acc = _mm256_fmadd_ps(wv, _mm256_loadu_ps(x + i), acc);
+    }
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, acc);
+    for (float lane : lanes) {
+        sum += lane;
+    }
+#endif
+    for (; i < n; ++i) {
+        sum += fp16_to_fp32(w[i]) * x[i];
+    }
+    return sum;
+}
+
+float dot_bf16(const uint16_t* w, const float* x, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t bits = static_cast<uint32_t>(w[i]) << 16;
+        float v;
+        std::memcpy(&v, &bits, sizeof(v));
+        sum += v * x[i];
+    }
+    return sum;
+}
+
+// Precision of the blocks of ADAPTIVE rows, by mask code
+constexpr DataType ADAPTIVE_TYPES[4] = {DataType::INT4, DataType::INT5, DataType::INT8, DataType::FP16};
+
+inline unsigned adaptive_code(const uint8_t* mask, size_t block) {
+    return (mask[block / 4] >> (2 * (block % 4))) & 3u;
+}
+
+// Bytes of one block of an ADAPTIVE row, by mask code
+inline void adaptive_block_sizes(size_t bs, size_t sizes[4]) {
+    sizes[0] = 2 + bs / 2;
+    sizes[1] = 2 + bs / 2 + bs / 8;
+    sizes[2] = 2 + bs;
+    sizes[3] = 2 * bs;
+}
+
+// Dot product of an ADAPTIVE row with an FP32 vector; the mask is read as
+// the row is walked, so every block costs only its own precision
+template <size_t N>
+float adaptive_row_dot(const uint8_t* row, const float* x, size_t cols, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    const size_t n_blocks = cols / bs;
+    size_t sizes[4];
+    adaptive_block_sizes(bs, sizes);
+    const uint8_t* block = row + adaptive_mask_bytes(n_blocks);
+    float sum = 0.0f;
+    for (size_t b = 0; b < n_blocks; ++b) {
+        const unsigned code = adaptive_code(row, b);
+        const float* xb = x + b * bs;
+        switch (code) {
+            case 0: sum += dot_block_q4<N>(block, xb, bs); break;
+            case 1: sum += dot_block_q5<N>(block, xb, bs); break;
+            case 2: sum += dot_block_q8<N>(block, xb, bs); break;
+            default: sum += dot_f16(reinterpret_cast<const uint16_t*>(block), xb, bs); break;
+        }
+        block += sizes[code];
+    }
+    return sum;
+}
+
+// Dot product of one stored row with an FP32 vector
+template <size_t N>
+float row_dot(DataType type, const uint8_t* row, const float* x, size_t cols, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    switch (type) {
+        case DataType::FP32:
+            return dot(reinterpret_cast<const float*>(row), x, cols);
+        case DataType::FP16:
+            return dot_f16(reinterpret_cast<const uint16_t*>(row), x, cols);
+        case DataType::BF16:
+            return dot_bf16(reinterpret_cast<const uint16_t*>(row), x, cols);
+        case DataType::ADAPTIVE:
+            return adaptive_row_dot<N>(row, x, cols, bs);
+        default:
+            break;
+    }
+
+    const size_t block_bytes = row_bytes(type, bs, bs);
+    float sum = 0.0f;
+    for (size_t b = 0; b < cols / bs; ++b) {
+        const uint8_t* block = row + b * block_bytes;
+        const float* xb = x + b * bs;
+        switch (type) {
+            case DataType::INT8: sum += dot_block_q8<N>(block, xb, bs); break;
+            case DataType::INT4: sum += dot_block_q4<N>(block, xb, bs); break;
+            case DataType::INT5: sum += dot_block_q5<N>(block, xb, bs); break;
+            default: break;
+        }
+    }
+    return sum;
+}
+
+inline float gelu_value(float v) {
+    constexpr float k = 0.7978845608f;  // sqrt(2 / pi)
+    return 0.5f * v * (1.0f + std::tanh(k * (v + 0.044715f * v * v * v)));
+}
+
+inline float silu_value(float v) {
+    return v / (1.0f + std::exp(-v));
+}
+
+inline float relu_value(float v) {
+    return std::max(v, 0.0f);
+}
+
+// Write one matmul output through the epilogue
+inline void store_output(const MatmulEpilogue& epilogue, float* y, float value, size_t row) {
+    if (epilogue.bias) {
+        value += epilogue.bias[row];
+    }
+    if (epilogue.activate) {
+        switch (epilogue.activation) {
+            case ActivationFunction::GELU: value = gelu_value(value); break;
+            case ActivationFunction::RELU: value = relu_value(value); break;
+            case ActivationFunction::SILU:
+            case ActivationFunction::SWIGLU: value = silu_value(value); break;
+        }
+    }
+    *y = epilogue.accumulate ? *y + value : value;
+}
+
+// Encode one INT8, INT4 or INT5 block of bs values with the scale that maps
+// its largest magnitude to the top level
+void quantize_block(DataType type, const float* x, uint8_t* block, size_t bs) {
+    const float qmax = type == DataType::INT8 ? 127.0f : type == DataType::INT5 ? 15.0f : 7.0f;
+    quantize_block_with_scale(type, x, absmax(x, bs) / qmax, block, bs);
+}
+
+// Decode one INT8, INT4 or INT5 block
+template <size_t N>
+inline void dequantize_block(DataType type, const uint8_t* block, float* y, size_t block_size) {
+    const size_t bs = N ? N : block_size;
+    const float d = read_scale(block);
+    if (type == DataType::INT8) {
+        const int8_t* q = reinterpret_cast<const int8_t*>(block + 2);
+        for (size_t i = 0; i < bs; ++i) {
+            y[i] = q[i] * d;
+        }
+    } else if (type == DataType::INT4) {
+        const uint8_t* qs = block + 2;
+        for (size_t i = 0; i < bs / 2; ++i) {
+            y[2 * i] = (static_cast<int>(qs[i] & 0x0F) - 8) * d;
+            y[2 * i + 1] = (static_cast<int>(qs[i] >> 4) - 8) * d;
+        }
+    } else if (type == DataType::INT5) {
+        const uint8_t* qs = block + 2;
+        const uint8_t* qh = qs + bs / 2;
+        for (size_t i = 0; i < bs; ++i) {
+            int lo = (i % 2 == 0) ? (qs[i / 2] & 0x0F) : (qs[i / 2] >> 4);
+            int hi = (qh[i / 8] >> (i % 8)) & 1;
+            y[i] = ((lo | (hi << 4)) - 16) * d;
+        }
+    }
+}
+
+template <size_t N>
+void dequantize_row_n(DataType type, const uint8_t* src, float* dst, size_t n, size_t block_size) {
+    switch (type) {
+        case DataType::FP32:
+            std::memcpy(dst, src, n * sizeof(float));
+            return;
+        case DataType::FP16:
+            for (size_t i = 0; i < n; ++i) {
+                uint16_t h;
+                std::memcpy(&h, src + 2 * i, sizeof(h));
+                dst[i] = fp16_to_fp32(h);
+            }
+            return;
+        case DataType::BF16:
+            for (size_t i = 0; i < n; ++i) {
+                uint16_t h;
+                std::memcpy(&h, src + 2 * i, sizeof(h));
+                uint32_t bits = static_cast<uint32_t>(h) << 16;
+                std::memcpy(&dst[i], &bits, sizeof(float));
+            }
+            return;
+        default:
+            break;
+    }
+
+    const size_t bs = N ? N : block_size;
+    if (type == DataType::ADAPTIVE) {
+        const size_t n_blocks = n / bs;
+        size_t sizes[4];
+        adaptive_block_sizes(bs, sizes);
+        const uint8_t* block = src + adaptive_mask_bytes(n_blocks);
+        for (size_t b = 0; b < n_blocks; ++b) {
+            const unsigned code = adaptive_code(src, b);
+            float* y = dst + b * bs;
+            if (ADAPTIVE_TYPES[code] == DataType::FP16) {
+                for (size_t i = 0; i < bs; ++i) {
+                    uint16_t h;
+                    std::memcpy(&h, block + 2 * i, sizeof(h));
+                    y[i] = fp16_to_fp32(h);
+                }
+            } else {
+                dequantize_block<N>(ADAPTIVE_TYPES[code], block, y, bs);
+            }
+            block += sizes[code];
+        }
+        return;
+    }
+
+    const size_t block_bytes = row_bytes(type, bs, bs);
+    for (size_t b = 0; b < n / bs; ++b) {
+        dequantize_block<N>(type, src + b * block_bytes, dst + b * bs, bs);
+    }
+}
+
+template <size_t N>
+void gemv_n(DataType type, const uint8_t* w, const float* x, float* y,
+            size_t rows, size_t cols, size_t block_size, size_t n_threads,
+            const MatmulEpilogue& epilogue) {
+    const size_t stride = row_bytes(type, cols, block_size, w);
+    const long n_rows = static_cast<long>(rows);
+
+    #pragma omp parallel for num_threads(resolve_threads(n_threads)) schedule(static)
+    for (long r = 0; r < n_rows; ++r) {
+        store_output(epilogue, y + r, row_dot<N>(type, w + r * stride, x, cols, block_size), r);
+    }
+}
+
+template <size_t N>
+void gemm_n(DataType type, const uint8_t* w, const float* x, float* y,
+            size_t m, size_t rows, size_t cols, size_t block_size, size_t n_threads,
+            const MatmulEpilogue& epilogue) {
+    const size_t stride = row_bytes(type, cols, block_size, w);
+    const long n_tiles = static_cast<long>((rows + GEMM_TILE_ROWS - 1) / GEMM_TILE_ROWS);
+
+    #pragma omp parallel for num_threads(resolve_threads(n_threads)) schedule(static)
+    for (long t = 0; t < n_tiles; ++t) {
+        const size_t row0 = t * GEMM_TILE_ROWS;
+        const size_t tile_rows = std::min(GEMM_TILE_ROWS, rows - row0);
+
+        // FP32 weights are used directly; other types are dequantized once per tile
+        const float* tile;
+        thread_local AlignedVector<float> buffer;
+        if (type == DataType::FP32) {
+            tile = reinterpret_cast<const float*>(w + row0 * stride);
+        } else {
+            buffer.resize(tile_rows * cols);
+            for (size_t r = 0; r < tile_rows; ++r) {
+                dequantize_row_n<N>(type, w + (row0 + r) * stride, buffer.data() + r * cols, cols, block_size);
+            }
+            tile = buffer.data();
+        }
+
+        for (size_t i = 0; i < m; ++i) {
+            const float* xi = x + i * cols;
+            float* yi = y + i * rows + row0;
+            for (size_t r = 0; r < tile_rows; ++r) {
+                store_output(epilogue, yi + r, dot(xi, tile + r * cols, cols), row0 + r);
+            }
+        }
+    }
+}
+
+template <size_t N>
+void rope_n(float* x, size_t n_heads, size_t head_size, size_t pos, float freq_base, float scaling) {
+    const size_t head_dim = N ? N : head_size;
+    // Rotates (x[i], x[i + half]) pairs, the layout used by HF checkpoints
+    const size_t half = head_dim / 2;
+    const float p = static_cast<float>(pos) / (scaling > 0.0f ? scaling : 1.0f);
+
+    // The inverse frequencies only change with head_dim and freq_base, and
+    // the angles only with the position: queries and keys of a token share
+    // them, so each is computed once per thread and reused
+    struct Table {
+        size_t head_dim = 0;
+        float freq_base = 0.0f;
+        float p = -1.0f;
+        AlignedVector<float> inv_freq, cos, sin;
+    };
+    thread_local Table table;
+    if (table.head_dim != head_dim || table.freq_base != freq_base) {
+        table.head_dim = head_dim;
+        table.freq_base = freq_base;
+        table.p = -1.0f;
+        table.inv_freq.resize(half);
+        table.cos.resize(half);
+        table.sin.resize(half);
+        for (size_t i = 0; i < half; ++i) {
+            table.inv_freq[i] = std::pow(freq_base, -2.0f * i / static_cast<float>(head_dim));
+        }
+    }
+    if (table.p != p) {
+        table.p = p;
+        for (size_t i = 0; i < half; ++i) {
+            const float theta = p * table.inv_freq[i];
+            table.cos[i] = std::cos(theta);
+            table.sin[i] = std::sin(theta);
+        }
+    }
+    const float* cos_table = table.cos.data();
+    const float* sin_table = table.sin.data();
+
+    for (size_t h = 0; h < n_heads; ++h) {
+        float* v = x + h * head_dim;
+        for (size_t i = 0; i < half; ++i) {
+            const float a = v[i];
+            const float b = v[i + half];
+            v[i] = a * cos_table[i] - b * sin_table[i];
+            v[i + half] = a * sin_table[i] + b * cos_table[i];
+        }
+    }
+}
+
+template <size_t N>
+void attention_n(const float* q, const float* k_cache, const float* v_cache, float* out,
+                 size_t n_heads, size_t n_kv_heads, size_t head_size, size_t n_ctx,
+                 float* scratch, size_t n_threads, const float* alibi_slopes) {
+    const size_t head_dim = N ? N : head_size;
+    const size_t kv_dim = n_kv_heads * head_dim;
+    const size_t group = n_heads / n_kv_heads;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(head_dim));
+    const long heads = static_cast<long>(n_heads);
+
+    #pragma omp parallel for num_threads(resolve_threads(n_threads)) schedule(static)
+    for (long h = 0; h < heads; ++h) {
+        const float* qh = q + h * head_dim;
+        const size_t kv_offset = (h / group) * head_dim;
+        float* scores = scratch + h * n_ctx;
+
+        if (alibi_slopes) {
+            // Linear penalty on the distance from the query (the last position)
+            const float slope = alibi_slopes[h];
+            const float last = static_cast<float>(n_ctx - 1);
+            for (size_t t = 0; t < n_ctx; ++t) {
+                scores[t] = dot_n<N>(qh, k_cache + t * kv_dim + kv_offset, head_dim) * scale -
+                            slope * (last - static_cast<float>(t));
+            }
+        } else {
+            for (size_t t = 0; t < n_ctx; ++t) {
+                scores[t] = dot_n<N>(qh, k_cache + t * kv_dim + kv_offset, head_dim) * scale;
+            }
+        }
+        softmax(scores, n_ctx);
+
+        float* oh = out + h * head_dim;
+        std::fill(oh, oh + head_dim, 0.0f);
+        for (size_t t = 0; t < n_ctx; ++t) {
+            const float* vt = v_cache + t * kv_dim + kv_offset;
+            const float s = scores[t];
+            for (size_t d = 0; d < head_dim; ++d) {
+                oh[d] += s * vt[d];
+            }
+        }
+    }
+}
+
+// Call f with the block size as a compile-time constant when it is a common
+// one, else with 0 (generic)
+template <typename F>
+auto with_block_size(size_t block_size, F&& f) {
+    switch (block_size) {
+        case 32: return f(std::integral_constant<size_t, 32>());
+        case 64: return f(std::integral_constant<size_t, 64>());
+        case 128: return f(std::integral_constant<size_t, 128>());
+        default: return f(std::integral_constant<size_t, 0>());
+    }
+}
+
+// Same for the attention head size
+template <typename F>
+auto with_head_dim(size_t head_dim, F&& f) {
+    switch (head_dim) {
+        case 64: return f(std::integral_constant<size_t, 64>());
+        case 80: return f(std::integral_constant<size_t, 80>());
+        case 96: return f(std::integral_constant<size_t, 96>());
+        case 128: return f(std::integral_constant<size_t, 128>());
+        default: return f(std::integral_constant<size_t, 0>());
+    }
+}
+
+DequantizeRowFn select_dequantize_row(size_t block_size) {
+    return with_block_size(block_size, [](auto bs) -> DequantizeRowFn {
+        return dequantize_row_n<decltype(bs)::value>;
+    });
+}
+
+GemvFn select_gemv(size_t block_size) {
+    return with_block_size(block_size, [](auto bs) -> GemvFn { return gemv_n<decltype(bs)::value>; });
+}
+
+GemmFn select_gemm(size_t block_size) {
+    return with_block_size(block_size, [](auto bs) -> GemmFn { return gemm_n<decltype(bs)::value>; });
+}
+
+RopeFn select_rope(size_t head_dim) {
+    return with_head_dim(head_dim, [](auto hd) -> RopeFn { return rope_n<decltype(hd)::value>; });
+}
+
+AttentionFn select_attention(size_t head_dim) {
+    return with_head_dim(head_dim, [](auto hd) -> AttentionFn { return attention_n<decltype(hd)::value>; });
+}
+
+// Candidate order of lm_head_top_k(): larger logit first, then lower token ID
+inline bool better_candidate(const std::pair<float, TokenId>& a, const std::pair<float, TokenId>& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+template <size_t N>
+size_t lm_head_top_k_n(DataType type, const uint8_t* w, const float* x, size_t n_vocab, size_t n_embd,
+                       size_t block_size, size_t k, const uint8_t* skip, SamplingScratch& scratch,
+                       size_t n_threads) {
+    const size_t stride = row_bytes(type, n_embd, block_size, w);
+    const long n_tiles = static_cast<long>((n_vocab + LM_HEAD_TILE - 1) / LM_HEAD_TILE);
+    const int threads = resolve_threads(n_threads);
+    auto& candidates = scratch.candidates;
+    candidates.resize(static_cast<size_t>(threads) * k);
+    std::vector<size_t> counts(threads, 0);
+
+    #pragma omp parallel num_threads(threads)
+    {
+#ifdef _OPENMP
+        const size_t t = static_cast<size_t>(omp_get_thread_num());
+#else
+        const size_t t = 0;
+#endif
+        // Heap whose front is the worst of the thread's candidates
+        std::pair<float, TokenId>* heap = candidates.data() + t * k;
+        size_t size = 0;
+        float tile[LM_HEAD_TILE];
+
+        #pragma omp for schedule(static)
+        for (long i = 0; i < n_tiles; ++i) {
+            const size_t begin = static_cast<size_t>(i) * LM_HEAD_TILE;
+            const size_t end = std::min(begin + LM_HEAD_TILE, n_vocab);
+            for (size_t r = begin; r < end; ++r) {
+                tile[r - begin] = row_dot<N>(type, w + r * stride, x, n_embd, block_size);
+            }
+            for (size_t r = begin; r < end; ++r) {
+                if (skip && skip[r]) {
+                    continue;
+                }
+                const std::pair<float, TokenId> item(tile[r - begin], static_cast<TokenId>(r));
+                if (size < k) {
+                    heap[size++] = item;
+                    std::push_heap(heap, heap + size, better_candidate);
+                } else if (better_candidate(item, heap[0])) {
+                    std::pop_heap(heap, heap + size, better_candidate);
+                    heap[size - 1] = item;
+                    std::push_heap(heap, heap + size, better_candidate);
+                }
+            }
+        }
+        counts[t] = size;
+    }
+
+    // Merge the per-thread lists at the front
+    size_t n = 0;
+    for (size_t t = 0; t < counts.size(); ++t) {
+        std::copy(candidates.begin() + t * k, candidates.begin() + t * k + counts[t], candidates.begin() + n);
+        n += counts[t];
+    }
+    const size_t result = std::min(k, n);
+    std::partial_sort(candidates.begin(), candidates.begin() + result, candidates.begin() + n, better_candidate);
+    candidates.resize(result);
+    return result;
+}
+
+} // namespace
+
+uint16_t fp32_to_fp16(float value) {
+#ifdef __F16C__
+    return static_cast<uint16_t>(_cvtss_sh(value, 0));
+#else
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000;
+    const uint32_t raw_exp = (f >> 23) & 0xFF;
+    uint32_t mant = f & 0x7FFFFF;
+
+    if (raw_exp == 0xFF) {
+        return static_cast<uint16_t>(sign | 0x7C00 | (mant ? 0x200 : 0));  // Inf / NaN
+    }
+    int32_t exp = static_cast<int32_t>(raw_exp) - 127 + 15;
+    if (exp >= 31) {
+        return static_cast<uint16_t>(sign | 0x7C00);  // Overflow to Inf
+    }
+    if (exp <= 0) {
+        if (exp < -10) {
+            return static_cast<uint16_t>(sign);  // Underflow to zero
+        }
+        // Subnormal half: shift the implicit bit in, round to nearest even
+        mant |= 0x800000;
+        const uint32_t shift = static_cast<uint32_t>(14 - exp);
+        uint32_t half = mant >> shift;
+        const uint32_t rem = mant & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (half & 1))) {
+            ++half;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    uint32_t half = (static_cast<uint32_t>(exp) << 10) | (mant >> 13);
+    const uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) {
+        ++half;  // May carry into the exponent, which is the correct rounding
+    }
+    return static_cast<uint16_t>(sign | half);
+#endif
+}
+
+float fp16_to_fp32(uint16_t value) {
+#ifdef __F16C__
+    return _cvtsh_ss(value);
+#else
+    const uint32_t sign = static_cast<uint32_t>(value & 0x8000) << 16;
+    const uint32_t exp = (value >> 10) & 0x1F;
+    const uint32_t mant = value & 0x3FF;
+    uint32_t bits;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            float v = std::ldexp(static_cast<float>(mant), -24);
+            return sign ? -v : v;
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7F800000 | (mant << 13);
+    } else {
+        bits = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+#endif
+}
+
+size_t row_bytes(DataType type, size_t n, size_t block_size, const uint8_t* row) {
+    switch (type) {
+        case DataType::FP32: return n * sizeof(float);
+        case DataType::FP16:
+        case DataType::BF16: return n * sizeof(uint16_t);
+        case DataType::INT8:
+            check_block_size(type, n, block_size);
+            return n / block_size * (2 + block_size);
+        case DataType::INT4:
+            check_block_size(type, n, block_size);
+            return n / block_size * (2 + block_size / 2);
+        case DataType::INT5:
+            check_block_size(type, n, block_size);
+            return n / block_size * (2 + block_size / 2 + block_size / 8);
+        case DataType::ADAPTIVE: {
+            check_block_size(type, n, block_size);
+            if (!row) {
+                throw std::invalid_argument("The size of an ADAPTIVE row depends on its precision mask");
+            }
+            size_t sizes[4];
+            adaptive_block_sizes(block_size, sizes);
+            const size_t n_blocks = n / block_size;
+            size_t bytes = adaptive_mask_bytes(n_blocks);
+            for (size_t b = 0; b < n_blocks; ++b) {
+                bytes += sizes[adaptive_code(row, b)];
+            }
+            return bytes;
+        }
+    }
+    throw std::invalid_argument("Unsupported data type");
+}
+
+size_t adaptive_mask_bytes(size_t n_blocks) {
+    return (n_blocks + 7) / 8 * 2;
+}
+
+DataType adaptive_block_type(const uint8_t* row, size_t block) {
+    return ADAPTIVE_TYPES[adaptive_code(row, block)];
+}
+
+void quantize_row(DataType type, const float* src, uint8_t* dst, size_t n, size_t block_size) {
+    switch (type) {
+        case DataType::FP32:
+            std::memcpy(dst, src, n * sizeof(float));
+            return;
+        case DataType::FP16:
+            for (size_t i = 0; i < n; ++i) {
+                uint16_t h = fp32_to_fp16(src[i]);
+                std::memcpy(dst + 2 * i, &h, sizeof(h));
+            }
+            return;
+        case DataType::BF16:
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t bits;
+                std::memcpy(&bits, &src[i], sizeof(bits));
+                uint16_t h = static_cast<uint16_t>((bits + 0x7FFF + ((bits >> 16) & 1)) >> 16);
+                std::memcpy(dst + 2 * i, &h, sizeof(h));
+            }
+            return;
+        case DataType::ADAPTIVE:
+            throw std::invalid_argument("ADAPTIVE rows need block precisions; use quantize_adaptive_row()");
+        default:
+            break;
+    }
+
+    const size_t bs = block_size;
+    const size_t block_bytes = row_bytes(type, bs, bs);
+    check_block_size(type, n, bs);
+    for (size_t b = 0; b < n / bs; ++b) {
+        quantize_block(type, src + b * bs, dst + b * block_bytes, bs);
+    }
+}
+
+void quantize_block_with_scale(DataType type, const float* src, float scale, uint8_t* dst, size_t block_size) {
+    const size_t bs = block_size;
+    const float d = scale;
+    const float id = d > 0.0f ? 1.0f / d : 0.0f;
+    write_scale(dst, d);
+    if (type == DataType::INT8) {
+        int8_t* q = reinterpret_cast<int8_t*>(dst + 2);
+        for (size_t i = 0; i < bs; ++i) {
+            q[i] = static_cast<int8_t>(std::clamp(std::lround(src[i] * id), -128L, 127L));
+        }
+    } else if (type == DataType::INT4) {
+        uint8_t* qs = dst + 2;
+        for (size_t i = 0; i < bs / 2; ++i) {
+            long q0 = std::clamp(std::lround(src[2 * i] * id) + 8, 0L, 15L);
+            long q1 = std::clamp(std::lround(src[2 * i + 1] * id) + 8, 0L, 15L);
+            qs[i] = static_cast<uint8_t>(q0 | (q1 << 4));
+        }
+    } else if (type == DataType::INT5) {
+        uint8_t* qs = dst + 2;
+        uint8_t* qh = qs + bs / 2;
+        std::memset(qh, 0, bs / 8);
+        for (size_t i = 0; i < bs; ++i) {
+            long q = std::clamp(std::lround(src[i] * id) + 16, 0L, 31L);
+            if (i % 2 == 0) {
+                qs[i / 2] = static_cast<uint8_t>(q & 0x0F);
+            } else {
+                qs[i / 2] |= static_cast<uint8_t>((q & 0x0F) << 4);
+            }
+            qh[i / 8] |= static_cast<uint8_t>(((q >> 4) & 1) << (i % 8));
+        }
+    } else {
+        throw std::invalid_argument("Only INT8, INT5 and INT4 blocks have a scale");
+    }
+}
+
+size_t quantize_adaptive_row(const float* src, const DataType* block_types, uint8_t* dst,
+                             size_t n, size_t block_size) {
+    check_block_size(DataType::ADAPTIVE, n, block_size);
+    const size_t n_blocks = n / block_size;
+    const size_t mask_bytes = adaptive_mask_bytes(n_blocks);
+    std::memset(dst, 0, mask_bytes);
+    uint8_t* block = dst + mask_bytes;
+    for (size_t b = 0; b < n_blocks; ++b) {
+        const auto code = std::find(std::begin(ADAPTIVE_TYPES), std::end(ADAPTIVE_TYPES), block_types[b]) -
+                          std::begin(ADAPTIVE_TYPES);
+        if (code == 4) {
+            throw std::invalid_argument("ADAPTIVE blocks must be INT4, INT5, INT8 or FP16");
+        }
+        dst[b / 4] |= static_cast<uint8_t>(code << (2 * (b % 4)));
+        const float* x = src + b * block_size;
+        if (block_types[b] == DataType::FP16) {
+            quantize_row(DataType::FP16, x, block, block_size, block_size);
+            block += 2 * block_size;
+        } else {
+            quantize_block(block_types[b], x, block, block_size);
+            block += row_bytes(block_types[b], block_size, block_size);
+        }
+    }
+    return static_cast<size_t>(block - dst);
+}
+
+void dequantize_row(DataType type, const uint8_t* src, float* dst, size_t n, size_t block_size) {
+    select_dequantize_row(block_size)(type, src, dst, n, block_size);
+}
+
+float dot(const float* a, const float* b, size_t n) {
+    return dot_n<0>(a, b, n);
+}
+
+void gemv(DataType type, const uint8_t* w, const float* x, float* y,
+          size_t rows, size_t cols, size_t block_size, size_t n_threads,
+          const MatmulEpilogue& epilogue) {
+    select_gemv(block_size)(type, w, x, y, rows, cols, block_size, n_threads, epilogue);
+}
+
+void gemm(DataType type, const uint8_t* w, const float* x, float* y,
+          size_t m, size_t rows, size_t cols, size_t block_size, size_t n_threads,
+          const MatmulEpilogue& epilogue) {
+    select_gemm(block_size)(type, w, x, y, m, rows, cols, block_size, n_threads, epilogue);
+}
+
+void gemv(const WeightView& w, const float* x, float* y, size_t n_threads,
+          const MatmulEpilogue& epilogue) {
+    gemv(w.type(), w.data(), x, y, w.rows(), w.cols(), w.block_size(), n_threads, epilogue);
+}
+
+void gemm(const WeightView& w, const float* x, float* y, size_t m, size_t n_threads,
+          const MatmulEpilogue& epilogue) {
+    gemm(w.type(), w.data(), x, y, m, w.rows(), w.cols(), w.block_size(), n_threads, epilogue);
+}
+
+void rms_norm(const float* x, const float* weight, float* y, size_t n, float eps, float weight_offset) {
+    const float ms = dot(x, x, n) / static_cast<float>(n);
+    const float scale = 1.0f / std::sqrt(ms + eps);
+    for (size_t i = 0; i < n; ++i) {
+        y[i] = x[i] * scale * (weight ? weight_offset + weight[i] : 1.0f);
+    }
+}
+
+void layer_norm(const float* x, const float* weight, const float* bias, float* y,
+                size_t n, float eps) {
+    float mean = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        mean += x[i];
+    }
+    mean /= static_cast<float>(n);
+
+    float var = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        const float d = x[i] - mean;
+        var += d * d;
+    }
+    var /= static_cast<float>(n);
+
+    const float scale = 1.0f / std::sqrt(var + eps);
+    for (size_t i = 0; i < n; ++i) {
+        float v = (x[i] - mean) * scale;
+        if (weight) {
+            v *= weight[i];
+        }
+        if (bias) {
+            v += bias[i];
+        }
+        y[i] = v;
+    }
+}
+
+void rope(float* x, size_t n_heads, size_t head_dim, size_t pos, float freq_base, float scaling) {
+    select_rope(head_dim)(x, n_heads, head_dim, pos, freq_base, scaling);
+}
+
+void softmax(float* x, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    const float max_val = *std::max_element(x, x + n);
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = std::exp(x[i] - max_val);
+        sum += x[i];
+    }
+    const float inv = 1.0f / sum;
+    for (size_t i = 0; i < n; ++i) {
+        x[i] *= inv;
+    }
+}
+
+void attention(const float* q, const float* k_cache, const float* v_cache, float* out,
+               size_t n_heads, size_t n_kv_heads, size_t head_dim, size_t n_ctx,
+               float* scratch, size_t n_threads, const float* alibi_slopes) {
+    select_attention(head_dim)(q, k_cache, v_cache, out, n_heads, n_kv_heads, head_dim, n_ctx,
+                               scratch, n_threads, alibi_slopes);
+}
+
+std::vector<float> alibi_slopes(size_t n_heads, float max_bias) {
+    size_t n = 1;
+    while (n * 2 <= n_heads) {
+        n *= 2;
+    }
+    const float m0 = std::pow(2.0f, -max_bias / static_cast<float>(n));
+    const float m1 = std::pow(2.0f, -max_bias / 2.0f / static_cast<float>(n));
+    std::vector<float> slopes(n_heads);
+    for (size_t h = 0; h < n_heads; ++h) {
+        slopes[h] = h < n ? std::pow(m0, static_cast<float>(h + 1))
+                          : std::pow(m1, static_cast<float>(2 * (h - n) + 1));
+    }
+    return slopes;
+}
+
+KernelSet select_kernels(size_t head_dim, size_t block_size, bool generic) {
+    KernelSet set;
+    set.head_dim = head_dim;
+    set.block_size = block_size;
+    const size_t hd = generic ? 0 : head_dim;
+    const size_t bs = generic ? 0 : block_size;
+    set.attention = select_attention(hd);
+    set.rope = select_rope(hd);
+    set.dequantize_row = select_dequantize_row(bs);
+    set.gemv = select_gemv(bs);
+    set.gemm = select_gemm(bs);
+    set.specialized_head_dim = set.attention != attention_n<0>;
+    set.specialized_block_size = set.gemv != gemv_n<0>;
+    return set;
+}
+
+void gelu(float* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = gelu_value(x[i]);
+    }
+}
+
+void silu(float* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = silu_value(x[i]);
+    }
+}
+
+void relu(float* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = relu_value(x[i]);
+    }
+}
+
+void activate(ActivationFunction function, float* x, size_t n) {
+    switch (function) {
+        case ActivationFunction::GELU:
+            gelu(x, n);
+            break;
+        case ActivationFunction::RELU:
+            relu(x, n);
+            break;
+        case ActivationFunction::SILU:
+        case ActivationFunction::SWIGLU:
+            silu(x, n);
+            break;
+    }
+}
+
+size_t lm_head_top_k(DataType type, const uint8_t* w, const float* x, size_t n_vocab, size_t n_embd,
+                     size_t block_size, size_t k, const uint8_t* skip, SamplingScratch& scratch,
+                     size_t n_threads) {
+    if (k == 0) {
+        scratch.candidates.clear();
+        return 0;
+    }
+    return with_block_size(block_size, [&](auto bs) {
+        return lm_head_top_k_n<decltype(bs)::value>(type, w, x, n_vocab, n_embd, block_size, k, skip,
+                                                    scratch, n_threads);
+    });
+}
+
+TokenId argmax(const float* logits, size_t n) {
+    return static_cast<TokenId>(std::distance(logits, std::max_element(logits, logits + n)));
+}
+
+TokenId sample_top_p(const float* logits, size_t n, float top_p, std::mt19937& gen,
+                     SamplingScratch& scratch) {
+    // If top_p is close to 0, just return the most likely token
+    if (top_p < 1e-6f) {
+        return argmax(logits, n);
+    }
+
+    std::vector<float>& probs = scratch.probs;
+    probs.assign(logits, logits + n);
+    softmax(probs.data(), n);
+
+    // Sort indices by probability (descending)
+    std::vector<int32_t>& indices = scratch.indices;
+    indices.resize(n);
+    std::iota(indices.begin(), indices.end(), 0);
+    std::sort(indices.begin(), indices.end(), [&probs](int32_t a, int32_t b) {
+        return probs[a] > probs[b];
+    });
+
+    // Compute cumulative probabilities and find cutoff
+    float cumsum = 0.0f;
+    size_t cutoff_idx = indices.size() - 1;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        cumsum += probs[indices[i]];
+        if (cumsum >= top_p) {
+            cutoff_idx = i;
+            break;
+        }
+    }
+
+    // Sample from the truncated distribution
+    float norm_factor = 0.0f;
+    for (size_t i = 0; i <= cutoff_idx; ++i) {
+        norm_factor += probs[indices[i]];
+    }
+    std::uniform_real_distribution<float> dist(0.0f, norm_factor);
+    const float r = dist(gen);
+    float cdf = 0.0f;
+    for (size_t i = 0; i <= cutoff_idx; ++i) {
+        cdf += probs[indices[i]];
+        if (r <= cdf) {
+            return indices[i];
+        }
+    }
+
+    // Fallback (should rarely happen)
+    return indices[0];
+}
+
+} // namespace kernels
+} // namespace embee
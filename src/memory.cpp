@@ -0,0 +1,188 @@
+/**
+ * @file memory.cpp
+ * @brief Aligned allocation, arenas and scratch pools
+ */
+
+#include "embee/memory.h"
+#include <algorithm>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+constexpr size_t PAGE_SIZE = 4096;
+constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+} // namespace
+
+void* aligned_allocate(size_t bytes, size_t alignment) {
+    alignment = std::max(alignment, MEMORY_ALIGNMENT);
+    // Page-align large buffers so they start on whole (huge) pages
+    if (bytes >= HUGE_PAGE_SIZE) {
+        alignment = std::max(alignment, HUGE_PAGE_SIZE);
+    } else if (bytes >= PAGE_SIZE) {
+        alignment = std::max(alignment, PAGE_SIZE);
+    }
+    // aligned_alloc requires the size to be a multiple of the alignment
+    const size_t size = align_up(std::max<size_t>(bytes, 1), alignment);
+    void* ptr = std::aligned_alloc(alignment, size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (bytes >= HUGE_PAGE_SIZE) {
+        // Advisory: fewer TLB misses when the kernel backs it with huge pages
+        ::madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+
+void aligned_free(void* ptr) {
+    std::free(ptr);
+}
+
+// ============================================================================
+// Arena
+// ============================================================================
+
+Arena::Arena(size_t block_size) : block_size_(std::max(block_size, PAGE_SIZE)) {}
+
+Arena::~Arena() {
+    for (const auto& block : blocks_) {
+        aligned_free(block.data);
+    }
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment) {
+    alignment = std::max(alignment, MEMORY_ALIGNMENT);
+    size_t offset = blocks_.empty() ? 0 : align_up(offset_, alignment);
+    if (blocks_.empty() || offset + bytes > blocks_.back().size) {
+        const size_t size = std::max(block_size_, align_up(bytes, PAGE_SIZE));
+        blocks_.push_back(Block{static_cast<uint8_t*>(aligned_allocate(size, PAGE_SIZE)), size});
+        reserved_ += size;
+        offset = 0;
+    }
+    offset_ = offset + bytes;
+    used_ += bytes;
+    return blocks_.back().data + offset;
+}
+
+void Arena::reset() {
+    // Keep the largest block so steady-state use does not reallocate
+    if (blocks_.size() > 1) {
+        auto largest = std::max_element(blocks_.begin(), blocks_.end(),
+                                        [](const Block& a, const Block& b) { return a.size < b.size; });
+        Block keep = *largest;
+        for (const auto& block : blocks_) {
+            if (block.data != keep.data) {
+                aligned_free(block.data);
+            }
+        }
+        blocks_.assign(1, keep);
+        reserved_ = keep.size;
+    }
+    offset_ = 0;
+    used_ = 0;
+}
+
+// ============================================================================
+// ScratchPool
+// ============================================================================
+
+ScratchPool::Block& ScratchPool::Block::operator=(Block&& other) noexcept {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        data_ = other.data_;
+        size_ = other.size_;
+        other.pool_ = nullptr;
+        other.data_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+void ScratchPool::Block::release() {
+    if (data_) {
+        pool_->give_back(data_, size_);
+        pool_ = nullptr;
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+ScratchPool::ScratchPool(size_t max_cached_bytes) : max_cached_bytes_(max_cached_bytes) {}
+
+ScratchPool::~ScratchPool() {
+    trim();
+}
+
+ScratchPool::Block ScratchPool::acquire(size_t bytes) {
+    size_t size_class = 0;
+    while ((size_t(1) << (MIN_CLASS_SHIFT + size_class)) < bytes) {
+        ++size_class;
+    }
+    const size_t size = size_t(1) << (MIN_CLASS_SHIFT + size_class);
+
+    Block block;
+    block.pool_ = this;
+    block.size_ = size;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (size_class < free_lists_.size() && !free_lists_[size_class].empty()) {
+            block.data_ = free_lists_[size_class].back();
+            free_lists_[size_class].pop_back();
+            cached_bytes_ -= size;
+            return block;
+        }
+    }
+    block.data_ = aligned_allocate(size, PAGE_SIZE);
+    return block;
+}
+
+void ScratchPool::give_back(void* data, size_t size) {
+    size_t size_class = 0;
+    while ((size_t(1) << (MIN_CLASS_SHIFT + size_class)) < size) {
+        ++size_class;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (cached_bytes_ + size <= max_cached_bytes_) {
+            if (free_lists_.size() <= size_class) {
+                free_lists_.resize(size_class + 1);
+            }
+            free_lists_[size_class].push_back(data);
+            cached_bytes_ += size;
+            return;
+        }
+    }
+    aligned_free(data);
+}
+
+size_t ScratchPool::cached_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cached_bytes_;
+}
+
+void ScratchPool::trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& list : free_lists_) {
+        for (void* data : list) {
+            aligned_free(data);
+        }
+        list.clear();
+    }
+    cached_bytes_ = 0;
+}
+
+} // namespace embee
@@ -0,0 +1,115 @@
+/**
+ * @file memory_planner.cpp
+ * @brief Greedy-by-size placement of activation buffers
+ */
+
+#include "embee/memory_planner.h"
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+namespace embee {
+
+namespace {
+
+size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+} // namespace
+
+size_t ActivationPlanner::add(const std::string& name, size_t bytes, size_t first_step, size_t last_step) {
+    if (last_step < first_step) {
+        throw std::invalid_argument("Buffer " + name + " ends before it starts");
+    }
+    buffers_.push_back(Buffer{name, bytes, first_step, last_step});
+    return buffers_.size() - 1;
+}
+
+MemoryPlan ActivationPlanner::plan(size_t alignment) const {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        throw std::invalid_argument("Arena alignment must be a power of two");
+    }
+
+    MemoryPlan result;
+    result.offsets.assign(buffers_.size(), 0);
+
+    // Largest first; ties by earlier start so the plan is deterministic
+    std::vector<size_t> order(buffers_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        if (buffers_[a].bytes != buffers_[b].bytes) {
+            return buffers_[a].bytes > buffers_[b].bytes;
+        }
+        return buffers_[a].first_step < buffers_[b].first_step;
+    });
+
+    std::vector<size_t> placed;
+    std::vector<std::pair<size_t, size_t>> conflicts;   // [offset, end) of live neighbours
+    for (size_t index : order) {
+        const Buffer& buffer = buffers_[index];
+        const size_t bytes = align_up(buffer.bytes, alignment);
+        result.naive_size += bytes;
+
+        conflicts.clear();
+        for (size_t other : placed) {
+            const Buffer& o = buffers_[other];
+            if (o.first_step <= buffer.last_step && buffer.first_step <= o.last_step) {
+                conflicts.emplace_back(result.offsets[other],
+                                       result.offsets[other] + align_up(o.bytes, alignment));
+            }
+        }
+        std::sort(conflicts.begin(), conflicts.end());
+
+        // Smallest gap that fits, else the end of the last conflict
+        size_t best_offset = 0;
+        size_t best_gap = SIZE_MAX;
+        size_t cursor = 0;
+        for (const auto& range : conflicts) {
+            if (range.first >= cursor + bytes && range.first - cursor < best_gap) {
+                best_gap = range.first - cursor;
+                best_offset = cursor;
+            }
+            cursor = std::max(cursor, range.second);
+        }
+        if (best_gap == SIZE_MAX) {
+            best_offset = cursor;
+        }
+
+        result.offsets[index] = best_offset;
+        result.arena_size = std::max(result.arena_size, best_offset + bytes);
+        placed.push_back(index);
+    }
+
+    // Peak of the live set, the bound any placement must meet
+    size_t last_step = 0;
+    for (const auto& buffer : buffers_) {
+        last_step = std::max(last_step, buffer.last_step);
+    }
+    for (size_t step = 0; step <= last_step && !buffers_.empty(); ++step) {
+        size_t live = 0;
+        for (const auto& buffer : buffers_) {
+            if (buffer.first_step <= step && step <= buffer.last_step) {
+                live += align_up(buffer.bytes, alignment);
+            }
+        }
+        result.peak_live_size = std::max(result.peak_live_size, live);
+    }
+    return result;
+}
+
+std::string ActivationPlanner::describe(const MemoryPlan& plan) const {
+    std::ostringstream out;
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+        const Buffer& buffer = buffers_[i];
+        out << buffer.name << ": " << buffer.bytes << " bytes at " << plan.offsets[i]
+            << ", steps " << buffer.first_step << "-" << buffer.last_step << "\n";
+    }
+    out << "arena " << plan.arena_size << " bytes (peak live " << plan.peak_live_size
+        << ", without reuse " << plan.naive_size << ")\n";
+    return out.str();
+}
+
+} // namespace embee
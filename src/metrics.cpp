@@ -0,0 +1,273 @@
+/**
+ * @file metrics.cpp
+ * @brief Metrics registry, Prometheus exposition and the metrics HTTP listener
+ */
+
+#include "embee/metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+// Add to an atomic double (fetch_add on floating point is C++20)
+void atomic_add(std::atomic<double>& target, double delta) {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {
+    }
+}
+
+std::string format_number(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.12g", value);
+    return buffer;
+}
+
+} // namespace
+
+void Gauge::add(double delta) {
+    atomic_add(value_, delta);
+}
+
+Histogram::Histogram(std::vector<double> bounds)
+    : bounds_(std::move(bounds)),
+      buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    if (!std::is_sorted(bounds_.begin(), bounds_.end())) {
+        throw std::invalid_argument("Histogram bucket bounds must be ascending");
+    }
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::observe(double value) {
+    // Bucket i counts values in (bounds[i-1], bounds[i]]
+    size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    atomic_add(sum_, value);
+}
+
+std::vector<uint64_t> Histogram::bucket_counts() const {
+    std::vector<uint64_t> counts(bounds_.size() + 1);
+    for (size_t i = 0; i < counts.size(); ++i) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    return counts;
+}
+
+std::vector<double> Histogram::latency_buckets() {
+    return {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0};
+}
+
+struct MetricsRegistry::Entry {
+    std::string name;
+    std::string help;
+    Kind kind;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+};
+
+MetricsRegistry::MetricsRegistry() = default;
+MetricsRegistry::~MetricsRegistry() = default;
+
+MetricsRegistry::Entry& MetricsRegistry::find_or_add(const std::string& name, const std::string& help,
+                                                     Kind kind, std::vector<double>* bounds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : entries_) {
+        if (entry->name == name) {
+            if (entry->kind != kind) {
+                throw std::invalid_argument("Metric registered with a different type: " + name);
+            }
+            return *entry;
+        }
+    }
+
+    auto entry = std::make_unique<Entry>();
+    entry->name = name;
+    entry->help = help;
+    entry->kind = kind;
+    switch (kind) {
+        case Kind::COUNTER:
+            entry->counter = std::make_unique<Counter>();
+            break;
+        case Kind::GAUGE:
+            entry->gauge = std::make_unique<Gauge>();
+            break;
+        case Kind::HISTOGRAM:
+            entry->histogram = std::make_unique<Histogram>(std::move(*bounds));
+            break;
+    }
+    entries_.push_back(std::move(entry));
+    return *entries_.back();
+}
+
+Counter& MetricsRegistry::counter(const std::string& name, const std::string& help) {
+    return *find_or_add(name, help, Kind::COUNTER, nullptr).counter;
+}
+
+Gauge& MetricsRegistry::gauge(const std::string& name, const std::string& help) {
+    return *find_or_add(name, help, Kind::GAUGE, nullptr).gauge;
+}
+
+Histogram& MetricsRegistry::histogram(const std::string& name, const std::string& help,
+                                      std::vector<double> bounds) {
+    return *find_or_add(name, help, Kind::HISTOGRAM, &bounds).histogram;
+}
+
+std::string MetricsRegistry::prometheus_text() const {
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : entries_) {
+        const std::string& name = entry->name;
+        out << "# HELP " << name << " " << entry->help << "\n";
+        switch (entry->kind) {
+            case Kind::COUNTER:
+                out << "# TYPE " << name << " counter\n"
+                    << name << " " << entry->counter->value() << "\n";
+                break;
+            case Kind::GAUGE:
+                out << "# TYPE " << name << " gauge\n"
+                    << name << " " << format_number(entry->gauge->value()) << "\n";
+                break;
+            case Kind::HISTOGRAM: {
+                const Histogram& h = *entry->histogram;
+                const auto counts = h.bucket_counts();
+                out << "# TYPE " << name << " histogram\n";
+                // Buckets are cumulative in the exposition format
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < h.bounds().size(); ++i) {
+                    cumulative += counts[i];
+                    out << name << "_bucket{le=\"" << format_number(h.bounds()[i]) << "\"} "
+                        << cumulative << "\n";
+                }
+                cumulative += counts.back();
+                out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+                    << name << "_sum " << format_number(h.sum()) << "\n"
+                    << name << "_count " << cumulative << "\n";
+                break;
+            }
+        }
+    }
+    return out.str();
+}
+
+#ifndef _WIN32
+
+MetricsServer::MetricsServer(const MetricsRegistry& registry, uint16_t port, const std::string& address)
+    : registry_(registry) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (::inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        throw std::runtime_error("Invalid metrics listen address: " + address);
+    }
+
+    socket_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_ < 0) {
+        throw std::runtime_error("Failed to create metrics socket");
+    }
+    int reuse = 1;
+    ::setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (::bind(socket_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        ::listen(socket_, 16) != 0) {
+        const int error = errno;
+        ::close(socket_);
+        throw std::runtime_error("Failed to listen on " + address + ":" + std::to_string(port) +
+                                 ": " + std::strerror(error));
+    }
+
+    socklen_t length = sizeof(addr);
+    ::getsockname(socket_, reinterpret_cast<sockaddr*>(&addr), &length);
+    port_ = ntohs(addr.sin_port);
+
+    thread_ = std::thread(&MetricsServer::serve, this);
+}
+
+MetricsServer::~MetricsServer() {
+    stop_.store(true);
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    ::close(socket_);
+}
+
+void MetricsServer::serve() {
+    while (!stop_.load()) {
+        // Wake periodically to notice shutdown
+        pollfd pfd{socket_, POLLIN, 0};
+        if (::poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        int client = ::accept(socket_, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+
+        // A slow or idle client must not stall the listener
+        timeval timeout{1, 0};
+        ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                break;
+            }
+            request.append(buffer, static_cast<size_t>(n));
+        }
+
+        std::string status = "404 Not Found";
+        std::string body = "Not found\n";
+        std::string content_type = "text/plain";
+        if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 13, "GET /metrics?") == 0) {
+            status = "200 OK";
+            body = registry_.prometheus_text();
+            content_type = "text/plain; version=0.0.4";
+        }
+        std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: " + content_type +
+                               "\r\nContent-Length: " + std::to_string(body.size()) +
+                               "\r\nConnection: close\r\n\r\n" + body;
+
+        size_t sent = 0;
+        while (sent < response.size()) {
+            ssize_t n = ::send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += static_cast<size_t>(n);
+        }
+        ::close(client);
+    }
+}
+
+#else
+
+MetricsServer::MetricsServer(const MetricsRegistry& registry, uint16_t, const std::string&)
+    : registry_(registry) {
+    throw std::runtime_error("MetricsServer is not supported on this platform");
+}
+
+MetricsServer::~MetricsServer() = default;
+
+void MetricsServer::serve() {}
+
+#endif
+
+} // namespace embee
@@ -5,11 +5,15 @@
 
 #include "embee/model.h"
 #include "embee/tokenizer.h"
+#include "embee/amb_format.h"
+#include "embee/kernels.h"
 #include <fstream>
 #include <stdexcept>
 #include <iostream>
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <random>
 
 namespace embee {
 
@@ -17,7 +21,7 @@ Model::Model(const std::string& path) {
     // Detect file format
     std::string format = detect_format(path);
     
-    std::cout << "Loading model in " << format << " format from: " << path << std::endl;
+    std::cerr << "Loading model in " << format << " format from: " << path << std::endl;
     
     // Load model based on detected format
     if (format == "amb") {
@@ -75,19 +79,235 @@ std::string Model::detect_format(const std::string& path) {
 }
 
 void Model::load_amb_model(const std::string& path) {
-    // This is a placeholder implementation
-    // In a real implementation, this would parse the AMB format file
-    
-    // Create a basic dummy configuration
-    config_.n_vocab = 32000;
-    config_.n_embd = 2048;
-    config_.n_layers = 24;
-    config_.n_heads = 16;
-    config_.n_kv_heads = 16;
+    // Map the file so that the tokenizer and weights can be used in place
+    std::shared_ptr<amb::MappedFile> mapping;
+    try {
+        mapping = std::make_shared<amb::MappedFile>(path);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Using placeholder model (" << e.what() << ")" << std::endl;
+    }
+    if (mapping && (mapping->size() < sizeof(amb::MAGIC) ||
+                    std::memcmp(mapping->data(), amb::MAGIC, sizeof(amb::MAGIC)) != 0)) {
+        std::cerr << "Using placeholder model (" << path << " is not an AMB file)" << std::endl;
+        mapping.reset();
+    }
+    
+    amb::Header header;
+    if (mapping) {
+        header = amb::parse_header(mapping->data(), mapping->size());
+        mapping_ = mapping;
+    }
+    
+    const uint8_t* tokenizer_section = mapping ? mapping->data() + header.tokenizer_offset() : nullptr;
+    if (header.tokenizer_size > 0 &&
+        tokenizer_section[0] == static_cast<uint8_t>(amb::TokenizerType::BINARY_BPE)) {
+        tokenizer_ = std::make_shared<BinaryTokenizer>(tokenizer_section, header.tokenizer_size, mapping_);
+    } else {
+        tokenizer_ = std::make_shared<CharTokenizer>();
+    }
+    
+    if (header.weights_size == 0) {
+        if (mapping) {
+            std::cerr << "Using placeholder model (" << path << " holds no weights)" << std::endl;
+        }
+        load_placeholder_model();
+        return;
+    }
+    
+    auto section = [&](size_t offset, size_t size) {
+        return std::string(reinterpret_cast<const char*>(mapping->data() + offset), size);
+    };
+    load_amb_config(section(header.metadata_offset(), header.metadata_size),
+                    section(header.config_offset(), header.config_size));
+    if (tokenizer_->vocab_size() > config_.n_vocab) {
+        throw std::runtime_error("Tokenizer has " + std::to_string(tokenizer_->vocab_size()) +
+                                 " tokens, the model config only " + std::to_string(config_.n_vocab));
+    }
+    mapped_weights_offset_ = header.weights_offset();
+    mapped_weights_size_ = header.weights_size;
+    load_amb_weights(mapping->data() + mapped_weights_offset_, mapped_weights_size_, mapped_weights_offset_,
+                     header.aligned_tensor_data());
+    
+    std::cerr << "Loaded " << config_.model_name << " with " << weights_.size() << " tensors" << std::endl;
+}
+
+void Model::load_amb_config(const std::string& metadata_json, const std::string& config_json) {
+    // Metadata is optional and informational
+    const auto metadata = metadata_json.find_first_not_of(" \t\r\n") == std::string::npos
+                              ? std::unordered_map<std::string, std::string>()
+                              : amb::parse_json_object(metadata_json);
+    const auto config = amb::parse_json_object(config_json);
+    
+    auto find = [](const std::unordered_map<std::string, std::string>& object, const std::string& key) {
+        auto it = object.find(key);
+        return it == object.end() ? nullptr : &it->second;
+    };
+    auto size_field = [&](const std::string& key, const std::string* fallback) -> size_t {
+        const std::string* value = find(config, key);
+        if (!value) {
+            value = fallback;
+        }
+        if (!value) {
+            throw std::runtime_error("Model config is missing \"" + key + "\"");
+        }
+        char* end = nullptr;
+        const unsigned long long n = std::strtoull(value->c_str(), &end, 10);
+        if (end != value->c_str() + value->size() || (*value)[0] == '-') {
+            throw std::runtime_error("Model config \"" + key + "\" must be a non-negative integer");
+        }
+        return static_cast<size_t>(n);
+    };
+    auto float_field = [&](const std::string& key, float fallback) {
+        const std::string* value = find(config, key);
+        return value ? std::stof(*value) : fallback;
+    };
+    auto bool_field = [&](const std::string& key, bool fallback) {
+        const std::string* value = find(config, key);
+        if (!value) {
+            return fallback;
+        }
+        if (*value != "true" && *value != "false") {
+            throw std::runtime_error("Model config \"" + key + "\" must be true or false");
+        }
+        return *value == "true";
+    };
+    auto string_field = [&](const std::unordered_map<std::string, std::string>& object, const std::string& key,
+                            const std::string& fallback) {
+        const std::string* value = find(object, key);
+        return value ? amb::json_string(*value) : fallback;
+    };
+    
+    const std::string architecture = string_field(config, "architecture", "");
+    static const std::pair<const char*, ModelArchitecture> architectures[] = {
+        {"llama", ModelArchitecture::LLAMA}, {"mistral", ModelArchitecture::MISTRAL},
+        {"gemma", ModelArchitecture::GEMMA}, {"phi", ModelArchitecture::PHI},
+        {"falcon", ModelArchitecture::FALCON}, {"gpt2", ModelArchitecture::GPT2},
+        {"mpt", ModelArchitecture::MPT}};
+    auto arch = std::find_if(std::begin(architectures), std::end(architectures),
+                             [&](const auto& entry) { return architecture == entry.first; });
+    if (arch == std::end(architectures)) {
+        throw std::runtime_error("Unsupported model architecture: \"" + architecture + "\"");
+    }
+    config_.architecture = arch->second;
+    
+    const std::string activation = string_field(config, "activation_fn", "gelu");
+    if (activation == "gelu") {
+        config_.activation_function = ActivationFunction::GELU;
+    } else if (activation == "silu") {
+        config_.activation_function = ActivationFunction::SILU;
+    } else if (activation == "relu") {
+        config_.activation_function = ActivationFunction::RELU;
+    } else if (activation == "swiglu") {
+        config_.activation_function = ActivationFunction::SWIGLU;
+    } else {
+        throw std::runtime_error("Unsupported activation function: \"" + activation + "\"");
+    }
+    
+    config_.n_vocab = size_field("n_vocab", nullptr);
+    config_.n_embd = size_field("n_embd", nullptr);
+    config_.n_layers = size_field("n_layers", nullptr);
+    config_.n_heads = size_field("n_heads", nullptr);
+    config_.n_kv_heads = size_field("n_kv_heads", find(config, "n_heads"));
+    const std::string default_seq_len = "2048";
+    config_.max_seq_len = size_field("max_seq_len", &default_seq_len);
+    config_.is_rope = bool_field("is_rope", false);
+    config_.use_alibi = bool_field("use_alibi", false);
+    config_.alibi_max_bias = float_field("alibi_max_bias", 8.0f);
+    config_.rope_freq_base = float_field("rope_freq_base", 10000.0f);
+    config_.rope_scaling = float_field("rope_scaling", 1.0f);
+    const std::string zero = "0";
+    config_.n_experts = size_field("n_experts", &zero);
+    config_.n_experts_used = size_field("n_experts_used", &zero);
+    if (config_.n_embd == 0 || config_.n_heads == 0 || config_.n_kv_heads == 0 ||
+        config_.n_embd % config_.n_heads != 0 || config_.n_heads % config_.n_kv_heads != 0) {
+        throw std::runtime_error("Model config has inconsistent embedding and head sizes");
+    }
+    
+    config_.quant_type = QuantizationType::NONE;
+    config_.quant_block_size = 32;
+    if (const std::string* quant_json = find(config, "quant")) {
+        const auto quant = amb::parse_json_object(*quant_json);
+        const std::string type = string_field(quant, "type", "none");
+        if (type == "int8") {
+            config_.quant_type = QuantizationType::INT8;
+        } else if (type == "int4_block" || type == "int4") {
+            config_.quant_type = QuantizationType::INT4_BLOCK;
+        } else if (type == "int5_block" || type == "int5") {
+            config_.quant_type = QuantizationType::INT5_BLOCK;
+        } else if (type == "adaptive") {
+            config_.quant_type = QuantizationType::ADAPTIVE;
+        } else if (type != "none") {
+            throw std::runtime_error("Unsupported quantization type: \"" + type + "\"");
+        }
+        if (const std::string* block_size = find(quant, "block_size")) {
+            config_.quant_block_size = std::stoul(*block_size);
+        }
+    }
+    
+    config_.model_name = string_field(metadata, "name", "unnamed");
+    config_.model_family = string_field(metadata, "family", "");
+    config_.model_creator = string_field(metadata, "creator", "");
+}
+
+void Model::load_amb_weights(const uint8_t* section, size_t size, size_t section_offset, bool aligned_data) {
+    for (size_t offset = 0; offset < size;) {
+        const amb::TensorRecord record = amb::parse_tensor_record(section, size, offset, aligned_data);
+        offset = record.end;
+        
+        // Reject data the kernels would read past the end of
+        const size_t rows = record.shape.size() > 1 ? record.shape[0] : 1;
+        size_t count = 1;
+        for (size_t dim : record.shape) {
+            count *= dim;
+        }
+        const size_t cols = rows > 0 ? count / rows : 0;
+        const size_t block_size = config_.quant_block_size;
+        const bool blocks = record.data_type != DataType::FP32 && record.data_type != DataType::FP16 &&
+                            record.data_type != DataType::BF16;
+        bool valid = !blocks || (block_size > 0 && cols % block_size == 0);
+        if (valid && record.data_type == DataType::ADAPTIVE) {
+            valid = count == 0 || record.data_size >= kernels::adaptive_mask_bytes(cols / block_size);
+        }
+        if (!valid || (count > 0 && record.data_size !=
+                                        rows * kernels::row_bytes(record.data_type, cols, block_size, record.data))) {
+            throw std::runtime_error("Tensor " + record.name + " holds " + std::to_string(record.data_size) +
+                                     " bytes, which does not match its shape and type");
+        }
+        
+        Tensor tensor;
+        tensor.name = record.name;
+        tensor.shape = record.shape;
+        tensor.data_type = record.data_type;
+        // FP32 values are read as floats; all other types at most as 16-bit halves
+        const size_t alignment = record.data_type == DataType::FP32 ? alignof(float) : alignof(uint16_t);
+        if (reinterpret_cast<uintptr_t>(record.data) % alignment == 0) {
+            tensor.mapped = record.data;
+            tensor.mapped_size = record.data_size;
+        } else {
+            // Version 1 record headers leave data at any offset; copy such
+            // tensors once and drop their pages from the mapping
+            tensor.data.assign(record.data, record.data + record.data_size);
+            mapping_->evict(section_offset + record.offset, record.end - record.offset);
+        }
+        if (!weights_.emplace(record.name, std::move(tensor)).second) {
+            throw std::runtime_error("Duplicate tensor in model file: " + record.name);
+        }
+    }
+}
+
+void Model::load_placeholder_model() {
+    // A small but complete configuration with every tensor the engine needs,
+    // filled with small random values so the forward pass does real work
+    // (tensor names: docs/model_format.md)
+    config_.n_vocab = tokenizer_->vocab_size();
+    config_.n_embd = 256;
+    config_.n_layers = 4;
+    config_.n_heads = 4;
+    config_.n_kv_heads = 4;
     config_.max_seq_len = 2048;
     config_.is_rope = true;
     config_.architecture = ModelArchitecture::PHI;
-    config_.activation_function = ActivationFunction::SILU;
+    config_.activation_function = ActivationFunction::GELU;
     config_.rope_freq_base = 10000.0f;
     config_.rope_scaling = 1.0f;
     config_.quant_type = QuantizationType::NONE;
@@ -95,81 +315,48 @@ void Model::load_amb_model(const std::string& path) {
     config_.model_family = "Phi";
     config_.model_creator = "Microsoft";
     
-    // Create a simple dummy tokenizer
-    // In real code, this would be loaded from the model file
-    // but for now we just create a dummy tokenizer
-    class DummyTokenizer : public Tokenizer {
-    public:
-        TokenVector encode(const std::string& text) const override {
-            // Very simple character-based encoding for demo purposes
-            TokenVector result;
-            for (char c : text) {
-                result.push_back(static_cast<TokenId>(c));
-            }
-            return result;
+    std::mt19937 gen(42);
+    std::normal_distribution<float> normal(0.0f, 0.02f);
+    auto add_tensor = [this, &gen, &normal](const std::string& name, std::vector<size_t> shape,
+                                            float fill, bool random) {
+        Tensor tensor;
+        tensor.name = name;
+        tensor.shape = std::move(shape);
+        tensor.data_type = DataType::FP32;
+        size_t count = 1;
+        for (size_t dim : tensor.shape) {
+            count *= dim;
         }
-        
-        std::string decode(const TokenVector& tokens) const override {
-            std::string result;
-            for (TokenId token : tokens) {
-                result.push_back(static_cast<char>(token));
-            }
-            return result;
-        }
-        
-        size_t vocab_size() const override {
-            return 256;  // ASCII
-        }
-        
-        std::optional<TokenId> bos_token() const override {
-            return 1;  // Just for demonstration
-        }
-        
-        std::optional<TokenId> eos_token() const override {
-            return 2;  // Just for demonstration
-        }
-        
-        std::optional<TokenId> pad_token() const override {
-            return 0;  // Just for demonstration
+        tensor.data.resize(count * sizeof(float));
+        float* values = reinterpret_cast<float*>(tensor.data.data());
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = random ? normal(gen) : fill;
         }
+        weights_[tensor.name] = std::move(tensor);
     };
     
-    tokenizer_ = std::make_shared<DummyTokenizer>();
-    
-    // In a real implementation, we'd load weights from the file
-    // For now, just create dummy tensors for testing
-    Tensor embedding;
-    embedding.name = "transformer.wte.weight";
-    embedding.shape = {config_.n_vocab, config_.n_embd};
-    embedding.data_type = DataType::FP32;
-    embedding.data.resize(config_.n_vocab * config_.n_embd * sizeof(float), 0);
-    weights_[embedding.name] = std::move(embedding);
+    const size_t n_embd = config_.n_embd;
+    const size_t n_ff = 4 * n_embd;
+    const size_t head_dim = n_embd / config_.n_heads;
+    const size_t qkv_dim = (config_.n_heads + 2 * config_.n_kv_heads) * head_dim;
     
-    // Add dummy weights for each layer
+    add_tensor("transformer.wte.weight", {config_.n_vocab, n_embd}, 0.0f, true);
     for (size_t i = 0; i < config_.n_layers; ++i) {
-        // Attention weights
-        {
-            Tensor attn_w;
-            attn_w.name = "transformer.h." + std::to_string(i) + ".attn.c_attn.weight";
-            attn_w.shape = {config_.n_embd, 3 * config_.n_embd};
-            attn_w.data_type = DataType::FP32;
-            attn_w.data.resize(config_.n_embd * 3 * config_.n_embd * sizeof(float), 0);
-            weights_[attn_w.name] = std::move(attn_w);
-        }
-        
-        {
-            Tensor attn_b;
-            attn_b.name = "transformer.h." + std::to_string(i) + ".attn.c_attn.bias";
-            attn_b.shape = {3 * config_.n_embd};
-            attn_b.data_type = DataType::FP32;
-            attn_b.data.resize(3 * config_.n_embd * sizeof(float), 0);
-            weights_[attn_b.name] = std::move(attn_b);
-        }
-        
-        // More weights would be added here in a real implementation...
+        const std::string prefix = "transformer.h." + std::to_string(i) + ".";
+        add_tensor(prefix + "ln_1.weight", {n_embd}, 1.0f, false);
+        add_tensor(prefix + "ln_1.bias", {n_embd}, 0.0f, false);
+        add_tensor(prefix + "attn.c_attn.weight", {qkv_dim, n_embd}, 0.0f, true);
+        add_tensor(prefix + "attn.c_attn.bias", {qkv_dim}, 0.0f, false);
+        add_tensor(prefix + "attn.c_proj.weight", {n_embd, n_embd}, 0.0f, true);
+        add_tensor(prefix + "ln_2.weight", {n_embd}, 1.0f, false);
+        add_tensor(prefix + "ln_2.bias", {n_embd}, 0.0f, false);
+        add_tensor(prefix + "mlp.c_fc.weight", {n_ff, n_embd}, 0.0f, true);
+        add_tensor(prefix + "mlp.c_proj.weight", {n_embd, n_ff}, 0.0f, true);
     }
+    add_tensor("transformer.ln_f.weight", {n_embd}, 1.0f, false);
+    add_tensor("transformer.ln_f.bias", {n_embd}, 0.0f, false);
     
-    std::cout << "Loaded dummy model with " << weights_.size() << " tensors." << std::endl;
+    std::cerr << "Loaded placeholder model with " << weights_.size() << " tensors" << std::endl;
 }
 
 void Model::load_gguf_model(const std::string& path) {
@@ -192,4 +379,18 @@ bool Model::has_tensor(const std::string& name) const {
     return weights_.find(name) != weights_.end();
 }
 
+MemoryStats Model::memory_usage() const {
+    MemoryStats stats;
+    for (const auto& entry : weights_) {
+        stats.weights_heap += entry.second.data.capacity();
+    }
+    if (mapping_) {
+        stats.weights_mapped = mapped_weights_size_;
+        stats.weights_resident = mapping_->resident_bytes(mapped_weights_offset_, mapped_weights_size_);
+    }
+    stats.weights_resident += stats.weights_heap;
+    stats.tokenizer = tokenizer_->memory_usage();
+    return stats;
+}
+
 } // namespace embee
\ No newline at end of file
@@ -0,0 +1,80 @@
+/**
+ * @file moe.cpp
+ * @brief Top-k expert routing grouped by expert
+ */
+
+#include "embee/moe.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+namespace embee {
+
+size_t ExpertRouting::active_experts() const {
+    size_t active = 0;
+    for (size_t e = 0; e + 1 < offsets.size(); ++e) {
+        active += count(e) > 0;
+    }
+    return active;
+}
+
+void route_top_k(const float* logits, size_t n_tokens, size_t n_experts, size_t k, ExpertRouting& routing) {
+    if (k == 0 || k > n_experts) {
+        throw std::invalid_argument("Cannot route to " + std::to_string(k) + " of " +
+                                    std::to_string(n_experts) + " experts");
+    }
+
+    // Selection per token; k is small, so insertion into a sorted list beats a heap
+    std::vector<uint32_t>& selected = routing.selected;
+    std::vector<float>& gates = routing.gates;
+    selected.resize(n_tokens * k);
+    gates.resize(n_tokens * k);
+    routing.offsets.assign(n_experts + 1, 0);
+    for (size_t t = 0; t < n_tokens; ++t) {
+        const float* row = logits + t * n_experts;
+        uint32_t* top = selected.data() + t * k;
+        size_t n_top = 0;
+        for (size_t e = 0; e < n_experts; ++e) {
+            if (n_top == k && row[e] <= row[top[k - 1]]) {
+                continue;
+            }
+            size_t i = n_top < k ? n_top++ : k - 1;
+            while (i > 0 && row[top[i - 1]] < row[e]) {
+                top[i] = top[i - 1];
+                --i;
+            }
+            top[i] = static_cast<uint32_t>(e);
+        }
+
+        // Softmax over the selected logits; top[0] holds the largest
+        float* gate = gates.data() + t * k;
+        float sum = 0.0f;
+        for (size_t i = 0; i < k; ++i) {
+            gate[i] = std::exp(row[top[i]] - row[top[0]]);
+            sum += gate[i];
+        }
+        for (size_t i = 0; i < k; ++i) {
+            gate[i] /= sum;
+            ++routing.offsets[top[i] + 1];
+        }
+    }
+
+    // Counting sort by expert keeps tokens in batch order within each group
+    for (size_t e = 0; e < n_experts; ++e) {
+        routing.offsets[e + 1] += routing.offsets[e];
+    }
+    routing.tokens.resize(n_tokens * k);
+    routing.weights.resize(n_tokens * k);
+    std::vector<uint32_t>& next = routing.cursor;
+    next.assign(routing.offsets.begin(), routing.offsets.end() - 1);
+    for (size_t t = 0; t < n_tokens; ++t) {
+        for (size_t i = 0; i < k; ++i) {
+            const uint32_t slot = next[selected[t * k + i]]++;
+            routing.tokens[slot] = static_cast<uint32_t>(t);
+            routing.weights[slot] = gates[t * k + i];
+        }
+    }
+}
+
+} // namespace embee
@@ -0,0 +1,524 @@
+/**
+ * @file profiler.cpp
+ * @brief Aggregation and export of engine profiles
+ */
+
+#include "embee/profiler.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef __linux__
+#include <filesystem>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+const char* const OP_NAMES[] = {
+    "embedding",
+    "attn_norm",
+    "qkv_proj",
+    "rope",
+    "kv_store",
+    "attention",
+    "attn_out_proj",
+    "ffn_norm",
+    "ffn_up",
+    "activation",
+    "ffn_down",
+    "router",
+    "experts",
+    "residual",
+    "final_norm",
+    "lm_head",
+    "sampling",
+    "detokenize",
+};
+static_assert(sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) == static_cast<size_t>(ProfileOp::COUNT),
+              "every ProfileOp needs a name");
+
+const char* const COUNTER_NAMES[] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "dtlb_misses",
+    "memory_bytes",
+};
+static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) ==
+              static_cast<size_t>(HardwareCounter::COUNT),
+              "every HardwareCounter needs a name");
+
+constexpr size_t N_COUNTERS = static_cast<size_t>(HardwareCounter::COUNT);
+
+#ifdef __linux__
+
+struct EventSpec {
+    HardwareCounter counter;
+    uint32_t type;
+    uint64_t config;
+};
+
+constexpr uint64_t cache_event(uint64_t cache) {
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Per-thread events, in group order
+const EventSpec THREAD_EVENTS[] = {
+    {HardwareCounter::CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {HardwareCounter::INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {HardwareCounter::LLC_MISSES, PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL)},
+    {HardwareCounter::DTLB_MISSES, PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+int perf_event_open(perf_event_attr& attr, pid_t pid, int cpu, int group_fd) {
+    return static_cast<int>(::syscall(__NR_perf_event_open, &attr, pid, cpu, group_fd, 0UL));
+}
+
+std::string read_text(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    std::string text;
+    std::getline(file, text);
+    return text;
+}
+
+// Encode "event=0x04,umask=0x03" using the PMU's format/ field layouts
+bool encode_pmu_event(const std::filesystem::path& pmu, const std::string& event, uint64_t& config) {
+    config = 0;
+    std::stringstream terms(event);
+    std::string term;
+    while (std::getline(terms, term, ',')) {
+        const size_t eq = term.find('=');
+        const std::string name = term.substr(0, eq);
+        const uint64_t value = eq == std::string::npos ? 1 : std::stoull(term.substr(eq + 1), nullptr, 0);
+        // Layout such as "config:8-15"
+        const std::string format = read_text(pmu / "format" / name);
+        const size_t colon = format.find(':');
+        if (colon == std::string::npos || format.compare(0, colon, "config") != 0) {
+            return false;
+        }
+        const unsigned low = static_cast<unsigned>(std::stoul(format.substr(colon + 1)));
+        config |= value << low;
+    }
+    return true;
+}
+
+#endif
+
+} // namespace
+
+const char* hardware_counter_name(HardwareCounter counter) {
+    size_t index = static_cast<size_t>(counter);
+    return index < N_COUNTERS ? COUNTER_NAMES[index] : "unknown";
+}
+
+struct PerfCounters::Group {
+    int leader = -1;
+    std::vector<int> fds;
+    std::vector<HardwareCounter> order;   // Counter of each value in a group read
+};
+
+#ifdef __linux__
+
+PerfCounters::PerfCounters(size_t n_threads) {
+    // Thread IDs of the calling thread (OpenMP thread 0) and its workers
+    std::vector<pid_t> tids;
+#ifdef _OPENMP
+    const int team = n_threads > 0 ? static_cast<int>(n_threads) : omp_get_max_threads();
+    tids.resize(team);
+    #pragma omp parallel num_threads(team)
+    {
+        tids[omp_get_thread_num()] = static_cast<pid_t>(::syscall(SYS_gettid));
+    }
+#else
+    (void)n_threads;
+    tids.push_back(static_cast<pid_t>(::syscall(SYS_gettid)));
+#endif
+
+    std::array<std::string, N_COUNTERS> errors;
+    std::array<bool, N_COUNTERS> failed{};
+    for (pid_t tid : tids) {
+        auto group = std::make_unique<Group>();
+        for (const EventSpec& spec : THREAD_EVENTS) {
+            const size_t index = static_cast<size_t>(spec.counter);
+            if (failed[index]) {
+                continue;
+            }
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = spec.type;
+            attr.config = spec.config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = perf_event_open(attr, tid, -1, group->leader);
+            if (fd < 0) {
+                // A counter missing on any thread would be undercounted; drop it everywhere
+                failed[index] = true;
+                errors[index] = std::strerror(errno);
+                continue;
+            }
+            if (group->leader < 0) {
+                group->leader = fd;
+            }
+            group->fds.push_back(fd);
+            group->order.push_back(spec.counter);
+        }
+        groups_.push_back(std::move(group));
+    }
+    for (const EventSpec& spec : THREAD_EVENTS) {
+        const size_t index = static_cast<size_t>(spec.counter);
+        available_[index] = !failed[index];
+    }
+
+    // Uncore memory controllers: CAS reads and writes, 64 bytes each
+    std::error_code ec;
+    const std::filesystem::path devices = "/sys/bus/event_source/devices";
+    for (const auto& entry : std::filesystem::directory_iterator(devices, ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.rfind("uncore_imc", 0) != 0) {
+            continue;
+        }
+        const std::string cpumask = read_text(entry.path() / "cpumask");
+        const int cpu = cpumask.empty() ? 0 : std::stoi(cpumask);
+        for (const char* event : {"cas_count_read", "cas_count_write"}) {
+            uint64_t config = 0;
+            const std::string spec = read_text(entry.path() / "events" / event);
+            if (spec.empty() || !encode_pmu_event(entry.path(), spec, config)) {
+                continue;
+            }
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = static_cast<uint32_t>(std::stoul(read_text(entry.path() / "type")));
+            attr.config = config;
+            int fd = perf_event_open(attr, -1, cpu, -1);
+            if (fd < 0) {
+                errors[static_cast<size_t>(HardwareCounter::MEMORY_BYTES)] = std::strerror(errno);
+                continue;
+            }
+            // The scale file converts counts to the unit in the .unit file (MiB)
+            const std::string scale = read_text(entry.path() / "events" / (std::string(event) + ".scale"));
+            uncore_fds_.push_back(fd);
+            uncore_scales_.push_back(scale.empty() ? 64.0 : std::stod(scale) * 1024.0 * 1024.0);
+        }
+    }
+    const size_t memory = static_cast<size_t>(HardwareCounter::MEMORY_BYTES);
+    available_[memory] = !uncore_fds_.empty();
+    if (!available_[memory] && errors[memory].empty()) {
+        errors[memory] = "no uncore memory controller PMU";
+    }
+
+    std::ostringstream status;
+    for (size_t i = 0; i < N_COUNTERS; ++i) {
+        status << (i > 0 ? ", " : "") << COUNTER_NAMES[i]
+               << (available_[i] ? "" : " unavailable (" + errors[i] + ")");
+    }
+    if (!any_available()) {
+        status << "; check /proc/sys/kernel/perf_event_paranoid and the container's seccomp profile";
+    }
+    status_ = status.str();
+}
+
+PerfCounters::~PerfCounters() {
+    for (const auto& group : groups_) {
+        for (int fd : group->fds) {
+            ::close(fd);
+        }
+    }
+    for (int fd : uncore_fds_) {
+        ::close(fd);
+    }
+}
+
+void PerfCounters::read(CounterValues& values) const {
+    values.fill(0);
+    uint64_t buffer[3 + N_COUNTERS];
+    for (const auto& group : groups_) {
+        if (group->leader < 0) {
+            continue;
+        }
+        const size_t bytes = (3 + group->order.size()) * sizeof(uint64_t);
+        if (::read(group->leader, buffer, bytes) != static_cast<ssize_t>(bytes)) {
+            continue;
+        }
+        // Layout: nr, time_enabled, time_running, value[nr]
+        const uint64_t enabled = buffer[1];
+        const uint64_t running = buffer[2];
+        for (size_t i = 0; i < group->order.size(); ++i) {
+            uint64_t value = buffer[3 + i];
+            if (running > 0 && running < enabled) {
+                // The group was multiplexed with other events; extrapolate
+                value = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+            }
+            values[static_cast<size_t>(group->order[i])] += value;
+        }
+    }
+    double memory_bytes = 0.0;
+    for (size_t i = 0; i < uncore_fds_.size(); ++i) {
+        uint64_t count = 0;
+        if (::read(uncore_fds_[i], &count, sizeof(count)) == sizeof(count)) {
+            memory_bytes += count * uncore_scales_[i];
+        }
+    }
+    values[static_cast<size_t>(HardwareCounter::MEMORY_BYTES)] = static_cast<uint64_t>(memory_bytes);
+}
+
+#else
+
+PerfCounters::PerfCounters(size_t) : status_("hardware counters require Linux perf_event_open") {}
+
+PerfCounters::~PerfCounters() = default;
+
+void PerfCounters::read(CounterValues& values) const {
+    values.fill(0);
+}
+
+#endif
+
+bool PerfCounters::available(HardwareCounter counter) const {
+    return available_[static_cast<size_t>(counter)];
+}
+
+bool PerfCounters::any_available() const {
+    return std::find(available_.begin(), available_.end(), true) != available_.end();
+}
+
+const char* profile_op_name(ProfileOp op) {
+    size_t index = static_cast<size_t>(op);
+    return index < static_cast<size_t>(ProfileOp::COUNT) ? OP_NAMES[index] : "unknown";
+}
+
+std::array<OpStats, static_cast<size_t>(ProfileOp::COUNT)> RequestProfile::by_op() const {
+    std::array<OpStats, static_cast<size_t>(ProfileOp::COUNT)> stats{};
+    for (size_t i = 0; i < events.size(); ++i) {
+        const ProfileEvent& event = events[i];
+        OpStats& s = stats[static_cast<size_t>(event.op)];
+        const double ns = (event.end - event.start) * ns_per_tick;
+        ++s.calls;
+        s.total_ns += ns;
+        s.max_ns = std::max(s.max_ns, ns);
+        if (i < counters.size()) {
+            for (size_t c = 0; c < N_COUNTERS; ++c) {
+                s.counters[c] += counters[i][c];
+            }
+        }
+    }
+    return stats;
+}
+
+std::vector<double> RequestProfile::by_layer() const {
+    std::vector<double> totals;
+    for (const auto& event : events) {
+        if (event.layer < 0) {
+            continue;
+        }
+        if (static_cast<size_t>(event.layer) >= totals.size()) {
+            totals.resize(event.layer + 1, 0.0);
+        }
+        totals[event.layer] += (event.end - event.start) * ns_per_tick;
+    }
+    return totals;
+}
+
+Profiler::Profiler(size_t max_requests)
+    : max_requests_(std::max<size_t>(1, max_requests)),
+      epoch_(std::chrono::steady_clock::now()) {}
+
+Profiler::~Profiler() = default;
+
+bool Profiler::enable_hardware_counters(size_t n_threads) {
+    counters_ = std::make_unique<PerfCounters>(n_threads);
+    counter_status_ = counters_->status();
+    if (!counters_->any_available()) {
+        counters_.reset();
+        return false;
+    }
+    return true;
+}
+
+std::string Profiler::hardware_counter_status() const {
+    return counter_status_;
+}
+
+void Profiler::record(ProfileOp op, int32_t layer, uint64_t start, uint64_t end,
+                      const CounterValues& counters_start, const CounterValues& counters_end) {
+    if (!active_) {
+        return;
+    }
+    current_.events.push_back(ProfileEvent{op, layer, start, end});
+    CounterValues delta;
+    for (size_t c = 0; c < N_COUNTERS; ++c) {
+        // Counters are monotonic; guard against extrapolation jitter
+        delta[c] = counters_end[c] > counters_start[c] ? counters_end[c] - counters_start[c] : 0;
+    }
+    current_.counters.push_back(delta);
+}
+
+void Profiler::begin_request() {
+    // Keep the event buffer's capacity from the previous request
+    current_.events.clear();
+    current_.counters.clear();
+    for (size_t c = 0; c < N_COUNTERS; ++c) {
+        current_.counters_available[c] = counters_ && counters_->available(static_cast<HardwareCounter>(c));
+    }
+    current_.id = next_id_++;
+    request_start_ = std::chrono::steady_clock::now();
+    current_.start_tick = read_timestamp();
+    current_.start_ns = std::chrono::duration<double, std::nano>(request_start_ - epoch_).count();
+    active_ = true;
+}
+
+void Profiler::end_request() {
+    if (!active_) {
+        return;
+    }
+    active_ = false;
+
+    const uint64_t end_tick = read_timestamp();
+    const auto end_time = std::chrono::steady_clock::now();
+    current_.duration_ns = std::chrono::duration<double, std::nano>(end_time - request_start_).count();
+
+    // Calibrate ticks against the wall clock over the request itself
+    if (end_tick > current_.start_tick) {
+        current_.ns_per_tick = current_.duration_ns / static_cast<double>(end_tick - current_.start_tick);
+    }
+
+    if (requests_.size() == max_requests_) {
+        requests_.pop_front();
+    }
+    requests_.push_back(current_);
+}
+
+std::string Profiler::table(const RequestProfile& request) {
+    std::ostringstream out;
+    const auto stats = request.by_op();
+    double timed_ns = 0.0;
+    for (const auto& s : stats) {
+        timed_ns += s.total_ns;
+    }
+
+    out << "Request " << request.id << ": " << std::fixed << std::setprecision(3)
+        << request.duration_ns / 1e6 << " ms total, " << timed_ns / 1e6 << " ms in ops\n";
+    out << std::left << std::setw(16) << "op" << std::right << std::setw(10) << "calls"
+        << std::setw(12) << "total ms" << std::setw(12) << "mean us" << std::setw(12) << "max us"
+        << std::setw(9) << "share";
+    const bool with_counters = !request.counters.empty();
+    if (with_counters) {
+        out << std::setw(8) << "IPC" << std::setw(10) << "LLC MPKI" << std::setw(11) << "dTLB MPKI"
+            << std::setw(9) << "GB/s";
+    }
+    out << "\n";
+
+    // Derived counter metrics, "-" where a counter is unavailable
+    auto has = [&request](HardwareCounter c) { return request.counters_available[static_cast<size_t>(c)]; };
+    auto value = [](const OpStats& s, HardwareCounter c) {
+        return static_cast<double>(s.counters[static_cast<size_t>(c)]);
+    };
+    auto column = [&out](int width, bool valid, double number) {
+        if (valid) {
+            out << std::setw(width) << number;
+        } else {
+            out << std::setw(width) << "-";
+        }
+    };
+
+    std::vector<size_t> order(stats.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&stats](size_t a, size_t b) {
+        return stats[a].total_ns > stats[b].total_ns;
+    });
+    for (size_t i : order) {
+        const OpStats& s = stats[i];
+        if (s.calls == 0) {
+            continue;
+        }
+        out << std::left << std::setw(16) << profile_op_name(static_cast<ProfileOp>(i)) << std::right
+            << std::setw(10) << s.calls
+            << std::setw(12) << std::setprecision(3) << s.total_ns / 1e6
+            << std::setw(12) << std::setprecision(2) << s.total_ns / s.calls / 1e3
+            << std::setw(12) << s.max_ns / 1e3
+            << std::setw(8) << std::setprecision(1)
+            << (timed_ns > 0.0 ? 100.0 * s.total_ns / timed_ns : 0.0) << "%";
+        if (with_counters) {
+            const double cycles = value(s, HardwareCounter::CYCLES);
+            const double instructions = value(s, HardwareCounter::INSTRUCTIONS);
+            const bool per_instruction = has(HardwareCounter::INSTRUCTIONS) && instructions > 0.0;
+            out << std::setprecision(2);
+            column(8, has(HardwareCounter::CYCLES) && per_instruction && cycles > 0.0, instructions / cycles);
+            column(10, has(HardwareCounter::LLC_MISSES) && per_instruction,
+                   1000.0 * value(s, HardwareCounter::LLC_MISSES) / instructions);
+            column(11, has(HardwareCounter::DTLB_MISSES) && per_instruction,
+                   1000.0 * value(s, HardwareCounter::DTLB_MISSES) / instructions);
+            column(9, has(HardwareCounter::MEMORY_BYTES) && s.total_ns > 0.0,
+                   value(s, HardwareCounter::MEMORY_BYTES) / s.total_ns);
+        }
+        out << "\n";
+    }
+
+    const auto layers = request.by_layer();
+    if (!layers.empty()) {
+        out << std::left << std::setw(16) << "layer" << std::right << std::setw(12) << "total ms" << "\n";
+        for (size_t l = 0; l < layers.size(); ++l) {
+            out << std::left << std::setw(16) << l << std::right << std::setw(12)
+                << std::setprecision(3) << layers[l] / 1e6 << "\n";
+        }
+    }
+    return out.str();
+}
+
+std::string Profiler::table() const {
+    return requests_.empty() ? std::string() : table(requests_.back());
+}
+
+void Profiler::write_chrome_trace(std::ostream& out) const {
+    // Complete ("X") events with microsecond timestamps
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << std::fixed << std::setprecision(3);
+    bool first = true;
+    for (const auto& request : requests_) {
+        if (!first) {
+            out << ",\n";
+        }
+        first = false;
+        out << "{\"name\":\"request " << request.id << "\",\"cat\":\"request\",\"ph\":\"X\","
+            << "\"pid\":1,\"tid\":1,\"ts\":" << request.start_ns / 1e3
+            << ",\"dur\":" << request.duration_ns / 1e3 << "}";
+
+        for (size_t i = 0; i < request.events.size(); ++i) {
+            const ProfileEvent& event = request.events[i];
+            const double ts = request.start_ns +
+                              (static_cast<double>(event.start) - static_cast<double>(request.start_tick)) *
+                              request.ns_per_tick;
+            const double dur = (event.end - event.start) * request.ns_per_tick;
+            out << ",\n{\"name\":\"" << profile_op_name(event.op) << "\",\"cat\":\""
+                << (event.layer >= 0 ? "layer" : "model") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                << "\"ts\":" << ts / 1e3 << ",\"dur\":" << dur / 1e3
+                << ",\"args\":{\"request\":" << request.id << ",\"layer\":" << event.layer;
+            if (i < request.counters.size()) {
+                for (size_t c = 0; c < N_COUNTERS; ++c) {
+                    if (request.counters_available[c]) {
+                        out << ",\"" << COUNTER_NAMES[c] << "\":" << request.counters[i][c];
+                    }
+                }
+            }
+            out << "}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+} // namespace embee
@@ -0,0 +1,791 @@
+/**
+ * @file quantizer.cpp
+ * @brief Streaming conversion of AMB models to quantized storage types
+ */
+
+#include "embee/quantizer.h"
+#include "embee/amb_format.h"
+#include "embee/calibration.h"
+#include "embee/kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+// Glob match where '*' matches any run of characters
+bool matches(const std::string& pattern, const std::string& name) {
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, resume = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+        } else if (p < pattern.size() && pattern[p] == name[n]) {
+            ++p;
+            ++n;
+        } else if (star != std::string::npos) {
+            p = star + 1;
+            n = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+size_t element_count(const std::vector<size_t>& shape) {
+    size_t count = 1;
+    for (size_t dim : shape) {
+        count *= dim;
+    }
+    return count;
+}
+
+// Rows of a tensor as the engine multiplies it: matrices by their first
+// dimension, everything else as one row
+size_t row_count(const std::vector<size_t>& shape) {
+    return shape.size() > 1 ? shape[0] : 1;
+}
+
+// Whether a tensor's rows can be stored in a block-quantized type
+bool fits_blocks(const std::vector<size_t>& shape, size_t block_size) {
+    const size_t rows = row_count(shape);
+    return shape.size() == 2 && rows > 0 && element_count(shape) / rows % block_size == 0;
+}
+
+// A JSON string literal holding text
+std::string json_quote(const std::string& text) {
+    std::string out = "\"";
+    for (const char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// The config JSON with its top-level "quant" value replaced (or added).
+// Members are written one per line, sorted by key.
+std::string with_quant_config(const std::string& json, const std::string& quant) {
+    std::unordered_map<std::string, std::string> members;
+    if (json.find_first_not_of(" \t\r\n") != std::string::npos) {
+        members = amb::parse_json_object(json);
+    }
+    members["quant"] = quant;
+    const std::map<std::string, std::string> sorted(members.begin(), members.end());
+    std::string out = "{";
+    for (const auto& [key, value] : sorted) {
+        out += (out.size() > 1 ? ",\n  " : "\n  ") + json_quote(key) + ": " + value;
+    }
+    return out + "\n}";
+}
+
+const char* quant_type_name(DataType type) {
+    switch (type) {
+        case DataType::INT8: return "int8";
+        case DataType::INT5: return "int5_block";
+        case DataType::INT4: return "int4_block";
+        case DataType::ADAPTIVE: return "adaptive";
+        default: return "none";
+    }
+}
+
+// Precisions of ADAPTIVE blocks, cheapest first (the mask codes in kernels.h)
+constexpr DataType ADAPTIVE_LEVELS[4] = {DataType::INT4, DataType::INT5, DataType::INT8, DataType::FP16};
+
+using BlockErrors = std::vector<std::array<double, 4>>;
+
+// Values per row of a tensor and bytes per source row, after checking that
+// the record holds whole full-precision rows
+std::pair<size_t, size_t> source_layout(const amb::TensorRecord& record, size_t block_size) {
+    if (is_block_quantized(record.data_type)) {
+        throw std::invalid_argument("Tensor " + record.name + " is already quantized (" +
+                                    data_type_name(record.data_type) + ")");
+    }
+    const size_t rows = row_count(record.shape);
+    const size_t cols = rows > 0 ? element_count(record.shape) / rows : 0;
+    const size_t stride = kernels::row_bytes(record.data_type, cols, block_size);
+    if (stride * rows != record.data_size) {
+        throw std::runtime_error("Tensor " + record.name + " holds " + std::to_string(record.data_size) +
+                                 " bytes, expected " + std::to_string(stride * rows));
+    }
+    return {cols, stride};
+}
+
+// Importance of each input column of a tensor, or empty without statistics
+std::vector<float> column_importance(const std::string& name, size_t cols, const ActivationStats* stats) {
+    if (!stats) {
+        return {};
+    }
+    std::vector<float> importance = stats->importance(name);
+    if (!importance.empty() && importance.size() != cols) {
+        throw std::invalid_argument("Calibration statistics of " + name + " have " +
+                                    std::to_string(importance.size()) + " columns, the tensor has " +
+                                    std::to_string(cols));
+    }
+    return importance;
+}
+
+// Error of each column block of a tensor at each ADAPTIVE precision: the
+// squared error of its weights, each weighted by the importance of its input
+// column, summed over all rows
+BlockErrors adaptive_errors(const amb::TensorRecord& record, size_t block_size, const ActivationStats* stats) {
+    const auto [cols, src_stride] = source_layout(record, block_size);
+    const std::vector<float> importance = column_importance(record.name, cols, stats);
+
+    BlockErrors errors(cols / block_size, std::array<double, 4>{});
+    std::vector<float> row(cols);
+    std::vector<float> decoded(cols);
+    std::vector<uint8_t> packed(kernels::row_bytes(DataType::FP16, cols, block_size));
+    for (size_t r = 0; r < row_count(record.shape); ++r) {
+        kernels::dequantize_row(record.data_type, record.data + r * src_stride, row.data(), cols, block_size);
+        for (size_t level = 0; level < 4; ++level) {
+            kernels::quantize_row(ADAPTIVE_LEVELS[level], row.data(), packed.data(), cols, block_size);
+            kernels::dequantize_row(ADAPTIVE_LEVELS[level], packed.data(), decoded.data(), cols, block_size);
+            for (size_t j = 0; j < cols; ++j) {
+                const double d = static_cast<double>(row[j]) - decoded[j];
+                errors[j / block_size][level] += d * d * (importance.empty() ? 1.0 : importance[j]);
+            }
+        }
+    }
+    return errors;
+}
+
+// Choose the precision of every column block of the ADAPTIVE tensors so that
+// they average bits_per_weight (masks and scales included) with the least
+// total error. All blocks start as INT4 and upgrades are taken greedily by
+// error removed per extra bit. Each block moves along the lower convex hull
+// of its (bits, error) points, so it can skip a precision that buys little.
+std::vector<std::vector<DataType>> allocate_precisions(const std::vector<BlockErrors>& errors,
+                                                       const std::vector<size_t>& rows, size_t block_size,
+                                                       double bits_per_weight) {
+    double bits[4];
+    for (size_t level = 0; level < 4; ++level) {
+        bits[level] = 8.0 * kernels::row_bytes(ADAPTIVE_LEVELS[level], block_size, block_size) / block_size;
+    }
+
+    std::vector<std::vector<uint8_t>> levels(errors.size());
+    double budget = 0.0;
+    for (size_t t = 0; t < errors.size(); ++t) {
+        levels[t].assign(errors[t].size(), 0);
+        const double weights = static_cast<double>(rows[t]) * errors[t].size() * block_size;
+        const double mask_bits = 8.0 * kernels::adaptive_mask_bytes(errors[t].size()) * rows[t];
+        budget += (bits_per_weight - bits[0]) * weights - mask_bits;
+    }
+
+    struct Step {
+        double gain;   // Error removed per bit
+        size_t tensor;
+        size_t block;
+        uint8_t level;
+        bool operator<(const Step& other) const { return gain < other.gain; }
+    };
+    std::priority_queue<Step> steps;
+    // Queue the best upgrade of a block to a level below limit
+    auto push_next = [&](size_t t, size_t b, uint8_t limit) {
+        const auto& e = errors[t][b];
+        const uint8_t from = levels[t][b];
+        Step best{0.0, t, b, from};
+        for (uint8_t to = from + 1; to < limit; ++to) {
+            const double gain = (e[from] - e[to]) / (bits[to] - bits[from]);
+            if (gain > best.gain) {
+                best.gain = gain;
+                best.level = to;
+            }
+        }
+        if (best.level != from) {
+            steps.push(best);
+        }
+    };
+    for (size_t t = 0; t < errors.size(); ++t) {
+        for (size_t b = 0; b < errors[t].size(); ++b) {
+            push_next(t, b, 4);
+        }
+    }
+    while (!steps.empty() && budget > 0.0) {
+        const Step step = steps.top();
+        steps.pop();
+        const uint8_t from = levels[step.tensor][step.block];
+        const double cost = (bits[step.level] - bits[from]) * rows[step.tensor] * block_size;
+        if (cost > budget) {
+            push_next(step.tensor, step.block, step.level);   // A smaller step may still fit
+            continue;
+        }
+        budget -= cost;
+        levels[step.tensor][step.block] = step.level;
+        push_next(step.tensor, step.block, 4);
+    }
+
+    std::vector<std::vector<DataType>> result(errors.size());
+    for (size_t t = 0; t < errors.size(); ++t) {
+        for (uint8_t level : levels[t]) {
+            result[t].push_back(ADAPTIVE_LEVELS[level]);
+        }
+    }
+    return result;
+}
+
+// Largest level of a block type: values are stored as q * d with q in
+// [-(top + 1), top]
+float top_level(DataType type) {
+    return type == DataType::INT8 ? 127.0f : type == DataType::INT5 ? 15.0f : 7.0f;
+}
+
+// A scale as stored (FP16)
+float stored_scale(float d) {
+    return kernels::fp16_to_fp32(kernels::fp32_to_fp16(d));
+}
+
+// Value of x after quantize_block_with_scale() with scale d
+inline float round_to_level(float x, float d, float top) {
+    const float id = d > 0.0f ? 1.0f / d : 0.0f;
+    return std::clamp(std::round(x * id), -(top + 1.0f), top) * d;
+}
+
+// Scale of a block with the least activation-weighted error, among
+// fractions of the scale that maps its largest value to the top level.
+// Clipping the largest values a little buys finer steps for the rest; the
+// importance decides whether that pays. Ties keep the plain scale.
+float search_scale(DataType type, const float* x, const float* importance, size_t bs) {
+    const float top = top_level(type);
+    float amax = 0.0f;
+    for (size_t i = 0; i < bs; ++i) {
+        amax = std::max(amax, std::fabs(x[i]));
+    }
+    float best_scale = amax / top;
+    double best_error = std::numeric_limits<double>::infinity();
+    for (int step = 0; step <= 30; ++step) {
+        const float d = stored_scale(amax / top * (1.0f - 0.01f * step));
+        double error = 0.0;
+        for (size_t i = 0; i < bs; ++i) {
+            const double e = x[i] - round_to_level(x[i], d, top);
+            error += importance[i] * e * e;
+        }
+        if (error < best_error) {
+            best_error = error;
+            best_scale = step == 0 ? amax / top : d;
+        }
+    }
+    return best_scale;
+}
+
+// Cholesky factorization in place: the lower triangle of a (n x n,
+// row-major) becomes L with a = L L^T and the upper triangle is zeroed.
+// Returns false if a is not positive definite.
+bool cholesky(std::vector<double>& a, size_t n) {
+    for (size_t j = 0; j < n; ++j) {
+        double* aj = a.data() + j * n;
+        double diag = aj[j];
+        for (size_t k = 0; k < j; ++k) {
+            diag -= aj[k] * aj[k];
+        }
+        if (!(diag > 0.0)) {
+            return false;
+        }
+        aj[j] = std::sqrt(diag);
+        const long last = static_cast<long>(n);
+        #pragma omp parallel for schedule(static)
+        for (long i = static_cast<long>(j) + 1; i < last; ++i) {
+            double* ai = a.data() + i * n;
+            double sum = ai[j];
+            for (size_t k = 0; k < j; ++k) {
+                sum -= ai[k] * aj[k];
+            }
+            ai[j] = sum / aj[j];
+        }
+        std::fill(aj + j + 1, aj + n, 0.0);
+    }
+    return true;
+}
+
+// Upper Cholesky factor U of the inverse of a damped Gram matrix (H^-1 =
+// U^T U), row-major. Columns no input reached get a unit diagonal so that
+// H stays invertible; their weights then round independently.
+std::vector<double> inverse_hessian_factor(std::vector<double> h, size_t n, double damping,
+                                           const std::string& name) {
+    double mean = 0.0;
+    for (size_t j = 0; j < n; ++j) {
+        if (h[j * n + j] <= 0.0) {
+            h[j * n + j] = 1.0;
+        }
+        mean += h[j * n + j] / n;
+    }
+
+    // Raise the damping until the factorization succeeds
+    std::vector<double> l;
+    for (int attempt = 0;; ++attempt) {
+        l = h;
+        for (size_t j = 0; j < n; ++j) {
+            l[j * n + j] += damping * mean;
+        }
+        if (cholesky(l, n)) {
+            break;
+        }
+        if (attempt == 4) {
+            throw std::runtime_error("Gram matrix of " + name + " is not positive definite");
+        }
+        damping = std::max(damping * 10.0, 1e-6);
+    }
+    // Release each n x n buffer once it is used up: at most two are held,
+    // 16 n^2 bytes per tensor in flight
+    std::vector<double>().swap(h);
+
+    // L^-1, lower triangular
+    std::vector<double> inv(n * n, 0.0);
+    for (size_t i = 0; i < n; ++i) {
+        const double* li = l.data() + i * n;
+        inv[i * n + i] = 1.0 / li[i];
+        const long cols = static_cast<long>(i);
+        #pragma omp parallel for schedule(static)
+        for (long j = 0; j < cols; ++j) {
+            double sum = 0.0;
+            for (size_t k = j; k < i; ++k) {
+                sum += li[k] * inv[k * n + j];
+            }
+            inv[i * n + j] = -sum / li[i];
+        }
+    }
+
+    std::vector<double>().swap(l);
+
+    // H^-1 = L^-T L^-1, then its lower factor, transposed
+    std::vector<double> t(n * n);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < n; ++k) {
+            t[i * n + k] = inv[k * n + i];
+        }
+    }
+    const long rows = static_cast<long>(n);
+    #pragma omp parallel for schedule(dynamic, 8)
+    for (long i = 0; i < rows; ++i) {
+        for (long j = 0; j <= i; ++j) {
+            double sum = 0.0;
+            for (size_t k = i; k < n; ++k) {
+                sum += t[i * n + k] * t[j * n + k];
+            }
+            inv[i * n + j] = sum;
+        }
+    }
+    if (!cholesky(inv, n)) {
+        throw std::runtime_error("Inverse Gram matrix of " + name + " is not positive definite");
+    }
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = i; k < n; ++k) {
+            t[i * n + k] = inv[k * n + i];
+        }
+        std::fill(t.begin() + i * n, t.begin() + i * n + i, 0.0);
+    }
+    return t;
+}
+
+// GPTQ on one row: columns are rounded in order and each rounding error is
+// spread over the later columns through U, so that the row's output on the
+// calibration inputs rather than its weights is reconstructed. A block's
+// scale is set from the updated weights when the block starts.
+void quantize_row_gptq(DataType type, const float* src, const std::vector<double>& u, uint8_t* dst,
+                       size_t cols, size_t block_size) {
+    const float top = top_level(type);
+    const size_t block_bytes = kernels::row_bytes(type, block_size, block_size);
+    std::vector<double> w(src, src + cols);
+    std::vector<float> q(block_size);
+    for (size_t b = 0; b < cols / block_size; ++b) {
+        double amax = 0.0;
+        for (size_t i = 0; i < block_size; ++i) {
+            amax = std::max(amax, std::fabs(w[b * block_size + i]));
+        }
+        const float d = stored_scale(static_cast<float>(amax / top));
+        for (size_t i = 0; i < block_size; ++i) {
+            const size_t j = b * block_size + i;
+            q[i] = round_to_level(static_cast<float>(w[j]), d, top);
+            const double* uj = u.data() + j * cols;
+            const double e = (w[j] - q[i]) / uj[j];
+            for (size_t k = j + 1; k < cols; ++k) {
+                w[k] -= e * uj[k];
+            }
+        }
+        kernels::quantize_block_with_scale(type, q.data(), d, dst + b * block_bytes, block_size);
+    }
+}
+
+// Whether a tensor is only read a row at a time, never multiplied: the
+// learned positions, and the token embeddings once lm_head.weight unties
+// the LM head
+bool is_lookup_table(const std::string& name, bool tied_embeddings) {
+    return name == "transformer.wpe.weight" || (name == "transformer.wte.weight" && !tied_embeddings);
+}
+
+struct ConvertedTensor {
+    AlignedBuffer data;
+    QuantizationMethod method = QuantizationMethod::ROUND_TO_NEAREST;
+};
+
+// Convert one tensor to its storage type, a row at a time
+ConvertedTensor convert_tensor(const amb::TensorRecord& record, DataType type, QuantizationMethod method,
+                               const QuantizerConfig& config, const std::vector<DataType>& block_types) {
+    const size_t block_size = config.block_size;
+    const auto [cols, src_stride] = source_layout(record, block_size);
+    const size_t rows = row_count(record.shape);
+    size_t dst_stride = 0;
+    if (type == DataType::ADAPTIVE) {
+        dst_stride = kernels::adaptive_mask_bytes(block_types.size());
+        for (DataType block_type : block_types) {
+            dst_stride += kernels::row_bytes(block_type, block_size, block_size);
+        }
+    } else {
+        dst_stride = kernels::row_bytes(type, cols, block_size);
+    }
+    ConvertedTensor result;
+    AlignedBuffer& out = result.data;
+    out.resize(dst_stride * rows);
+    if (type == record.data_type) {
+        std::memcpy(out.data(), record.data, out.size());
+        return result;
+    }
+
+    // Calibrated methods apply to fixed block types with statistics
+    std::vector<float> importance;
+    std::vector<double> u;
+    if (method != QuantizationMethod::ROUND_TO_NEAREST && type != DataType::ADAPTIVE && is_block_quantized(type)) {
+        importance = column_importance(record.name, cols, config.activation_stats);
+        result.method = method;
+        if (result.method == QuantizationMethod::GPTQ) {
+            u = inverse_hessian_factor(config.activation_stats->gram(record.name), cols, config.gptq_damping,
+                                       record.name);
+        }
+    }
+
+    std::vector<float> row(cols);
+    const size_t block_bytes = is_block_quantized(type) ? kernels::row_bytes(type, block_size, block_size) : 0;
+    for (size_t r = 0; r < rows; ++r) {
+        kernels::dequantize_row(record.data_type, record.data + r * src_stride, row.data(), cols, block_size);
+        uint8_t* dst = out.data() + r * dst_stride;
+        if (type == DataType::ADAPTIVE) {
+            kernels::quantize_adaptive_row(row.data(), block_types.data(), dst, cols, block_size);
+        } else if (result.method == QuantizationMethod::GPTQ) {
+            quantize_row_gptq(type, row.data(), u, dst, cols, block_size);
+        } else if (result.method == QuantizationMethod::ACTIVATION_AWARE) {
+            for (size_t b = 0; b < cols / block_size; ++b) {
+                const float* x = row.data() + b * block_size;
+                const float d = search_scale(type, x, importance.data() + b * block_size, block_size);
+                kernels::quantize_block_with_scale(type, x, d, dst + b * block_bytes, block_size);
+            }
+        } else {
+            kernels::quantize_row(type, row.data(), dst, cols, block_size);
+        }
+    }
+    return result;
+}
+
+// Run work(i, slot) for items [0, n) in parallel, a window of slots at a
+// time, then finish(i, slot) for the window's items in order
+template <typename Work, typename Finish>
+void for_each_window(size_t n, size_t threads, size_t window, Work&& work, Finish&& finish) {
+    std::vector<std::exception_ptr> errors(window);
+    for (size_t begin = 0; begin < n; begin += window) {
+        const size_t count = std::min(window, n - begin);
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(static_cast<int>(std::min(threads, count)))
+        for (size_t j = 0; j < count; ++j) {
+            try {
+                work(begin + j, j);
+            } catch (...) {
+                errors[j] = std::current_exception();
+            }
+        }
+        for (size_t j = 0; j < count; ++j) {
+            if (errors[j]) {
+                std::rethrow_exception(errors[j]);
+            }
+        }
+        for (size_t j = 0; j < count; ++j) {
+            finish(begin + j, j);
+        }
+    }
+}
+
+void write_bytes(std::ofstream& out, const void* data, size_t size, const std::string& path) {
+    out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+void write_padding(std::ofstream& out, size_t n, const std::string& path) {
+    static const uint8_t zeros[amb::SECTION_ALIGNMENT] = {};
+    write_bytes(out, zeros, n, path);
+}
+
+} // namespace
+
+DataType parse_data_type(const std::string& name) {
+    if (name == "fp32") return DataType::FP32;
+    if (name == "fp16") return DataType::FP16;
+    if (name == "bf16") return DataType::BF16;
+    if (name == "int8") return DataType::INT8;
+    if (name == "int5" || name == "int5_block") return DataType::INT5;
+    if (name == "int4" || name == "int4_block") return DataType::INT4;
+    if (name == "adaptive") return DataType::ADAPTIVE;
+    throw std::invalid_argument("Unknown storage type: " + name);
+}
+
+const char* data_type_name(DataType type) {
+    switch (type) {
+        case DataType::FP32: return "fp32";
+        case DataType::FP16: return "fp16";
+        case DataType::BF16: return "bf16";
+        case DataType::INT8: return "int8";
+        case DataType::INT4: return "int4";
+        case DataType::INT5: return "int5";
+        case DataType::ADAPTIVE: return "adaptive";
+    }
+    return "unknown";
+}
+
+QuantizationMethod parse_quantization_method(const std::string& name) {
+    if (name == "rtn") return QuantizationMethod::ROUND_TO_NEAREST;
+    if (name == "activation-aware" || name == "awq") return QuantizationMethod::ACTIVATION_AWARE;
+    if (name == "gptq") return QuantizationMethod::GPTQ;
+    throw std::invalid_argument("Unknown quantization method: " + name);
+}
+
+const char* quantization_method_name(QuantizationMethod method) {
+    switch (method) {
+        case QuantizationMethod::ROUND_TO_NEAREST: return "rtn";
+        case QuantizationMethod::ACTIVATION_AWARE: return "activation-aware";
+        case QuantizationMethod::GPTQ: return "gptq";
+    }
+    return "unknown";
+}
+
+bool is_block_quantized(DataType type) {
+    return type == DataType::INT8 || type == DataType::INT5 || type == DataType::INT4 ||
+           type == DataType::ADAPTIVE;
+}
+
+DataType select_tensor_type(const QuantizerConfig& config, const std::string& name,
+                            const std::vector<size_t>& shape) {
+    for (const TensorTypeRule& rule : config.rules) {
+        if (matches(rule.pattern, name)) {
+            if (is_block_quantized(rule.type) && !fits_blocks(shape, config.block_size)) {
+                throw std::invalid_argument("Tensor " + name + " cannot be stored as " +
+                                            data_type_name(rule.type) + " with block size " +
+                                            std::to_string(config.block_size));
+            }
+            return rule.type;
+        }
+    }
+    if (shape.size() != 2 || name == "transformer.wpe.weight") {
+        return DataType::FP32;
+    }
+    if (is_block_quantized(config.type) && !fits_blocks(shape, config.block_size)) {
+        return DataType::FP16;
+    }
+    return config.type;
+}
+
+QuantizationSummary quantize_model(const std::string& input_path, const std::string& output_path,
+                                   const QuantizerConfig& config,
+                                   const std::function<void(const TensorQuantization&)>& on_tensor) {
+    if (config.block_size == 0 || config.block_size % 8 != 0 || config.block_size > UINT16_MAX) {
+        throw std::invalid_argument("Block size must be a positive multiple of 8");
+    }
+    std::error_code ec;
+    if (std::filesystem::equivalent(input_path, output_path, ec)) {
+        throw std::invalid_argument("Quantizer output would overwrite its input: " + output_path);
+    }
+
+    amb::MappedFile input(input_path);
+    if (input.size() >= 4 && std::memcmp(input.data(), "GGUF", 4) == 0) {
+        throw std::runtime_error("GGUF input is not supported; convert the model to AMB first");
+    }
+    const amb::Header header = amb::parse_header(input.data(), input.size());
+    const uint8_t* weights = input.data() + header.weights_offset();
+
+    // Index the tensor records; only their headers are read here
+    std::vector<amb::TensorRecord> records;
+    for (size_t offset = 0; offset < header.weights_size;) {
+        records.push_back(
+            amb::parse_tensor_record(weights, header.weights_size, offset, header.aligned_tensor_data()));
+        offset = records.back().end;
+    }
+
+    // The config gains the quantization settings and is padded with spaces
+    // so that the tokenizer section stays 8-byte aligned
+    const std::string config_json(reinterpret_cast<const char*>(input.data() + header.config_offset()),
+                                  header.config_size);
+    std::string out_config = with_quant_config(config_json, std::string("{\"type\": \"") +
+                                                   quant_type_name(config.type) + "\", \"block_size\": " +
+                                                   std::to_string(config.block_size) +
+                                                   ", \"scale_type\": \"fp16\"}");
+    out_config.append(amb::tensor_record_padding(amb::HEADER_SIZE + header.metadata_size + out_config.size()),
+                      ' ');
+    const size_t tokenizer_padding = amb::tensor_record_padding(header.tokenizer_size);
+
+    amb::Header out_header;
+    out_header.flags = header.flags;
+    out_header.metadata_size = header.metadata_size;
+    out_header.config_size = static_cast<uint32_t>(out_config.size());
+    out_header.tokenizer_size = static_cast<uint32_t>(header.tokenizer_size + tokenizer_padding);
+
+#ifdef _OPENMP
+    const size_t threads = config.n_threads > 0 ? config.n_threads
+                                                : static_cast<size_t>(omp_get_max_threads());
+#else
+    const size_t threads = 1;
+#endif
+    const size_t window = config.max_tensors_in_flight > 0 ? config.max_tensors_in_flight : threads;
+    std::vector<DataType> types(records.size());
+    std::vector<size_t> adaptive;
+    for (size_t i = 0; i < records.size(); ++i) {
+        types[i] = select_tensor_type(config, records[i].name, records[i].shape);
+        if (types[i] == DataType::ADAPTIVE) {
+            adaptive.push_back(i);
+        }
+    }
+
+    if (config.method != QuantizationMethod::ROUND_TO_NEAREST && !config.activation_stats) {
+        throw std::invalid_argument(std::string("Quantization method ") + quantization_method_name(config.method) +
+                                    " needs calibration statistics");
+    }
+    if (config.method == QuantizationMethod::GPTQ && !config.activation_stats->collects_gram()) {
+        throw std::invalid_argument("GPTQ needs calibration statistics collected with Gram matrices");
+    }
+    // Tables that are only looked up by row never see an input during
+    // calibration, so they are rounded. Every other tensor the method applies
+    // to must have been reached by the calibration text; falling back to
+    // rounding would go unnoticed
+    const bool tied_embeddings = std::none_of(records.begin(), records.end(), [](const amb::TensorRecord& record) {
+        return record.name == "lm_head.weight";
+    });
+    std::vector<QuantizationMethod> methods(records.size(), config.method);
+    if (config.method != QuantizationMethod::ROUND_TO_NEAREST) {
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (is_lookup_table(records[i].name, tied_embeddings)) {
+                methods[i] = QuantizationMethod::ROUND_TO_NEAREST;
+            } else if (is_block_quantized(types[i]) && types[i] != DataType::ADAPTIVE &&
+                types[i] != records[i].data_type && config.activation_stats->importance(records[i].name).empty()) {
+                throw std::invalid_argument("Tensor " + records[i].name + " has no calibration statistics for " +
+                                            quantization_method_name(config.method) +
+                                            "; store it in another type with a rule");
+            }
+        }
+    }
+
+    // First pass over ADAPTIVE tensors: measure, then spend the bit budget
+    std::vector<std::vector<DataType>> block_types(records.size());
+    if (!adaptive.empty()) {
+        if (!(config.target_bits_per_weight > 0.0f)) {
+            throw std::invalid_argument("ADAPTIVE tensors need a positive bits-per-weight target");
+        }
+        std::vector<BlockErrors> errors(adaptive.size());
+        std::vector<size_t> rows(adaptive.size());
+        for_each_window(
+            adaptive.size(), threads, window,
+            [&](size_t k, size_t) {
+                errors[k] = adaptive_errors(records[adaptive[k]], config.block_size, config.activation_stats);
+                rows[k] = row_count(records[adaptive[k]].shape);
+            },
+            [&](size_t k, size_t) {
+                const amb::TensorRecord& record = records[adaptive[k]];
+                input.evict(header.weights_offset() + record.offset, record.end - record.offset);
+            });
+        auto plans = allocate_precisions(errors, rows, config.block_size, config.target_bits_per_weight);
+        for (size_t k = 0; k < adaptive.size(); ++k) {
+            block_types[adaptive[k]] = std::move(plans[k]);
+        }
+    }
+
+    QuantizationSummary summary;
+    try {
+        std::ofstream out(output_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Failed to create " + output_path);
+        }
+        const auto placeholder = amb::serialize_header(out_header);
+        write_bytes(out, placeholder.data(), placeholder.size(), output_path);
+        write_bytes(out, input.data() + header.metadata_offset(), header.metadata_size, output_path);
+        write_bytes(out, out_config.data(), out_config.size(), output_path);
+        write_bytes(out, input.data() + header.tokenizer_offset(), header.tokenizer_size, output_path);
+        write_padding(out, tokenizer_padding, output_path);
+
+        // Convert a window of tensors in parallel, then write it in order
+        uint64_t weights_size = 0;
+        std::vector<ConvertedTensor> converted(window);
+        for_each_window(
+            records.size(), threads, window,
+            [&](size_t i, size_t slot) {
+                converted[slot] = convert_tensor(records[i], types[i], methods[i], config, block_types[i]);
+            },
+            [&](size_t i, size_t slot) {
+                const amb::TensorRecord& record = records[i];
+                const DataType type = types[i];
+                const std::vector<uint8_t> record_header =
+                    amb::serialize_tensor_header(record.name, record.shape, type, converted[slot].data.size());
+                write_bytes(out, record_header.data(), record_header.size(), output_path);
+                const AlignedBuffer& data = converted[slot].data;
+                write_bytes(out, data.data(), data.size(), output_path);
+                weights_size += record_header.size() + data.size();
+                const size_t padding = amb::tensor_record_padding(weights_size);
+                write_padding(out, padding, output_path);
+                weights_size += padding;
+
+                ++summary.n_tensors;
+                summary.n_quantized += is_block_quantized(type);
+                summary.source_bytes += record.data_size;
+                summary.bytes += data.size();
+                summary.n_weights += element_count(record.shape);
+                for (DataType block_type : block_types[i]) {
+                    const size_t level = std::find(std::begin(ADAPTIVE_LEVELS), std::end(ADAPTIVE_LEVELS),
+                                                   block_type) - std::begin(ADAPTIVE_LEVELS);
+                    summary.adaptive_blocks[level] += row_count(record.shape);
+                }
+                if (on_tensor) {
+                    on_tensor(TensorQuantization{record.name, record.shape, record.data_type, type,
+                                                 record.data_size, data.size(), converted[slot].method});
+                }
+                converted[slot] = ConvertedTensor();
+                input.evict(header.weights_offset() + record.offset, record.end - record.offset);
+            });
+
+        out_header.weights_size = weights_size;
+        const auto final_header = amb::serialize_header(out_header);
+        out.seekp(0);
+        write_bytes(out, final_header.data(), final_header.size(), output_path);
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed to write " + output_path);
+        }
+    } catch (...) {
+        std::remove(output_path.c_str());
+        throw;
+    }
+    return summary;
+}
+
+} // namespace embee
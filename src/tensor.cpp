@@ -0,0 +1,130 @@
+/**
+ * @file tensor.cpp
+ * @brief Tensor accessors and dtype-dispatched weight views
+ */
+
+#include "embee/tensor.h"
+#include "embee/kernels.h"
+#include <cstring>
+
+namespace embee {
+
+size_t Tensor::numel() const {
+    size_t n = 1;
+    for (size_t d : shape) {
+        n *= d;
+    }
+    return n;
+}
+
+float QuantBlock::scale() const {
+    uint16_t h;
+    std::memcpy(&h, ptr, sizeof(h));
+    return kernels::fp16_to_fp32(h);
+}
+
+WeightView::WeightView(DataType type, const uint8_t* data, size_t rows, size_t cols, size_t block_size)
+    : type_(type), data_(data), rows_(rows), cols_(cols), block_size_(block_size),
+      row_stride_(type == DataType::ADAPTIVE && rows == 0
+                      ? 0 : kernels::row_bytes(type, cols, block_size, data)) {}
+
+bool WeightView::is_quantized() const {
+    return type_ == DataType::INT8 || type_ == DataType::INT5 || type_ == DataType::INT4 ||
+           type_ == DataType::ADAPTIVE;
+}
+
+WeightView WeightView::slice_rows(size_t begin, size_t end) const {
+    if (begin > end || end > rows_) {
+        throw std::out_of_range("Row slice [" + std::to_string(begin) + ", " + std::to_string(end) +
+                                ") out of range for " + std::to_string(rows_) + " rows");
+    }
+    WeightView result = *this;
+    result.data_ = row(begin);
+    result.rows_ = end - begin;
+    return result;
+}
+
+void WeightView::dequantize_row(size_t r, float* dst) const {
+    kernels::dequantize_row(type_, row(r), dst, cols_, block_size_);
+}
+
+float WeightView::at(size_t r, size_t c) const {
+    const uint8_t* src = row(r);
+    switch (type_) {
+        case DataType::FP32: {
+            float value;
+            std::memcpy(&value, src + c * sizeof(float), sizeof(value));
+            return value;
+        }
+        case DataType::FP16:
+        case DataType::BF16: {
+            float value;
+            kernels::dequantize_row(type_, src + c * sizeof(uint16_t), &value, 1, block_size_);
+            return value;
+        }
+        case DataType::ADAPTIVE: {
+            // Block offsets depend on the precision mask
+            std::vector<float> values(cols_);
+            kernels::dequantize_row(type_, src, values.data(), cols_, block_size_);
+            return values[c];
+        }
+        default: {
+            // Decode only the block holding the element
+            const size_t block_bytes = kernels::row_bytes(type_, block_size_, block_size_);
+            std::vector<float> values(block_size_);
+            kernels::dequantize_row(type_, src + (c / block_size_) * block_bytes, values.data(),
+                                    block_size_, block_size_);
+            return values[c % block_size_];
+        }
+    }
+}
+
+WeightView::BlockRange WeightView::blocks(size_t r) const {
+    if (!is_quantized()) {
+        throw std::logic_error("Float weights have no quantization blocks");
+    }
+    if (type_ == DataType::ADAPTIVE) {
+        throw std::logic_error("ADAPTIVE rows mix block layouts; use kernels::adaptive_block_type()");
+    }
+    const size_t block_bytes = kernels::row_bytes(type_, block_size_, block_size_);
+    const uint8_t* first = row(r);
+    return BlockRange{BlockIterator(first, block_bytes), BlockIterator(first + row_stride_, block_bytes)};
+}
+
+TensorView<const float> WeightView::as_fp32() const {
+    if (type_ != DataType::FP32) {
+        throw std::logic_error("Weights are not stored as FP32");
+    }
+    return TensorView<const float>(reinterpret_cast<const float*>(data_), {rows_, cols_});
+}
+
+namespace {
+
+void check_fp32(const Tensor& tensor) {
+    if (tensor.data_type != DataType::FP32) {
+        throw std::invalid_argument("Tensor " + tensor.name + " is not FP32");
+    }
+}
+
+} // namespace
+
+TensorView<float> fp32_view(Tensor& tensor) {
+    check_fp32(tensor);
+    if (tensor.mapped) {
+        throw std::logic_error("Tensor " + tensor.name + " is read-only (used in place)");
+    }
+    return TensorView<float>(reinterpret_cast<float*>(tensor.data.data()), tensor.shape);
+}
+
+TensorView<const float> fp32_view(const Tensor& tensor) {
+    check_fp32(tensor);
+    return TensorView<const float>(reinterpret_cast<const float*>(tensor.bytes()), tensor.shape);
+}
+
+WeightView weight_view(const Tensor& tensor, size_t block_size) {
+    const size_t rows = tensor.shape.size() > 1 ? tensor.shape[0] : 1;
+    const size_t cols = rows > 0 ? tensor.numel() / rows : 0;
+    return WeightView(tensor.data_type, tensor.bytes(), rows, cols, block_size);
+}
+
+} // namespace embee
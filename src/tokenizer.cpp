@@ -0,0 +1,616 @@
+/**
+ * @file tokenizer.cpp
+ * @brief Shared Tokenizer functionality and the in-place binary BPE tokenizer
+ */
+
+#include "embee/tokenizer.h"
+#include "embee/amb_format.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace embee {
+
+namespace {
+
+// Per-thread scratch used by encode_batch(). OpenMP keeps its worker threads
+// alive between parallel regions, so the buffers keep their capacity and a
+// steady-state batch performs no allocation beyond the output buffers.
+TokenVector& batch_scratch() {
+    thread_local TokenVector scratch;
+    return scratch;
+}
+
+// Symbols of the piece being merged by BinaryTokenizer, as a doubly
+// linked list over the piece's bytes, and the pending merges as a min-heap
+struct MergeSymbol {
+    int32_t id;     // -1 once merged into the symbol on its left
+    int32_t prev;   // Index of the previous live symbol, -1 at the start
+    int32_t next;   // Index of the next live symbol, -1 at the end
+};
+
+struct MergeCandidate {
+    uint32_t rank;
+    int32_t left;    // Index of the left symbol
+    int32_t left_id;
+    int32_t right_id;
+    int32_t merged;
+
+    // Lowest rank first, then leftmost, so merges apply in BPE order
+    bool operator<(const MergeCandidate& other) const {
+        return rank != other.rank ? rank > other.rank : left > other.left;
+    }
+};
+
+struct MergeScratch {
+    std::vector<MergeSymbol> symbols;
+    std::vector<MergeCandidate> heap;
+};
+
+MergeScratch& merge_scratch() {
+    thread_local MergeScratch scratch;
+    return scratch;
+}
+
+// Character classes of the pre-tokenizer
+enum class CharClass {
+    SPACE,
+    LETTER,
+    NUMBER,
+    OTHER   // Punctuation and symbols
+};
+
+// Class of a code point. Letters are everything not listed as space, number
+// or punctuation/symbol; the ranges cover ASCII, Latin-1, general and CJK
+// punctuation, fullwidth forms, arrows and math, box drawing and emoji.
+CharClass char_class(uint32_t c) {
+    if (c < 0x80) {
+        if (c == ' ' || (c >= '\t' && c <= '\r')) return CharClass::SPACE;
+        if (c >= '0' && c <= '9') return CharClass::NUMBER;
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return CharClass::LETTER;
+        return CharClass::OTHER;
+    }
+    if (c == 0x85 || c == 0xA0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200A) || c == 0x2028 ||
+        c == 0x2029 || c == 0x202F || c == 0x205F || c == 0x3000) {
+        return CharClass::SPACE;
+    }
+    if ((c >= 0x0660 && c <= 0x0669) || (c >= 0x06F0 && c <= 0x06F9) || (c >= 0x0966 && c <= 0x096F) ||
+        (c >= 0xFF10 && c <= 0xFF19)) {
+        return CharClass::NUMBER;
+    }
+    if ((c >= 0xA1 && c <= 0xBF) || c == 0xD7 || c == 0xF7 || (c >= 0x2010 && c <= 0x2027) ||
+        (c >= 0x2030 && c <= 0x205E) || (c >= 0x20A0 && c <= 0x20CF) || (c >= 0x2190 && c <= 0x2BFF) ||
+        (c >= 0x3001 && c <= 0x3003) || (c >= 0x3008 && c <= 0x301F) || (c >= 0xFE30 && c <= 0xFE4F) ||
+        (c >= 0xFF01 && c <= 0xFF0F) || (c >= 0xFF1A && c <= 0xFF20) || (c >= 0xFF3B && c <= 0xFF40) ||
+        (c >= 0xFF5B && c <= 0xFF65) || (c >= 0x1F000 && c <= 0x1FAFF)) {
+        return CharClass::OTHER;
+    }
+    // Combining marks and format characters (joiners, variation selectors)
+    // are neither letters nor numbers, so emoji sequences stay in one piece
+    if ((c >= 0x0300 && c <= 0x036F) || (c >= 0x1AB0 && c <= 0x1AFF) || (c >= 0x1DC0 && c <= 0x1DFF) ||
+        (c >= 0x200B && c <= 0x200F) || (c >= 0x202A && c <= 0x202E) || (c >= 0x2060 && c <= 0x206F) ||
+        (c >= 0x20D0 && c <= 0x20FF) || (c >= 0xFE00 && c <= 0xFE0F) || (c >= 0xFE20 && c <= 0xFE2F) ||
+        c == 0xFEFF || (c >= 0xE0000 && c <= 0xE007F) || (c >= 0xE0100 && c <= 0xE01EF)) {
+        return CharClass::OTHER;
+    }
+    return CharClass::LETTER;
+}
+
+// Decode the UTF-8 sequence at text[i]; malformed bytes decode on their own
+// as punctuation, so arbitrary bytes still split deterministically
+size_t next_char(const uint8_t* text, size_t length, size_t i, CharClass& cls) {
+    const uint8_t lead = text[i];
+    size_t n = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+    if (n == 0 || i + n > length) {
+        cls = CharClass::OTHER;
+        return 1;
+    }
+    uint32_t c = n == 1 ? lead : lead & (0x7F >> n);
+    for (size_t k = 1; k < n; ++k) {
+        if ((text[i + k] & 0xC0) != 0x80) {
+            cls = CharClass::OTHER;
+            return 1;
+        }
+        c = (c << 6) | (text[i + k] & 0x3F);
+    }
+    cls = char_class(c);
+    return n;
+}
+
+// Length of an English contraction ('s 't 're 've 'm 'll 'd) at text[i], or 0
+size_t contraction(const uint8_t* text, size_t length, size_t i) {
+    if (text[i] != '\'' || i + 1 >= length) {
+        return 0;
+    }
+    const uint8_t a = text[i + 1];
+    if (a == 's' || a == 't' || a == 'm' || a == 'd') {
+        return 2;
+    }
+    const uint8_t b = i + 2 < length ? text[i + 2] : 0;
+    if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l')) {
+        return 3;
+    }
+    return 0;
+}
+
+std::string lowercase_extension(const std::string& path) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return ext;
+}
+
+int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+} // namespace
+
+std::unique_ptr<Tokenizer> Tokenizer::load(const std::string& path) {
+    // vocab.json/merges.txt directories and SentencePiece models are not
+    // implemented yet; only binary sections load
+    if (std::filesystem::is_directory(path) || lowercase_extension(path) == ".model") {
+        throw std::runtime_error("unsupported tokenizer type: " + path);
+    }
+
+    auto file = std::make_shared<amb::MappedFile>(path);
+    const uint8_t* section = file->data();
+    size_t section_size = file->size();
+
+    // A full AMB model: use its tokenizer section; otherwise a bare section
+    if (section_size >= amb::HEADER_SIZE &&
+        std::memcmp(section, amb::MAGIC, sizeof(amb::MAGIC)) == 0) {
+        amb::Header header = amb::parse_header(section, section_size);
+        section += header.tokenizer_offset();
+        section_size = header.tokenizer_size;
+    }
+
+    if (section_size == 0 ||
+        section[0] != static_cast<uint8_t>(amb::TokenizerType::BINARY_BPE)) {
+        throw std::runtime_error("Unrecognized tokenizer file: " + path);
+    }
+    return std::make_unique<BinaryTokenizer>(section, section_size, file);
+}
+
+void Tokenizer::encode_into(std::string_view text, TokenVector& out) const {
+    TokenVector encoded = encode(std::string(text));
+    out.insert(out.end(), encoded.begin(), encoded.end());
+}
+
+size_t Tokenizer::memory_usage() const {
+    return 0;
+}
+
+void Tokenizer::encode_batch(const std::string_view* texts, size_t n_texts,
+                             TokenVector& tokens, std::vector<size_t>& offsets,
+                             size_t n_threads) const {
+    offsets.assign(n_texts + 1, 0);
+    if (n_texts == 0) {
+        tokens.clear();
+        return;
+    }
+
+    size_t requested = n_threads > 0 ? n_threads : static_cast<size_t>(max_threads());
+    int threads = static_cast<int>(std::max<size_t>(1, std::min(requested, n_texts)));
+
+    // chunk_start[t] is the position of thread t's first token in the output
+    std::vector<size_t> chunk_start(threads + 1, 0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    #pragma omp parallel num_threads(threads)
+    {
+#ifdef _OPENMP
+        const size_t t = omp_get_thread_num();
+        const size_t nt = omp_get_num_threads();
+#else
+        const size_t t = 0;
+        const size_t nt = 1;
+#endif
+        // Contiguous chunks keep each thread's output in document order
+        const size_t begin = n_texts * t / nt;
+        const size_t end = n_texts * (t + 1) / nt;
+
+        TokenVector& scratch = batch_scratch();
+        scratch.clear();
+
+        try {
+            for (size_t i = begin; i < end; ++i) {
+                size_t before = scratch.size();
+                encode_into(texts[i], scratch);
+                offsets[i + 1] = scratch.size() - before;
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        chunk_start[t + 1] = scratch.size();
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for (size_t i = 0; i < nt; ++i) {
+                chunk_start[i + 1] += chunk_start[i];
+            }
+            if (!error) {
+                tokens.resize(chunk_start[nt]);
+            }
+        }
+
+        if (!error && !scratch.empty()) {
+            std::memcpy(tokens.data() + chunk_start[t], scratch.data(),
+                        scratch.size() * sizeof(TokenId));
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // Per-document lengths -> offsets
+    for (size_t i = 0; i < n_texts; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+}
+
+// CharTokenizer
+
+TokenVector CharTokenizer::encode(const std::string& text) const {
+    TokenVector result;
+    encode_into(text, result);
+    return result;
+}
+
+void CharTokenizer::encode_into(std::string_view text, TokenVector& out) const {
+    size_t start = out.size();
+    out.resize(start + text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        out[start + i] = static_cast<unsigned char>(text[i]);
+    }
+}
+
+std::string CharTokenizer::decode(const TokenVector& tokens) const {
+    std::string result;
+    result.reserve(tokens.size());
+    for (TokenId token : tokens) {
+        result.push_back(static_cast<char>(token));
+    }
+    return result;
+}
+
+size_t CharTokenizer::vocab_size() const {
+    return 256;
+}
+
+std::optional<TokenId> CharTokenizer::bos_token() const {
+    return 1;  // ASCII SOH
+}
+
+std::optional<TokenId> CharTokenizer::eos_token() const {
+    return 2;  // ASCII STX
+}
+
+std::optional<TokenId> CharTokenizer::pad_token() const {
+    return 0;
+}
+
+// BinaryTokenizer
+
+BinaryTokenizer::BinaryTokenizer(const uint8_t* data, size_t size, std::shared_ptr<const void> owner)
+    : owner_(std::move(owner)), section_size_(size) {
+    if (reinterpret_cast<uintptr_t>(data) % alignof(uint32_t) != 0) {
+        // Sections are aligned by the writer; tolerate foreign files with one copy
+        auto copy = std::make_shared<std::vector<uint32_t>>((size + 3) / 4);
+        std::memcpy(copy->data(), data, size);
+        data = reinterpret_cast<const uint8_t*>(copy->data());
+        owner_ = copy;
+    }
+
+    if (size < sizeof(amb::TokenizerSectionHeader)) {
+        throw std::runtime_error("Tokenizer section too small");
+    }
+    header_ = reinterpret_cast<const amb::TokenizerSectionHeader*>(data);
+    if (header_->type != static_cast<uint8_t>(amb::TokenizerType::BINARY_BPE) ||
+        header_->version != amb::TOKENIZER_LAYOUT_VERSION) {
+        throw std::runtime_error("Unsupported tokenizer section type or version");
+    }
+    if (header_->merge_table_size == 0 ||
+        (header_->merge_table_size & (header_->merge_table_size - 1)) != 0) {
+        throw std::runtime_error("Tokenizer merge table size must be a power of two");
+    }
+
+    auto check_range = [size](uint64_t offset, uint64_t bytes) {
+        if (offset % alignof(uint32_t) != 0 || offset > size || bytes > size - offset) {
+            throw std::runtime_error("Tokenizer section array out of bounds");
+        }
+    };
+    check_range(header_->offsets_offset, (uint64_t(header_->n_vocab) + 1) * sizeof(uint32_t));
+    check_range(header_->byte_tokens_offset, 256 * sizeof(int32_t));
+    check_range(header_->merges_offset, uint64_t(header_->merge_table_size) * sizeof(amb::MergeSlot));
+    check_range(header_->trie_nodes_offset, uint64_t(header_->n_trie_nodes) * sizeof(amb::TrieNode));
+    check_range(header_->trie_edges_offset, uint64_t(header_->n_trie_edges) * sizeof(amb::TrieEdge));
+    if (header_->string_pool_offset > size ||
+        header_->string_pool_size > size - header_->string_pool_offset) {
+        throw std::runtime_error("Tokenizer string pool out of bounds");
+    }
+
+    offsets_ = reinterpret_cast<const uint32_t*>(data + header_->offsets_offset);
+    string_pool_ = reinterpret_cast<const char*>(data + header_->string_pool_offset);
+    byte_tokens_ = reinterpret_cast<const int32_t*>(data + header_->byte_tokens_offset);
+    merges_ = reinterpret_cast<const amb::MergeSlot*>(data + header_->merges_offset);
+    trie_nodes_ = reinterpret_cast<const amb::TrieNode*>(data + header_->trie_nodes_offset);
+    trie_edges_ = reinterpret_cast<const amb::TrieEdge*>(data + header_->trie_edges_offset);
+    merge_mask_ = header_->merge_table_size - 1;
+
+    if (offsets_[header_->n_vocab] > header_->string_pool_size) {
+        throw std::runtime_error("Tokenizer string offsets exceed the string pool");
+    }
+
+    // Header fields are checked here; merge slots and trie links are checked
+    // where encode() reads them, so loading stays independent of their size
+    const int64_t n_vocab = header_->n_vocab;
+    auto check_token = [n_vocab](int32_t id, const char* what) {
+        if (id >= n_vocab) {
+            throw std::runtime_error(std::string("Tokenizer ") + what + " " + std::to_string(id) +
+                                     " is outside the vocabulary");
+        }
+    };
+    check_token(header_->bos_id, "BOS token");
+    check_token(header_->eos_id, "EOS token");
+    check_token(header_->pad_id, "pad token");
+    check_token(header_->unk_id, "unknown token");
+    check_token(header_->mask_id, "mask token");
+    for (size_t b = 0; b < 256; ++b) {
+        if (byte_tokens_[b] < 0) {
+            throw std::runtime_error("Tokenizer has no token for byte " + std::to_string(b));
+        }
+        check_token(byte_tokens_[b], "byte token");
+    }
+}
+
+TokenVector BinaryTokenizer::encode(const std::string& text) const {
+    TokenVector result;
+    encode_into(text, result);
+    return result;
+}
+
+void BinaryTokenizer::encode_into(std::string_view text, TokenVector& out) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(text.data());
+    const size_t n = text.size();
+
+    if (header_->n_trie_nodes == 0) {
+        encode_text(p, n, out);
+        return;
+    }
+
+    // Special tokens are atomic: split the text around them
+    size_t segment_start = 0;
+    size_t i = 0;
+    while (i < n) {
+        TokenId id;
+        size_t length = match_special(p + i, n - i, id);
+        if (length == 0) {
+            ++i;
+            continue;
+        }
+        encode_text(p + segment_start, i - segment_start, out);
+        out.push_back(id);
+        i += length;
+        segment_start = i;
+    }
+    encode_text(p + segment_start, n - segment_start, out);
+}
+
+void BinaryTokenizer::encode_text(const uint8_t* text, size_t length, TokenVector& out) const {
+    // GPT-2 pre-tokenization on character classes:
+    //   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+    // Merges never cross piece boundaries.
+    size_t i = 0;
+    while (i < length) {
+        const size_t start = i;
+        if (const size_t n = contraction(text, length, i)) {
+            encode_piece(text + start, n, out);
+            i += n;
+            continue;
+        }
+
+        CharClass cls;
+        size_t n = next_char(text, length, i, cls);
+        if (cls == CharClass::SPACE) {
+            CharClass next_cls = cls;
+            size_t last = i;
+            while (i < length) {
+                n = next_char(text, length, i, next_cls);
+                if (next_cls != CharClass::SPACE) {
+                    break;
+                }
+                last = i;
+                i += n;
+            }
+            if (i == length) {
+                encode_piece(text + start, i - start, out);
+                continue;
+            }
+            // Before a non-space the run leaves its last character to the
+            // next piece; a single space joins the following run, any other
+            // single whitespace character stands alone
+            if (last > start) {
+                encode_piece(text + start, last - start, out);
+                i = last;
+                continue;
+            }
+            if (text[start] != ' ') {
+                encode_piece(text + start, i - start, out);
+                continue;
+            }
+            cls = next_cls;
+        }
+
+        // A run of one class, after an optional leading space
+        CharClass run_cls = cls;
+        while (run_cls == cls) {
+            i += n;
+            if (i >= length) {
+                break;
+            }
+            n = next_char(text, length, i, run_cls);
+        }
+        encode_piece(text + start, i - start, out);
+    }
+}
+
+int32_t BinaryTokenizer::find_merge(int32_t left, int32_t right, uint32_t& rank) const {
+    uint32_t slot = amb::merge_hash(left, right, merge_mask_);
+    for (uint32_t probe = 0; probe <= merge_mask_ && merges_[slot].left >= 0; ++probe) {
+        const amb::MergeSlot& m = merges_[slot];
+        if (m.left == left && m.right == right) {
+            if (static_cast<uint32_t>(m.merged) >= header_->n_vocab) {
+                throw std::runtime_error("Tokenizer section is corrupt: merge token " +
+                                         std::to_string(m.merged) + " is outside the vocabulary");
+            }
+            rank = m.rank;
+            return m.merged;
+        }
+        slot = (slot + 1) & merge_mask_;
+    }
+    return -1;
+}
+
+void BinaryTokenizer::encode_piece(const uint8_t* piece, size_t length, TokenVector& out) const {
+    MergeScratch& scratch = merge_scratch();
+    std::vector<MergeSymbol>& symbols = scratch.symbols;
+    std::vector<MergeCandidate>& heap = scratch.heap;
+    symbols.clear();
+    heap.clear();
+    // Every byte has a token (checked at construction)
+    const int32_t n = static_cast<int32_t>(length);
+    for (int32_t i = 0; i < n; ++i) {
+        symbols.push_back({byte_tokens_[piece[i]], i - 1, i + 1 < n ? i + 1 : -1});
+    }
+    if (symbols.empty()) {
+        return;
+    }
+
+    auto push_pair = [&](int32_t left) {
+        const int32_t right = left >= 0 ? symbols[left].next : -1;
+        if (right < 0) {
+            return;
+        }
+        uint32_t rank = 0;
+        const int32_t merged = find_merge(symbols[left].id, symbols[right].id, rank);
+        if (merged >= 0) {
+            heap.push_back({rank, left, symbols[left].id, symbols[right].id, merged});
+            std::push_heap(heap.begin(), heap.end());
+        }
+    };
+    for (int32_t i = 0; i + 1 < static_cast<int32_t>(symbols.size()); ++i) {
+        push_pair(i);
+    }
+
+    // Apply the lowest-ranked merge until none is left. Candidates whose
+    // symbols have changed since they were queued are stale and skipped.
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end());
+        const MergeCandidate c = heap.back();
+        heap.pop_back();
+        MergeSymbol& left = symbols[c.left];
+        if (left.id != c.left_id || left.next < 0 || symbols[left.next].id != c.right_id) {
+            continue;
+        }
+        MergeSymbol& right = symbols[left.next];
+        left.id = c.merged;
+        right.id = -1;
+        left.next = right.next;
+        if (right.next >= 0) {
+            symbols[right.next].prev = c.left;
+        }
+        push_pair(left.prev);
+        push_pair(c.left);
+    }
+
+    for (int32_t i = 0; i >= 0; i = symbols[i].next) {
+        out.push_back(symbols[i].id);
+    }
+}
+
+size_t BinaryTokenizer::match_special(const uint8_t* text, size_t length, TokenId& id) const {
+    size_t best = 0;
+    uint32_t node = 0;
+    for (size_t i = 0; i < length; ++i) {
+        const amb::TrieNode& n = trie_nodes_[node];
+        if (uint64_t(n.first_edge) + n.n_edges > header_->n_trie_edges) {
+            throw std::runtime_error("Tokenizer section is corrupt: trie edges out of bounds");
+        }
+        const amb::TrieEdge* first = trie_edges_ + n.first_edge;
+        const amb::TrieEdge* last = first + n.n_edges;
+        const amb::TrieEdge* edge = std::lower_bound(first, last, text[i],
+            [](const amb::TrieEdge& e, uint8_t c) { return e.byte < c; });
+        if (edge == last || edge->byte != text[i]) {
+            break;
+        }
+        node = edge->child;
+        if (node >= header_->n_trie_nodes ||
+            (trie_nodes_[node].token_id >= 0 &&
+             static_cast<uint32_t>(trie_nodes_[node].token_id) >= header_->n_vocab)) {
+            throw std::runtime_error("Tokenizer section is corrupt: trie link out of bounds");
+        }
+        if (trie_nodes_[node].token_id >= 0) {
+            best = i + 1;
+            id = trie_nodes_[node].token_id;
+        }
+    }
+    return best;
+}
+
+std::string BinaryTokenizer::decode(const TokenVector& tokens) const {
+    std::string result;
+    for (TokenId token : tokens) {
+        if (token < 0 || static_cast<uint32_t>(token) >= header_->n_vocab) {
+            continue;
+        }
+        uint32_t begin = offsets_[token];
+        uint32_t end = offsets_[token + 1];
+        if (begin <= end && end <= header_->string_pool_size) {
+            result.append(string_pool_ + begin, end - begin);
+        }
+    }
+    return result;
+}
+
+size_t BinaryTokenizer::vocab_size() const {
+    return header_->n_vocab;
+}
+
+size_t BinaryTokenizer::memory_usage() const {
+    // The section itself, whether used in place or copied
+    return section_size_;
+}
+
+std::optional<TokenId> BinaryTokenizer::bos_token() const {
+    return header_->bos_id >= 0 ? std::optional<TokenId>(header_->bos_id) : std::nullopt;
+}
+
+std::optional<TokenId> BinaryTokenizer::eos_token() const {
+    return header_->eos_id >= 0 ? std::optional<TokenId>(header_->eos_id) : std::nullopt;
+}
+
+std::optional<TokenId> BinaryTokenizer::pad_token() const {
+    return header_->pad_id >= 0 ? std::optional<TokenId>(header_->pad_id) : std::nullopt;
+}
+
+} // namespace embee
@@ -0,0 +1,160 @@
+/**
+ * @file calibration_test.cpp
+ * @brief Activation statistics recorded while running calibration text
+ */
+
+#include "test_util.h"
+
+#include "embee/amb_format.h"
+#include "embee/calibration.h"
+#include "embee/model.h"
+#include "embee/tokenizer.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace amb = embee::amb;
+
+const size_t N_EMBD = 64, N_FF = 128, N_HEADS = 4;
+
+// 256 byte tokens, then "he", "ll", "hell", "hello", " w", "<|endoftext|>"
+amb::TokenizerSpec make_spec() {
+    amb::TokenizerSpec spec;
+    for (int b = 0; b < 256; ++b) {
+        spec.vocab.push_back(std::string(1, static_cast<char>(b)));
+    }
+    for (const char* token : {"he", "ll", "hell", "hello", " w", "<|endoftext|>"}) {
+        spec.vocab.push_back(token);
+    }
+    spec.merges = {{'h', 'e'}, {'l', 'l'}, {256, 257}, {258, 'o'}, {' ', 'w'}};
+    spec.special_tokens = {261};
+    return spec;
+}
+
+// A one-layer LLaMA with the tokenizer above; returns its path
+std::string write_test_model() {
+    const size_t n_vocab = make_spec().vocab.size();
+    std::mt19937 gen(23);
+    std::normal_distribution<float> normal(0.0f, 0.1f);
+    auto random = [&](const std::string& name, std::vector<size_t> shape) {
+        std::vector<float> values(shape[0] * (shape.size() > 1 ? shape[1] : 1));
+        for (float& v : values) {
+            v = normal(gen);
+        }
+        return embee_test::TestTensor{name, std::move(shape), std::move(values)};
+    };
+    auto ones = [](const std::string& name) {
+        return embee_test::TestTensor{name, {N_EMBD}, std::vector<float>(N_EMBD, 1.0f)};
+    };
+    const std::string p = "transformer.h.0.";
+    const std::vector<embee_test::TestTensor> tensors = {
+        random("transformer.wte.weight", {n_vocab, N_EMBD}),
+        ones(p + "ln_1.weight"),
+        random(p + "attn.c_attn.weight", {3 * N_EMBD, N_EMBD}),
+        random(p + "attn.c_proj.weight", {N_EMBD, N_EMBD}),
+        ones(p + "ln_2.weight"),
+        random(p + "mlp.c_fc.weight", {N_FF, N_EMBD}),
+        random(p + "mlp.c_gate.weight", {N_FF, N_EMBD}),
+        random(p + "mlp.c_proj.weight", {N_EMBD, N_FF}),
+        ones("transformer.ln_f.weight"),
+    };
+    const std::string config = "{\"architecture\": \"llama\", \"n_vocab\": " + std::to_string(n_vocab) +
+                               ", \"n_embd\": 64, \"n_layers\": 1, \"n_heads\": 4, \"max_seq_len\": 64, "
+                               "\"is_rope\": true, \"activation_fn\": \"silu\"}";
+    const std::string path = embee_test::temp_path("calibration.amb");
+    embee_test::write_model(path, config, tensors, amb::serialize_tokenizer(make_spec()));
+    return path;
+}
+
+} // namespace
+
+TEST(records_every_token_of_every_chunk) {
+    const std::string path = write_test_model();
+    {
+        const embee::Model model(path);
+        // Seven tokens repeated, run in chunks of seven: every chunk is the
+        // same sequence, so none may be served from the previous one's cache
+        std::string text;
+        for (int i = 0; i < 12; ++i) {
+            text += "hello world<|endoftext|>";
+        }
+        const size_t n_tokens = model.tokenizer()->encode(text).size();
+        CHECK(n_tokens == 12 * 7);
+
+        embee::ActivationStats stats;
+        const size_t n_run = embee::collect_activation_stats(model, text, stats, 7);
+        CHECK(n_run == n_tokens);
+        for (const char* weight : {"transformer.h.0.attn.c_attn.weight", "transformer.h.0.mlp.c_fc.weight",
+                                   "transformer.h.0.mlp.c_proj.weight"}) {
+            CHECK(stats.rows(weight) == n_run);
+        }
+        CHECK(stats.importance("transformer.h.0.attn.c_attn.weight").size() == N_EMBD);
+        CHECK(stats.importance("transformer.h.0.mlp.c_proj.weight").size() == N_FF);
+
+        embee::ActivationStats first;
+        CHECK(embee::collect_activation_stats(model, text, first, 5, 2) == 10);
+        CHECK(first.rows("transformer.h.0.mlp.c_fc.weight") == 10);
+        CHECK_THROWS(embee::collect_activation_stats(model, text, first, 65), std::invalid_argument);
+    }
+    std::remove(path.c_str());
+}
+
+TEST(adds_from_many_threads) {
+    embee::ActivationStats stats(true);
+    const size_t cols = 8, rows = 50, threads = 8;
+    const std::vector<float> ones(rows * cols, 1.0f), twos(rows * cols, 2.0f);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (int i = 0; i < 20; ++i) {
+                stats.add("shared", ones.data(), rows, cols);
+                stats.add("own" + std::to_string(t), (t % 2 ? twos : ones).data(), rows, cols);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    CHECK(stats.weights().size() == threads + 1);
+    CHECK(stats.rows("shared") == threads * 20 * rows);
+    CHECK(stats.importance("shared") == std::vector<float>(cols, 1.0f));
+    CHECK(stats.importance("own1") == std::vector<float>(cols, 4.0f));
+    CHECK(stats.gram("own3") == std::vector<double>(cols * cols, 4.0));
+    CHECK(stats.importance("missing").empty());
+    CHECK(stats.rows("missing") == 0);
+}
+
+TEST(weights_reading_one_input_share_its_gram_matrix) {
+    const std::string path = write_test_model();
+    {
+        const embee::Model model(path);
+        embee::ActivationStats stats(true);
+        const size_t n_run = embee::collect_activation_stats(model, "hello world hello", stats, 4);
+        const std::string p = "transformer.h.0.";
+        CHECK(stats.rows(p + "mlp.c_gate.weight") == n_run);
+        CHECK(stats.gram(p + "mlp.c_gate.weight") == stats.gram(p + "mlp.c_fc.weight"));
+        CHECK(stats.gram(p + "mlp.c_fc.weight").size() == N_EMBD * N_EMBD);
+        CHECK(stats.weights().size() == 6);   // The block's five and the tied LM head
+    }
+    std::remove(path.c_str());
+
+    embee::ActivationStats stats(true);
+    const float x[] = {1.0f, 2.0f, 3.0f, 0.0f, 1.0f, -1.0f};
+    stats.share_input("b", "a");
+    stats.share_input("c", "b");   // Resolves to a
+    stats.share_input("c", "a");   // Declared again
+    stats.add("a", x, 2, 3);
+    stats.add("c", x, 2, 3);       // Ignored: a holds it
+    CHECK(stats.rows("c") == 2);
+    CHECK(stats.gram("b") == (std::vector<double>{0.5, 1.0, 1.5, 1.0, 2.5, 2.5, 1.5, 2.5, 5.0}));
+    CHECK_THROWS(stats.share_input("a", "d"), std::invalid_argument);
+}
+
+int main() {
+    return embee_test::run_tests();
+}
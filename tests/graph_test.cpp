@@ -0,0 +1,214 @@
+/**
+ * @file graph_test.cpp
+ * @brief Fused and unfused compute graphs produce the same logits
+ */
+
+#include "test_util.h"
+
+#include "embee/engine.h"
+#include "embee/graph.h"
+#include "embee/model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+
+const size_t N_VOCAB = 256, N_EMBD = 64, N_LAYERS = 2, N_HEADS = 4, N_FF = 128;
+
+struct TestModel {
+    const char* architecture;
+    const char* activation;
+    size_t n_kv_heads;
+    bool rope;
+    bool biases;        // LayerNorm and matmul biases, learned positions, untied head
+    bool gated;         // mlp.c_gate
+    bool shared_norm;   // Parallel block reading ln_1 (no ln_2)
+};
+
+// Write a small random model of the given layout and return its path
+std::string write_test_model(const TestModel& m) {
+    std::mt19937 gen(17);
+    std::normal_distribution<float> normal(0.0f, 0.1f);
+    auto random = [&](std::vector<size_t> shape) {
+        size_t n = 1;
+        for (size_t dim : shape) {
+            n *= dim;
+        }
+        std::vector<float> values(n);
+        for (float& v : values) {
+            v = normal(gen);
+        }
+        return embee_test::TestTensor{"", std::move(shape), std::move(values)};
+    };
+    auto norm = [&](size_t n) {
+        embee_test::TestTensor tensor = random({n});
+        for (float& v : tensor.values) {
+            v += 1.0f;
+        }
+        return tensor;
+    };
+    std::vector<embee_test::TestTensor> tensors;
+    auto add = [&tensors](const std::string& name, embee_test::TestTensor tensor) {
+        tensor.name = name;
+        tensors.push_back(std::move(tensor));
+    };
+
+    const size_t head_dim = N_EMBD / N_HEADS;
+    const size_t qkv = (N_HEADS + 2 * m.n_kv_heads) * head_dim;
+    add("transformer.wte.weight", random({N_VOCAB, N_EMBD}));
+    if (m.biases && !m.rope) {
+        add("transformer.wpe.weight", random({64, N_EMBD}));
+    }
+    for (size_t i = 0; i < N_LAYERS; ++i) {
+        const std::string p = "transformer.h." + std::to_string(i) + ".";
+        add(p + "ln_1.weight", norm(N_EMBD));
+        add(p + "attn.c_attn.weight", random({qkv, N_EMBD}));
+        add(p + "attn.c_proj.weight", random({N_EMBD, N_EMBD}));
+        if (!m.shared_norm) {
+            add(p + "ln_2.weight", norm(N_EMBD));
+        }
+        add(p + "mlp.c_fc.weight", random({N_FF, N_EMBD}));
+        if (m.gated) {
+            add(p + "mlp.c_gate.weight", random({N_FF, N_EMBD}));
+        }
+        add(p + "mlp.c_proj.weight", random({N_EMBD, N_FF}));
+        if (m.biases) {
+            add(p + "ln_1.bias", random({N_EMBD}));
+            add(p + "attn.c_attn.bias", random({qkv}));
+            add(p + "attn.c_proj.bias", random({N_EMBD}));
+            if (!m.shared_norm) {
+                add(p + "ln_2.bias", random({N_EMBD}));
+            }
+            add(p + "mlp.c_fc.bias", random({N_FF}));
+            add(p + "mlp.c_proj.bias", random({N_EMBD}));
+        }
+    }
+    add("transformer.ln_f.weight", norm(N_EMBD));
+    if (m.biases) {
+        add("transformer.ln_f.bias", random({N_EMBD}));
+        add("lm_head.weight", random({N_VOCAB, N_EMBD}));
+    }
+
+    const std::string config = std::string("{\"architecture\": \"") + m.architecture + "\", \"n_vocab\": " +
+                               std::to_string(N_VOCAB) + ", \"n_embd\": " + std::to_string(N_EMBD) +
+                               ", \"n_layers\": " + std::to_string(N_LAYERS) + ", \"n_heads\": " +
+                               std::to_string(N_HEADS) + ", \"n_kv_heads\": " + std::to_string(m.n_kv_heads) +
+                               ", \"max_seq_len\": 64, \"is_rope\": " + (m.rope ? "true" : "false") +
+                               ", \"activation_fn\": \"" + m.activation + "\"}";
+    const std::string path = embee_test::temp_path(std::string("graph_") + m.architecture + ".amb");
+    embee_test::write_model(path, config, tensors);
+    return path;
+}
+
+const TestModel MODELS[] = {
+    {"llama", "silu", 2, true, false, true, false},
+    {"gpt2", "gelu", N_HEADS, false, true, false, false},
+    {"falcon", "gelu", 1, true, false, false, true},
+};
+
+void check_close(const std::vector<float>& a, const std::vector<float>& b) {
+    CHECK(a.size() == b.size());
+    float scale = 0.0f;
+    for (float v : a) {
+        scale = std::max(scale, std::fabs(v));
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        CHECK_NEAR(a[i], b[i], 1e-4 * scale + 1e-6);
+    }
+}
+
+} // namespace
+
+TEST(fused_and_unfused_graphs_give_the_same_logits) {
+    for (const TestModel& m : MODELS) {
+        const std::string path = write_test_model(m);
+        {
+            const embee::Model model(path);
+            embee::EngineConfig fused_config;
+            fused_config.n_threads = 1;
+            embee::EngineConfig plain_config = fused_config;
+            plain_config.fuse_graph = false;
+            embee::Engine fused(model, fused_config);
+            embee::Engine plain(model, plain_config);
+
+            // A prefill, then a prompt extending it (decode through the KV cache)
+            for (const char* prompt : {"The quick brown fox", "The quick brown fox jumps"}) {
+                const std::vector<float> a = fused.get_logits(prompt);
+                const std::vector<float> b = plain.get_logits(prompt);
+                CHECK(a.size() == N_VOCAB);
+                check_close(a, b);
+            }
+        }
+        std::remove(path.c_str());
+    }
+}
+
+TEST(parallel_branches_leave_the_nesting_setting_alone) {
+    const std::string path = write_test_model(MODELS[2]);
+    {
+        const embee::Model model(path);
+        embee::EngineConfig serial_config;
+        serial_config.n_threads = 1;
+        embee::EngineConfig branch_config;
+        branch_config.n_threads = 4;
+#ifdef _OPENMP
+        const int levels = omp_get_max_active_levels();
+#endif
+        embee::Engine serial(model, serial_config);
+        embee::Engine branches(model, branch_config);
+        check_close(serial.get_logits("The quick brown fox"), branches.get_logits("The quick brown fox"));
+#ifdef _OPENMP
+        CHECK(omp_get_max_active_levels() == levels);
+#endif
+    }
+    std::remove(path.c_str());
+}
+
+TEST(fusion_folds_activations_and_residual_adds) {
+    const std::string path = write_test_model(MODELS[0]);
+    {
+        const embee::Model model(path);
+        embee::GraphWeights weights;
+        weights.token_embedding = &model.get_tensor("transformer.wte.weight");
+        weights.final_norm = &model.get_tensor("transformer.ln_f.weight");
+        weights.lm_head = weights.token_embedding;
+        for (size_t i = 0; i < N_LAYERS; ++i) {
+            const std::string p = "transformer.h." + std::to_string(i) + ".";
+            embee::BlockWeights block;
+            block.attn_norm = &model.get_tensor(p + "ln_1.weight");
+            block.qkv = &model.get_tensor(p + "attn.c_attn.weight");
+            block.attn_out = &model.get_tensor(p + "attn.c_proj.weight");
+            block.ffn_norm = &model.get_tensor(p + "ln_2.weight");
+            block.ffn_up = &model.get_tensor(p + "mlp.c_fc.weight");
+            block.ffn_gate = &model.get_tensor(p + "mlp.c_gate.weight");
+            block.ffn_down = &model.get_tensor(p + "mlp.c_proj.weight");
+            weights.layers.push_back(block);
+        }
+
+        const embee::Graph plain = embee::compile_graph(model.config(), weights, false);
+        const embee::Graph fused = embee::compile_graph(model.config(), weights, true);
+        auto count = [](const embee::Graph& graph, embee::OpCode op) {
+            return std::count_if(graph.program.begin(), graph.program.end(),
+                                 [op](const embee::Instruction& in) { return in.op == op; });
+        };
+        // Per layer: the gate activation and both residual adds fold into matmuls
+        CHECK(count(plain, embee::OpCode::ACTIVATION) == static_cast<long>(N_LAYERS));
+        CHECK(count(fused, embee::OpCode::ACTIVATION) == 0);
+        CHECK(count(fused, embee::OpCode::ADD) == count(plain, embee::OpCode::ADD) - 2 * static_cast<long>(N_LAYERS));
+        CHECK(fused.program.size() == plain.program.size() - 3 * N_LAYERS);
+    }
+    std::remove(path.c_str());
+}
+
+int main() {
+    return embee_test::run_tests();
+}
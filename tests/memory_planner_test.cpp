@@ -0,0 +1,81 @@
+/**
+ * @file memory_planner_test.cpp
+ * @brief Arena placement of activation buffers
+ */
+
+#include "test_util.h"
+
+#include "embee/memory_planner.h"
+
+#include <random>
+#include <vector>
+
+using embee::ActivationPlanner;
+using embee::MemoryPlan;
+
+namespace {
+
+struct Lifetime {
+    size_t bytes;
+    size_t first;
+    size_t last;
+};
+
+// Buffers that are live at the same step must not share bytes
+void check_no_live_overlap(const std::vector<Lifetime>& buffers, const MemoryPlan& plan, size_t alignment) {
+    CHECK(plan.offsets.size() == buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        CHECK(plan.offsets[i] % alignment == 0);
+        CHECK(plan.offsets[i] + buffers[i].bytes <= plan.arena_size);
+        for (size_t j = i + 1; j < buffers.size(); ++j) {
+            const bool live_together = buffers[i].first <= buffers[j].last && buffers[j].first <= buffers[i].last;
+            const bool disjoint = plan.offsets[i] + buffers[i].bytes <= plan.offsets[j] ||
+                                  plan.offsets[j] + buffers[j].bytes <= plan.offsets[i];
+            CHECK(!live_together || disjoint || buffers[i].bytes == 0 || buffers[j].bytes == 0);
+        }
+    }
+}
+
+} // namespace
+
+TEST(reuses_memory_of_dead_buffers) {
+    ActivationPlanner planner;
+    planner.add("a", 1024, 0, 1);
+    planner.add("b", 1024, 1, 2);
+    planner.add("c", 1024, 2, 3);
+    const MemoryPlan plan = planner.plan(64);
+
+    check_no_live_overlap({{1024, 0, 1}, {1024, 1, 2}, {1024, 2, 3}}, plan, 64);
+    CHECK(plan.naive_size == 3 * 1024);
+    CHECK(plan.peak_live_size == 2 * 1024);
+    CHECK(plan.offsets[0] == plan.offsets[2]);
+    CHECK(plan.arena_size == 2 * 1024);
+}
+
+TEST(never_overlaps_live_buffers) {
+    std::mt19937 gen(11);
+    for (int round = 0; round < 50; ++round) {
+        ActivationPlanner planner;
+        std::vector<Lifetime> buffers;
+        const size_t n = 2 + gen() % 40;
+        for (size_t i = 0; i < n; ++i) {
+            const size_t first = gen() % 30;
+            const Lifetime buffer{1 + gen() % 5000, first, first + gen() % 10};
+            planner.add("buffer" + std::to_string(i), buffer.bytes, buffer.first, buffer.last);
+            buffers.push_back(buffer);
+        }
+        const size_t alignment = size_t(16) << (round % 3);
+        const MemoryPlan plan = planner.plan(alignment);
+        check_no_live_overlap(buffers, plan, alignment);
+        CHECK(plan.arena_size >= plan.peak_live_size);
+    }
+}
+
+TEST(rejects_inverted_lifetimes) {
+    ActivationPlanner planner;
+    CHECK_THROWS(planner.add("bad", 16, 3, 2), std::invalid_argument);
+}
+
+int main() {
+    return embee_test::run_tests();
+}
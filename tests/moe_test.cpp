@@ -0,0 +1,91 @@
+/**
+ * @file moe_test.cpp
+ * @brief Top-k routing of tokens to experts
+ */
+
+#include "test_util.h"
+
+#include "embee/moe.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using embee::ExpertRouting;
+using embee::route_top_k;
+
+TEST(selects_the_top_k_experts_of_each_token) {
+    // Token 0 prefers experts 2 then 0, token 1 prefers 3 then 1
+    const std::vector<float> logits = {
+        1.0f, -1.0f, 3.0f, 0.0f,
+        -2.0f, 0.5f, 0.0f, 4.0f,
+    };
+    ExpertRouting routing;
+    route_top_k(logits.data(), 2, 4, 2, routing);
+
+    CHECK(routing.offsets == (std::vector<uint32_t>{0, 1, 2, 3, 4}));
+    CHECK(routing.tokens == (std::vector<uint32_t>{0, 1, 0, 1}));
+    CHECK(routing.active_experts() == 4);
+    // Gates are the softmax of the selected logits
+    CHECK_NEAR(routing.weights[2], 1.0 / (1.0 + std::exp(-2.0)), 1e-6);
+    CHECK_NEAR(routing.weights[0], 1.0 / (1.0 + std::exp(2.0)), 1e-6);
+    CHECK_NEAR(routing.weights[3], 1.0 / (1.0 + std::exp(-3.5)), 1e-6);
+}
+
+TEST(groups_assignments_by_expert_in_batch_order) {
+    const size_t n_tokens = 37, n_experts = 8, k = 2;
+    std::mt19937 gen(3);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::vector<float> logits(n_tokens * n_experts);
+    for (float& x : logits) {
+        x = normal(gen);
+    }
+    ExpertRouting routing;
+    route_top_k(logits.data(), n_tokens, n_experts, k, routing);
+
+    CHECK(routing.offsets.size() == n_experts + 1);
+    CHECK(routing.offsets.back() == n_tokens * k);
+    std::vector<double> gate_sums(n_tokens, 0.0);
+    std::vector<size_t> assignments(n_tokens, 0);
+    for (size_t e = 0; e < n_experts; ++e) {
+        for (uint32_t a = routing.offsets[e]; a < routing.offsets[e + 1]; ++a) {
+            const uint32_t token = routing.tokens[a];
+            CHECK(a == routing.offsets[e] || routing.tokens[a - 1] < token);
+            gate_sums[token] += routing.weights[a];
+            ++assignments[token];
+
+            // No unselected expert of this token scores higher
+            const float* row = logits.data() + token * n_experts;
+            const size_t higher = std::count_if(row, row + n_experts, [&](float x) { return x > row[e]; });
+            CHECK(higher < k);
+        }
+    }
+    for (size_t t = 0; t < n_tokens; ++t) {
+        CHECK(assignments[t] == k);
+        CHECK_NEAR(gate_sums[t], 1.0, 1e-5);
+    }
+}
+
+TEST(reuses_the_routing_between_calls) {
+    ExpertRouting routing;
+    const std::vector<float> wide(16 * 4, 0.0f);
+    route_top_k(wide.data(), 16, 4, 1, routing);
+    const std::vector<float> narrow = {0.0f, 1.0f, 0.0f, 0.0f};
+    route_top_k(narrow.data(), 1, 4, 1, routing);
+    CHECK(routing.offsets.back() == 1);
+    CHECK(routing.count(1) == 1);
+    CHECK(routing.active_experts() == 1);
+    CHECK_NEAR(routing.weights[0], 1.0, 1e-6);
+}
+
+TEST(rejects_k_out_of_range) {
+    ExpertRouting routing;
+    const std::vector<float> logits(4, 0.0f);
+    CHECK_THROWS(route_top_k(logits.data(), 1, 4, 0, routing), std::invalid_argument);
+    CHECK_THROWS(route_top_k(logits.data(), 1, 4, 5, routing), std::invalid_argument);
+}
+
+int main() {
+    return embee_test::run_tests();
+}
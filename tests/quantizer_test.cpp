@@ -0,0 +1,291 @@
+/**
+ * @file quantizer_test.cpp
+ * @brief Streaming quantization of AMB files, block encoding with chosen
+ *        scales and calibrated quantization
+ */
+
+#include "test_util.h"
+
+#include "embee/amb_format.h"
+#include "embee/calibration.h"
+#include "embee/kernels.h"
+#include "embee/model.h"
+#include "embee/quantizer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using embee::DataType;
+namespace amb = embee::amb;
+namespace kernels = embee::kernels;
+
+const size_t ROWS = 32, COLS = 128, SAMPLES = 512, BLOCK = 32;
+
+const char* CONFIG = "{\"architecture\": \"llama\", \"n_vocab\": 256, \"n_embd\": 128, \"n_layers\": 1, "
+                     "\"n_heads\": 4, \"quant\": {\"type\": \"none\"}}";
+
+// Dequantized weights of a tensor of an AMB file
+std::vector<float> read_tensor(const std::string& path, const std::string& name) {
+    amb::MappedFile file(path);
+    const amb::Header header = amb::parse_header(file.data(), file.size());
+    const uint8_t* section = file.data() + header.weights_offset();
+    for (size_t offset = 0; offset < header.weights_size;) {
+        const amb::TensorRecord record =
+            amb::parse_tensor_record(section, header.weights_size, offset, header.aligned_tensor_data());
+        offset = record.end;
+        if (record.name == name) {
+            const size_t cols = record.shape.back();
+            const size_t stride = kernels::row_bytes(record.data_type, cols, BLOCK);
+            std::vector<float> values(record.shape[0] * cols);
+            for (size_t r = 0; r < record.shape[0]; ++r) {
+                kernels::dequantize_row(record.data_type, record.data + r * stride, values.data() + r * cols,
+                                        cols, BLOCK);
+            }
+            return values;
+        }
+    }
+    throw std::runtime_error("No tensor " + name + " in " + path);
+}
+
+// Squared error of the layer outputs W x over the calibration inputs
+double output_error(const std::vector<float>& w, const std::vector<float>& q, const std::vector<float>& x) {
+    double total = 0.0;
+    for (size_t s = 0; s < SAMPLES; ++s) {
+        for (size_t r = 0; r < ROWS; ++r) {
+            double d = 0.0;
+            for (size_t c = 0; c < COLS; ++c) {
+                d += (static_cast<double>(w[r * COLS + c]) - q[r * COLS + c]) * x[s * COLS + c];
+            }
+            total += d * d;
+        }
+    }
+    return total;
+}
+
+} // namespace
+
+TEST(quantized_tensors_are_aligned_and_used_in_place) {
+    std::mt19937 gen(7);
+    std::normal_distribution<float> normal(0.0f, 0.05f);
+    std::vector<float> w(ROWS * COLS), norm(COLS, 1.0f);
+    for (float& v : w) {
+        v = normal(gen);
+    }
+    const std::string input = embee_test::temp_path("align_input.amb");
+    const std::string output = embee_test::temp_path("align_output.amb");
+    // Names of odd lengths so unpadded record headers would misalign the data
+    embee_test::write_model(input, CONFIG, {{"a.weight", {ROWS, COLS}, w}, {"bb.norm", {COLS}, norm},
+                                            {"ccc.weight", {ROWS, COLS}, w}});
+
+    embee::QuantizerConfig config;
+    config.type = DataType::INT5;
+    config.block_size = BLOCK;
+    const embee::QuantizationSummary summary = embee::quantize_model(input, output, config);
+    CHECK(summary.n_quantized == 2);
+
+    {
+        amb::MappedFile file(output);
+        const amb::Header header = amb::parse_header(file.data(), file.size());
+        CHECK(header.aligned_tensor_data());
+        const uint8_t* section = file.data() + header.weights_offset();
+        for (size_t offset = 0; offset < header.weights_size;) {
+            const amb::TensorRecord record = amb::parse_tensor_record(section, header.weights_size, offset, true);
+            CHECK(reinterpret_cast<uintptr_t>(record.data) % amb::SECTION_ALIGNMENT == 0);
+            offset = record.end;
+        }
+
+        const embee::Model model(output);
+        for (const char* name : {"a.weight", "bb.norm", "ccc.weight"}) {
+            CHECK(model.get_tensor(name).mapped != nullptr);
+        }
+    }
+    const std::vector<float> q = read_tensor(output, "ccc.weight");
+    for (size_t i = 0; i < w.size(); ++i) {
+        CHECK_NEAR(q[i], w[i], 0.02);
+    }
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(replaces_the_quant_config_and_keeps_the_rest) {
+    const std::string input = embee_test::temp_path("config_input.amb");
+    const std::string output = embee_test::temp_path("config_output.amb");
+    embee_test::write_model(input, CONFIG, {{"layer.weight", {ROWS, COLS}, std::vector<float>(ROWS * COLS, 0.5f)}});
+    embee::QuantizerConfig config;
+    config.type = DataType::INT8;
+    config.block_size = 64;
+    embee::quantize_model(input, output, config);
+
+    amb::MappedFile file(output);
+    const amb::Header header = amb::parse_header(file.data(), file.size());
+    const auto members = amb::parse_json_object(
+        std::string(reinterpret_cast<const char*>(file.data() + header.config_offset()), header.config_size));
+    CHECK(members.size() == 6);
+    CHECK(amb::json_string(members.at("architecture")) == "llama");
+    CHECK(members.at("n_embd") == "128");
+    const auto quant = amb::parse_json_object(members.at("quant"));
+    CHECK(amb::json_string(quant.at("type")) == "int8");
+    CHECK(quant.at("block_size") == "64");
+    CHECK(header.config_offset() + header.config_size == header.tokenizer_offset());
+    CHECK(header.tokenizer_offset() % amb::SECTION_ALIGNMENT == 0);
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(block_with_scale_round_trips_exact_levels) {
+    const float scale = 0.25f;   // Exact in FP16
+    const struct {
+        DataType type;
+        int low, high;
+    } types[] = {{DataType::INT8, -128, 127}, {DataType::INT5, -16, 15}, {DataType::INT4, -8, 7}};
+    for (const auto& t : types) {
+        std::vector<float> src(BLOCK), out(BLOCK);
+        for (size_t i = 0; i < BLOCK; ++i) {
+            src[i] = static_cast<float>(t.low + static_cast<int>(i * 7) % (t.high - t.low + 1)) * scale;
+        }
+        src[0] = (t.high + 40) * scale;   // Clamped to the largest level
+        src[1] = (t.low - 40) * scale;    // and to the smallest
+        src[2] = 3.1f * scale;            // Rounded to the nearest level
+        std::vector<uint8_t> block(kernels::row_bytes(t.type, BLOCK, BLOCK));
+        kernels::quantize_block_with_scale(t.type, src.data(), scale, block.data(), BLOCK);
+        kernels::dequantize_row(t.type, block.data(), out.data(), BLOCK, BLOCK);
+
+        CHECK(out[0] == t.high * scale);
+        CHECK(out[1] == t.low * scale);
+        CHECK(out[2] == 3.0f * scale);
+        for (size_t i = 3; i < BLOCK; ++i) {
+            CHECK(out[i] == src[i]);
+        }
+    }
+    float src[BLOCK] = {};
+    uint8_t dst[4 * BLOCK];
+    CHECK_THROWS(kernels::quantize_block_with_scale(DataType::FP16, src, 1.0f, dst, BLOCK), std::invalid_argument);
+}
+
+TEST(gptq_reconstructs_outputs_better_than_rounding) {
+    // Inputs with strongly correlated columns, as activations have
+    std::mt19937 gen(5);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    const size_t rank = 8;
+    std::vector<float> mix(rank * COLS);
+    for (float& v : mix) {
+        v = normal(gen);
+    }
+    std::vector<float> x(SAMPLES * COLS);
+    for (size_t s = 0; s < SAMPLES; ++s) {
+        float z[rank];
+        for (float& v : z) {
+            v = normal(gen);
+        }
+        for (size_t c = 0; c < COLS; ++c) {
+            float v = 0.1f * normal(gen);
+            for (size_t k = 0; k < rank; ++k) {
+                v += z[k] * mix[k * COLS + c];
+            }
+            x[s * COLS + c] = v;
+        }
+    }
+    std::vector<float> w(ROWS * COLS);
+    for (float& v : w) {
+        v = 0.05f * normal(gen);
+    }
+
+    const std::string input = embee_test::temp_path("gptq_input.amb");
+    const std::string rtn = embee_test::temp_path("gptq_rtn.amb");
+    const std::string gptq = embee_test::temp_path("gptq_gptq.amb");
+    embee_test::write_model(input, CONFIG, {{"layer.weight", {ROWS, COLS}, w}});
+
+    embee::ActivationStats stats(true);
+    stats.add("layer.weight", x.data(), SAMPLES, COLS);
+    embee::QuantizerConfig config;
+    config.type = DataType::INT4;
+    config.block_size = BLOCK;
+    embee::quantize_model(input, rtn, config);
+    config.method = embee::QuantizationMethod::GPTQ;
+    config.activation_stats = &stats;
+    std::vector<embee::QuantizationMethod> methods;
+    embee::quantize_model(input, gptq, config,
+                          [&](const embee::TensorQuantization& t) { methods.push_back(t.method); });
+    CHECK(methods == std::vector<embee::QuantizationMethod>{embee::QuantizationMethod::GPTQ});
+
+    const double rtn_error = output_error(w, read_tensor(rtn, "layer.weight"), x);
+    const double gptq_error = output_error(w, read_tensor(gptq, "layer.weight"), x);
+    CHECK(gptq_error < 0.7 * rtn_error);
+
+    for (const std::string& path : {input, rtn, gptq}) {
+        std::remove(path.c_str());
+    }
+}
+
+TEST(calibrated_methods_need_statistics_for_every_tensor) {
+    std::vector<float> w(ROWS * COLS, 0.01f);
+    const std::string input = embee_test::temp_path("awq_input.amb");
+    const std::string output = embee_test::temp_path("awq_output.amb");
+    embee_test::write_model(input, CONFIG,
+                            {{"seen.weight", {ROWS, COLS}, w}, {"unseen.weight", {ROWS, COLS}, w}});
+
+    embee::ActivationStats stats;
+    std::vector<float> x(COLS, 1.0f);
+    stats.add("seen.weight", x.data(), 1, COLS);
+    embee::QuantizerConfig config;
+    config.type = DataType::INT4;
+    config.block_size = BLOCK;
+    config.method = embee::QuantizationMethod::ACTIVATION_AWARE;
+    config.activation_stats = &stats;
+    CHECK_THROWS(embee::quantize_model(input, output, config), std::invalid_argument);
+
+    // A tensor kept in another type needs none
+    config.rules.push_back({"unseen.weight", DataType::FP16});
+    const embee::QuantizationSummary summary = embee::quantize_model(input, output, config);
+    CHECK(summary.n_quantized == 1);
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+TEST(lookup_tables_are_rounded_without_statistics) {
+    std::vector<float> w(ROWS * COLS, 0.01f), wte(256 * COLS, 0.02f);
+    const std::string input = embee_test::temp_path("untied_input.amb");
+    const std::string output = embee_test::temp_path("untied_output.amb");
+    embee_test::write_model(input, CONFIG, {{"transformer.wte.weight", {256, COLS}, wte},
+                                            {"lm_head.weight", {256, COLS}, wte},
+                                            {"layer.weight", {ROWS, COLS}, w}});
+
+    // Calibration reaches lm_head.weight but never the untied embeddings
+    embee::ActivationStats stats(true);
+    std::vector<float> x(COLS, 1.0f);
+    stats.add("lm_head.weight", x.data(), 1, COLS);
+    stats.add("layer.weight", x.data(), 1, COLS);
+    embee::QuantizerConfig config;
+    config.type = DataType::INT4;
+    config.block_size = BLOCK;
+    config.activation_stats = &stats;
+    for (embee::QuantizationMethod method :
+         {embee::QuantizationMethod::ACTIVATION_AWARE, embee::QuantizationMethod::GPTQ}) {
+        config.method = method;
+        std::vector<embee::TensorQuantization> tensors;
+        const embee::QuantizationSummary summary = embee::quantize_model(
+            input, output, config, [&](const embee::TensorQuantization& t) { tensors.push_back(t); });
+        CHECK(summary.n_quantized == 3);
+        CHECK(tensors.size() == 3);
+        CHECK(tensors[0].name == "transformer.wte.weight");
+        CHECK(tensors[0].type == DataType::INT4);
+        CHECK(tensors[0].method == embee::QuantizationMethod::ROUND_TO_NEAREST);
+        CHECK(tensors[1].method == method);
+        CHECK(tensors[2].method == method);
+    }
+
+    std::remove(input.c_str());
+    std::remove(output.c_str());
+}
+
+int main() {
+    return embee_test::run_tests();
+}
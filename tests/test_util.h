@@ -0,0 +1,158 @@
+/**
+ * @file test_util.h
+ * @brief Minimal test harness and fixtures shared by the behavior tests
+ *
+ * Each test file defines cases with TEST(name) and runs them from main()
+ * with run_tests(). A failed CHECK throws, so the remaining cases still run
+ * and the process exits non-zero for CTest.
+ */
+
+#pragma once
+
+#include "embee/amb_format.h"
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace embee_test {
+
+struct TestFailure : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+inline std::vector<std::pair<const char*, std::function<void()>>>& registry() {
+    static std::vector<std::pair<const char*, std::function<void()>>> tests;
+    return tests;
+}
+
+inline bool register_test(const char* name, std::function<void()> fn) {
+    registry().emplace_back(name, std::move(fn));
+    return true;
+}
+
+[[noreturn]] inline void fail(const char* file, int line, const std::string& message) {
+    std::ostringstream out;
+    out << file << ":" << line << ": " << message;
+    throw TestFailure(out.str());
+}
+
+/**
+ * Run every registered test
+ * @return Process exit code: 0 if all passed
+ */
+inline int run_tests() {
+    size_t failed = 0;
+    for (const auto& [name, fn] : registry()) {
+        try {
+            fn();
+            std::printf("[ ok ] %s\n", name);
+        } catch (const std::exception& e) {
+            std::printf("[FAIL] %s\n       %s\n", name, e.what());
+            ++failed;
+        }
+    }
+    std::printf("%zu of %zu tests passed\n", registry().size() - failed, registry().size());
+    return failed == 0 ? 0 : 1;
+}
+
+// An FP32 tensor of a test model
+struct TestTensor {
+    std::string name;
+    std::vector<size_t> shape;
+    std::vector<float> values;
+};
+
+/**
+ * Path of a scratch file in the system temporary directory
+ */
+inline std::string temp_path(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("embee_test_" + name)).string();
+}
+
+/**
+ * Write an AMB file with FP32 tensors
+ * @param path Output file
+ * @param config_json Config section (see docs/model_format.md)
+ * @param tensors Weights, written in order
+ * @param tokenizer BINARY_BPE section, or empty for the byte tokenizer
+ */
+inline void write_model(const std::string& path, const std::string& config_json,
+                        const std::vector<TestTensor>& tensors, const std::vector<uint8_t>& tokenizer = {}) {
+    std::string metadata = "{\"name\": \"test\"}";
+    metadata.append(embee::amb::tensor_record_padding(embee::amb::HEADER_SIZE + metadata.size()), ' ');
+    std::string config = config_json;
+    config.append(embee::amb::tensor_record_padding(config.size()), ' ');
+    std::vector<uint8_t> tokenizer_section = tokenizer;
+    tokenizer_section.resize(tokenizer.size() + embee::amb::tensor_record_padding(tokenizer.size()));
+
+    std::vector<uint8_t> weights;
+    for (const TestTensor& tensor : tensors) {
+        const std::vector<uint8_t> header = embee::amb::serialize_tensor_header(
+            tensor.name, tensor.shape, embee::DataType::FP32, tensor.values.size() * sizeof(float));
+        weights.insert(weights.end(), header.begin(), header.end());
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(tensor.values.data());
+        weights.insert(weights.end(), data, data + tensor.values.size() * sizeof(float));
+        weights.resize(weights.size() + embee::amb::tensor_record_padding(weights.size()));
+    }
+
+    embee::amb::Header header;
+    header.metadata_size = static_cast<uint32_t>(metadata.size());
+    header.config_size = static_cast<uint32_t>(config.size());
+    header.tokenizer_size = static_cast<uint32_t>(tokenizer_section.size());
+    header.weights_size = weights.size();
+    const auto header_bytes = embee::amb::serialize_header(header);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(header_bytes.data()), header_bytes.size());
+    out << metadata << config;
+    out.write(reinterpret_cast<const char*>(tokenizer_section.data()), tokenizer_section.size());
+    out.write(reinterpret_cast<const char*>(weights.data()), weights.size());
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+} // namespace embee_test
+
+#define TEST(name)                                                                      \
+    static void name();                                                                 \
+    static const bool name##_registered = embee_test::register_test(#name, name);       \
+    static void name()
+
+#define CHECK(condition)                                                                \
+    do {                                                                                \
+        if (!(condition)) {                                                             \
+            embee_test::fail(__FILE__, __LINE__, "CHECK(" #condition ") failed");       \
+        }                                                                               \
+    } while (0)
+
+#define CHECK_NEAR(a, b, tolerance)                                                     \
+    do {                                                                                \
+        const double check_a = (a), check_b = (b);                                      \
+        if (!(std::fabs(check_a - check_b) <= (tolerance))) {                           \
+            std::ostringstream check_message;                                           \
+            check_message << #a " = " << check_a << ", " #b " = " << check_b;           \
+            embee_test::fail(__FILE__, __LINE__, check_message.str());                  \
+        }                                                                               \
+    } while (0)
+
+#define CHECK_THROWS(expression, exception)                                             \
+    do {                                                                                \
+        bool check_thrown = false;                                                      \
+        try {                                                                           \
+            (void)(expression);                                                         \
+        } catch (const exception&) {                                                    \
+            check_thrown = true;                                                        \
+        }                                                                               \
+        if (!check_thrown) {                                                            \
+            embee_test::fail(__FILE__, __LINE__, #expression " did not throw " #exception); \
+        }                                                                               \
+    } while (0)
@@ -0,0 +1,147 @@
+/**
+ * @file tokenizer_test.cpp
+ * @brief BinaryTokenizer against sections built by amb::serialize_tokenizer()
+ */
+
+#include "test_util.h"
+
+#include "embee/amb_format.h"
+#include "embee/tokenizer.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using embee::BinaryTokenizer;
+using embee::TokenId;
+using embee::TokenVector;
+namespace amb = embee::amb;
+
+// 256 byte tokens, then "he", "ll", "hell", "hello", " w", "<|endoftext|>"
+amb::TokenizerSpec make_spec() {
+    amb::TokenizerSpec spec;
+    for (int b = 0; b < 256; ++b) {
+        spec.vocab.push_back(std::string(1, static_cast<char>(b)));
+    }
+    auto add = [&spec](const std::string& token) {
+        spec.vocab.push_back(token);
+        return static_cast<TokenId>(spec.vocab.size() - 1);
+    };
+    const TokenId he = add("he");
+    const TokenId ll = add("ll");
+    const TokenId hell = add("hell");
+    add("hello");
+    add(" w");
+    const TokenId eot = add("<|endoftext|>");
+    spec.merges = {{'h', 'e'}, {'l', 'l'}, {he, ll}, {hell, 'o'}, {' ', 'w'}};
+    spec.special_tokens = {eot};
+    spec.bos_id = eot;
+    spec.eos_id = eot;
+    return spec;
+}
+
+TokenId id_of(const amb::TokenizerSpec& spec, const std::string& token) {
+    for (size_t i = 0; i < spec.vocab.size(); ++i) {
+        if (spec.vocab[i] == token) {
+            return static_cast<TokenId>(i);
+        }
+    }
+    throw std::logic_error("No token " + token);
+}
+
+} // namespace
+
+TEST(round_trips_every_byte) {
+    const std::vector<uint8_t> section = amb::serialize_tokenizer(make_spec());
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+    CHECK(tokenizer.vocab_size() == 262);
+
+    std::string all_bytes;
+    for (int b = 0; b < 256; ++b) {
+        all_bytes += static_cast<char>(b);
+    }
+    for (const std::string& text : {std::string(), std::string("hello world"), all_bytes,
+                                    std::string("caf\xc3\xa9 \xe6\x97\xa5\xe6\x9c\xac <|endoftext|>x"),
+                                    std::string("  spaced\n\tout  ")}) {
+        CHECK(tokenizer.decode(tokenizer.encode(text)) == text);
+    }
+}
+
+TEST(applies_merges_in_rank_order) {
+    const amb::TokenizerSpec spec = make_spec();
+    const std::vector<uint8_t> section = amb::serialize_tokenizer(spec);
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+
+    CHECK(tokenizer.encode("hello") == TokenVector{id_of(spec, "hello")});
+    CHECK(tokenizer.encode("help") == (TokenVector{id_of(spec, "he"), 'l', 'p'}));
+    CHECK(tokenizer.encode("hello world") ==
+          (TokenVector{id_of(spec, "hello"), id_of(spec, " w"), 'o', 'r', 'l', 'd'}));
+    // Merges do not cross pre-tokenization pieces
+    CHECK(tokenizer.encode("hel lo") == (TokenVector{id_of(spec, "he"), 'l', ' ', 'l', 'o'}));
+}
+
+TEST(matches_special_tokens_atomically) {
+    const amb::TokenizerSpec spec = make_spec();
+    const std::vector<uint8_t> section = amb::serialize_tokenizer(spec);
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+    const TokenId eot = id_of(spec, "<|endoftext|>");
+
+    CHECK(tokenizer.encode("a<|endoftext|>b") == (TokenVector{'a', eot, 'b'}));
+    CHECK(tokenizer.encode("<|endoftext|><|endoftext|>") == (TokenVector{eot, eot}));
+    CHECK(tokenizer.encode("<|end").size() == 5);
+    CHECK(tokenizer.bos_token() == eot);
+    CHECK(!tokenizer.pad_token());
+}
+
+TEST(maps_bytes_without_a_token_to_unk) {
+    amb::TokenizerSpec spec = make_spec();
+    spec.vocab[0xff] = "<unk>";
+    CHECK_THROWS(amb::serialize_tokenizer(spec), std::invalid_argument);
+
+    spec.unk_id = 0xff;
+    const std::vector<uint8_t> section = amb::serialize_tokenizer(spec);
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+    CHECK(tokenizer.encode("a\xff") == (TokenVector{'a', 0xff}));
+}
+
+TEST(rejects_negative_byte_tokens) {
+    std::vector<uint8_t> section = amb::serialize_tokenizer(make_spec());
+    amb::TokenizerSectionHeader header;
+    std::memcpy(&header, section.data(), sizeof(header));
+    const int32_t none = -1;
+    std::memcpy(section.data() + header.byte_tokens_offset + 'x' * sizeof(int32_t), &none, sizeof(none));
+    CHECK_THROWS(BinaryTokenizer(section.data(), section.size()), std::runtime_error);
+}
+
+TEST(checks_merge_tokens_when_encoding) {
+    std::vector<uint8_t> section = amb::serialize_tokenizer(make_spec());
+    amb::TokenizerSectionHeader header;
+    std::memcpy(&header, section.data(), sizeof(header));
+    auto* slots = reinterpret_cast<amb::MergeSlot*>(section.data() + header.merges_offset);
+    for (uint32_t i = 0; i < header.merge_table_size; ++i) {
+        if (slots[i].left == 'l' && slots[i].right == 'l') {
+            slots[i].merged = static_cast<int32_t>(header.n_vocab) + 10;
+        }
+    }
+    // Loading does not scan the merge table; encoding through the bad slot throws
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+    CHECK(tokenizer.encode("he") == TokenVector{256});
+    CHECK_THROWS(tokenizer.encode("all"), std::runtime_error);
+}
+
+TEST(checks_trie_links_when_encoding) {
+    std::vector<uint8_t> section = amb::serialize_tokenizer(make_spec());
+    amb::TokenizerSectionHeader header;
+    std::memcpy(&header, section.data(), sizeof(header));
+    auto* edges = reinterpret_cast<amb::TrieEdge*>(section.data() + header.trie_edges_offset);
+    edges[header.n_trie_edges - 1].child = header.n_trie_nodes;
+    const BinaryTokenizer tokenizer(section.data(), section.size());
+    CHECK(tokenizer.encode("plain text").size() > 0);
+    CHECK_THROWS(tokenizer.encode("<|endoftext|>"), std::runtime_error);
+}
+
+int main() {
+    return embee_test::run_tests();
+}